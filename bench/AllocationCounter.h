@@ -0,0 +1,141 @@
+/*! \file AllocationCounter.h
+    \author John Torcivia, Ph.D.
+
+    \brief Heap allocation counting for the benchmarks.
+
+    Replaces the global operator new/delete of the benchmark binary with
+    versions that count every allocation (from any thread) before handing it
+    to malloc.  The benchmarks read the counter around map() to report
+    allocations per row.  BM_MapAllocations reads R and then 2R rows through
+    the per-row read path of each join mode and fails, exiting nonzero (the
+    MapAllocations ctest), unless both make exactly as many allocations.
+
+    Replacement allocation functions must be defined exactly once per
+    program, so only main.cpp may include this header.  Built only when
+    BIOMAPPER_COUNT_ALLOCATIONS is defined (CMake option of the same name);
+    otherwise the count stays at zero and nothing is reported.
+*/
+
+#ifndef BIOMAPPER_ALLOCATIONCOUNTER_H
+#define BIOMAPPER_ALLOCATIONCOUNTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <benchmark/benchmark.h>
+
+/**
+ *
+ */
+class AllocationCounter {
+public:
+    /**
+     *
+     * @retval true Allocations are being counted in this build.
+     */
+    static constexpr bool available() {
+#ifdef BIOMAPPER_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     *
+     * @return Allocations made by the program so far.
+     */
+    static uint64_t count() { return allocations_.load(std::memory_order_relaxed); }
+
+    /**
+     * Called by the replacement operator new; not for use elsewhere.
+     */
+    static void add() { allocations_.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+     * Start counting for one benchmark.
+     */
+    void start() { start_ = count(); }
+
+    /**
+     * Stop counting; the value is kept until the next start().
+     */
+    void stop() { value_ = count() - start_; }
+
+    /**
+     *
+     * @return Allocations between the last start() and stop().
+     */
+    [[nodiscard]] uint64_t value() const { return value_; }
+
+    /**
+     * @brief Add the allocations, divided by rows, as a user counter of a benchmark.
+     *
+     * @param[in] state The benchmark to report into.
+     * @param[in] rows The total rows processed while counting.
+     */
+    void report(benchmark::State & state, double rows) const {
+        if (available() && rows > 0) {
+            state.counters["allocs/row"] = static_cast<double>(value_) / rows;
+        }
+    }
+
+private:
+    inline static std::atomic <uint64_t> allocations_{0};
+
+    uint64_t    start_ = 0;     ///< count() at the last start()
+    uint64_t    value_ = 0;     ///< Allocations counted at the last stop()
+};
+
+#ifdef BIOMAPPER_COUNT_ALLOCATIONS
+
+/**
+ * The one allocation behind every replacement operator new.
+ */
+static void * countedAllocate(std::size_t size, std::size_t alignment) {
+    AllocationCounter::add();
+    void * p = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+        p = std::malloc(size != 0 ? size : 1);
+    } else {
+        // aligned_alloc wants a multiple of the alignment
+        p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    }
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+/**
+ * The one release behind every replacement operator delete.
+ */
+static void countedFree(void * p) noexcept { std::free(p); }
+
+// Once inlined, GCC sees free() on memory from operator new and warns, not
+// knowing both are replaced here to go through malloc.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void * operator new(std::size_t size) { return countedAllocate(size, 0); }
+void * operator new[](std::size_t size) { return countedAllocate(size, 0); }
+void * operator new(std::size_t size, std::align_val_t alignment) { return countedAllocate(size, static_cast<std::size_t>(alignment)); }
+void * operator new[](std::size_t size, std::align_val_t alignment) { return countedAllocate(size, static_cast<std::size_t>(alignment)); }
+
+void operator delete(void * p) noexcept { countedFree(p); }
+void operator delete[](void * p) noexcept { countedFree(p); }
+void operator delete(void * p, std::size_t) noexcept { countedFree(p); }
+void operator delete[](void * p, std::size_t) noexcept { countedFree(p); }
+void operator delete(void * p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void * p, std::size_t, std::align_val_t) noexcept { countedFree(p); }
+
+#pragma GCC diagnostic pop
+
+#endif
+
+#endif //BIOMAPPER_ALLOCATIONCOUNTER_H
@@ -0,0 +1,200 @@
+/*! \file PerfCounters.h
+    \author John Torcivia, Ph.D.
+
+    \brief Hardware performance counters for the benchmarks.
+
+    Thin wrapper around perf_event_open that counts cycles, instructions, L1
+    data cache misses, last level cache misses and branch misses for the
+    calling thread and every thread it creates afterwards (so pool workers
+    spawned inside map() are included).  Only user space is counted, which
+    works unprivileged with kernel.perf_event_paranoid <= 2.  Counters that
+    cannot be opened (paranoid setting, container seccomp, virtual machine
+    without a PMU) are skipped and simply not reported.
+
+    Built only when BIOMAPPER_PERF_COUNTERS is defined (CMake option of the
+    same name) on Linux; otherwise every call is a no-op.  Setting the
+    BIOMAPPER_NO_PERF environment variable disables them at run time.
+*/
+
+#ifndef BIOMAPPER_PERFCOUNTERS_H
+#define BIOMAPPER_PERFCOUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#if defined(BIOMAPPER_PERF_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BIOMAPPER_HAVE_PERF_EVENTS 1
+#endif
+
+/**
+ *
+ */
+class PerfCounters {
+public:
+    PerfCounters() {
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+        if (const char * disable = std::getenv("BIOMAPPER_NO_PERF"); disable != nullptr && *disable != '\0') {
+            return;
+        }
+        for (size_t i = 0; i < EVENT_COUNT; i++) {
+            fds_[i] = _open(EVENTS[i].type, EVENTS[i].config);
+        }
+        if (!available()) {
+            _warnOnce();
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters & operator=(const PerfCounters &) = delete;
+
+    /**
+     * @retval true At least one counter could be opened.
+     */
+    [[nodiscard]] bool available() const {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Reset and start all counters.
+     */
+    void start() {
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    /**
+     * Stop all counters; the values are kept until the next start().
+     */
+    void stop() {
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+        for (size_t i = 0; i < EVENT_COUNT; i++) {
+            if (fds_[i] >= 0) {
+                ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+                values_[i] = _read(fds_[i]);
+            }
+        }
+#endif
+    }
+
+    /**
+     * @brief Add the counters, divided by rows, as user counters of a benchmark.
+     *
+     * @param[in] state The benchmark to report into.
+     * @param[in] rows The total rows processed while the counters ran.
+     */
+    void report(benchmark::State & state, double rows) const {
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+        if (rows <= 0) {
+            return;
+        }
+        for (size_t i = 0; i < EVENT_COUNT; i++) {
+            if (fds_[i] >= 0) {
+                state.counters[std::string(EVENTS[i].name) + "/row"] = static_cast<double>(values_[i]) / rows;
+            }
+        }
+        if (fds_[CYCLES] >= 0 && fds_[INSTRUCTIONS] >= 0 && values_[CYCLES] > 0) {
+            state.counters["IPC"] = static_cast<double>(values_[INSTRUCTIONS]) / static_cast<double>(values_[CYCLES]);
+        }
+#else
+        (void)state;
+        (void)rows;
+#endif
+    }
+
+private:
+    enum Event { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, EVENT_COUNT };
+
+#ifdef BIOMAPPER_HAVE_PERF_EVENTS
+    struct EventInfo {
+        const char *    name;
+        uint32_t        type;
+        uint64_t        config;
+    };
+
+    // PERF_TYPE_HW_CACHE configs are cache | (operation << 8) | (result << 16)
+    static constexpr std::array<EventInfo, EVENT_COUNT> EVENTS = {{
+        {"cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"L1d_misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"LLC_misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    }};
+
+    /**
+     * Open one counter for this thread and its future children, user space only.
+     * Counters are opened individually because inherited counters cannot be
+     * read as a group.
+     */
+    static int _open(uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    /**
+     * Read a counter, scaled up if the kernel multiplexed it.
+     */
+    static uint64_t _read(int fd) {
+        uint64_t data[3] = {0, 0, 0};   // value, time enabled, time running
+        if (::read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+            return 0;
+        }
+        if (data[2] < data[1]) {
+            return static_cast<uint64_t>(static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]));
+        }
+        return data[0];
+    }
+
+    static void _warnOnce() {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            std::cerr << "WARNING: Hardware performance counters are unavailable (check kernel.perf_event_paranoid); "
+                         "benchmarks will report wall time only." << std::endl;
+        }
+    }
+#endif
+
+    std::array<int, EVENT_COUNT>        fds_{-1, -1, -1, -1, -1};   ///< Counter file descriptors, -1 if unavailable
+    std::array<uint64_t, EVENT_COUNT>   values_{};                  ///< Values read at the last stop()
+};
+
+#endif //BIOMAPPER_PERFCOUNTERS_H
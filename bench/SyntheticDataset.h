@@ -0,0 +1,226 @@
+/*! \file SyntheticDataset.h
+    \author John Torcivia, Ph.D.
+
+    \brief Deterministic synthetic annotation files for the benchmarks.
+
+    Generates annotation files with a controllable number of rows, files,
+    references, interval lengths, columns, text length, sortedness and delimiter.  The same
+    parameters and seed always produce byte-identical files, so benchmark runs
+    on different machines measure the same input.
+*/
+
+#ifndef BIOMAPPER_SYNTHETICDATASET_H
+#define BIOMAPPER_SYNTHETICDATASET_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/**
+ * How the length of each generated interval is drawn.
+ */
+enum class LengthDistribution {
+    Fixed,          ///< Every interval is mean_length long
+    Uniform,        ///< Uniform in [1, 2 * mean_length - 1]
+    Exponential     ///< Exponential with the given mean (long tail of large intervals)
+};
+
+/**
+ * Parameters of a synthetic dataset.  Columns are laid out as
+ * reference, start, end, then filler columns up to column_count.
+ * Ranges are zero based with an exclusive end.
+ */
+struct SyntheticDatasetOptions {
+    uint64_t            rows = 10000;           ///< Rows per file
+    uint32_t            files = 4;              ///< Number of files
+    uint32_t            references = 24;        ///< Number of distinct reference IDs
+    LengthDistribution  length_distribution = LengthDistribution::Uniform; ///< Interval length distribution
+    uint64_t            mean_length = 1000;     ///< Mean interval length
+    uint64_t            reference_length = 0;   ///< Length of each reference; 0 scales it with rows so density stays constant
+    uint32_t            column_count = 4;       ///< Total columns per row (at least 3)
+    double              sortedness = 1.0;       ///< Fraction of rows left in sorted (reference, start) order
+    char                delimiter = ',';        ///< Column delimiter
+    uint32_t            text_length = 0;        ///< Reference names and filler columns are zero padded to this length; 0 leaves them short
+    bool                has_header = true;      ///< Write a header line
+    uint64_t            seed = 42;              ///< Base seed; file i uses seed + i
+};
+
+/**
+ * @brief Small, fully specified PRNG (splitmix64).
+ *
+ * The standard distributions are implementation defined, so values are
+ * derived from the raw 64 bit output to keep files identical everywhere.
+ */
+class SyntheticRandom {
+public:
+    explicit SyntheticRandom(uint64_t seed) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * @return Uniform integer in [0, bound).
+     */
+    uint64_t below(uint64_t bound) {
+        return bound == 0 ? 0 : next() % bound;
+    }
+
+    /**
+     * @return Uniform double in [0, 1).
+     */
+    double unit() {
+        return static_cast<double>(next() >> 11) * 0x1.0p-53;
+    }
+
+private:
+    uint64_t state_;
+};
+
+/**
+ *
+ */
+class SyntheticDataset {
+public:
+    explicit SyntheticDataset(SyntheticDatasetOptions options) : options_(options) {
+        options_.column_count = std::max<uint32_t>(3, options_.column_count);
+        options_.references = std::max<uint32_t>(1, options_.references);
+        options_.mean_length = std::max<uint64_t>(1, options_.mean_length);
+        if (options_.reference_length == 0) {
+            // Keep roughly two intervals covering each base per file.
+            options_.reference_length = std::max<uint64_t>(
+                    options_.mean_length * 2, options_.rows / options_.references * options_.mean_length / 2);
+        }
+    }
+
+    /**
+     * @brief Write the dataset's files into a directory.
+     *
+     * Files are named file1 ... fileN with a .csv or .tsv extension.  Files
+     * that already exist with the same parameters are reused.
+     *
+     * @param[in] directory The directory to write into; created if missing.
+     * @return The paths of the generated files, in order.
+     */
+    std::vector <std::string> generate(const std::string & directory) const {
+        std::filesystem::path dir = std::filesystem::path(directory) / _name();
+        std::filesystem::create_directories(dir);
+
+        std::vector <std::string> paths;
+        const char * extension = options_.delimiter == '\t' ? ".tsv" : ".csv";
+        for (uint32_t f = 0; f < options_.files; f++) {
+            std::filesystem::path path = dir / ("file" + std::to_string(f + 1) + extension);
+            if (!std::filesystem::exists(path)) {
+                std::filesystem::path partial = path;
+                partial += ".partial";
+                _writeFile(partial.string(), options_.seed + f);
+                std::filesystem::rename(partial, path);
+            }
+            paths.push_back(path.string());
+        }
+        return paths;
+    }
+
+    [[nodiscard]] const SyntheticDatasetOptions & options() const { return options_; }
+
+private:
+    /**
+     * @return A directory name unique to the parameters.
+     */
+    [[nodiscard]] std::string _name() const {
+        std::string name = "r" + std::to_string(options_.rows) + "_f" + std::to_string(options_.files) +
+                           "_ref" + std::to_string(options_.references) +
+                           "_len" + std::to_string(static_cast<int>(options_.length_distribution)) + "x" + std::to_string(options_.mean_length) +
+                           "_span" + std::to_string(options_.reference_length) +
+                           "_c" + std::to_string(options_.column_count) +
+                           "_s" + std::to_string(static_cast<int>(std::lround(options_.sortedness * 1000))) +
+                           "_d" + std::to_string(static_cast<int>(options_.delimiter)) +
+                           "_h" + std::to_string(options_.has_header) +
+                           "_seed" + std::to_string(options_.seed);
+        if (options_.text_length != 0) {
+            // Only named when set, so the short datasets keep their directories
+            name += "_t" + std::to_string(options_.text_length);
+        }
+        return name;
+    }
+
+    uint64_t _length(SyntheticRandom & random) const {
+        switch (options_.length_distribution) {
+            case LengthDistribution::Fixed:
+                return options_.mean_length;
+            case LengthDistribution::Uniform:
+                return 1 + random.below(2 * options_.mean_length - 1);
+            case LengthDistribution::Exponential:
+                return 1 + static_cast<uint64_t>(-std::log(1.0 - random.unit()) * static_cast<double>(options_.mean_length - 1));
+        }
+        return options_.mean_length;
+    }
+
+    void _writeFile(const std::string & path, uint64_t seed) const {
+        SyntheticRandom random(seed);
+
+        // (reference, start, end)
+        std::vector <std::tuple <uint32_t, uint64_t, uint64_t> > rows(options_.rows);
+        for (auto & row : rows) {
+            uint32_t reference = static_cast<uint32_t>(random.below(options_.references));
+            uint64_t start = random.below(options_.reference_length);
+            row = {reference, start, start + _length(random)};
+        }
+        std::sort(rows.begin(), rows.end());
+
+        // Displace a (1 - sortedness) fraction of the rows.
+        auto displaced = static_cast<uint64_t>(std::llround((1.0 - std::clamp(options_.sortedness, 0.0, 1.0)) * static_cast<double>(rows.size())));
+        for (uint64_t i = 0; i < displaced && rows.size() > 1; i++) {
+            std::swap(rows[random.below(rows.size())], rows[random.below(rows.size())]);
+        }
+
+        std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+        const char d = options_.delimiter;
+        if (options_.has_header) {
+            out << "reference" << d << "start" << d << "end";
+            for (uint32_t c = 3; c < options_.column_count; c++) {
+                out << d << "column" << c;
+            }
+            out << '\n';
+        }
+
+        // A prefix, then the number zero padded up to text_length
+        auto appendText = [this](std::string & line, const char * prefix, uint64_t number) {
+            const std::string digits = std::to_string(number);
+            const size_t length = std::char_traits<char>::length(prefix) + digits.size();
+            line += prefix;
+            if (options_.text_length > length) {
+                line.append(options_.text_length - length, '0');
+            }
+            line += digits;
+        };
+
+        std::string line;
+        for (const auto & [reference, start, end] : rows) {
+            line.clear();
+            appendText(line, "chr", reference + 1);
+            line += d;
+            line += std::to_string(start);
+            line += d;
+            line += std::to_string(end);
+            for (uint32_t c = 3; c < options_.column_count; c++) {
+                line += d;
+                appendText(line, "v", random.below(1000000));
+            }
+            line += '\n';
+            out << line;
+        }
+    }
+
+    SyntheticDatasetOptions options_;
+};
+
+#endif //BIOMAPPER_SYNTHETICDATASET_H
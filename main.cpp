@@ -3,71 +3,1059 @@
 //
 
 #include "src/BioMapper.h"
+#include "AllocationCounter.h"
+#include "BlockReader.h"
+#include "PerfCounters.h"
+#include "JobServer.h"
+#include "OverlapPredicates.h"
+#include "QueryEngine.h"
+#include "SyntheticDataset.h"
 #include <benchmark/benchmark.h>
+#include <bit>
+#include <fstream>
+#include <latch>
+#include <set>
 
+/**
+ * Directory the synthetic datasets are generated into (relative to the binary's working directory).
+ */
+static const char * DATASET_DIRECTORY = "test/synthetic";
 
+/**
+ * Set when a benchmark's correctness check fails, so the run exits nonzero.
+ */
+static bool checkFailed = false;
+
+/**
+ * Fail a benchmark on a wrong result rather than skip it.
+ */
+static void failCheck(benchmark::State& state, const std::string & error) {
+	checkFailed = true;
+	state.SkipWithError(error.c_str());
+}
+
+/**
+ * Generate (or reuse) a dataset and add all of its files to a mapper.
+ */
+static SyntheticDataset addDataset(BioMapper & bm, const SyntheticDatasetOptions & options) {
+	SyntheticDataset dataset(options);
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY))
+		bm.addFile(path.c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	return dataset;
+}
+
+/**
+ * Report rows processed so the output shows throughput alongside time, and
+ * the hardware counters per row when they are available.
+ */
+static void setRowCounters(benchmark::State& state, const SyntheticDatasetOptions & options, const PerfCounters & perf) {
+	const auto rows = static_cast<int64_t>(options.rows * options.files);
+	state.SetItemsProcessed(state.iterations() * rows);
+	state.counters["rows"] = static_cast<double>(rows);
+	perf.report(state, static_cast<double>(state.iterations() * rows));
+}
+
+
+/*
+ * Pre-processing stages: scaling with rows per file (range 0) and file count (range 1).
+ */
 static void BM_VerifyFiles(benchmark::State& state) {
-	std::vector <std::string> fail_list;
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.files = state.range(1);
 	BioMapper bm = BioMapper(4);
-	bm.addFile("test/file1.csv", 0, 1, 2);
-	bm.addFile("test/file2.csv", 0, 1, 2);
-	bm.addFile("test/file3.csv", 0, 1, 2);
-	bm.addFile("test/file4.csv", 0, 1, 2);
-	for (auto _ : state)
-		bm._verifyFiles(fail_list);
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		std::vector <std::string> fail_list;
+		benchmark::DoNotOptimize(bm._verifyFiles(fail_list));
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
 }
 // Register the function as a benchmark
-BENCHMARK(BM_VerifyFiles);
+BENCHMARK(BM_VerifyFiles)->ArgsProduct({{1 << 10, 1 << 14, 1 << 17}, {2, 4, 8}});
 
 static void BM_ParseHeaders(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.files = state.range(1);
 	BioMapper bm = BioMapper(4);
-	bm.addFile("test/file1.csv", 0, 1, 2);
-	bm.addFile("test/file2.csv", 0, 1, 2);
-	bm.addFile("test/file3.csv", 0, 1, 2);
-	bm.addFile("test/file4.csv", 0, 1, 2);
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
 	for (auto _ : state)
-		bm._parseHeaders();
+		benchmark::DoNotOptimize(bm._parseHeaders());
+	perf.stop();
+	setRowCounters(state, options, perf);
 }
 // Register the function as a benchmark
-BENCHMARK(BM_ParseHeaders);
+BENCHMARK(BM_ParseHeaders)->ArgsProduct({{1 << 10, 1 << 14, 1 << 17}, {2, 4, 8}});
 
+/*
+ * Reference discovery: scaling with rows per file (range 0) and reference count (range 1).
+ */
 static void BM_DetermineReferences(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.references = state.range(1);
 	BioMapper bm = BioMapper(4);
-	bm.addFile("test/file1.csv", 0, 1, 2);
-	bm.addFile("test/file2.csv", 0, 1, 2);
-	bm.addFile("test/file3.csv", 0, 1, 2);
-	bm.addFile("test/file4.csv", 0, 1, 2);
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
 	for (auto _ : state)
-		bm._determineReferences();
+		benchmark::DoNotOptimize(bm._determineReferences());
+	perf.stop();
+	setRowCounters(state, options, perf);
 }
 // Register the function as a benchmark
-BENCHMARK(BM_DetermineReferences);
+BENCHMARK(BM_DetermineReferences)->ArgsProduct({{1 << 10, 1 << 14, 1 << 17}, {1, 24, 1000}})->Unit(benchmark::kMillisecond);
+
+/*
+ * Full mapping runs.  Each benchmark varies one dataset parameter from the
+ * defaults so the output reads as a scaling curve for that parameter.
+ */
+static void runMap(benchmark::State& state, const SyntheticDatasetOptions & options, uint64_t memory_budget = 0) {
+	BioMapper bm = BioMapper(4);
+	bm.setMemoryBudget(memory_budget);
+	addDataset(bm, options);
+	PerfCounters perf;
+	AllocationCounter allocations;
+	perf.start();
+	allocations.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	allocations.stop();
+	perf.stop();
+	setRowCounters(state, options, perf);
+	allocations.report(state, static_cast<double>(state.iterations() * options.rows * options.files));
+	if (memory_budget != 0)
+		state.counters["peak_tracked_MB"] = static_cast<double>(bm.peakTrackedMemory()) / (1 << 20);
+}
 
+// Rows per file (range 0) and file count (range 1)
 static void BM_Map(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.files = state.range(1);
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_Map)->ArgsProduct({{1 << 10, 1 << 14, 1 << 17}, {2, 4, 8}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Number of references the rows are spread over (range 0); the largest counts
+// exercise the Bloom filter path of the join key prefilter
+static void BM_MapReferences(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.references = state.range(0);
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapReferences)->RangeMultiplier(8)->Range(1, 1 << 18)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Interval length distribution (range 0, LengthDistribution) and mean length (range 1)
+static void BM_MapIntervalLength(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.length_distribution = static_cast<LengthDistribution>(state.range(0));
+	options.mean_length = state.range(1);
+	options.reference_length = 1 << 24;
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapIntervalLength)->ArgsProduct({{static_cast<int64_t>(LengthDistribution::Fixed),
+                                                static_cast<int64_t>(LengthDistribution::Uniform),
+                                                static_cast<int64_t>(LengthDistribution::Exponential)},
+                                               {10, 1000, 100000}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Columns per row (range 0)
+static void BM_MapColumns(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.column_count = state.range(0);
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapColumns)->DenseRange(3, 19, 4)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Percentage of rows left in sorted order (range 0)
+static void BM_MapSortedness(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.sortedness = static_cast<double>(state.range(0)) / 100.0;
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapSortedness)->DenseRange(0, 100, 25)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Rows per file (range 0) and files already mapped (range 1) when one more file is added
+static void BM_MapIncremental(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.files = state.range(1) + 1;
+	SyntheticDataset dataset(options);
+	const std::vector <std::string> paths = dataset.generate(DATASET_DIRECTORY);
+	std::unique_ptr <BioMapper> bm;
+	for (auto _ : state) {
+		// The full map of the earlier files is setup, not measured.
+		state.PauseTiming();
+		bm = std::make_unique<BioMapper>(4);
+		for (size_t f = 0; f + 1 < paths.size(); f++)
+			bm->addFile(paths[f].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+		bool mapped = bm->map();
+		bm->addFile(paths.back().c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+		state.ResumeTiming();
+		if (!mapped || !bm->map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	// Only the added file's rows are new work.  No hardware counters, as
+	// they cannot be paused with the timer.
+	state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(options.rows));
+	state.counters["rows"] = static_cast<double>(options.rows);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapIncremental)->ArgsProduct({{1 << 14, 1 << 17}, {2, 8, 30}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Memory budget in MiB (range 0, 0 for none); small budgets spill to disk
+static void BM_MapMemoryBudget(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	runMap(state, options, static_cast<uint64_t>(state.range(0)) << 20);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapMemoryBudget)->Arg(0)->Arg(256)->Arg(64)->Arg(16)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Delimiter character (range 0)
+static void BM_MapDelimiter(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.delimiter = static_cast<char>(state.range(0));
+	runMap(state, options);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapDelimiter)->Arg(',')->Arg('\t')->Arg('|')->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Read backend (range 0: 1 io_uring, 2 pread) over 8 files; skipped where
+// the kernel refuses io_uring
+static void BM_MapReadBackend(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	options.files = 8;
 	BioMapper bm = BioMapper(4);
-	bm.addFile("test/file1.csv", 0, 1, 2);
-	bm.addFile("test/file2.csv", 0, 1, 2);
-	bm.addFile("test/file3.csv", 0, 1, 2);
-	bm.addFile("test/file4.csv", 0, 1, 2);
-	for (auto _ : state)
-		bm.map();
+	bm.setReadBackend(static_cast<ReadBackend>(state.range(0)));
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
 }
 // Register the function as a benchmark
-BENCHMARK(BM_Map);
+BENCHMARK(BM_MapReadBackend)->Arg(static_cast<int>(ReadBackend::IoUring))->Arg(static_cast<int>(ReadBackend::Pread))->Unit(benchmark::kMillisecond)->UseRealTime();
 
+// Reading threads (range 0) over 16 files; each thread interleaves the
+// parsing of BioMapper::FILES_PER_READER files
+static void BM_MapReadLanes(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	options.files = 16;
+	BioMapper bm = BioMapper(4, static_cast<int>(state.range(0)));
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapReadLanes)->Arg(1)->Arg(2)->Arg(4)->Unit(benchmark::kMillisecond)->UseRealTime();
 
-BENCHMARK_MAIN();
+// Worker processes (range 0, 1 for none) mapping shards of 24 references,
+// output written and merged; no hardware counters, as the workers are not
+// counted by this process
+static void BM_MapProcesses(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	options.files = 4;
+	BioMapper bm = BioMapper(4);
+	bm.setProcessShards(static_cast<int>(state.range(0)));
+	bm.setOutputFile(std::string(DATASET_DIRECTORY) + "/processes.out");
+	addDataset(bm, options);
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	const auto rows = static_cast<int64_t>(options.rows * options.files);
+	state.SetItemsProcessed(state.iterations() * rows);
+	state.counters["rows"] = static_cast<double>(rows);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapProcesses)->Arg(1)->Arg(2)->Arg(4)->Unit(benchmark::kMillisecond)->UseRealTime();
 
-//int main(int argv, char * argc[]) {
-//    // Test function
-//
-//    BioMapper bm = BioMapper(4);
-//    bm.addFile("file1.csv", 0, 1, 2);
-//    bm.addFile("file2.csv", 0, 1, 2);
-//    bm.addFile("file3.csv", 0, 1, 2);
-//    bm.addFile("file4.csv", 0, 1, 2);
-//
-//    bm.map();
-//
-//
-//}
\ No newline at end of file
+// Checkpoints every range 0 ms (-1 for none, 0 for every reference) while
+// mapping 24 references, output written and synced
+static void BM_MapCheckpoints(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	BioMapper bm = BioMapper(4);
+	if (state.range(0) >= 0) {
+		bm.enableCheckpoints(true, static_cast<uint32_t>(state.range(0)));
+	}
+	bm.setOutputFile(std::string(DATASET_DIRECTORY) + "/checkpoints.out");
+	addDataset(bm, options);
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	const auto rows = static_cast<int64_t>(options.rows * options.files);
+	state.SetItemsProcessed(state.iterations() * rows);
+	state.counters["rows"] = static_cast<double>(rows);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapCheckpoints)->Arg(-1)->Arg(1000)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Stopping a run: a thread polls progress() every millisecond and cancels
+// once range 0 percent of the run is done (100 to let it finish); stop_ms is
+// the time from cancel() until map() returns
+static void BM_MapCancel(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	BioMapper bm = BioMapper(4);
+	bm.setOutputFile(std::string(DATASET_DIRECTORY) + "/cancel.out");
+	addDataset(bm, options);
+	const double at = static_cast<double>(state.range(0)) / 100;
+	double stopMs = 0, polls = 0;
+	int64_t stops = 0;
+	for (auto _ : state) {
+		bm.resetIndex();
+		CancelToken token;
+		bm.setCancelToken(token);
+		std::atomic <bool> done = false;
+		std::chrono::steady_clock::time_point cancelled;
+		std::thread poller([&]() {
+			while (!done) {
+				polls++;
+				if (at < 1 && bm.progress().fraction >= at) {
+					cancelled = std::chrono::steady_clock::now();
+					token.cancel();
+					return;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+		const bool mapped = bm.map();
+		const auto returned = std::chrono::steady_clock::now();
+		done = true;
+		poller.join();
+		if (token.cancelled()) {
+			stopMs += std::chrono::duration<double, std::milli>(returned - cancelled).count();
+			stops++;
+		} else if (!mapped) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	state.counters["stop_ms"] = stops > 0 ? stopMs / static_cast<double>(stops) : 0;
+	state.counters["polls"] = benchmark::Counter(polls, benchmark::Counter::kAvgIterations);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapCancel)->Arg(10)->Arg(50)->Arg(90)->Arg(100)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Estimating the results from range 0 per mille of each file; the actual
+// count is mapped once, outside the timing, to compare the estimate against
+static void BM_EstimateResults(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	BioMapper bm = BioMapper(4);
+	addDataset(bm, options);
+	uint64_t actual = 0;
+	if (!bm.map([&actual](const ResultBatch & batch) { actual += batch.size(); })) {
+		state.SkipWithError("map() failed");
+		return;
+	}
+	ResultEstimator::Settings settings;
+	settings.fraction = static_cast<double>(state.range(0)) / 1000;
+	ResultEstimate estimate;
+	for (auto _ : state) {
+		if (!bm.estimateResults(estimate, settings)) {
+			state.SkipWithError("estimateResults() failed");
+			break;
+		}
+		settings.seed++;
+	}
+	state.counters["estimate"] = estimate.results.value;
+	state.counters["low"] = estimate.results.low;
+	state.counters["high"] = estimate.results.high;
+	state.counters["actual"] = static_cast<double>(actual);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_EstimateResults)->Arg(10)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/**
+ * Nearest searches with known answers: five queries, one of them on the
+ * reverse strand and one tied between an upstream and a downstream row,
+ * against five rows, under each kind of option.  False, with the options
+ * that went wrong, if any result differs.
+ */
+static bool checkNearest(std::string & error) {
+	// Zero based, half open; the queries' strand is column 3
+	const std::string queries = std::string(DATASET_DIRECTORY) + "/nearest_queries.csv";
+	const std::string targets = std::string(DATASET_DIRECTORY) + "/nearest_targets.csv";
+	std::filesystem::create_directories(DATASET_DIRECTORY);
+	std::ofstream(queries, std::ofstream::trunc) << "chr1,45,55,+\nchr1,35,36,+\nchr1,35,36,-\nchr1,85,90,+\nchr1,80,100,+\n";
+	std::ofstream(targets, std::ofstream::trunc) << "chr1,0,10\nchr1,20,30\nchr1,40,50\nchr1,60,70\nchr1,110,120\n";
+
+	struct Case {
+		const char *        name;
+		NearestOptions      options;
+		std::set <std::tuple <uint64_t, uint64_t, long long int> > expected;    ///< Query row, target row, distance
+	};
+	auto options = [](uint32_t k, long long int window, NearestDirection direction, bool ties, int strand) {
+		NearestOptions nearest;
+		nearest.k = k;
+		nearest.window = window;
+		nearest.direction = direction;
+		nearest.ties = ties;
+		nearest.strandColumn = strand;
+		return nearest;
+	};
+	const std::vector <Case> cases = {
+		{"k=1", options(1, -1, NearestDirection::Any, true, 3),
+		 {{1, 3, 0}, {2, 3, 5}, {3, 3, -5}, {4, 4, -16}, {5, 4, -11}, {5, 5, 11}}},
+		{"k=1 without ties", options(1, -1, NearestDirection::Any, false, 3),
+		 {{1, 3, 0}, {2, 3, 5}, {3, 3, -5}, {4, 4, -16}, {5, 4, -11}}},
+		{"k=1 without a strand column", options(1, -1, NearestDirection::Any, true, -1),
+		 {{1, 3, 0}, {2, 3, 5}, {3, 3, 5}, {4, 4, -16}, {5, 4, -11}, {5, 5, 11}}},
+		{"k=2", options(2, -1, NearestDirection::Any, true, 3),
+		 {{1, 3, 0}, {1, 4, 6}, {2, 3, 5}, {2, 2, -6}, {3, 3, -5}, {3, 2, 6}, {4, 4, -16}, {4, 5, 21}, {5, 4, -11}, {5, 5, 11}}},
+		{"downstream", options(1, -1, NearestDirection::Downstream, true, 3),
+		 {{1, 3, 0}, {2, 3, 5}, {3, 2, 6}, {4, 5, 21}, {5, 5, 11}}},
+		{"upstream", options(1, -1, NearestDirection::Upstream, true, 3),
+		 {{1, 3, 0}, {2, 2, -6}, {3, 3, -5}, {4, 4, -16}, {5, 4, -11}}},
+		{"k=0 in a window of 0", options(0, 0, NearestDirection::Any, true, 3),
+		 {{1, 3, 0}}},
+		{"k=0 in a window of 10", options(0, 10, NearestDirection::Any, true, 3),
+		 {{1, 3, 0}, {1, 4, 6}, {2, 3, 5}, {2, 2, -6}, {3, 3, -5}, {3, 2, 6}}},
+		{"k=0 in a window of 11", options(0, 11, NearestDirection::Any, true, 3),
+		 {{1, 3, 0}, {1, 4, 6}, {2, 3, 5}, {2, 2, -6}, {3, 3, -5}, {3, 2, 6}, {5, 4, -11}, {5, 5, 11}}},
+	};
+	for (const Case & test : cases) {
+		BioMapper bm = BioMapper(1);
+		bm.setResultMode(ResultMode::Nearest);
+		bm.setNearestOptions(test.options);
+		bm.addFile(queries.c_str(), 0, 1, 2, true);
+		bm.addFile(targets.c_str(), 0, 1, 2, true);
+		std::set <std::tuple <uint64_t, uint64_t, long long int> > found;
+		const bool mapped = bm.map([&found](const ResultBatch & batch) {
+			for (const MappedResult & result : batch)
+				found.emplace(result.annotation_a->rowNumber(), result.annotation_b->rowNumber(), result.distance);
+		});
+		if (!mapped || found != test.expected) {
+			error = std::string("wrong nearest rows for ") + test.name;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Nearest rows kept per row (range 0, 0 for all in the window) within a window
+// (range 1, -1 for none) of 24 references; the results of a small fixed
+// dataset are checked first
+static void BM_MapNearest(benchmark::State& state) {
+	std::string error;
+	if (!checkNearest(error)) {
+		failCheck(state, error);
+		return;
+	}
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 15;
+	NearestOptions nearest;
+	nearest.k = static_cast<uint32_t>(state.range(0));
+	nearest.window = state.range(1);
+	BioMapper bm = BioMapper(4);
+	bm.setResultMode(ResultMode::Nearest);
+	bm.setNearestOptions(nearest);
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapNearest)->Args({1, -1})->Args({10, -1})->Args({3, 1000})->Args({0, 1000})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Rows per file (range 0) joined into pairs or aggregated (range 1, ResultMode),
+// output written; the output size shows what aggregation saves
+static void BM_MapCoverage(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	const std::string output = std::string(DATASET_DIRECTORY) + "/coverage.out";
+	BioMapper bm = BioMapper(4);
+	bm.setResultMode(static_cast<ResultMode>(state.range(1)));
+	bm.setOutputFile(output);
+	addDataset(bm, options);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
+	std::error_code ec;
+	state.counters["output_MB"] = static_cast<double>(std::filesystem::file_size(output, ec)) / (1 << 20);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapCoverage)->ArgsProduct({{1 << 14, 1 << 17}, {static_cast<int64_t>(ResultMode::Pairs),
+                                                              static_cast<int64_t>(ResultMode::Coverage)}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// A track of range 0 rows mapped against a query of a sixteenth of that,
+// parsed every run (range 1 == 0) or attached as a shared index (range 1 == 1)
+static void BM_MapSharedIndex(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.files = 2;
+	SyntheticDataset dataset(options);
+	const std::vector <std::string> paths = dataset.generate(DATASET_DIRECTORY);
+	SyntheticDatasetOptions queryOptions = options;
+	queryOptions.rows = options.rows / 16;
+	queryOptions.files = 1;
+	const std::vector <std::string> query = SyntheticDataset(queryOptions).generate(DATASET_DIRECTORY);
+
+	BioMapper bm = BioMapper(4);
+	bm.addFile(query[0].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	MapperFile track(paths[1].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	if (state.range(1) == 1) {
+		// Built on the first run, attached afterwards
+		if (!bm.addIndexedFile(track, paths[1] + ".index")) {
+			state.SkipWithError("could not attach the index");
+			return;
+		}
+	} else {
+		bm.addFile(std::move(track));
+	}
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	SyntheticDatasetOptions mapped = options;
+	mapped.rows = options.rows + queryOptions.rows;
+	mapped.files = 1;
+	setRowCounters(state, mapped, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapSharedIndex)->ArgsProduct({{1 << 14, 1 << 17}, {0, 1}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Range 0 requests, each a query of 1 << 10 rows mapped against the same
+// track of 1 << 17, served by a fresh mapper each, one after another
+// (range 1 == 0), or submitted at once to a JobServer, which keeps its pool
+// and the track's index between requests (range 1 == 1)
+static void BM_JobServer(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	options.files = 1;
+	const SyntheticDataset dataset(options);
+	const std::vector <std::string> track = dataset.generate(DATASET_DIRECTORY);
+	SyntheticDatasetOptions queryOptions = dataset.options();
+	queryOptions.rows = 1 << 10;
+	queryOptions.seed = options.seed + 1;
+	const std::vector <std::string> query = SyntheticDataset(queryOptions).generate(DATASET_DIRECTORY);
+
+	std::unique_ptr <JobServer> server;
+	if (state.range(1) == 1) {
+		server = std::make_unique<JobServer>(4);
+	}
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		std::vector <std::unique_ptr <BioMapper> > jobs;
+		std::vector <std::future <bool> > done;
+		bool passed = true;
+		for (int64_t j = 0; j < state.range(0); j++) {
+			auto bm = std::make_unique<BioMapper>(2);
+			bm->addFile(query[0].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+			MapperFile file(track[0].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+			if (server) {
+				passed = server->addFile(*bm, std::move(file)) && passed;
+				done.push_back(server->submit(*bm));
+			} else {
+				bm->addFile(std::move(file));
+				passed = bm->map() && passed;
+			}
+			jobs.push_back(std::move(bm));
+		}
+		for (auto & job : done) {
+			passed = job.get() && passed;
+		}
+		if (!passed) {
+			state.SkipWithError("a request failed");
+			break;
+		}
+	}
+	perf.stop();
+	SyntheticDatasetOptions mapped = options;
+	mapped.rows = (options.rows + queryOptions.rows) * state.range(0);
+	setRowCounters(state, mapped, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_JobServer)->ArgsProduct({{1, 8}, {0, 1}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// A query of range 1 rows mapped against a track of 1 << 18 over the same
+// span, with the settings of the constructor (range 0 == 0) or planned from a
+// pre-scan (range 0 == 1), which searches the track when the query is small
+static void BM_MapPlanned(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 18;
+	options.files = 1;
+	const SyntheticDataset dataset(options);
+	const std::vector <std::string> track = dataset.generate(DATASET_DIRECTORY);
+	SyntheticDatasetOptions queryOptions = dataset.options();
+	queryOptions.rows = state.range(1);
+	queryOptions.seed = options.seed + 1;
+	const std::vector <std::string> query = SyntheticDataset(queryOptions).generate(DATASET_DIRECTORY);
+
+	BioMapper bm = BioMapper(4);
+	bm.enablePlanning(state.range(0) == 1);
+	bm.addFile(query[0].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	bm.addFile(track[0].c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	SyntheticDatasetOptions mapped = options;
+	mapped.rows = options.rows + queryOptions.rows;
+	setRowCounters(state, mapped, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapPlanned)->ArgsProduct({{0, 1}, {1 << 8, 1 << 18}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Exact key join over rows per file (range 0), keyed on the reference column
+// alone (range 1 == 1, about one match per row and file pair) or composite
+// with a filler column (range 1 == 2, almost no matches: probe cost only)
+static void BM_MapKeyJoin(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = state.range(0);
+	options.references = static_cast<uint32_t>(state.range(0));
+	const std::vector <int32_t> keyColumns = state.range(1) == 1 ? std::vector <int32_t>{0} : std::vector <int32_t>{0, 3};
+
+	BioMapper bm = BioMapper(4);
+	bm.setJoinMode(JoinMode::Key);
+	SyntheticDataset dataset(options);
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY))
+		bm.addKeyFile(path.c_str(), keyColumns, options.has_header, options.delimiter);
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		bm.resetIndex();
+		if (!bm.map()) {
+			state.SkipWithError("map() failed");
+			break;
+		}
+	}
+	perf.stop();
+	setRowCounters(state, options, perf);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapKeyJoin)->ArgsProduct({{1 << 14, 1 << 17}, {1, 2}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/**
+ * The rows of a file, without its header, to feed the read path one by one.
+ */
+static std::vector <std::string> fileRows(const std::string & path, bool has_header) {
+	std::vector <std::string> rows;
+	std::ifstream in(path);
+	std::string row;
+	if (has_header)
+		std::getline(in, row);
+	while (std::getline(in, row))
+		rows.push_back(row);
+	return rows;
+}
+
+/**
+ * Allocations made reading the first count rows of each file through the
+ * per-row read path of the join mode.  The mapper is set up first, as map()
+ * would set it up, outside the count; a key join's rows and arena are sized
+ * for the most rows read, as map() leaves them after a larger run.
+ */
+static bool readRowAllocations(const SyntheticDatasetOptions & options, const std::vector <std::vector <std::string> > & rows,
+                               JoinMode mode, size_t count, uint64_t & allocations) {
+	BioMapper bm = BioMapper(1);
+	bm.setJoinMode(mode);
+	SyntheticDataset dataset(options);
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY)) {
+		if (mode == JoinMode::Key)
+			bm.addKeyFile(path.c_str(), {0}, options.has_header, options.delimiter);
+		else
+			bm.addFile(path.c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	}
+	if (!bm._prepareFiles())
+		return false;
+	const size_t files = rows.size();
+	std::vector <std::vector <int32_t> > keyColumns(files);
+	if (mode == JoinMode::Key) {
+		bm.keyedFiles_.resize(files);
+		for (size_t f = 0; f < files; f++) {
+			keyColumns[f] = bm.files_[f].key_indexes();
+			bm.keyedFiles_[f].arena = std::make_unique<std::pmr::monotonic_buffer_resource>(1 << 24);
+			bm.keyedFiles_[f].rows.reserve(rows[f].size());
+			bm.keyedFiles_[f].hashes.reserve(rows[f].size());
+		}
+	} else {
+		if (!bm._determineReferences())
+			return false;
+		std::set <std::string, std::less <> > newlyShared;
+		bm._createStreams(newlyShared);
+	}
+
+	BioMapper::RowColumns columns;
+	bool read = true;
+	AllocationCounter counter;
+	counter.start();
+	for (size_t f = 0; f < files; f++) {
+		for (size_t r = 0; r < count && read; r++) {
+			size_t bytes = 0;
+			read = mode == JoinMode::Key ? bm._readKeyRow(f, rows[f][r], r + 2, keyColumns[f], columns)
+			                             : bm._readRow(f, rows[f][r], r + 2, columns, nullptr, bytes);
+		}
+	}
+	counter.stop();
+	allocations = counter.value();
+	return read;
+}
+
+// Allocation regression check of the per-row read path for the join mode
+// (range 0, JoinMode).  The first R and then the first 2R rows of the same
+// files are read into freshly set up mappers, after a throwaway pass that
+// warms up anything made once per program.  Each run makes the same fixed
+// allocations (a partition's row vector and first arena chunk), as the rows
+// are shuffled over few references so the first R already reach every
+// partition and its rows fit what was reserved; so the runs must make
+// exactly the same number, and any difference is the rows allocating.
+static void BM_MapAllocations(benchmark::State& state) {
+	static constexpr size_t ROWS = 1 << 10;
+	if (!AllocationCounter::available()) {
+		state.SkipWithError("built without BIOMAPPER_COUNT_ALLOCATIONS");
+		return;
+	}
+	const auto mode = static_cast<JoinMode>(state.range(0));
+	SyntheticDatasetOptions options;
+	options.rows = 2 * ROWS;
+	options.sortedness = 0.0;
+	options.text_length = 24;
+	SyntheticDataset dataset(options);
+	std::vector <std::vector <std::string> > rows;
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY))
+		rows.push_back(fileRows(path, options.has_header));
+
+	uint64_t warm = 0, base = 0, doubled = 0;
+	for (auto _ : state) {
+		if (!readRowAllocations(options, rows, mode, ROWS, warm) ||
+		    !readRowAllocations(options, rows, mode, ROWS, base) ||
+		    !readRowAllocations(options, rows, mode, 2 * ROWS, doubled)) {
+			failCheck(state, "reading the rows failed");
+			return;
+		}
+	}
+	const int64_t extra = static_cast<int64_t>(doubled) - static_cast<int64_t>(base);
+	state.counters["allocs/run"] = static_cast<double>(base);
+	state.counters["allocs/extra"] = static_cast<double>(extra);
+	state.counters["allocs/row"] = static_cast<double>(extra) / static_cast<double>(ROWS * options.files);
+	if (extra != 0)
+		failCheck(state, "the per-row read path allocates");
+}
+// Register the function as a benchmark
+BENCHMARK(BM_MapAllocations)->Arg(static_cast<int>(JoinMode::Range))->Arg(static_cast<int>(JoinMode::Key))->Iterations(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/*
+ * Query engine: batch size (range 0) of random queries against a loaded
+ * dataset; items are queries.
+ */
+static void BM_QueryBatch(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	SyntheticDataset dataset(options);
+	QueryEngine engine(4);
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY))
+		engine.addFile(path.c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	if (!engine.load()) {
+		state.SkipWithError("load() failed");
+		return;
+	}
+
+	SyntheticRandom random(options.seed);
+	std::vector <IntervalQuery> queries(state.range(0));
+	for (IntervalQuery & query : queries) {
+		query.reference = "chr" + std::to_string(1 + random.below(dataset.options().references));
+		query.start = static_cast<long long int>(random.below(dataset.options().reference_length));
+		query.end = query.start + static_cast<long long int>(random.below(dataset.options().mean_length));
+	}
+
+	QueryResults results;
+	PerfCounters perf;
+	perf.start();
+	for (auto _ : state) {
+		engine.query(queries, results);
+		benchmark::DoNotOptimize(results.hits.data());
+	}
+	perf.stop();
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.counters["hits_per_query"] = static_cast<double>(results.hits.size()) / static_cast<double>(queries.size());
+	perf.report(state, static_cast<double>(state.iterations() * state.range(0)));
+}
+// Register the function as a benchmark
+BENCHMARK(BM_QueryBatch)->RangeMultiplier(10)->Range(100, 100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+/**
+ * Candidates tested per second by one predicate over columnar start and end
+ * arrays, with the batch kernel (Batched) or one candidate at a time.
+ */
+template <typename Predicate, bool Batched>
+static void BM_OverlapPredicate(benchmark::State& state) {
+	const size_t count = static_cast<size_t>(state.range(0));
+	SyntheticRandom random(42);
+	std::vector <long long int> starts(count), ends(count);
+	for (size_t i = 0; i < count; i++) {
+		starts[i] = static_cast<long long int>(random.below(1 << 20));
+		ends[i] = starts[i] + 1 + static_cast<long long int>(random.below(1000));
+	}
+
+	size_t hits = 0;
+	for (auto _ : state) {
+		RangeQuery query;
+		query.start = static_cast<long long int>(random.below(1 << 20));
+		query.end = query.start + 1 + static_cast<long long int>(random.below(1000));
+		query.distance = 100;
+		const RangeWindow window = Predicate::window(query);
+		for (size_t i = 0; i + OVERLAP_BATCH <= count; i += OVERLAP_BATCH) {
+			const uint32_t mask = Batched ? matchBatch(window, &starts[i], &ends[i])
+			                              : matchBatchScalar(window, &starts[i], &ends[i]);
+			hits += static_cast<size_t>(std::popcount(mask));
+		}
+		benchmark::DoNotOptimize(hits);
+	}
+	state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(count));
+}
+// Register the function as a benchmark
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, OverlapPredicate<Coordinates::HalfOpen>, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, OverlapPredicate<Coordinates::HalfOpen>, true)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, OverlapPredicate<Coordinates::Closed>, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, OverlapPredicate<Coordinates::Closed>, true)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, ContainsPredicate<Coordinates::HalfOpen>, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, ContainsPredicate<Coordinates::HalfOpen>, true)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, WithinPredicate<Coordinates::HalfOpen>, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, WithinPredicate<Coordinates::HalfOpen>, true)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, PointHitPredicate<Coordinates::HalfOpen>, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_OverlapPredicate, PointHitPredicate<Coordinates::HalfOpen>, true)->Arg(1 << 16);
+
+/**
+ * Every row of a file, read as rowBatches() hands them out.
+ */
+static DetachedTask collectRows(BlockReader & reader, PoolScheduler scheduler, std::vector <std::string> & rows) {
+	AsyncGenerator <RowBatch> batches = rowBatches(reader, 0, scheduler, true);
+	while (co_await batches.next())
+		for (std::string_view row : batches.value().rows)
+			rows.emplace_back(row);
+}
+
+/**
+ * Quoted rows whose parsing is known: embedded delimiters, escaped quotes,
+ * a quoted field across a 64 byte chunk and a line break in quotes across
+ * two blocks of a file.  False, with what was wrong, if any comes out wrong.
+ */
+static bool checkQuotedRows(std::string & error) {
+	std::vector <std::string_view> fields;
+	std::string unescaped;
+	auto split = [&](std::string_view row, const std::vector <std::string_view> & expected, const char * what) {
+		splitQuotedRow(row, ',', fields, unescaped);
+		if (fields != expected)
+			error = std::string("splitQuotedRow() got ") + what + " wrong";
+		return fields == expected;
+	};
+	if (!split("chr1,\"gene, kinase\",7", {"chr1", "gene, kinase", "7"}, "an embedded delimiter") ||
+	    !split("chr1,\"say \"\"hi\"\", twice\",\"\"\"\"", {"chr1", "say \"hi\", twice", "\""}, "escaped quotes"))
+		return false;
+
+	// The quoted field opens in the first chunk and closes in the second.
+	const std::string pad(CSV_CHUNK - 6, 'x');
+	if (!split(pad + ",\"a,b\nc,d\",e", {pad, "a,b\nc,d", "e"}, "a quoted field across chunks"))
+		return false;
+	CsvQuotes quotes;
+	const std::string twoRows = pad + ",\"a\nb\"\nnext";
+	if (csvRowEnd(twoRows, quotes) != twoRows.find("\nnext")) {
+		error = "csvRowEnd() broke a row inside quotes across chunks";
+		return false;
+	}
+
+	// A row whose quoted line break is just past the first 64 KiB block
+	const std::string path = std::string(DATASET_DIRECTORY) + "/quoted_rows.csv";
+	std::vector <std::string> expected;
+	std::string text;
+	while (text.size() < (1 << 16) - 100) {
+		expected.push_back("chr1," + std::to_string(expected.size()) + ",1,plain");
+		text += expected.back() + "\n";
+	}
+	const std::string head = "chr2,0,1,\"" + std::string((1 << 16) - text.size(), 'q');
+	expected.push_back(head + "\nrest, of it\",end");
+	text += expected.back() + "\n";
+	expected.push_back("chr3,0,1,last");
+	text += expected.back() + "\n";
+	std::filesystem::create_directories(DATASET_DIRECTORY);
+	std::ofstream(path, std::ofstream::trunc) << text;
+
+	std::vector <std::string> rows;
+	{
+		thread_pool pool(1);
+		JobPool jobs(pool);
+		BlockReader reader(ReadBackend::Auto, 1 << 16, 4);
+		std::vector <std::string> fail_list;
+		if (!reader.open({path}, fail_list)) {
+			error = "could not open " + path;
+			return false;
+		}
+		std::latch done(1);
+		collectRows(reader, PoolScheduler{&jobs}, rows).start(jobs, -1, done);
+		done.wait();
+	}
+	if (rows != expected) {
+		error = "rowBatches() split a quoted line break across blocks wrong";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Bytes of rows split into columns per second: the plain split (range 0 ==
+ * 0), the quote-aware split on rows without quotes (1) and on rows with a
+ * quoted column holding delimiters and escaped quotes (2).  The quote-aware
+ * parsing is checked against known rows first.
+ */
+static void BM_SplitRows(benchmark::State& state) {
+	std::string error;
+	if (state.range(0) != 0 && !checkQuotedRows(error)) {
+		failCheck(state, error);
+		return;
+	}
+	SyntheticRandom random(42);
+	std::vector <std::string> rows(1 << 12);
+	int64_t bytes = 0;
+	for (std::string & row : rows) {
+		const uint64_t start = random.below(1 << 28);
+		row = "chr" + std::to_string(1 + random.below(24)) + "," + std::to_string(start) + "," +
+		      std::to_string(start + 1 + random.below(1000)) + ",";
+		row += state.range(0) == 2 ? "\"gene, \"\"putative\"\" kinase, isoform " + std::to_string(random.below(10)) + "\""
+		                           : "gene putative kinase isoform " + std::to_string(random.below(10));
+		row += ",ENSG" + std::to_string(random.below(1 << 30));
+		bytes += static_cast<int64_t>(row.size()) + 1;
+	}
+	std::vector <std::string_view> fields;
+	std::string unescaped;
+	for (auto _ : state) {
+		for (const std::string & row : rows) {
+			if (state.range(0) == 0) {
+				BioMapper::_splitRow(row, ',', fields);
+			} else {
+				splitQuotedRow(row, ',', fields, unescaped);
+			}
+			benchmark::DoNotOptimize(fields.data());
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * bytes);
+}
+// Register the function as a benchmark
+BENCHMARK(BM_SplitRows)->DenseRange(0, 2);
+
+/**
+ * Batched queries by mode against the same loaded files.
+ */
+static void BM_QueryMode(benchmark::State& state) {
+	SyntheticDatasetOptions options;
+	options.rows = 1 << 17;
+	SyntheticDataset dataset(options);
+	QueryEngine engine(4);
+	for (const std::string & path : dataset.generate(DATASET_DIRECTORY))
+		engine.addFile(path.c_str(), 0, 1, 2, true, options.has_header, options.delimiter);
+	if (!engine.load()) {
+		state.SkipWithError("load() failed");
+		return;
+	}
+
+	SyntheticRandom random(options.seed);
+	std::vector <IntervalQuery> queries(10000);
+	for (IntervalQuery & query : queries) {
+		query.reference = "chr" + std::to_string(1 + random.below(dataset.options().references));
+		query.start = static_cast<long long int>(random.below(dataset.options().reference_length));
+		query.end = query.start + static_cast<long long int>(random.below(dataset.options().mean_length));
+		query.distance = static_cast<long long int>(dataset.options().mean_length);
+	}
+
+	QueryResults results;
+	for (auto _ : state) {
+		engine.query(queries, results, static_cast<OverlapMode>(state.range(0)));
+		benchmark::DoNotOptimize(results.hits.data());
+	}
+	state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(queries.size()));
+	state.counters["hits_per_query"] = static_cast<double>(results.hits.size()) / static_cast<double>(queries.size());
+}
+// Register the function as a benchmark
+BENCHMARK(BM_QueryMode)->DenseRange(0, 3)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Run the benchmarks as BENCHMARK_MAIN() would, failing if a check did
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return checkFailed ? 1 : 0;
+}
@@ -10,16 +10,29 @@
 #ifndef BIOMAPPER_ANNOTATION_H
 #define BIOMAPPER_ANNOTATION_H
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <numeric>
+#include <span>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <variant>
+#include <vector>
+
+#include "SharedIndex.h"
 
 /**
  * Typedef for a variant container that allows all expected annotation types.
- * This allows for a vector that contains different types.
+ * This allows for a vector that contains different types.  Text is a pmr
+ * string, so a row's fields can live in the arena of its partition.
  */
  // TODO: Might want to use a union instead?
-typedef std::variant<uint8_t, uint16_t, uint32_t, uint64_t, float, double, std::string> AnnotationTypes;
+typedef std::variant<uint8_t, uint16_t, uint32_t, uint64_t, float, double, std::pmr::string> AnnotationTypes;
 
 
 /**
@@ -31,13 +44,29 @@ public:
     /**
      *
      */
-    Annotation() : start_range_(-1), end_range_(-1) {};
+    Annotation() : start_range_(-1), end_range_(-1), row_number_(0) {};
+
+    /**
+     * @brief An annotation whose elements and join value are allocated from resource.
+     *
+     * Readers pass the arena of the partition the annotation goes to, so
+     * storing a row does not touch the global allocator.  The resource
+     * must outlive the annotation.
+     */
+    explicit Annotation(std::pmr::memory_resource * resource) : elements_(resource), start_range_(-1), end_range_(-1), row_number_(0) {};
 
     /**
      *
      */
     ~Annotation() = default;
 
+    // Spelled out since the destructor above would otherwise suppress the
+    // moves, and every move would copy the elements to the default resource.
+    Annotation(const Annotation &) = default;
+    Annotation(Annotation &&) noexcept = default;
+    Annotation & operator=(const Annotation &) = default;
+    Annotation & operator=(Annotation &&) = default;
+
     /**
      *
      * @param start_range
@@ -64,8 +93,17 @@ public:
      * @return
      */
     bool setJoinIndex(AnnotationTypes join_index) {
-        // TODO: Make sure this is a copy and not a move!
-        join_index_ = join_index;
+        join_index_ = std::move(join_index);
+        return true;
+    }
+
+    /**
+     *
+     * @param join_index A text join value, copied to the annotation's resource.
+     * @return
+     */
+    bool setJoinIndex(std::string_view join_index) {
+        join_index_.emplace<std::pmr::string>(join_index, elements_.get_allocator());
         return true;
     }
 
@@ -75,10 +113,18 @@ public:
      * @return
      */
     bool setElements(std::vector <AnnotationTypes> & elements) {
-        elements_ = std::move(elements);
+        elements_.assign(std::make_move_iterator(elements.begin()), std::make_move_iterator(elements.end()));
+        elements.clear();
         return true;
     }
 
+    /**
+     * Reserve room for count elements, so adding them allocates once.
+     */
+    void reserveElements(size_t count) {
+        elements_.reserve(count);
+    }
+
     /**
      *
      * @param element
@@ -89,49 +135,567 @@ public:
         return true;
     }
 
+    /**
+     *
+     * @param text A text column, copied into the annotation.
+     * @return
+     */
+    bool addElement(std::string_view text) {
+        // The variant is not allocator aware, so the resource is passed by hand.
+        elements_.emplace_back(std::in_place_type<std::pmr::string>, text, elements_.get_allocator());
+        return true;
+    }
+
+    /**
+     *
+     * @param row_number The (1 based) line number of the annotation in its file.
+     * @return
+     */
+    bool setRowNumber(uint64_t row_number) {
+        row_number_ = row_number;
+        return true;
+    }
+
+    /**
+     *
+     * @return The start location, normalized to zero based.
+     */
+    [[nodiscard]] long long int startRange() const { return start_range_; }
+
+    /**
+     *
+     * @return The end location, normalized to zero based and exclusive.
+     */
+    [[nodiscard]] long long int endRange() const { return end_range_; }
+
+    /**
+     *
+     * @return The join value.
+     */
+    [[nodiscard]] const AnnotationTypes & joinIndex() const { return join_index_; }
+
+    /**
+     *
+     * @return All of the elements (columns) of the annotation.
+     */
+    [[nodiscard]] const std::pmr::vector <AnnotationTypes> & elements() const { return elements_; }
+
+    /**
+     *
+     * @return The (1 based) line number of the annotation in its file.
+     */
+    [[nodiscard]] uint64_t rowNumber() const { return row_number_; }
+
+    /**
+     *
+     * @return Estimated bytes the annotation occupies, including its elements.
+     */
+    [[nodiscard]] size_t memoryUsage() const {
+        size_t bytes = sizeof(Annotation) + elements_.capacity() * sizeof(AnnotationTypes);
+        auto heapBytes = [](const AnnotationTypes & value) -> size_t {
+            const auto * text = std::get_if<std::pmr::string>(&value);
+            // Short strings live inside the variant
+            return text != nullptr && text->capacity() > 15 ? text->capacity() + 1 : 0;
+        };
+        for (const AnnotationTypes & element : elements_) {
+            bytes += heapBytes(element);
+        }
+        return bytes + heapBytes(join_index_);
+    }
+
+    /**
+     * @brief Write the annotation in the spill format; the join value is not written.
+     *
+     * @param out Binary stream to append to.
+     */
+    void write(std::ostream & out) const {
+        _writeValue(out, start_range_);
+        _writeValue(out, end_range_);
+        _writeValue(out, row_number_);
+        _writeValue(out, static_cast<uint32_t>(elements_.size()));
+        for (const AnnotationTypes & element : elements_) {
+            _writeValue(out, static_cast<uint8_t>(element.index()));
+            std::visit([&out](const auto & value) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::pmr::string>) {
+                    _writeValue(out, static_cast<uint32_t>(value.size()));
+                    out.write(value.data(), static_cast<std::streamsize>(value.size()));
+                } else {
+                    _writeValue(out, value);
+                }
+            }, element);
+        }
+    }
+
+    /**
+     * @brief Read an annotation written by write().
+     *
+     * @param in Binary stream to read from.
+     * @retval false The stream ended or is corrupt.
+     */
+    bool read(std::istream & in) {
+        uint32_t count = 0;
+        _readValue(in, start_range_);
+        _readValue(in, end_range_);
+        _readValue(in, row_number_);
+        _readValue(in, count);
+        elements_.clear();
+        elements_.reserve(count);
+        for (uint32_t i = 0; i < count && in; i++) {
+            uint8_t index = 0;
+            _readValue(in, index);
+            elements_.push_back(_readElement(in, index, elements_.get_allocator()));
+        }
+        return static_cast<bool>(in);
+    }
+
 private:
-    std::vector <AnnotationTypes>   elements_;     ///< Vector of elements of the annotation
+    template <typename T>
+    static void _writeValue(std::ostream & out, const T & value) {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void _readValue(std::istream & in, T & value) {
+        in.read(reinterpret_cast<char *>(&value), sizeof(T));
+    }
+
+    template <size_t I = 0>
+    static AnnotationTypes _readElement(std::istream & in, size_t index, const std::pmr::polymorphic_allocator <char> & allocator) {
+        if constexpr (I < std::variant_size_v<AnnotationTypes>) {
+            if (index != I) {
+                return _readElement<I + 1>(in, index, allocator);
+            }
+            using Type = std::variant_alternative_t<I, AnnotationTypes>;
+            if constexpr (std::is_same_v<Type, std::pmr::string>) {
+                uint32_t size = 0;
+                _readValue(in, size);
+                std::pmr::string value(size, '\0', allocator);
+                in.read(value.data(), size);
+                return value;
+            } else {
+                Type value{};
+                _readValue(in, value);
+                return value;
+            }
+        } else {
+            in.setstate(std::ios::failbit);
+            return AnnotationTypes();
+        }
+    }
+
+
+    std::pmr::vector <AnnotationTypes> elements_;  ///< Vector of elements of the annotation
     AnnotationTypes                 join_index_;   ///< The join value
     long long int                   start_range_;  ///< The start location
     long long int                   end_range_;    ///< The end location (-1 if it is a single position annotation)
+    uint64_t                        row_number_;   ///< The line in the source file
+
+};
+
+/**
+ * Start sorted, columnar copy of one file's ranges within a stream; the
+ * index the plane sweep runs on.  Either built from the annotations, and
+ * owning its arrays, or a view of the arrays of a SharedIndex.
+ */
+struct SortedRanges {
+    std::span <const long long int> starts;     ///< Start of each range, ascending
+    std::span <const long long int> ends;       ///< End of each range
+    std::span <const uint32_t>      order;      ///< Index of each range in the stream
+
+    /// Bytes the index takes per range, for memory accounting
+    static constexpr size_t BYTES_PER_RANGE = 2 * sizeof(long long int) + sizeof(uint32_t);
+
+    SortedRanges() = default;
+    // Moving a vector keeps its buffer, so the views stay valid; a copy would not.
+    SortedRanges(SortedRanges &&) noexcept = default;
+    SortedRanges & operator=(SortedRanges &&) noexcept = default;
+    SortedRanges(const SortedRanges &) = delete;
+    SortedRanges & operator=(const SortedRanges &) = delete;
+
+    /**
+     * @param annotations One file's annotations of a stream.
+     * @return Their ranges sorted by start, ties in file order.
+     */
+    static SortedRanges build(const std::vector <Annotation> & annotations) {
+        SortedRanges ranges;
+        ranges.ownedOrder_.resize(annotations.size());
+        std::iota(ranges.ownedOrder_.begin(), ranges.ownedOrder_.end(), 0);
+        std::sort(ranges.ownedOrder_.begin(), ranges.ownedOrder_.end(), [&](uint32_t a, uint32_t b) {
+            return annotations[a].startRange() < annotations[b].startRange() ||
+                   (annotations[a].startRange() == annotations[b].startRange() && a < b);
+        });
+        ranges.ownedStarts_.reserve(annotations.size());
+        ranges.ownedEnds_.reserve(annotations.size());
+        for (uint32_t index : ranges.ownedOrder_) {
+            ranges.ownedStarts_.push_back(annotations[index].startRange());
+            ranges.ownedEnds_.push_back(annotations[index].endRange());
+        }
+        ranges.starts = ranges.ownedStarts_;
+        ranges.ends = ranges.ownedEnds_;
+        ranges.order = ranges.ownedOrder_;
+        return ranges;
+    }
+
+    /**
+     * @param reference One reference of a shared index, which must outlive the view.
+     * @return Its sorted ranges, in place.
+     */
+    static SortedRanges view(const SharedIndex::Reference & reference) {
+        SortedRanges ranges;
+        ranges.starts = std::span <const long long int>(reference.starts, reference.count);
+        ranges.ends = std::span <const long long int>(reference.ends, reference.count);
+        ranges.order = std::span <const uint32_t>(reference.order, reference.count);
+        return ranges;
+    }
 
+private:
+    std::vector <long long int> ownedStarts_;   ///< Storage of starts when built
+    std::vector <long long int> ownedEnds_;     ///< Storage of ends when built
+    std::vector <uint32_t>      ownedOrder_;    ///< Storage of order when built
 };
 
 /**
+ * @brief All of the annotations for one join ID (reference), split by source file.
  *
+ * Each file's annotations are only ever appended to by the reader handling that
+ * file, so no locking is needed while reading.  The first append reserves
+ * bufferSize_ annotations, which places that memory on the reader's NUMA node
+ * by first touch.
  */
 class AnnotationStream {
 public:
 
-    AnnotationStream(std::string join_id, uint32_t buffer_size=1000) : joinId_(std::move(join_id)), bufferSize_(buffer_size), circularBuffer_(NULL), location_(0) {
-        // Create a circular buffer of annotations
-        circularBuffer_ = new Annotation[bufferSize_];
+    AnnotationStream(std::string join_id, uint32_t buffer_size=1000, size_t file_count=0) : joinId_(std::move(join_id)), bufferSize_(buffer_size), files_(file_count), sorted_(file_count),
+            bytes_(file_count, 0), spilledBytes_(file_count, 0), spilledCount_(file_count, 0), shared_(file_count) {
+        _addArenas(file_count);
     }
 
-    ~AnnotationStream() {
-        // Clean up the memory for the circular buffer
-        delete circularBuffer_;
-    };
+    ~AnnotationStream() = default;
 
-    void addElement(Annotation & annot) {
-        // TODO: What to do if we've matched the location where things are being read from?
-        //      we dont' want to overwrite data that isn't written yet
-        if (location_ >= bufferSize_) {
-            // We've gone past the buffer, need to loop around.
-            circularBuffer_ -= location_;
-        } else {
-            ++circularBuffer_;
-            ++location_;
+    /**
+     *
+     * @param file_index The index of the file the annotation was read from.
+     * @param annot The annotation to move into the stream.
+     */
+    void addElement(size_t file_index, Annotation && annot, size_t bytes = 0) {
+        std::vector <Annotation> & annotations = files_[file_index];
+        if (annotations.capacity() == 0) {
+            annotations.reserve(bufferSize_);
         }
+        annotations.push_back(std::move(annot));
+        bytes_[file_index] += bytes;
+    }
 
-		// TODO: This will need to be verified that this actually works; untested
-        circularBuffer_ = &annot;
+    /**
+     * @brief Where the elements of one file's annotations are allocated.
+     *
+     * Freed as a whole when the partition is spilled or the stream is
+     * destroyed.  Like the partition, only used by the reader of that file.
+     *
+     * @param file_index The index of the file.
+     */
+    [[nodiscard]] std::pmr::memory_resource * arena(size_t file_index) const { return arenas_[file_index].get(); }
 
+    /**
+     * @brief Grow the stream to cover files added since it was created.
+     *
+     * @param file_count The new number of files; never shrinks the stream.
+     */
+    void addFiles(size_t file_count) {
+        if (file_count > files_.size()) {
+            files_.resize(file_count);
+            sorted_.resize(file_count);
+            bytes_.resize(file_count, 0);
+            spilledBytes_.resize(file_count, 0);
+            spilledCount_.resize(file_count, 0);
+            shared_.resize(file_count);
+            _addArenas(file_count);
+        }
+    }
+
+    /**
+     *
+     * @param file_index The index of the file.
+     * @return The annotations read from that file for this join ID.
+     */
+    [[nodiscard]] const std::vector <Annotation> & annotations(size_t file_index) const { return files_[file_index]; }
+
+    /**
+     * @brief One annotation of a file, whether read or in a shared index.
+     *
+     * Rows of a shared partition are copied out of the index the first
+     * time they are asked for, into the partition's arena, and kept at the
+     * same address from then on.  Not thread safe; only the task mapping
+     * the stream may call it.
+     *
+     * @param file_index The index of the file.
+     * @param index The annotation's index, as in SortedRanges::order.
+     */
+    const Annotation & annotation(size_t file_index, uint32_t index) {
+        SharedPartition & shared = shared_[file_index];
+        if (shared.reference == nullptr) {
+            return files_[file_index][index];
+        }
+        if (shared.slots.empty()) {
+            shared.slots.assign(shared.reference->count, 0);
+        }
+        uint32_t & slot = shared.slots[index];
+        if (slot == 0) {
+            const SharedIndex::Row row = shared.index->row(*shared.reference, index);
+            Annotation & annot = shared.rows.emplace_back(arena(file_index));
+            annot.setStartRange(row.start);
+            annot.setEndRange(row.end);
+            annot.setJoinIndex(joinId_);
+            annot.setRowNumber(row.rowNumber);
+            annot.reserveElements(row.fieldCount);
+            const char * text = row.data;
+            for (uint32_t i = 0; i < row.fieldCount; i++) {
+                annot.addElement(std::string_view(text, row.lengths[i]));
+                text += row.lengths[i];
+            }
+            slot = static_cast<uint32_t>(shared.rows.size());
+        }
+        return shared.rows[slot - 1];
+    }
+
+    /**
+     * @brief Take one file's annotations from a shared index instead of reading them.
+     *
+     * The partition is then only a view of the index: it is never charged
+     * to the memory budget nor spilled, and costs memory only for the rows
+     * that are mapped.  Does nothing if the partition is attached already.
+     *
+     * @param file_index The index of the file.
+     * @param index The file's index, kept alive by the stream.
+     * @param reference This stream's reference in the index.
+     */
+    void attachShared(size_t file_index, std::shared_ptr <const SharedIndex> index, const SharedIndex::Reference & reference) {
+        SharedPartition & shared = shared_[file_index];
+        if (shared.reference != nullptr) {
+            return;
+        }
+        shared.index = std::move(index);
+        shared.reference = &reference;
+        shared.rows = std::pmr::deque <Annotation>(arena(file_index));
+        sorted_[file_index] = SortedRanges::view(reference);
+    }
+
+    /**
+     *
+     * @param file_index The index of the file.
+     * @return Whether that file's annotations come from a shared index.
+     */
+    [[nodiscard]] bool shared(size_t file_index) const { return shared_[file_index].reference != nullptr; }
+
+    /**
+     * @brief The sorted index of one file's annotations.
+     *
+     * Built on first use and kept, so later map() calls only sort files
+     * that gained annotations.  Annotations are only ever appended, so a
+     * size mismatch is enough to detect a stale index.  Not thread safe;
+     * only the task mapping the stream may call it.
+     *
+     * @param file_index The index of the file.
+     */
+    const SortedRanges & sortedRanges(size_t file_index) {
+        SortedRanges & ranges = sorted_[file_index];
+        if (!shared(file_index) && ranges.order.size() != files_[file_index].size()) {
+            ranges = SortedRanges::build(files_[file_index]);
+        }
+        return ranges;
+    }
+
+    /**
+     *
+     * @return The number of files this stream is split across.
+     */
+    [[nodiscard]] size_t fileCount() const { return files_.size(); }
+
+    /**
+     *
+     * @return The total number of annotations in the stream.
+     */
+    [[nodiscard]] size_t size() const {
+        size_t total = 0;
+        for (size_t f = 0; f < files_.size(); f++) {
+            total += rows(f);
+        }
+        return total;
+    }
+
+    /*************************************************************************
+     *
+     * Spilling - a file's partition of the stream can be moved to disk and
+     * loaded back for mapping.  Rows added after a spill stay in memory
+     * and follow the spilled rows, keeping file order.
+     *
+     *************************************************************************/
+
+    /**
+     * @param file_index The index of the file.
+     * @return Estimated bytes of that file's annotations held in memory and not on disk.
+     */
+    [[nodiscard]] size_t residentBytes(size_t file_index) const { return bytes_[file_index]; }
+
+    /**
+     *
+     * @return Estimated bytes held in memory and not on disk, over all files.
+     */
+    [[nodiscard]] size_t residentBytes() const { return std::accumulate(bytes_.begin(), bytes_.end(), size_t(0)); }
+
+    /**
+     *
+     * @return Estimated bytes on disk, i.e. what load() adds to memory.
+     */
+    [[nodiscard]] size_t spilledBytes() const { return std::accumulate(spilledBytes_.begin(), spilledBytes_.end(), size_t(0)); }
+
+    /**
+     *
+     * @param file_index The index of the file.
+     * @return The number of annotations from that file, in memory or on disk.
+     */
+    [[nodiscard]] size_t rows(size_t file_index) const {
+        if (shared(file_index)) {
+            return shared_[file_index].reference->count;
+        }
+        return files_[file_index].size() + (loaded_ ? 0 : spilledCount_[file_index]);
+    }
+
+    /**
+     *
+     * @return Whether any partition has been spilled.
+     */
+    [[nodiscard]] bool spilled() const { return spilledBytes() != 0; }
+
+    /**
+     * @brief Append the in-memory rows of one file to its spill file and free them.
+     *
+     * Only the reader of that file may call this while reading.  Requires
+     * spillPrefix_ to be set.
+     *
+     * @param file_index The index of the file.
+     * @return Bytes released, or 0 with ok false on a write error.
+     */
+    size_t spill(size_t file_index, bool & ok) {
+        ok = true;
+        if (shared(file_index)) {
+            // Held by the index, not the stream.
+            return 0;
+        }
+        std::vector <Annotation> & annotations = files_[file_index];
+        // A loaded partition holds its spilled rows in front of the new ones.
+        const size_t first = loaded_ ? _spilledRows(file_index) : 0;
+        if (annotations.size() > first) {
+            std::ofstream out(_spillPath(file_index), std::ofstream::binary | std::ofstream::app);
+            for (size_t i = first; i < annotations.size(); i++) {
+                annotations[i].write(out);
+            }
+            ok = !out.fail();
+            if (!ok) {
+                return 0;
+            }
+        }
+        const size_t released = bytes_[file_index];
+        spilledBytes_[file_index] += released;
+        spilledCount_[file_index] += annotations.size() - first;
+        bytes_[file_index] = 0;
+        std::vector <Annotation>().swap(annotations);
+        arenas_[file_index]->release();
+        sorted_[file_index] = SortedRanges();
+        return released;
+    }
+
+    /**
+     * @brief Read the spilled partitions back in front of the in-memory rows.
+     *
+     * @retval false A spill file could not be read.
+     */
+    bool load() {
+        if (loaded_) {
+            return true;
+        }
+        for (size_t f = 0; f < files_.size(); f++) {
+            const size_t count = _spilledRows(f);
+            if (count == 0) {
+                continue;
+            }
+            std::ifstream in(_spillPath(f), std::ifstream::binary);
+            std::vector <Annotation> annotations;
+            annotations.reserve(count + files_[f].size());
+            for (size_t i = 0; i < count; i++) {
+                Annotation annot(arena(f));
+                if (!annot.read(in)) {
+                    return false;
+                }
+                annot.setJoinIndex(joinId_);
+                annotations.push_back(std::move(annot));
+            }
+            for (Annotation & annot : files_[f]) {
+                annotations.push_back(std::move(annot));
+            }
+            files_[f] = std::move(annotations);
+        }
+        loaded_ = true;
+        return true;
+    }
+
+    /**
+     * @brief Spill every file that has spilled before, after load(), freeing the stream's memory.
+     *
+     * @return Bytes of rows that were only in memory and are now on disk.
+     */
+    size_t unload(bool & ok) {
+        ok = true;
+        size_t released = 0;
+        for (size_t f = 0; f < files_.size(); f++) {
+            if (_spilledRows(f) != 0) {
+                bool spilledOk = true;
+                released += spill(f, spilledOk);
+                ok = ok && spilledOk;
+            }
+        }
+        loaded_ = false;
+        return released;
     }
 
-    std::string     joinId_; ///< The join ID / index that is used (i.e. the sequence ID)
-    Annotation *    circularBuffer_;
-    uint32_t        bufferSize_;
-    uint32_t        location_;
+    std::string     spillPrefix_;   ///< Path prefix of the stream's spill files, empty if it cannot spill
+    std::string     joinId_;        ///< The join ID / index that is used (i.e. the sequence ID)
+    uint32_t        bufferSize_;    ///< The number of annotations reserved per file on first use
+    int             node_ = -1;     ///< The NUMA node (index) the stream is mapped on, -1 if unplaced
+
+private:
+    // First, so they outlive the annotations whose elements they hold.
+    std::vector <std::unique_ptr <std::pmr::monotonic_buffer_resource> > arenas_;   ///< Element storage per source file
+    std::vector <std::vector <Annotation> > files_;  ///< Annotations per source file
+    std::vector <SortedRanges>              sorted_; ///< Sorted index per source file, rebuilt when stale
+    std::vector <size_t>                    bytes_;  ///< Estimated bytes in memory (and not on disk) per source file
+    std::vector <size_t>                    spilledBytes_;   ///< Estimated bytes on disk per source file
+    std::vector <size_t>                    spilledCount_;   ///< Rows on disk per source file
+    bool                                    loaded_ = false; ///< Whether the spilled rows are in memory
+
+    /**
+     * A file's partition taken from a shared index.
+     */
+    struct SharedPartition {
+        std::shared_ptr <const SharedIndex>     index;                  ///< Keeps the mapping alive
+        const SharedIndex::Reference *          reference = nullptr;    ///< This stream's rows in it; null if the file was read
+        std::vector <uint32_t>                  slots;                  ///< Per row, 1 + its position in rows; 0 until copied out
+        std::pmr::deque <Annotation>            rows;                   ///< The rows copied out so far, in the arena
+    };
+    std::deque <SharedPartition>            shared_;         ///< Per source file; a deque so growing it never moves the rows
+
+    void _addArenas(size_t file_count) {
+        while (arenas_.size() < file_count) {
+            arenas_.push_back(std::make_unique<std::pmr::monotonic_buffer_resource>(ARENA_CHUNK));
+        }
+    }
+
+    static constexpr size_t ARENA_CHUNK = 1 << 16;  ///< First chunk of an arena; later ones grow
+
+    [[nodiscard]] size_t _spilledRows(size_t file_index) const { return spilledCount_[file_index]; }
+
+    [[nodiscard]] std::string _spillPath(size_t file_index) const {
+        return spillPrefix_ + "_" + std::to_string(file_index) + ".spill";
+    }
 };
 #endif //BIOMAPPER_ANNOTATION_H
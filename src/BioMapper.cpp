@@ -1,13 +1,22 @@
 #include "BioMapper.h"
 
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <climits>
+#include <csignal>
+#include <filesystem>
 #include <iostream>
+#include <numeric>
+#include <unistd.h>
+#include <sys/wait.h>
 
 /*****************************************************************************************
  * BioMapper
  *      Constructor
  ****************************************************************************************/
 
-BioMapper::BioMapper (int threadsToUse /* =-1 */, int readingThreads /* =-1 */ ) : threadsToUse_(threadsToUse), readingThreads_(readingThreads), maximumThreads_(std::thread::hardware_concurrency()) {
+BioMapper::BioMapper (int threadsToUse /* =-1 */, int readingThreads /* =-1 */ ) : maximumThreads_(std::thread::hardware_concurrency()), threadsToUse_(threadsToUse), readingThreads_(readingThreads) {
     // Generate the thread pool
     // If threads to use is defined, use that; otherwise use maximum the
     // hardware supports.
@@ -17,11 +26,11 @@ BioMapper::BioMapper (int threadsToUse /* =-1 */, int readingThreads /* =-1 */ )
     }
 
     // Set up the reading thread count
-    if (readingThreads_ == -1 || readingThreads_ > maximumThreads_) {
+    if (readingThreads_ == -1 || readingThreads_ > static_cast<int>(maximumThreads_)) {
         // Unspecified
         // Set to one
         readingThreads_ = 1;
-    } else if (readingThreads_ == maximumThreads_) {
+    } else if (readingThreads_ == static_cast<int>(maximumThreads_)) {
         // Hmmm so read everything in first before mapping?
         // Don't do anything, but flagging as potential issue
     }
@@ -30,12 +39,542 @@ BioMapper::BioMapper (int threadsToUse /* =-1 */, int readingThreads /* =-1 */ )
     mappingThreads_ = threadsToUse_ - readingThreads_;
 }
 
+BioMapper::~BioMapper() {
+    resetIndex();
+}
+
 bool BioMapper::map() {
+    return map(ResultCallback());
+}
+
+bool BioMapper::map(const ResultCallback & callback) {
+    if (stats_.enabled()) {
+        stats_.reset();
+    }
+    if (!traceFileName_.empty()) {
+        tracer_ = std::make_unique<TraceRecorder>();
+        tracer_->setThreadName("main");
+    } else {
+        tracer_.reset();
+    }
+    stopReason_ = StopReason::None;
+    const bool sharded = processShards_ > 1 && shard_ < 0 && sharedPool_ == nullptr && joinMode_ == JoinMode::Range
+                         && !callback && !outputFileName_.empty();
+    progress_.start(files_.size(), joinMode_ == JoinMode::Key || sharded ? 2 : 3);
+
+    bool passed = !_interrupted() && _runPipeline(callback);
+    if (stopReason() != StopReason::None) {
+        std::cerr << "ERROR: Mapping " << (stopReason() == StopReason::Cancelled ? "was cancelled" :
+                                           stopReason() == StopReason::Deadline ? "passed its deadline" : "failed in the result callback")
+                  << "; stopped.  \n";
+        resetIndex();
+        passed = false;
+    }
+    progress_.finish(passed);
+
+    if (!statsFileName_.empty() && !stats_.writeJson(statsFileName_)) {
+        std::cerr << "WARNING: Could not write the run statistics to " << statsFileName_ << ".  \n";
+    }
+    if (tracer_ && !tracer_->writeJson(traceFileName_)) {
+        std::cerr << "WARNING: Could not write the trace to " << traceFileName_ << ".  \n";
+    }
+    return passed;
+}
+
+/******************************************************************
+ * Interrupted
+ *      The token and the clock are read until one says stop; the
+ *      reason is then kept, so every later check agrees.
+ ******************************************************************/
+bool BioMapper::_interrupted() const {
+    if (stopReason_.load(std::memory_order_relaxed) != StopReason::None) {
+        return true;
+    }
+    StopReason reason = StopReason::None;
+    if (cancelToken_.cancelled()) {
+        reason = StopReason::Cancelled;
+    } else if (deadline_ != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline_) {
+        reason = StopReason::Deadline;
+    }
+    if (reason == StopReason::None) {
+        return false;
+    }
+    StopReason none = StopReason::None;
+    stopReason_.compare_exchange_strong(none, reason, std::memory_order_relaxed);
+    return true;
+}
+
+/******************************************************************
+ * Run Stage
+ *      Run one pipeline stage, recording it in the stats and,
+ *      when tracing, as a slice on the calling thread.
+ ******************************************************************/
+template <typename F>
+bool BioMapper::_runStage(MapperStats::Stage stage, F && body) {
+    TraceScope scope(tracer_.get(), "stage", MapperStats::stageName(stage));
+    stats_.beginStage(stage);
+    bool passed = body();
+    stats_.endStage(stage);
+    return passed;
+}
+
+namespace {
+
+/**
+ * Whether the calling thread is the only one in the process, so a fork
+ * cannot copy a lock some other thread holds.  False if it cannot be told.
+ */
+bool singleThreaded() {
+    std::error_code ec;
+    size_t threads = 0;
+    for (std::filesystem::directory_iterator it("/proc/self/task", ec), end; !ec && it != end; it.increment(ec)) {
+        threads++;
+    }
+    return !ec && threads == 1;
+}
+
+} // namespace
+
+bool BioMapper::_runPipeline(const ResultCallback & callback) {
+    // The workers are forked before this process starts any thread, and
+    // only if the caller has none running either.
+    if (processShards_ > 1 && shard_ < 0 && joinMode_ == JoinMode::Range && !callback && !outputFileName_.empty()) {
+        if (sharedPool_ != nullptr) {
+            std::cerr << "WARNING: Shards are not forked beside a shared thread pool; mapping in process.  \n";
+        } else if (!singleThreaded()) {
+            std::cerr << "WARNING: Shards are only forked from a process with no other thread; mapping in process.  \n";
+        } else {
+            return _runShards();
+        }
+    }
+
+    /*
+     * CREATE THE THREAD POOL
+     * This will use the defined number of threads based
+     * on the hardware or user specified, placed according
+     * to the placement policy.  On a shared pool the run
+     * is a job of at most that many tasks at once.
+     */
+    std::unique_ptr <thread_pool> ownPool;
+    if (sharedPool_ == nullptr) {
+        std::vector <std::vector <int> > threadCpus;
+        std::vector <int> threadNodes;
+        _planPlacement(NumaTopology::detect(), threadCpus, threadNodes);
+        ownPool = std::make_unique<thread_pool>(threadsToUse_, threadCpus, threadNodes);
+        ownPool->tracer = tracer_.get();
+    }
+    JobPool pool(sharedPool_ != nullptr ? *sharedPool_ : *ownPool,
+                 sharedPool_ != nullptr ? static_cast<uint32_t>(threadsToUse_) : 0,
+                 sharedPool_ != nullptr ? tracer_.get() : nullptr);
+
+    bool resultsWritten;
+    if (joinMode_ == JoinMode::Key) {
+        /*
+         * Exact key joins skip the references and streams; each file's
+         * rows are kept whole and matched through hash tables.
+         */
+        if (!_prepareFiles()) {
+            return false;
+        }
+        bool filesRead = _runStage(MapperStats::Stage::Read, [&]() { return _readKeyFiles(pool); });
+        if (!filesRead) {
+            if (stopReason() == StopReason::None) {
+                std::cerr << "Failure in reading one or more files' keys.  \n";
+            }
+            resetIndex();
+            return false;
+        }
+        resultsWritten = _mapKeys(pool, callback);
+    } else {
+        if (!_ingest(pool)) {
+            return false;
+        }
+
+        /*
+         * Map each reference that gained annotations on the pool
+         * while this thread delivers the results, in reference
+         * order, to the output file and the callback.  Aggregates
+         * cover every file, so then every reference is mapped.
+         */
+        const size_t firstFile = resultMode_ == ResultMode::Coverage ? 0 : mappedFileCount_;
+        std::vector <AnnotationStream *> streams;
+        for (auto & stream : annotationStreams_) {
+            for (size_t f = firstFile; f < stream.second.fileCount(); f++) {
+                if (stream.second.rows(f) != 0) {
+                    streams.push_back(&stream.second);
+                    break;
+                }
+            }
+        }
+        resultsWritten = _mapWaves(pool, streams, callback);
+    }
+    mappedFileCount_ = files_.size();
+    if (!resultsWritten) {
+        if (stopReason() == StopReason::None) {
+            std::cerr << "Failure in writing the mapped results to " << outputFileName_ << ".  \n";
+        }
+        resetIndex();
+        return false;
+    }
+
+    // The index lacks the references a resumed run skipped.
+    if (checkpoint_) {
+        checkpoint_.reset();
+        resetIndex();
+    }
+    return true;
+}
+
+/******************************************************************
+ * Ingest
+ *      Every stage up to and including reading the files added
+ *      since the last map() into the annotation streams.
+ ******************************************************************/
+bool BioMapper::_ingest(JobPool & pool) {
+    if (shard_ < 0) {
+        if (!_prepareFiles()) {
+            return false;
+        }
+
+        /*
+         * Read in all of the reference IDs, unless resuming
+         */
+        if (_openCheckpoint()) {
+            progress_.beginFiles(MapperStats::Stage::References, {});
+        } else {
+            bool referencesFound = _runStage(MapperStats::Stage::References, [&]() { return _determineReferences(); });
+            if (!referencesFound) {
+                if (stopReason() == StopReason::None) {
+                    std::cerr << "Failure in parsing one or more files' reference IDs.  \n";
+                }
+                resetIndex();
+                return false;
+            }
+            if (checkpoint_) {
+                std::vector <Checkpoint::References> references;
+                for (const MapperFile & file : files_) {
+                    references.push_back(referenceIDs_[file.file_path()]);
+                }
+                checkpoint_->setReferences(std::move(references));
+                if (!checkpoint_->commit(0)) {
+                    std::cerr << "WARNING: Could not write the checkpoint " << checkpoint_->path() << ".  \n";
+                }
+            }
+        }
+
+        // References done by the checkpointed run are neither read nor mapped.
+        if (checkpoint_) {
+            for (auto it = allReferenceIDs_.begin(); it != allReferenceIDs_.end(); ) {
+                it = checkpoint_->done(it->first) ? allReferenceIDs_.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    std::set <std::string, std::less <> > newlyShared;
+    _createStreams(newlyShared);
+
+    /*
+     * Read all files into the annotation streams
+     */
+    bool filesRead = _runStage(MapperStats::Stage::Read, [&]() { return _readFiles(pool, newlyShared); });
+    if (!filesRead) {
+        if (stopReason() == StopReason::None) {
+            std::cerr << "Failure in reading one or more files' annotations.  \n";
+        }
+        resetIndex();
+        return false;
+    }
+    return true;
+}
+
+/******************************************************************
+ * Open Checkpoint
+ *      The run line holds every file and setting that shapes the
+ *      output.  A checkpoint is only resumed if the output still
+ *      holds everything it records.
+ ******************************************************************/
+bool BioMapper::_openCheckpoint() {
+    checkpoint_.reset();
+    if (!checkpointing_) {
+        return false;
+    }
+    if (joinMode_ != JoinMode::Range || resultMode_ == ResultMode::Coverage || outputFileName_.empty()
+        || mappedFileCount_ > 0) {
+        std::cerr << "WARNING: Checkpoints are kept for range joins of pairs or nearest rows into an output file, "
+                     "mapping every file; mapping without.  \n";
+        return false;
+    }
+
+    std::string run = "mode:" + std::to_string(static_cast<int>(resultMode_));
+    if (resultMode_ == ResultMode::Nearest) {
+        run += ":" + std::to_string(nearestOptions_.k) + ":" + std::to_string(nearestOptions_.window) + ":"
+               + std::to_string(static_cast<int>(nearestOptions_.direction)) + ":" + std::to_string(nearestOptions_.ties)
+               + ":" + std::to_string(nearestOptions_.strandColumn);
+    }
+    for (const MapperFile & file : files_) {
+        run += '\t';
+        if (!Checkpoint::describeFile(file.file_path(), run)) {
+            return false;
+        }
+        run += ":" + std::to_string(file.join_index()) + ":" + std::to_string(file.start_range_index()) + ":"
+               + std::to_string(file.end_range_index()) + ":" + std::to_string(file.zero_based_range()) + ":"
+               + std::to_string(file.has_header()) + ":" + std::to_string(static_cast<int>(file.delimiter())) + ":"
+               + std::to_string(file.quoted());
+    }
+    checkpoint_ = std::make_unique<Checkpoint>(outputFileName_ + ".checkpoint", run);
+    if (!resume_ || !checkpoint_->load(files_.size())) {
+        return false;
+    }
+
+    std::error_code ec;
+    const uint64_t outputBytes = std::filesystem::file_size(outputFileName_, ec);
+    if (checkpoint_->outputBytes() > 0 && (ec || outputBytes < checkpoint_->outputBytes())) {
+        std::cerr << "WARNING: " << outputFileName_ << " is shorter than its checkpoint; mapping from the start.  \n";
+        checkpoint_ = std::make_unique<Checkpoint>(checkpoint_->path(), run);
+        return false;
+    }
+
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    referenceIDs_.clear();
+    allReferenceIDs_.clear();
+    for (size_t f = 0; f < fileCount; f++) {
+        std::map <std::string, uint64_t, std::less <> > & refIDs = referenceIDs_[files_[f].file_path()];
+        refIDs = checkpoint_->references()[f];
+        for (const auto & refID : refIDs) {
+            allReferenceIDs_[refID.first] += 1;
+        }
+    }
+    return true;
+}
+
+/******************************************************************
+ * Checkpoint Streams
+ *      Streams are done once drained; the output is flushed and
+ *      synced before the checkpoint claims it.
+ ******************************************************************/
+void BioMapper::_checkpointStreams(const std::vector <AnnotationStream *> & wave, size_t count, std::ofstream & out,
+                                   size_t & recorded, std::chrono::steady_clock::time_point & committed) {
+    for (; recorded < count; recorded++) {
+        checkpoint_->complete(wave[recorded]->joinId_);
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (count < wave.size() && now - committed < checkpointInterval_) {
+        return;
+    }
+    out.flush();
+    std::error_code ec;
+    const uint64_t outputBytes = std::filesystem::file_size(outputFileName_, ec);
+    if (out.fail() || ec || !Checkpoint::syncFile(outputFileName_) || !checkpoint_->commit(outputBytes)) {
+        std::cerr << "WARNING: Could not write the checkpoint " << checkpoint_->path() << ".  \n";
+    }
+    committed = now;
+}
+
+/******************************************************************
+ * Run Shards
+ *      Coordinate a sharded run: find the references once, fork a
+ *      worker per shard, run failed shards once more, and merge the
+ *      workers' output files in shard (reference) order.
+ ******************************************************************/
+bool BioMapper::_runShards() {
+    if (checkpointing_) {
+        std::cerr << "WARNING: Checkpoints are not kept for sharded runs; mapping without.  \n";
+    }
+    // Workers map every file; nothing is kept between runs.
+    resetIndex();
+    if (!_prepareFiles()) {
+        return false;
+    }
+    bool referencesFound = _runStage(MapperStats::Stage::References, [&]() { return _determineReferences(); });
+    if (!referencesFound) {
+        if (stopReason() == StopReason::None) {
+            std::cerr << "Failure in parsing one or more files' reference IDs.  \n";
+        }
+        resetIndex();
+        return false;
+    }
+
+    const auto shards = _planShards(static_cast<size_t>(processShards_));
+    std::vector <std::string> outputs;
+    for (size_t k = 0; k < shards.size(); k++) {
+        outputs.push_back(outputFileName_ + ".shard" + std::to_string(k) + "." + std::to_string(getpid()));
+    }
+
+    // Run every shard, then the failed ones a second time.  The workers
+    // are polled rather than waited for, so a stopped run can kill them.
+    std::vector <bool> done(shards.size(), false);
+    progress_.beginParts(shards.size());
+    const bool mapped = _runStage(MapperStats::Stage::Map, [&]() {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            std::vector <pid_t> workers(shards.size(), -1);
+            std::vector <int> statuses(shards.size(), 0);
+            size_t running = 0;
+            for (size_t k = 0; k < shards.size(); k++) {
+                if (!done[k]) {
+                    workers[k] = _forkShard(k, shards.size(), shards[k], outputs[k]);
+                    running += workers[k] > 0;
+                }
+            }
+            while (running > 0) {
+                if (_interrupted()) {
+                    for (const pid_t worker : workers) {
+                        if (worker > 0) {
+                            kill(worker, SIGKILL);
+                            waitpid(worker, nullptr, 0);
+                        }
+                    }
+                    return false;
+                }
+                for (size_t k = 0; k < shards.size(); k++) {
+                    if (workers[k] > 0 && waitpid(workers[k], &statuses[k], WNOHANG) == workers[k]) {
+                        workers[k] = 0;
+                        running--;
+                        if (WIFEXITED(statuses[k]) && WEXITSTATUS(statuses[k]) == 0) {
+                            done[k] = true;
+                            progress_.addParts(1);
+                        }
+                    }
+                }
+                if (running > 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+            for (size_t k = 0; k < shards.size(); k++) {
+                if (done[k]) {
+                    continue;
+                }
+                const int status = statuses[k];
+                std::cerr << (attempt == 0 ? "WARNING: " : "ERROR: ") << "Shard " << k << " ("
+                          << shards[k].front() << " to " << shards[k].back() << ") ";
+                if (workers[k] < 0) {
+                    std::cerr << "could not be started";
+                } else if (WIFSIGNALED(status)) {
+                    std::cerr << "was killed by signal " << WTERMSIG(status);
+                } else {
+                    std::cerr << "failed";
+                }
+                std::cerr << (attempt == 0 ? "; running it again.  \n" : ".  \n");
+            }
+        }
+        return true;
+    });
+    resetIndex();
+    if (!mapped) {
+        for (const std::string & output : outputs) {
+            std::error_code ec;
+            std::filesystem::remove(output, ec);
+        }
+        return false;
+    }
+
+    return _runStage(MapperStats::Stage::Write, [&]() {
+        std::ofstream out(outputFileName_, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+        bool passed = !out.fail();
+        for (size_t k = 0; k < shards.size(); k++) {
+            if (done[k]) {
+                std::ifstream in(outputs[k], std::ifstream::in | std::ifstream::binary);
+                // Streaming an empty buffer would fail the output.
+                if (in.peek() != std::ifstream::traits_type::eof()) {
+                    out << in.rdbuf();
+                }
+            }
+            passed = passed && done[k];
+            std::error_code ec;
+            std::filesystem::remove(outputs[k], ec);
+        }
+        out.close();
+        return passed && !out.fail();
+    });
+}
+
+/******************************************************************
+ * Plan Shards
+ *      Runs of references in reference order, so the shards'
+ *      outputs concatenate in order.  A shard ends where the next
+ *      reference would take it past its share of the rows.
+ ******************************************************************/
+std::vector <std::vector <std::string> > BioMapper::_planShards(size_t count) const {
+    std::vector <std::pair <const std::string *, uint64_t> > references;
+    uint64_t total = 0;
+    for (const auto & refID : allReferenceIDs_) {
+        if (refID.second < _minFilesPerReference()) {
+            continue;
+        }
+        uint64_t rows = 0;
+        for (const auto & file : referenceIDs_) {
+            auto it = file.second.find(refID.first);
+            if (it != file.second.end()) {
+                rows += it->second;
+            }
+        }
+        references.emplace_back(&refID.first, rows);
+        total += rows;
+    }
+
+    std::vector <std::vector <std::string> > shards;
+    uint64_t assigned = 0;
+    for (const auto & [name, rows] : references) {
+        // Past the middle of this reference the current shard has its share.
+        if (shards.empty() || (shards.size() < count && assigned + rows / 2 >= total * shards.size() / count)) {
+            shards.emplace_back();
+        }
+        shards.back().push_back(*name);
+        assigned += rows;
+    }
+    return shards;
+}
+
+/******************************************************************
+ * Fork Shard
+ *      The worker inherits the files and references found by the
+ *      coordinator, drops the references of the other shards and
+ *      maps from the streams on.  It leaves with _exit(), so none
+ *      of the coordinator's state is torn down (or flushed) twice.
+ ******************************************************************/
+pid_t BioMapper::_forkShard(size_t shard, size_t shard_count, const std::vector <std::string> & references,
+                            const std::string & output) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    shard_ = static_cast<long>(shard);
+    outputFileName_ = output;
+    tracer_.reset();
+    if (memoryBudget_.enabled()) {
+        memoryBudget_.setLimit(std::max<uint64_t>(1, memoryBudget_.limit() / shard_count));
+    }
+    for (auto it = allReferenceIDs_.begin(); it != allReferenceIDs_.end(); ) {
+        if (std::binary_search(references.begin(), references.end(), it->first)) {
+            ++it;
+        } else {
+            it = allReferenceIDs_.erase(it);
+        }
+    }
+
+    // Nothing may unwind past here into the caller's code.
+    bool passed = false;
+    try {
+        passed = _runPipeline(ResultCallback());
+        resetIndex();
+    } catch (...) {
+        passed = false;
+    }
+    _exit(passed ? 0 : 1);
+}
+
+/******************************************************************
+ * Prepare Files
+ *      Check that the files added since the last map() open and
+ *      read their headers.
+ ******************************************************************/
+bool BioMapper::_prepareFiles() {
     /*
      * Pre-processing Checks
      */
     std::vector <std::string> fail_list;
-    if (!_verifyFiles(fail_list)) {
+    bool verified = _runStage(MapperStats::Stage::Verify, [&]() { return _verifyFiles(fail_list); });
+    if (!verified) {
         // Files failed;
         std::cerr << "Failure in opening one or more files:  \n";
         for (auto &fail_file : fail_list) {
@@ -47,35 +586,93 @@ bool BioMapper::map() {
     /*
      * Read in all headers if they exist
      */
-    if (!_parseHeaders()) {
+    bool headersParsed = _runStage(MapperStats::Stage::Header, [&]() { return _parseHeaders(); });
+    if (!headersParsed) {
         std::cerr << "Failure in parsing one or more files' headers.  \n";
         return false;
     }
 
-	/*
-	 * Read in all of the reference IDs
-	 */
-	if (!_determineReferences()) {
-		std::cerr << "Failure in parsing one or more files' reference IDs.  \n";
-		return false;
-	}
-
-    /*
-     * CREATE THE THREAD POOL
-     * This will use the defined number of threads based
-     * on the hardware or user specified.
-     */
-    thread_pool pool(threadsToUse_);
+    if (planning_) {
+        _planExecution();
+    }
+    return true;
+}
 
+/******************************************************************
+ * Plan Execution
+ *      Plan from the estimates of every file, earlier ones too,
+ *      and set the members the stages read their settings from.
+ ******************************************************************/
+void BioMapper::_planExecution() {
+    ExecutionPlanner::Settings settings;
+    settings.threads = threadsToUse_;
+    settings.filesPerReader = FILES_PER_READER;
+    settings.keyJoin = joinMode_ == JoinMode::Key;
+    settings.memoryBudget = requestedBudget_;
+    settings.resultBatchSize = resultBatchSize_;
+    settings.physicalMemory = ExecutionPlanner::physicalMemory();
+    plan_ = ExecutionPlanner::plan(estimates_, settings);
+    planOverride_.apply(plan_);
+    if ((plan_.engine == MapEngine::Hash) != (joinMode_ == JoinMode::Key)) {
+        plan_.engine = joinMode_ == JoinMode::Key ? MapEngine::Hash : MapEngine::Sweep;
+    }
+    std::clog << "PLAN: " << plan_.describe() << "\n";
 
+    mapEngine_ = plan_.engine;
+    readingThreads_ = std::max(1, plan_.readingThreads);
+    mappingThreads_ = plan_.mappingThreads;
+    blockSize_ = plan_.blockSize;
+    resultBatchSize_ = std::max<size_t>(1, plan_.resultBatchSize);
+    streamCapacity_ = plan_.streamCapacity;
+    memoryBudget_.setLimit(plan_.memoryBudget);
+}
 
-    return true;
+/******************************************************************
+ * Reset Index
+ *      Forget every file's references and annotations so the
+ *      next map() starts from scratch.
+ ******************************************************************/
+void BioMapper::resetIndex() {
+    referenceIDs_.clear();
+    allReferenceIDs_.clear();
+    annotationStreams_.clear();
+    joinFilter_ = JoinKeyFilter();
+    streamsById_.clear();
+    keyedFiles_.clear();
+    fileNodes_.clear();
+    mappedFileCount_ = 0;
+    memoryBudget_.reset();
+    if (!spillPath_.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(spillPath_, ec);
+        spillPath_.clear();
+    }
 }
 
 bool BioMapper::addFile(const char * file_path, int join_index, long long int start_range_index, long long int end_range_index,
              bool zero_based_range, bool has_header, char delimiter) {
-    MapperFile file = MapperFile(file_path, join_index, start_range_index, end_range_index, zero_based_range, has_header, delimiter);
-    return addFile(file);
+    return addFile(MapperFile(file_path, join_index, start_range_index, end_range_index, zero_based_range, has_header, delimiter));
+}
+
+bool BioMapper::addIndexedFile(MapperFile file, const std::string & index_path) {
+    std::shared_ptr <const SharedIndex> index = SharedIndex::attach(file, index_path);
+    if (!index) {
+        return false;
+    }
+    for (const auto & [column, name] : index->header()) {
+        file.add_column_to_header(column, name);
+    }
+    file.set_shared_index(std::move(index));
+    return addFile(std::move(file));
+}
+
+bool BioMapper::addKeyFile(const char * file_path, std::vector <int32_t> key_columns, bool has_header, char delimiter) {
+    if (key_columns.empty()) {
+        return false;
+    }
+    MapperFile file = MapperFile(file_path, key_columns.front(), -1, -1, true, has_header, delimiter);
+    file.set_key_indexes(std::move(key_columns));
+    return addFile(std::move(file));
 }
 
 
@@ -87,8 +684,13 @@ bool BioMapper::addFile(const char * file_path, int join_index, long long int st
 bool BioMapper::_verifyFiles(std::vector <std::string> &fail_list) {
     // Verify that all the files are openable.
     // Can just do serially
+    const size_t fileCount = static_cast<size_t>(files_.size());
     bool passed = true;
-    for (auto &file : files_) {
+    if (planning_) {
+        estimates_.resize(fileCount);
+    }
+    for (size_t f = mappedFileCount_; f < fileCount; f++) {
+        const MapperFile & file = files_[f];
         std::ifstream fs;
         fs.open(file.file_path(), std::ifstream::in);
         if (fs.fail() || fs.peek() == std::ifstream::traits_type::eof()) {
@@ -99,6 +701,11 @@ bool BioMapper::_verifyFiles(std::vector <std::string> &fail_list) {
         } else {
             // No error state, so close the file
             fs.close();
+            // Pre-scan for the plan
+            if (planning_ && ExecutionPlanner::estimate(file, estimates_[f])) {
+                stats_.addRows(MapperStats::Stage::Verify, estimates_[f].sampledRows,
+                               static_cast<uint64_t>(estimates_[f].rowWidth * static_cast<double>(estimates_[f].sampledRows)));
+            }
         }
     }
     return passed;
@@ -110,10 +717,12 @@ bool BioMapper::_verifyFiles(std::vector <std::string> &fail_list) {
  *      object to be const later
  ******************************************************************/
 bool BioMapper::_parseHeaders() {
-    // TODO: Need to fix the iterator here; need to add begin to class
-    for (auto &file : files_) {
-        if (!file.has_header()) {
-            // No header, continue
+    // Files of earlier runs already have their headers
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    for (size_t f = mappedFileCount_; f < fileCount; f++) {
+        MapperFile & file = files_[f];
+        if (!file.has_header() || file.shared_index()) {
+            // No header, or taken from the index; continue
             continue;
         }
 
@@ -130,38 +739,85 @@ bool BioMapper::_parseHeaders() {
             return false;
         }
 
-        std::stringstream _rowElements(row);
-        std::string _element;
-        int i = 0;
-        while (std::getline(_rowElements, _element, file.delimiter())) {
-            file.add_column_to_header(i, _element);
-            i++;
+        if (file.quoted()) {
+            std::vector <std::string_view> names;
+            std::string unescaped;
+            splitQuotedRow(row, file.delimiter(), names, unescaped);
+            for (size_t i = 0; i < names.size(); i++) {
+                file.add_column_to_header(i, std::string(names[i]));
+            }
+        } else {
+            std::stringstream _rowElements(row);
+            std::string _element;
+            int i = 0;
+            while (std::getline(_rowElements, _element, file.delimiter())) {
+                file.add_column_to_header(i, _element);
+                i++;
+            }
         }
+        stats_.addRows(MapperStats::Stage::Header, 1, row.size() + 1);
     }
     return true;
 }
 
 /******
  *
- * Pre-fetch all the references across all the files.
+ * Pre-fetch all the references across all the files.  Only files
+ * added since the last map() are scanned; their references are
+ * added to the counts of the earlier files.
  */
 bool BioMapper::_determineReferences() {
     // Determine all references across all files
     // This could be chromosome, segment, or sequence IDs
-    for (const MapperFile & file : files_ ) {
+    if (mappedFileCount_ == 0) {
+        referenceIDs_.clear();
+        allReferenceIDs_.clear();
+    }
+    // The files are read in order; the next ones are prefetched meanwhile.
+    // Files with a shared index have their references listed in it.
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    std::vector <size_t> order;
+    for (size_t f = mappedFileCount_; f < fileCount; f++) {
+        if (!files_[f].shared_index()) {
+            order.push_back(f);
+        }
+    }
+    std::unique_ptr <BlockReader> reader = _openReader(order);
+    if (!reader) {
+        return false;
+    }
+    std::vector <uint64_t> totalBytes(fileCount, 0);
+    for (size_t f : order) {
+        std::error_code ec;
+        totalBytes[f] = std::filesystem::file_size(files_[f].file_path(), ec);
+    }
+    progress_.beginFiles(MapperStats::Stage::References, totalBytes);
+    size_t slot = 0;
+    for (size_t f = mappedFileCount_; f < fileCount; f++) {
+        const MapperFile & file = files_[f];
         // Get a reference to the refID we want to update (so each file will have
         // a list of their own files
-        std::map <std::string, bool> &_refIDs = referenceIDs_[file.file_path()];
+        std::map <std::string, uint64_t, std::less <> > &_refIDs = referenceIDs_[file.file_path()];
+
+        if (file.shared_index()) {
+            for (const SharedIndex::Reference & reference : file.shared_index()->references()) {
+                _refIDs[std::string(reference.name)] += reference.count;
+            }
+            for (auto& refID : _refIDs) {
+                allReferenceIDs_[refID.first] += 1;
+            }
+            continue;
+        }
+
         // Read in file
-        std::ifstream fs;
-        fs.open(file.file_path());
+        BlockLineReader lines(*reader, slot++, file.quoted());
 
         // Read in all references as a dictionary
-        std::string row;
+        std::string_view row;
 
         if (file.has_header()) {
             // remove first line and save for future use
-            std::getline(fs, row);
+            lines.next(row);
 
             if (row.empty()) {
                 std::cerr << "ERROR: No file size for " << file.file_path() << ".  Aborting." << std::endl << std::endl;
@@ -171,20 +827,40 @@ bool BioMapper::_determineReferences() {
             // done with a different function.
         }
 
-        while ( std::getline(fs, row) ) {
-            std::stringstream _rowElements(row);
-            std::string _element;
-            auto i = 1;
-
-            while ( std::getline(_rowElements, _element, file.delimiter()) ) {
-                if ( i == file.join_index() ) {
-					_refIDs[_element] = true;
-                    // Break out of loop and move to next row
-                    break;
+        // Progress is counted, and a stop looked for, every CHECK_ROWS rows.
+        uint64_t rows = 0, bytes = 0, counted = 0, countedBytes = 0;
+        std::vector <std::string_view> fields;
+        std::string unescaped;
+        while ( lines.next(row) ) {
+            rows++;
+            bytes += row.size() + 1;
+            if (rows - counted == CHECK_ROWS) {
+                progress_.addRows(f, rows - counted, bytes - countedBytes);
+                counted = rows;
+                countedBytes = bytes;
+                if (_interrupted()) {
+                    return false;
+                }
+            }
+            _splitFields(row, file, fields, unescaped);
+            if ( file.join_index() >= 0 && static_cast<size_t>(file.join_index()) < fields.size() ) {
+                const std::string_view refID = fields[file.join_index()];
+                // Only a new reference costs a string
+                auto it = _refIDs.find(refID);
+                if ( it == _refIDs.end() ) {
+                    _refIDs.emplace(refID, 1);
+                } else {
+                    it->second++;
                 }
-                i++;
             }
         }
+        progress_.addRows(f, rows - counted, bytes - countedBytes);
+        stats_.addRows(MapperStats::Stage::References, rows, bytes);
+        if (lines.failed()) {
+            std::cerr << "ERROR: Could not read " << file.file_path() << ".  Aborting." << std::endl << std::endl;
+            return false;
+        }
+
         // Add this file's reference IDs to the universal list.
         for (auto& refID : _refIDs) {
             auto it = allReferenceIDs_.find(refID.first);
@@ -197,4 +873,1586 @@ bool BioMapper::_determineReferences() {
     }
 
     return true;
-}
\ No newline at end of file
+}
+/******************************************************************
+ * Plan Placement
+ *      Decide which CPUs and NUMA node each pool worker uses.
+ ******************************************************************/
+void BioMapper::_planPlacement(const NumaTopology & topology, std::vector <std::vector <int> > & thread_cpus,
+                               std::vector <int> & thread_nodes) const {
+    thread_cpus.clear();
+    thread_nodes.clear();
+    if (placementPolicy_ == PlacementPolicy::None || threadsToUse_ <= 0) {
+        return;
+    }
+
+    if (placementPolicy_ == PlacementPolicy::NumaAware && topology.is_numa()) {
+        // Deal workers out to the nodes round robin, each pinned to its own
+        // core on that node.
+        const auto & nodes = topology.nodes();
+        for (int i = 0; i < threadsToUse_; i++) {
+            const NumaNode & node = nodes[i % nodes.size()];
+            thread_cpus.push_back({node.cpus[(i / nodes.size()) % node.cpus.size()]});
+            thread_nodes.push_back(static_cast<int>(i % nodes.size()));
+        }
+        return;
+    }
+
+    // PinCores, or NumaAware on a single node machine.
+    std::vector <int> cpus = topology.interleaved_cpus();
+    for (int i = 0; i < threadsToUse_; i++) {
+        thread_cpus.push_back({cpus[i % cpus.size()]});
+    }
+}
+
+/******************************************************************
+ * Create Streams
+ *      A reference gets a stream if it is in at least
+ *      _minFilesPerReference() files, which is two for a join and
+ *      one for coverage or a query index.  Rows of other
+ *      references are dropped while reading.  Streams of earlier
+ *      runs are kept and grown to the new files; references that
+ *      become shared only now are returned, as their rows in the
+ *      earlier files were dropped and must be read again.
+ ******************************************************************/
+void BioMapper::_createStreams(std::set <std::string, std::less <> > & newly_shared) {
+    if (mappedFileCount_ == 0) {
+        annotationStreams_.clear();
+    }
+    for (auto & stream : annotationStreams_) {
+        stream.second.addFiles(files_.size());
+    }
+    for (auto & refID : allReferenceIDs_) {
+        if (refID.second < _minFilesPerReference() || annotationStreams_.count(refID.first) != 0) {
+            continue;
+        }
+        annotationStreams_.emplace(std::piecewise_construct, std::forward_as_tuple(refID.first),
+                                   std::forward_as_tuple(refID.first, streamCapacity_, files_.size()));
+        if (mappedFileCount_ > 0) {
+            newly_shared.insert(refID.first);
+        }
+    }
+
+    // Rows are matched to their stream through the join key filter.
+    joinFilter_.build(allReferenceIDs_, _minFilesPerReference());
+    streamsById_.clear();
+    if (!joinFilter_.usesBloom()) {
+        for (auto & refID : allReferenceIDs_) {
+            auto it = annotationStreams_.find(refID.first);
+            streamsById_.push_back(it == annotationStreams_.end() ? nullptr : &it->second);
+        }
+    }
+
+    // Name the spill files up front so readers never share a counter.
+    if (memoryBudget_.enabled()) {
+        if (spillPath_.empty()) {
+            std::filesystem::path base = spillDirectory_.empty() ? std::filesystem::temp_directory_path()
+                                                                 : std::filesystem::path(spillDirectory_);
+            static std::atomic <uint64_t> instances = 0;
+            base /= "biomapper-" + std::to_string(getpid()) + "-" + std::to_string(instances++);
+            spillPath_ = base.string();
+        }
+        for (auto & stream : annotationStreams_) {
+            if (stream.second.spillPrefix_.empty()) {
+                stream.second.spillPrefix_ = (std::filesystem::path(spillPath_) / std::to_string(streamsCreated_++)).string();
+            }
+        }
+    }
+}
+
+/******************************************************************
+ * Read Files
+ *      Files are assigned to NUMA nodes balanced by size and read
+ *      by the read lanes, each preferring the files of its node.
+ *      Files of earlier runs are only read again for the
+ *      references in newly_shared.  Files with a shared index are
+ *      not read at all.
+ ******************************************************************/
+bool BioMapper::_readFiles(JobPool & pool, const std::set <std::string, std::less <> > & newly_shared) {
+    const size_t fileCount = files_.size();
+    const size_t nodeCount = std::max<size_t>(1, pool.get_node_count());
+
+    _attachSharedIndexes();
+
+    std::vector <size_t> bySize;
+    for (size_t i = 0; i < fileCount; i++) {
+        if (files_[i].shared_index()) {
+            continue;
+        }
+        if (i >= mappedFileCount_) {
+            bySize.push_back(i);
+            continue;
+        }
+        const auto & refIDs = referenceIDs_[files_[i].file_path()];
+        if (std::any_of(newly_shared.begin(), newly_shared.end(),
+                        [&](const std::string & refID) { return refIDs.count(refID) != 0; })) {
+            bySize.push_back(i);
+        }
+    }
+
+    // Largest files first, each to the least loaded node.
+    std::vector <uintmax_t> fileSizes(fileCount, 0);
+    for (size_t i : bySize) {
+        std::error_code ec;
+        fileSizes[i] = std::filesystem::file_size(files_[i].file_path(), ec);
+    }
+    std::sort(bySize.begin(), bySize.end(), [&](size_t a, size_t b) { return fileSizes[a] > fileSizes[b]; });
+    progress_.beginFiles(MapperStats::Stage::Read, std::vector <uint64_t>(fileSizes.begin(), fileSizes.end()));
+
+    ReadQueue queue;
+    queue.nodeFiles.resize(nodeCount);
+    queue.cursors = std::vector <std::atomic <size_t> >(nodeCount);
+    std::vector <uintmax_t> nodeLoad(nodeCount, 0);
+    for (size_t fileIndex : bySize) {
+        size_t node = std::min_element(nodeLoad.begin(), nodeLoad.end()) - nodeLoad.begin();
+        queue.nodeFiles[node].push_back(fileIndex);
+        nodeLoad[node] += fileSizes[fileIndex];
+    }
+
+    // Reads are prefetched in the order the lanes take the files.
+    queue.slots.assign(fileCount, 0);
+    std::vector <size_t> readOrder;
+    for (size_t offset = 0; readOrder.size() < bySize.size(); offset++) {
+        for (const auto & files : queue.nodeFiles) {
+            if (offset < files.size()) {
+                queue.slots[files[offset]] = readOrder.size();
+                readOrder.push_back(files[offset]);
+            }
+        }
+    }
+    std::unique_ptr <BlockReader> blocks = _openReader(readOrder);
+    if (!blocks) {
+        return false;
+    }
+    memoryBudget_.charge(blocks->memoryUsage());
+
+    fileNodes_.resize(fileCount, -1);
+    readDone_.assign(fileCount, true);
+    for (size_t fileIndex : bySize) {
+        readDone_[fileIndex] = false;
+    }
+
+    const bool passed = _runReadLanes(pool, *blocks, queue, &newly_shared);
+    memoryBudget_.release(blocks->memoryUsage());
+
+    return passed;
+}
+
+/******************************************************************
+ * Attach Shared Indexes
+ *      Point each stream's partition of an indexed file at that
+ *      reference in the index.  Streams of earlier runs already
+ *      have theirs, so this covers the new files and, in the
+ *      earlier files, the references that became shared now.
+ ******************************************************************/
+void BioMapper::_attachSharedIndexes() {
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    for (size_t f = 0; f < fileCount; f++) {
+        const std::shared_ptr <const SharedIndex> & index = files_[f].shared_index();
+        if (!index) {
+            continue;
+        }
+        for (auto & [name, stream] : annotationStreams_) {
+            if (stream.shared(f)) {
+                continue;
+            }
+            if (const SharedIndex::Reference * reference = index->find(name)) {
+                stream.attachShared(f, index, *reference);
+                stats_.addRows(MapperStats::Stage::Read, reference->count, 0);
+            }
+        }
+    }
+}
+
+/******************************************************************
+ * Read Lanes
+ *      readingThreads_ * FILES_PER_READER coroutines, each taking
+ *      one file at a time, spread over the NUMA nodes.  A lane
+ *      waiting for a block is suspended instead of holding its
+ *      worker, and is resumed on a worker of its node once the
+ *      block is in.
+ ******************************************************************/
+bool BioMapper::ReadQueue::take(int node, size_t & file_index) {
+    const size_t nodeCount = nodeFiles.size();
+    const size_t home = node < 0 ? 0 : static_cast<size_t>(node);
+    // Own node's files first, then help the other nodes.
+    for (size_t offset = 0; offset < nodeCount; offset++) {
+        const size_t n = (home + offset) % nodeCount;
+        const size_t next = cursors[n]++;
+        if (next < nodeFiles[n].size()) {
+            file_index = nodeFiles[n][next];
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t BioMapper::ReadQueue::remaining() const {
+    size_t count = 0;
+    for (size_t n = 0; n < nodeFiles.size(); n++) {
+        count += nodeFiles[n].size() - std::min(nodeFiles[n].size(), cursors[n].load());
+    }
+    return count;
+}
+
+bool BioMapper::_runReadLanes(JobPool & pool, BlockReader & blocks, ReadQueue & queue,
+                              const std::set <std::string, std::less <> > * newly_shared) {
+    size_t fileCount = 0;
+    for (const auto & files : queue.nodeFiles) {
+        fileCount += files.size();
+    }
+    const size_t nodeCount = queue.nodeFiles.size();
+    const size_t lanes = std::clamp<size_t>(static_cast<size_t>(std::max(1, readingThreads_)) * FILES_PER_READER,
+                                            1, std::max<size_t>(1, fileCount));
+
+    std::atomic <bool> passed = true;
+    std::latch done(static_cast<std::ptrdiff_t>(lanes));
+    queue.pushed = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lanes; i++) {
+        const int node = static_cast<int>(i % nodeCount);
+        _readLane(pool, node, blocks, queue, newly_shared, passed).start(pool, node, done);
+    }
+    // Suspended lanes are not pool tasks; wait for the lanes themselves.
+    done.wait();
+    return passed;
+}
+
+DetachedTask BioMapper::_readLane(JobPool & pool, int node, BlockReader & blocks, ReadQueue & queue,
+                                  const std::set <std::string, std::less <> > * newly_shared, std::atomic <bool> & passed) {
+    if (stats_.enabled()) {
+        stats_.addConsumerStall(MapperStats::Stage::Read, MapperStats::elapsedNs(queue.pushed));
+    }
+    const PoolScheduler scheduler{&pool, node};
+    size_t fileIndex;
+    while (queue.take(node, fileIndex)) {
+        stats_.recordQueueDepth(MapperStats::Stage::Read, queue.remaining());
+        const size_t slot = queue.slots[fileIndex];
+        bool read;
+        if (joinMode_ == JoinMode::Key) {
+            read = co_await _readKeyFile(fileIndex, blocks, slot, scheduler);
+        } else {
+            fileNodes_[fileIndex] = thread_pool::get_current_node();
+            read = co_await _readFile(fileIndex, blocks, slot, scheduler, fileIndex < mappedFileCount_ ? newly_shared : nullptr);
+            const std::scoped_lock lock(spillMtx_);
+            readDone_[fileIndex] = true;
+        }
+        if (!read) {
+            passed = false;
+        }
+    }
+}
+
+/******************************************************************
+ * Read File
+ *      Parse one file into the annotation streams.  Ranges are
+ *      normalized to zero based, end exclusive coordinates.
+ ******************************************************************/
+Task <bool> BioMapper::_readFile(size_t file_index, BlockReader & blocks, size_t slot, PoolScheduler scheduler,
+                                  const std::set <std::string, std::less <> > * only) {
+    const MapperFile & file = files_[file_index];
+    AsyncGenerator <RowBatch> batches = rowBatches(blocks, slot, scheduler, file.quoted());
+    // Header was already parsed
+    bool header = file.has_header();
+    uint64_t rowNumber = 0;
+
+    // Rows and bytes are flushed to the stats in batches, as is the
+    // memory charged to the budget.
+    uint64_t rows = 0, bytes = 0;
+    uint64_t charged = 0;
+    const bool budgeted = memoryBudget_.enabled();
+    RowColumns columns;
+    while ( co_await batches.next() ) {
+        if (_interrupted()) {
+            co_return false;
+        }
+        // One slice per block; a file's blocks may be parsed on different workers.
+        TraceScope scope(tracer_.get(), "read", "read", file.file_path());
+        uint64_t batchBytes = 0;
+        for ( std::string_view row : batches.value().rows ) {
+            rowNumber++;
+            batchBytes += row.size() + 1;
+            if (header) {
+                header = false;
+                continue;
+            }
+            rows++;
+            bytes += row.size() + 1;
+            if (rows == 4096) {
+                stats_.addRows(MapperStats::Stage::Read, rows, bytes);
+                rows = bytes = 0;
+            }
+
+            size_t annotBytes = 0;
+            if (!_readRow(file_index, row, rowNumber, columns, only, annotBytes)) {
+                co_return false;
+            }
+            charged += annotBytes;
+            if (budgeted && charged >= (1 << 16)) {
+                memoryBudget_.charge(charged);
+                charged = 0;
+                if (memoryBudget_.overLimit() && !co_await _makeRoom(file_index, scheduler)) {
+                    co_return false;
+                }
+            }
+        }
+        progress_.addRows(file_index, batches.value().rows.size(), batchBytes);
+    }
+    memoryBudget_.charge(charged);
+    if (memoryBudget_.overLimit() && !co_await _makeRoom(file_index, scheduler)) {
+        co_return false;
+    }
+    stats_.addRows(MapperStats::Stage::Read, rows, bytes);
+    if (blocks.failed(slot)) {
+        std::cerr << "ERROR: Could not read " << file.file_path() << ".  Aborting." << std::endl << std::endl;
+        co_return false;
+    }
+    co_return true;
+}
+
+/******************************************************************
+ * Read Row
+ *      Parse one row of a range file into its stream.  Once the
+ *      columns and the stream's partition have their capacity,
+ *      a row allocates nothing: its elements go to the
+ *      partition's arena.
+ ******************************************************************/
+bool BioMapper::_readRow(size_t file_index, std::string_view row, uint64_t row_number, RowColumns & columns,
+                         const std::set <std::string, std::less <> > * only, size_t & bytes) {
+    const MapperFile & file = files_[file_index];
+    bytes = 0;
+    if (row.empty()) {
+        return true;
+    }
+
+    // Drop rows whose reference is only in this file as soon as the
+    // join column is found, before the rest of the row is split.
+    // Quoted columns may hold the delimiter, so those rows are split first.
+    AnnotationStream * stream;
+    if ( file.quoted() ) {
+        _splitFields(row, file, columns.fields, columns.unescaped);
+        stream = _findStream(columns.column(file.join_index()));
+    } else {
+        stream = _findStream(_column(row, file.join_index(), file.delimiter()));
+        if ( stream != nullptr ) {
+            _splitRow(row, file.delimiter(), columns.fields);
+        }
+    }
+    if ( stream == nullptr ) {
+        return true;
+    }
+    const std::string_view joinValue = columns.column(file.join_index());
+
+    if ( only != nullptr && only->count(joinValue) == 0 ) {
+        // Already read in an earlier run
+        return true;
+    }
+
+    auto parseRange = [](std::string_view value, long long int & range) {
+        auto result = std::from_chars(value.data(), value.data() + value.size(), range);
+        return result.ec == std::errc();
+    };
+    long long int start, end;
+    if ( !parseRange(columns.column(file.start_range_index()), start) ||
+         (file.end_range_index() >= 0 && !parseRange(columns.column(file.end_range_index()), end)) ) {
+        std::cerr << "ERROR: Could not read the range on line " << row_number << " of " << file.file_path()
+                  << ".  Aborting." << std::endl << std::endl;
+        return false;
+    }
+
+    if ( !file.zero_based_range() ) {
+        start -= 1;
+    }
+    if ( file.end_range_index() < 0 || end <= start ) {
+        // Single position annotation
+        end = start + 1;
+    }
+
+    Annotation annot(stream->arena(file_index));
+    annot.setStartRange(start);
+    annot.setEndRange(end);
+    annot.setJoinIndex(joinValue);
+    annot.reserveElements(columns.fields.size());
+    for (std::string_view field : columns.fields) {
+        annot.addElement(field);
+    }
+    annot.setRowNumber(row_number);
+    bytes = annot.memoryUsage() + SortedRanges::BYTES_PER_RANGE;
+    stream->addElement(file_index, std::move(annot), bytes);
+    return true;
+}
+
+/******************************************************************
+ * Open Reader
+ *      One BlockReader per stage, over the files it reads.  With
+ *      a memory budget the buffer pool is kept to an eighth of it.
+ ******************************************************************/
+std::unique_ptr <BlockReader> BioMapper::_openReader(const std::vector <size_t> & file_indexes) const {
+    size_t blockCount = 16;
+    size_t blockSize = blockSize_;
+    if (memoryBudget_.enabled()) {
+        blockCount = static_cast<size_t>(std::clamp<uint64_t>(memoryBudget_.limit() / 8 / (1 << 20), 4, 16));
+        blockSize = std::min<size_t>(blockSize, memoryBudget_.limit() / 8 / blockCount);
+    }
+    auto reader = std::make_unique<BlockReader>(readBackend_, blockSize, blockCount);
+
+    std::vector <std::string> paths, fail_list;
+    for (size_t f : file_indexes) {
+        paths.push_back(files_[f].file_path());
+    }
+    if (!reader->open(paths, fail_list)) {
+        for (const std::string & path : fail_list) {
+            std::cerr << "ERROR: Could not open " << path << " for reading.  \n";
+        }
+        return nullptr;
+    }
+    return reader;
+}
+
+/******************************************************************
+ * Column
+ *      View of one column of a row, empty if the row is shorter.
+ ******************************************************************/
+std::string_view BioMapper::_column(std::string_view row, int index, char delimiter) {
+    size_t begin = 0;
+    for (int i = 0; i < index; i++) {
+        begin = row.find(delimiter, begin);
+        if (begin == std::string_view::npos) {
+            return {};
+        }
+        begin++;
+    }
+    return row.substr(begin, row.find(delimiter, begin) - begin);
+}
+
+/******************************************************************
+ * Split Row
+ *      Views of every column, split like std::getline: a trailing
+ *      delimiter does not start an empty last column.
+ ******************************************************************/
+void BioMapper::_splitRow(std::string_view row, char delimiter, std::vector <std::string_view> & fields) {
+    fields.clear();
+    size_t position = 0;
+    while (position < row.size()) {
+        const size_t next = row.find(delimiter, position);
+        if (next == std::string_view::npos) {
+            fields.push_back(row.substr(position));
+            break;
+        }
+        fields.push_back(row.substr(position, next - position));
+        position = next + 1;
+    }
+}
+
+/******************************************************************
+ * Split Fields
+ *      _splitRow(), or the quote-aware split for files with
+ *      quoted fields.
+ ******************************************************************/
+void BioMapper::_splitFields(std::string_view row, const MapperFile & file, std::vector <std::string_view> & fields,
+                             std::string & unescaped) {
+    if (file.quoted()) {
+        splitQuotedRow(row, file.delimiter(), fields, unescaped);
+    } else {
+        _splitRow(row, file.delimiter(), fields);
+    }
+}
+
+/******************************************************************
+ * Find Stream
+ *      The stream of a join value, or null if it cannot map.  The
+ *      filter answers most lookups; only Bloom filter hits need
+ *      the exact (tree) lookup.
+ ******************************************************************/
+AnnotationStream * BioMapper::_findStream(std::string_view join_value) {
+    const uint32_t id = joinFilter_.lookup(join_value);
+    if (id == JoinKeyFilter::NONE) {
+        return nullptr;
+    }
+    if (id != JoinKeyFilter::UNRESOLVED) {
+        return streamsById_[id];
+    }
+    auto it = annotationStreams_.find(join_value);
+    return it == annotationStreams_.end() ? nullptr : &it->second;
+}
+
+/******************************************************************
+ * Make Room
+ *      Called by the reader of a file when the budget is over its
+ *      cap.  Spills until usage is back under it; while the files
+ *      other readers are still reading hold partitions, it gives
+ *      way to those readers to spill them, which is the
+ *      backpressure on reading.  With nothing left anywhere to
+ *      spill the cap cannot be kept, and the run fails.  Time
+ *      spent here is the read stage's producer stall.
+ ******************************************************************/
+Task <bool> BioMapper::_makeRoom(size_t file_index, PoolScheduler scheduler) {
+    const auto stalled = std::chrono::steady_clock::now();
+    bool passed = true;
+    while (memoryBudget_.overLimit()) {
+        bool others = false;
+        if (!_spillForRoom(file_index, others)) {
+            std::cerr << "ERROR: Could not spill " << files_[file_index].file_path() << " to " << spillPath_
+                      << ".  Aborting." << std::endl << std::endl;
+            passed = false;
+            break;
+        }
+        if (!memoryBudget_.overLimit()) {
+            break;
+        }
+        if (!others) {
+            std::cerr << "ERROR: Memory budget of " << memoryBudget_.limit()
+                      << " bytes exceeded with nothing left to spill.  Aborting." << std::endl << std::endl;
+            passed = false;
+            break;
+        }
+        if (_interrupted()) {
+            passed = false;
+            break;
+        }
+        // Block briefly, then let this worker's other readers run.
+        memoryBudget_.waitForRoom(std::chrono::milliseconds(1));
+        co_await Reschedule{scheduler};
+    }
+    stats_.addProducerStall(MapperStats::Stage::Read, MapperStats::elapsedNs(stalled));
+    co_return passed;
+}
+
+/******************************************************************
+ * Spill For Room
+ *      Spills the largest partitions of one file and of the files
+ *      no longer being read until usage is an eighth under the
+ *      cap, so spills are not triggered on every row.
+ ******************************************************************/
+bool BioMapper::_spillForRoom(size_t file_index, bool & others) {
+    TraceScope scope(tracer_.get(), "read", "spill", files_[file_index].file_path());
+    const uint64_t target = memoryBudget_.limit() - memoryBudget_.limit() / 8;
+
+    // Spills are serialized; partitions of files still being read
+    // are only spilled by their own reader.
+    const std::scoped_lock lock(spillMtx_);
+    std::vector <std::pair <AnnotationStream *, size_t> > partitions;
+    others = false;
+    for (auto & stream : annotationStreams_) {
+        for (size_t f = 0; f < stream.second.fileCount(); f++) {
+            if (stream.second.residentBytes(f) == 0) {
+                continue;
+            }
+            if (f == file_index || readDone_[f]) {
+                partitions.emplace_back(&stream.second, f);
+            } else {
+                others = true;
+            }
+        }
+    }
+    std::sort(partitions.begin(), partitions.end(), [](const auto & a, const auto & b) {
+        return a.first->residentBytes(a.second) > b.first->residentBytes(b.second);
+    });
+
+    std::error_code ec;
+    std::filesystem::create_directories(spillPath_, ec);
+    bool passed = true;
+    for (auto & [stream, f] : partitions) {
+        if (memoryBudget_.used() <= target) {
+            break;
+        }
+        memoryBudget_.release(stream->spill(f, passed));
+        if (!passed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/******************************************************************
+ * Plan Waves
+ *      Without a budget, or with nothing spilled, everything is
+ *      one wave.  Otherwise streams are taken in order while their
+ *      spilled data and result buffers fit in the room left by
+ *      what is resident; a stream that fits nowhere gets a wave
+ *      of its own.
+ ******************************************************************/
+std::vector <std::vector <AnnotationStream *> > BioMapper::_planWaves(const std::vector <AnnotationStream *> & streams) const {
+    std::vector <std::vector <AnnotationStream *> > waves(1);
+    const bool anySpilled = std::any_of(streams.begin(), streams.end(),
+                                        [](const AnnotationStream * stream) { return stream->spilled(); });
+    if (!memoryBudget_.enabled() || !anySpilled) {
+        waves[0] = streams;
+        return waves;
+    }
+
+    const uint64_t room = memoryBudget_.available();
+    const uint64_t bufferBytes = maxBufferedBatches_ * resultBatchSize_ * sizeof(MappedResult);
+    uint64_t used = 0;
+    for (AnnotationStream * stream : streams) {
+        const uint64_t cost = stream->spilledBytes() + bufferBytes;
+        if (!waves.back().empty() && used + cost > room) {
+            waves.emplace_back();
+            used = 0;
+        }
+        waves.back().push_back(stream);
+        used += cost;
+    }
+    return waves;
+}
+
+/******************************************************************
+ * Map Waves
+ *      Map and deliver each wave in turn; the spilled streams of a
+ *      wave are spilled again (only their rows added since) and
+ *      freed before the next one is loaded.  Results keep
+ *      reference order across waves.
+ ******************************************************************/
+bool BioMapper::_mapWaves(JobPool & pool, const std::vector <AnnotationStream *> & streams, const ResultCallback & callback) {
+    // Partly spilled streams are loaded in full for mapping anyway, so
+    // move the rest of them to disk first to leave the waves more room.
+    if (memoryBudget_.enabled()) {
+        for (AnnotationStream * stream : streams) {
+            if (!stream->spilled()) {
+                continue;
+            }
+            for (size_t f = 0; f < stream->fileCount(); f++) {
+                bool spilled = true;
+                memoryBudget_.release(stream->spill(f, spilled));
+                if (!spilled) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    const auto waves = _planWaves(streams);
+    const uint64_t bufferBytes = maxBufferedBatches_ * resultBatchSize_ * sizeof(MappedResult);
+
+    progress_.beginParts(streams.size());
+    stats_.beginStage(MapperStats::Stage::Map);
+    return _runStage(MapperStats::Stage::Write, [&]() {
+        // Incremental runs append to the output file, unless aggregating.
+        const bool aggregate = resultMode_ == ResultMode::Coverage;
+        std::ofstream out;
+        if (checkpoint_ && checkpoint_->outputBytes() > 0) {
+            // Resuming: cut off whatever was written after the checkpoint.
+            std::error_code ec;
+            std::filesystem::resize_file(outputFileName_, checkpoint_->outputBytes(), ec);
+            out.open(outputFileName_, std::ofstream::out | std::ofstream::app);
+            if (ec) {
+                out.setstate(std::ofstream::failbit);
+            }
+        } else if (!outputFileName_.empty()) {
+            out.open(outputFileName_, std::ofstream::out | (mappedFileCount_ > 0 && !aggregate ? std::ofstream::app : std::ofstream::trunc));
+        }
+        if (aggregate) {
+            coverage_.clear();
+        }
+        auto committed = std::chrono::steady_clock::now();
+
+        bool passed = true;
+        for (size_t w = 0; w < waves.size(); w++) {
+            if (_interrupted()) {
+                passed = false;
+                break;
+            }
+            const auto & wave = waves[w];
+            uint64_t reserved = 0;
+            if (memoryBudget_.enabled()) {
+                for (const AnnotationStream * stream : wave) {
+                    reserved += stream->spilledBytes() + bufferBytes;
+                }
+                memoryBudget_.charge(reserved);
+            }
+
+            if (aggregate) {
+                passed = _aggregateWave(pool, wave, out, w + 1 == waves.size()) && passed;
+                progress_.addParts(wave.size());
+            } else {
+                std::atomic <bool> mapped = true;
+                ResultQueue queue(wave.size(), maxBufferedBatches_);
+                _mapStreams(pool, wave, queue, w + 1 == waves.size(), mapped);
+                size_t recorded = 0;
+                std::function<void(size_t)> drained;
+                if (checkpoint_) {
+                    drained = [&](size_t count) { _checkpointStreams(wave, count, out, recorded, committed); };
+                }
+                passed = _deliverResults(queue, callback, out, drained) && passed;
+                pool.wait_for_tasks();
+                passed = passed && mapped;
+            }
+
+            for (AnnotationStream * stream : wave) {
+                if (stream->spilled()) {
+                    bool spilled = true;
+                    memoryBudget_.release(stream->unload(spilled));
+                    passed = passed && spilled;
+                }
+            }
+            memoryBudget_.release(reserved);
+        }
+        return passed;
+    });
+}
+
+/******************************************************************
+ * Map Streams
+ *      One mapping task per stream, run on the node that read the
+ *      most annotations of that stream.  Returns once the tasks are
+ *      queued; the last task to finish ends the map stage.
+ ******************************************************************/
+void BioMapper::_mapStreams(JobPool & pool, const std::vector <AnnotationStream *> & streams, ResultQueue & queue,
+                            bool end_stage, std::atomic <bool> & passed) {
+    if (streams.empty()) {
+        if (end_stage) {
+            stats_.endStage(MapperStats::Stage::Map);
+        }
+        return;
+    }
+    auto remaining = std::make_shared<std::atomic <size_t> >(streams.size());
+
+    const size_t nodeCount = pool.get_node_count();
+    for (size_t i = 0; i < streams.size(); i++) {
+        AnnotationStream & stream = *streams[i];
+        if (nodeCount > 0) {
+            std::vector <size_t> nodeRows(nodeCount, 0);
+            for (size_t f = 0; f < stream.fileCount(); f++) {
+                if (fileNodes_[f] >= 0) {
+                    nodeRows[fileNodes_[f]] += stream.rows(f);
+                }
+            }
+            stream.node_ = static_cast<int>(std::max_element(nodeRows.begin(), nodeRows.end()) - nodeRows.begin());
+        }
+        const auto pushed = std::chrono::steady_clock::now();
+        pool.push_task_on_node(stream.node_, [this, &pool, &stream, &queue, &passed, i, pushed, remaining, end_stage]() {
+            if (stats_.enabled()) {
+                stats_.addConsumerStall(MapperStats::Stage::Map, MapperStats::elapsedNs(pushed));
+                stats_.recordQueueDepth(MapperStats::Stage::Map, pool.get_tasks_queued());
+            }
+            // A stopped run skips the streams not started, but finishes them in the queue.
+            if (_interrupted() || !_mapStream(stream, i, queue)) {
+                passed = false;
+            }
+            queue.finish(i);
+            if (--*remaining == 0 && end_stage) {
+                stats_.endStage(MapperStats::Stage::Map);
+            }
+        });
+    }
+}
+
+namespace {
+
+/**
+ * Plane sweep over two start sorted range lists, calling emit(a, b) with the
+ * sorted positions of every pair Predicate, an OverlapPredicate, matches.
+ * The ranges still open on each side are a min-heap on their ends, so
+ * expiring one costs O(log n) and every range left in a heap matches the
+ * next start's window.
+ */
+template <typename Predicate, typename Emit>
+void sweepOverlaps(const SortedRanges & a, const SortedRanges & b, Emit emit) {
+    std::vector <size_t> activeA, activeB;
+    size_t ia = 0, ib = 0;
+    const size_t na = a.starts.size(), nb = b.starts.size();
+
+    auto open = [](std::vector <size_t> & active, std::span <const long long int> ends, size_t i) {
+        active.push_back(i);
+        std::push_heap(active.begin(), active.end(), [&](size_t x, size_t y) { return ends[x] > ends[y]; });
+    };
+    // Ranges ending at or before the window's end bound match no later start.
+    auto expire = [](std::vector <size_t> & active, std::span <const long long int> ends, const RangeWindow & window) {
+        const auto later = [&](size_t x, size_t y) { return ends[x] > ends[y]; };
+        while (!active.empty() && ends[active.front()] <= window.endAbove) {
+            std::pop_heap(active.begin(), active.end(), later);
+            active.pop_back();
+        }
+    };
+
+    while (ia < na || ib < nb) {
+        if (ib >= nb || (ia < na && a.starts[ia] <= b.starts[ib])) {
+            expire(activeB, b.ends, Predicate::window(RangeQuery{a.starts[ia], a.ends[ia]}));
+            for (size_t j : activeB) {
+                emit(ia, j);
+            }
+            open(activeA, a.ends, ia++);
+        } else {
+            expire(activeA, a.ends, Predicate::window(RangeQuery{b.starts[ib], b.ends[ib]}));
+            for (size_t i : activeA) {
+                emit(i, ib);
+            }
+            open(activeB, b.ends, ib++);
+        }
+    }
+}
+
+/**
+ * Running maximum of a start sorted range list's ends, for probeOverlaps().
+ */
+std::vector <long long int> prefixMaxEnds(const SortedRanges & ranges) {
+    std::vector <long long int> prefix(ranges.ends.size());
+    long long int running = LLONG_MIN;
+    for (size_t i = 0; i < ranges.ends.size(); i++) {
+        running = std::max(running, ranges.ends[i]);
+        prefix[i] = running;
+    }
+    return prefix;
+}
+
+/**
+ * Each range of a searched in b, calling emit(a, b) with the sorted positions
+ * of every pair Predicate matches.  Of the ranges of b starting before the
+ * window's start bound, those past the first whose running end is beyond
+ * its end bound are tested, OVERLAP_BATCH at a time with matchBatch(), so a
+ * small a costs O(|a| log |b|) plus the candidates, not |b|.
+ */
+template <typename Predicate, typename Emit>
+void probeOverlaps(const SortedRanges & a, const SortedRanges & b, const std::vector <long long int> & b_prefix_max_end,
+                   Emit emit) {
+    for (size_t ia = 0; ia < a.starts.size(); ia++) {
+        const RangeWindow window = Predicate::window(RangeQuery{a.starts[ia], a.ends[ia]});
+        const size_t last = std::lower_bound(b.starts.begin(), b.starts.end(), window.startBelow) - b.starts.begin();
+        size_t ib = std::upper_bound(b_prefix_max_end.begin(), b_prefix_max_end.begin() + last, window.endAbove) - b_prefix_max_end.begin();
+        for (; ib + OVERLAP_BATCH <= last; ib += OVERLAP_BATCH) {
+            for (uint32_t mask = matchBatch(window, &b.starts[ib], &b.ends[ib]); mask != 0; mask &= mask - 1) {
+                emit(ia, ib + std::countr_zero(mask));
+            }
+        }
+        for (; ib < last; ib++) {
+            if (matchRange(window, b.starts[ib], b.ends[ib])) {
+                emit(ia, ib);
+            }
+        }
+    }
+}
+
+void appendAnnotation(std::string & out, uint32_t file_index, const Annotation & annot) {
+    out += std::to_string(file_index);
+    for (const AnnotationTypes & element : annot.elements()) {
+        out += '\t';
+        std::visit([&out](const auto & value) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::pmr::string>) {
+                out += value;
+            } else {
+                out += std::to_string(value);
+            }
+        }, element);
+    }
+}
+
+/**
+ * Whether a row is on the reverse strand: its strand column, if any, is "-".
+ */
+bool reverseStrand(const Annotation & annot, int column) {
+    if (column < 0 || static_cast<size_t>(column) >= annot.elements().size()) {
+        return false;
+    }
+    const auto * strand = std::get_if<std::pmr::string>(&annot.elements()[column]);
+    return strand != nullptr && *strand == "-";
+}
+
+} // namespace
+
+/******************************************************************
+ * Nearest Stream
+ *      Each row of an earlier file is a query against every later
+ *      file, queries in start order.  The index of a file is built
+ *      the first time it is searched and shared by all the
+ *      earlier files.
+ ******************************************************************/
+template <typename Flush>
+void BioMapper::_nearestStream(AnnotationStream & stream, const std::vector <const SortedRanges *> & sorted,
+                               ResultBatch & batch, Flush & flush) const {
+    std::vector <std::unique_ptr <NearestIndex> > indexes(stream.fileCount());
+    for (size_t i = 0; i < stream.fileCount(); i++) {
+        for (size_t j = std::max(i + 1, mappedFileCount_); j < stream.fileCount(); j++) {
+            if (sorted[j]->starts.empty()) {
+                continue;
+            }
+            if (!indexes[j]) {
+                indexes[j] = std::make_unique<NearestIndex>(*sorted[j]);
+            }
+            const NearestIndex & index = *indexes[j];
+            for (size_t a = 0; a < sorted[i]->starts.size(); a++) {
+                if (a % CHECK_ROWS == 0 && _interrupted()) {
+                    return;
+                }
+                const Annotation & query = stream.annotation(i, sorted[i]->order[a]);
+                const bool reverse = reverseStrand(query, nearestOptions_.strandColumn);
+                index.nearest(sorted[i]->starts[a], sorted[i]->ends[a], reverse, nearestOptions_, [&](size_t b, long long int distance) {
+                    batch.push_back(MappedResult{stream.joinId_, static_cast<uint32_t>(i), &query,
+                                                 static_cast<uint32_t>(j), &stream.annotation(j, sorted[j]->order[b]), distance});
+                    if (batch.size() >= resultBatchSize_) {
+                        flush();
+                    }
+                });
+            }
+        }
+    }
+}
+
+/******************************************************************
+ * Map Stream
+ *      Find every overlapping pair of annotations (the nearest ones
+ *      in ResultMode::Nearest) between each pair of files for one
+ *      reference, skipping pairs of files
+ *      already mapped by an earlier run, and push them to the
+ *      result queue in batches.  Spilled partitions are loaded
+ *      and stale sorted indexes rebuilt here so they are first
+ *      touched on the mapper's node.
+ ******************************************************************/
+bool BioMapper::_mapStream(AnnotationStream & stream, size_t stream_index, ResultQueue & queue) const {
+    TraceScope scope(tracer_.get(), "map", "map", stream.joinId_);
+    if (stream.spilled() && !stream.load()) {
+        std::cerr << "ERROR: Could not load the spilled annotations of " << stream.joinId_ << ".  \n";
+        return false;
+    }
+    std::vector <const SortedRanges *> sorted(stream.fileCount());
+    for (size_t f = 0; f < stream.fileCount(); f++) {
+        sorted[f] = &stream.sortedRanges(f);
+    }
+
+    // Once the run is stopped, results are dropped rather than pushed.
+    bool stopped = false;
+    ResultBatch batch = queue.spare(resultBatchSize_);
+    auto flush = [&]() {
+        stopped = stopped || _interrupted();
+        if (stopped) {
+            batch.clear();
+            return;
+        }
+        stats_.addRows(MapperStats::Stage::Map, batch.size(), batch.size() * sizeof(MappedResult));
+        if (stats_.enabled()) {
+            const auto waiting = std::chrono::steady_clock::now();
+            const size_t depth = queue.push(stream_index, std::move(batch));
+            stats_.addProducerStall(MapperStats::Stage::Map, MapperStats::elapsedNs(waiting));
+            stats_.recordQueueDepth(MapperStats::Stage::Write, depth);
+        } else {
+            queue.push(stream_index, std::move(batch));
+        }
+        batch = queue.spare(resultBatchSize_);
+    };
+
+    if (resultMode_ == ResultMode::Nearest) {
+        _nearestStream(stream, sorted, batch, flush);
+        if (!batch.empty()) {
+            flush();
+        }
+        return !_interrupted();
+    }
+
+    // The index engine searches the larger file of each pair; its running
+    // ends are built the first time it is searched.  Annotations are stored
+    // half open whatever the files' convention, so both engines match with
+    // the half open overlap predicate.
+    using Predicate = OverlapPredicate<Coordinates::HalfOpen>;
+    std::vector <std::vector <long long int> > prefixMaxEnd(mapEngine_ == MapEngine::Index ? stream.fileCount() : 0);
+    for (size_t i = 0; i < stream.fileCount(); i++) {
+        for (size_t j = std::max(i + 1, mappedFileCount_); j < stream.fileCount() && !stopped; j++) {
+            auto emit = [&](size_t a, size_t b) {
+                if (stopped) {
+                    return;
+                }
+                batch.push_back(MappedResult{stream.joinId_, static_cast<uint32_t>(i), &stream.annotation(i, sorted[i]->order[a]),
+                                             static_cast<uint32_t>(j), &stream.annotation(j, sorted[j]->order[b])});
+                if (batch.size() >= resultBatchSize_) {
+                    flush();
+                }
+            };
+            if (mapEngine_ != MapEngine::Index) {
+                sweepOverlaps<Predicate>(*sorted[i], *sorted[j], emit);
+                continue;
+            }
+            const bool searchJ = sorted[j]->starts.size() >= sorted[i]->starts.size();
+            const size_t searched = searchJ ? j : i;
+            if (prefixMaxEnd[searched].size() != sorted[searched]->starts.size()) {
+                prefixMaxEnd[searched] = prefixMaxEnds(*sorted[searched]);
+            }
+            if (searchJ) {
+                probeOverlaps<Predicate>(*sorted[i], *sorted[j], prefixMaxEnd[j], emit);
+            } else {
+                probeOverlaps<Predicate>(*sorted[j], *sorted[i], prefixMaxEnd[i], [&](size_t b, size_t a) { emit(a, b); });
+            }
+        }
+    }
+    if (!batch.empty()) {
+        flush();
+    }
+    return !stopped;
+}
+
+/******************************************************************
+ * Aggregate Wave
+ *      One aggregation task per stream, on the node that read the
+ *      most of it, each formatting its own output; this thread
+ *      then writes the texts in reference order.  The output of a
+ *      wave is bounded by its rows.
+ ******************************************************************/
+bool BioMapper::_aggregateWave(JobPool & pool, const std::vector <AnnotationStream *> & wave, std::ofstream & out,
+                               bool end_stage) {
+    std::vector <std::string> texts(wave.size());
+    std::vector <ReferenceCoverage> coverages(wave.size());
+    std::atomic <bool> aggregated = true;
+
+    const size_t nodeCount = pool.get_node_count();
+    for (size_t i = 0; i < wave.size(); i++) {
+        AnnotationStream & stream = *wave[i];
+        if (nodeCount > 0) {
+            std::vector <size_t> nodeRows(nodeCount, 0);
+            for (size_t f = 0; f < stream.fileCount(); f++) {
+                if (fileNodes_[f] >= 0) {
+                    nodeRows[fileNodes_[f]] += stream.rows(f);
+                }
+            }
+            stream.node_ = static_cast<int>(std::max_element(nodeRows.begin(), nodeRows.end()) - nodeRows.begin());
+        }
+        pool.push_task_on_node(stream.node_, [this, &stream, &texts, &coverages, &aggregated, i]() {
+            if (_interrupted() || !_aggregateStream(stream, texts[i], coverages[i])) {
+                aggregated = false;
+            }
+        });
+    }
+    pool.wait_for_tasks();
+    if (end_stage) {
+        stats_.endStage(MapperStats::Stage::Map);
+    }
+
+    bool passed = aggregated && !out.fail();
+    for (size_t i = 0; i < wave.size(); i++) {
+        if (passed && out.is_open()) {
+            out.write(texts[i].data(), static_cast<std::streamsize>(texts[i].size()));
+            passed = !out.fail();
+        }
+        stats_.addRows(MapperStats::Stage::Write, std::accumulate(coverages[i].ranges.begin(), coverages[i].ranges.end(), uint64_t(0)),
+                       texts[i].size());
+        coverage_.insert_or_assign(wave[i]->joinId_, std::move(coverages[i]));
+    }
+    return passed;
+}
+
+/******************************************************************
+ * Aggregate Stream
+ *      Overlap counts of every row and the coverage of one
+ *      reference, from sorted endpoint sweeps; see CoverageSweep.
+ *      The rows are written in file order, each with its count.
+ ******************************************************************/
+bool BioMapper::_aggregateStream(AnnotationStream & stream, std::string & text, ReferenceCoverage & coverage) const {
+    TraceScope scope(tracer_.get(), "map", "aggregate", stream.joinId_);
+    if (stream.spilled() && !stream.load()) {
+        std::cerr << "ERROR: Could not load the spilled annotations of " << stream.joinId_ << ".  \n";
+        return false;
+    }
+    std::vector <const SortedRanges *> sorted(stream.fileCount());
+    for (size_t f = 0; f < stream.fileCount(); f++) {
+        sorted[f] = &stream.sortedRanges(f);
+    }
+
+    CoverageSweep sweep(sorted);
+    std::vector <uint64_t> counts, fileOrder;
+    uint64_t rows = 0;
+    for (size_t f = 0; f < stream.fileCount(); f++) {
+        sweep.overlaps(f, counts);
+        fileOrder.resize(counts.size());
+        for (size_t i = 0; i < counts.size(); i++) {
+            fileOrder[sorted[f]->order[i]] = counts[i];
+        }
+        for (uint32_t i = 0; i < fileOrder.size(); i++) {
+            appendAnnotation(text, static_cast<uint32_t>(f), stream.annotation(f, i));
+            text += '\t';
+            text += std::to_string(fileOrder[i]);
+            text += '\n';
+        }
+        rows += fileOrder.size();
+    }
+
+    coverage = sweep.summary();
+    text += "#coverage\t" + stream.joinId_ + '\t' + std::to_string(coverage.covered);
+    for (uint64_t bases : coverage.fileCovered) {
+        text += '\t';
+        text += std::to_string(bases);
+    }
+    text += '\n';
+    for (size_t depth = 1; depth < coverage.depth.size(); depth++) {
+        if (coverage.depth[depth] != 0) {
+            text += "#depth\t" + stream.joinId_ + '\t' + std::to_string(depth) + '\t' + std::to_string(coverage.depth[depth]) + '\n';
+        }
+    }
+    stats_.addRows(MapperStats::Stage::Map, rows, text.size());
+    return true;
+}
+
+/******************************************************************
+ * Read Key Files
+ *      Read the files added since the last map() for an exact key
+ *      join, readingThreads_ files at a time.  Earlier files keep
+ *      their rows and tables.
+ ******************************************************************/
+bool BioMapper::_readKeyFiles(JobPool & pool) {
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    keyedFiles_.resize(fileCount);
+    ReadQueue queue;
+    queue.nodeFiles.resize(1);
+    queue.cursors = std::vector <std::atomic <size_t> >(1);
+    queue.slots.assign(fileCount, 0);
+    for (size_t f = mappedFileCount_; f < fileCount; f++) {
+        queue.slots[f] = queue.nodeFiles[0].size();
+        queue.nodeFiles[0].push_back(f);
+    }
+    std::unique_ptr <BlockReader> blocks = _openReader(queue.nodeFiles[0]);
+    if (!blocks) {
+        return false;
+    }
+    std::vector <uint64_t> totalBytes(fileCount, 0);
+    for (size_t f : queue.nodeFiles[0]) {
+        std::error_code ec;
+        totalBytes[f] = std::filesystem::file_size(files_[f].file_path(), ec);
+    }
+    progress_.beginFiles(MapperStats::Stage::Read, totalBytes);
+    return _runReadLanes(pool, *blocks, queue, nullptr);
+}
+
+/******************************************************************
+ * Read Key File
+ *      Parse one file's rows with their keys: the values of the
+ *      key columns joined by a unit separator (0x1F), which cannot
+ *      occur in a delimited text value, and hashed once here.
+ ******************************************************************/
+Task <bool> BioMapper::_readKeyFile(size_t file_index, BlockReader & blocks, size_t slot, PoolScheduler scheduler) {
+    const MapperFile & file = files_[file_index];
+    KeyedFile & keyed = keyedFiles_[file_index];
+    AsyncGenerator <RowBatch> batches = rowBatches(blocks, slot, scheduler, file.quoted());
+    // Header was already parsed
+    bool header = file.has_header();
+    uint64_t rowNumber = 0;
+
+    const std::vector <int32_t> keyColumns = file.key_indexes();
+    uint64_t rows = 0, bytes = 0;
+    RowColumns columns;
+    if (!keyed.arena) {
+        keyed.arena = std::make_unique<std::pmr::monotonic_buffer_resource>();
+    }
+    while ( co_await batches.next() ) {
+        if (_interrupted()) {
+            co_return false;
+        }
+        TraceScope scope(tracer_.get(), "read", "read", file.file_path());
+        uint64_t batchBytes = 0;
+        for ( std::string_view row : batches.value().rows ) {
+            rowNumber++;
+            batchBytes += row.size() + 1;
+            if (header) {
+                header = false;
+                continue;
+            }
+            rows++;
+            bytes += row.size() + 1;
+            if (rows == 4096) {
+                stats_.addRows(MapperStats::Stage::Read, rows, bytes);
+                rows = bytes = 0;
+            }
+            if (!_readKeyRow(file_index, row, rowNumber, keyColumns, columns)) {
+                co_return false;
+            }
+        }
+        progress_.addRows(file_index, batches.value().rows.size(), batchBytes);
+    }
+    stats_.addRows(MapperStats::Stage::Read, rows, bytes);
+    if (blocks.failed(slot)) {
+        std::cerr << "ERROR: Could not read " << file.file_path() << ".  Aborting." << std::endl << std::endl;
+        co_return false;
+    }
+    co_return true;
+}
+
+/******************************************************************
+ * Read Key Row
+ *      Parse one row of a key file with its key, the values of
+ *      the key columns joined by a unit separator.  The key is
+ *      sized first and built once in the file's arena, then moved
+ *      in, so with the rows' capacity reserved a row allocates
+ *      nothing.
+ ******************************************************************/
+bool BioMapper::_readKeyRow(size_t file_index, std::string_view row, uint64_t row_number,
+                            const std::vector <int32_t> & key_columns, RowColumns & columns) {
+    const MapperFile & file = files_[file_index];
+    KeyedFile & keyed = keyedFiles_[file_index];
+    if (row.empty()) {
+        return true;
+    }
+
+    _splitFields(row, file, columns.fields, columns.unescaped);
+    const std::vector <std::string_view> & fields = columns.fields;
+    size_t keyBytes = key_columns.empty() ? 0 : key_columns.size() - 1;
+    for (int32_t keyColumn : key_columns) {
+        if (keyColumn < 0 || static_cast<size_t>(keyColumn) >= fields.size()) {
+            std::cerr << "ERROR: Could not read the key on line " << row_number << " of " << file.file_path()
+                      << ".  Aborting." << std::endl << std::endl;
+            return false;
+        }
+        keyBytes += fields[keyColumn].size();
+    }
+    std::pmr::string key(keyed.arena.get());
+    key.reserve(keyBytes);
+    for (size_t k = 0; k < key_columns.size(); k++) {
+        if (k != 0) {
+            key += '\x1F';
+        }
+        key += fields[key_columns[k]];
+    }
+
+    Annotation annot(keyed.arena.get());
+    keyed.hashes.push_back(KeyHashTable::hash(key));
+    annot.setJoinIndex(AnnotationTypes(std::move(key)));
+    annot.reserveElements(fields.size());
+    for (std::string_view field : fields) {
+        annot.addElement(field);
+    }
+    annot.setRowNumber(row_number);
+    keyed.rows.push_back(std::move(annot));
+    return true;
+}
+
+/******************************************************************
+ * Map Keys
+ *      Every file pair involving a new file is joined by probing
+ *      the table of its smaller file with the rows of the larger
+ *      one.  Tables are built in parallel first (once per file,
+ *      kept for later runs), then each pair's probe rows are split
+ *      into chunks, one pool task and result queue slot each, so
+ *      results come by pair and in the probing file's row order.
+ ******************************************************************/
+bool BioMapper::_mapKeys(JobPool & pool, const ResultCallback & callback) {
+    static constexpr size_t PROBE_CHUNK = 1 << 16;
+
+    struct Probe {
+        uint32_t    first;      ///< Lower file index of the pair
+        uint32_t    second;     ///< Higher file index of the pair
+        bool        firstBuilt; ///< Whether the table is first's (else second's)
+        size_t      begin;      ///< First probing row of the chunk
+        size_t      end;        ///< End of the chunk's probing rows
+    };
+    std::vector <Probe> probes;
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    std::vector <bool> needsTable(fileCount, false);
+    for (size_t j = std::max<size_t>(1, mappedFileCount_); j < fileCount; j++) {
+        for (size_t i = 0; i < j; i++) {
+            const bool firstBuilt = keyedFiles_[i].rows.size() <= keyedFiles_[j].rows.size();
+            const KeyedFile & built = keyedFiles_[firstBuilt ? i : j];
+            const KeyedFile & probing = keyedFiles_[firstBuilt ? j : i];
+            if (built.rows.empty()) {
+                continue;
+            }
+            needsTable[firstBuilt ? i : j] = true;
+            for (size_t begin = 0; begin < probing.rows.size(); begin += PROBE_CHUNK) {
+                probes.push_back(Probe{static_cast<uint32_t>(i), static_cast<uint32_t>(j), firstBuilt, begin,
+                                       std::min(probing.rows.size(), begin + PROBE_CHUNK)});
+            }
+        }
+    }
+
+    progress_.beginParts(probes.size());
+    stats_.beginStage(MapperStats::Stage::Map);
+    for (size_t f = 0; f < fileCount; f++) {
+        if (needsTable[f] && !keyedFiles_[f].built) {
+            pool.push_task([this, f]() {
+                TraceScope scope(tracer_.get(), "map", "build", files_[f].file_path());
+                keyedFiles_[f].table.build(keyedFiles_[f].hashes);
+                keyedFiles_[f].built = true;
+            });
+        }
+    }
+    pool.wait_for_tasks();
+
+    return _runStage(MapperStats::Stage::Write, [&]() {
+        // Incremental runs append to the output file.
+        std::ofstream out;
+        if (!outputFileName_.empty()) {
+            out.open(outputFileName_, std::ofstream::out | (mappedFileCount_ > 0 ? std::ofstream::app : std::ofstream::trunc));
+        }
+
+        ResultQueue queue(probes.size(), maxBufferedBatches_);
+        if (probes.empty()) {
+            stats_.endStage(MapperStats::Stage::Map);
+        }
+        auto remaining = std::make_shared<std::atomic <size_t> >(probes.size());
+        for (size_t p = 0; p < probes.size(); p++) {
+            pool.push_task([this, &queue, &probes, p, remaining]() {
+                const Probe & probe = probes[p];
+                const KeyedFile & built = keyedFiles_[probe.firstBuilt ? probe.first : probe.second];
+                const KeyedFile & probing = keyedFiles_[probe.firstBuilt ? probe.second : probe.first];
+                TraceScope scope(tracer_.get(), "map", "probe", files_[probe.firstBuilt ? probe.second : probe.first].file_path());
+
+                ResultBatch batch = queue.spare(resultBatchSize_);
+                auto flush = [&]() {
+                    stats_.addRows(MapperStats::Stage::Map, batch.size(), batch.size() * sizeof(MappedResult));
+                    if (stats_.enabled()) {
+                        const auto waiting = std::chrono::steady_clock::now();
+                        const size_t depth = queue.push(p, std::move(batch));
+                        stats_.addProducerStall(MapperStats::Stage::Map, MapperStats::elapsedNs(waiting));
+                        stats_.recordQueueDepth(MapperStats::Stage::Write, depth);
+                    } else {
+                        queue.push(p, std::move(batch));
+                    }
+                    batch = queue.spare(resultBatchSize_);
+                };
+
+                // A stopped run leaves the rest of its chunks unprobed.
+                for (size_t r = probe.begin; r < probe.end; r++) {
+                    if ((r - probe.begin) % CHECK_ROWS == 0 && _interrupted()) {
+                        batch.clear();
+                        break;
+                    }
+                    const Annotation & row = probing.rows[r];
+                    const std::pmr::string & key = std::get<std::pmr::string>(row.joinIndex());
+                    built.table.find(probing.hashes[r], [&](uint32_t match) {
+                        const Annotation & other = built.rows[match];
+                        const std::pmr::string & otherKey = std::get<std::pmr::string>(other.joinIndex());
+                        if (otherKey != key) {
+                            // Different keys with the same hash
+                            return;
+                        }
+                        const Annotation & a = probe.firstBuilt ? other : row;
+                        const Annotation & b = probe.firstBuilt ? row : other;
+                        batch.push_back(MappedResult{std::get<std::pmr::string>(a.joinIndex()), probe.first, &a, probe.second, &b});
+                        if (batch.size() >= resultBatchSize_) {
+                            flush();
+                        }
+                    });
+                }
+                if (!batch.empty()) {
+                    flush();
+                }
+                queue.finish(p);
+                if (--*remaining == 0) {
+                    stats_.endStage(MapperStats::Stage::Map);
+                }
+            });
+        }
+
+        bool passed = _deliverResults(queue, callback, out);
+        pool.wait_for_tasks();
+        return passed;
+    });
+}
+
+/******************************************************************
+ * Deliver Results
+ *      Consume the result batches in reference order, handing each
+ *      to the callback and writing it to the output file if one is
+ *      set.  The queue is always drained, even after a write
+ *      failure, a stop or a callback that throws, so the mappers
+ *      can finish before the queue goes out of scope.
+ ******************************************************************/
+bool BioMapper::_deliverResults(ResultQueue & queue, const ResultCallback & callback, std::ofstream & out,
+                                const std::function<void(size_t)> & drained) const {
+    bool passed = !out.fail();
+
+    ResultBatch batch;
+    std::string lines;
+    size_t reported = 0;
+    bool stopped = false;
+    while (true) {
+        const auto waiting = std::chrono::steady_clock::now();
+        if (!queue.pop(batch)) {
+            break;
+        }
+        if (stats_.enabled()) {
+            stats_.addConsumerStall(MapperStats::Stage::Write, MapperStats::elapsedNs(waiting));
+        }
+        // A stopped run drains the rest undelivered, so the mappers can finish.
+        if (!stopped && _interrupted()) {
+            stopped = true;
+            passed = false;
+        }
+        if (stopped) {
+            queue.recycle(std::move(batch));
+            continue;
+        }
+        // The streams before this batch's are all written.
+        if (const size_t done = queue.drained(); done > reported) {
+            progress_.addParts(done - reported);
+            reported = done;
+            if (drained) {
+                drained(reported);
+            }
+        }
+
+        // A callback that throws stops the run; the rest is drained undelivered.
+        if (callback) {
+            try {
+                callback(batch);
+            } catch (const std::exception & e) {
+                std::cerr << "ERROR: The result callback threw: " << e.what() << ".  \n";
+                stopped = true;
+            } catch (...) {
+                std::cerr << "ERROR: The result callback threw.  \n";
+                stopped = true;
+            }
+            if (stopped) {
+                StopReason none = StopReason::None;
+                stopReason_.compare_exchange_strong(none, StopReason::Callback, std::memory_order_relaxed);
+                passed = false;
+                queue.recycle(std::move(batch));
+                continue;
+            }
+        }
+        progress_.addResults(batch.size());
+
+        lines.clear();
+        if (passed && out.is_open()) {
+            for (const MappedResult & result : batch) {
+                appendAnnotation(lines, result.file_a, *result.annotation_a);
+                lines += '\t';
+                appendAnnotation(lines, result.file_b, *result.annotation_b);
+                if (resultMode_ == ResultMode::Nearest) {
+                    lines += '\t';
+                    lines += std::to_string(result.distance);
+                }
+                lines += '\n';
+            }
+            out.write(lines.data(), static_cast<std::streamsize>(lines.size()));
+            passed = !out.fail();
+        }
+        stats_.addRows(MapperStats::Stage::Write, batch.size(), lines.size());
+        queue.recycle(std::move(batch));
+    }
+    if (passed) {
+        progress_.addParts(queue.streamCount() - reported);
+        if (drained) {
+            drained(queue.streamCount());
+        }
+    }
+    return passed;
+}
+
+/******************************************************************
+ * Estimate Results
+ *      Sample every file into a directory of the estimate's own,
+ *      map the samples with this mapper's settings, and tally each
+ *      result by the blocks its rows were sampled in.
+ ******************************************************************/
+bool BioMapper::estimateResults(ResultEstimate & estimate, const ResultEstimator::Settings & settings) {
+    const auto started = std::chrono::steady_clock::now();
+    estimate = ResultEstimate();
+    if (resultMode_ != ResultMode::Pairs) {
+        std::cerr << "ERROR: Only pairs of rows are estimated, not nearest rows or coverage.  \n";
+        return false;
+    }
+    const size_t fileCount = static_cast<size_t>(files_.size());
+    if (fileCount < 2) {
+        std::cerr << "ERROR: Results are estimated for two or more files.  \n";
+        return false;
+    }
+
+    static std::atomic <uint64_t> estimates = 0;
+    const std::filesystem::path directory = std::filesystem::temp_directory_path() /
+                                            ("biomapper-estimate-" + std::to_string(getpid()) + "-" + std::to_string(estimates++));
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec) {
+        std::cerr << "ERROR: Could not create " << directory.string() << " for the samples.  \n";
+        return false;
+    }
+
+    BioMapper samples(threadsToUse_, readingThreads_);
+    samples.joinMode_ = joinMode_;
+    samples.planning_ = planning_;
+    samples.planOverride_ = planOverride_;
+    samples.mapEngine_ = mapEngine_;
+    samples.blockSize_ = blockSize_;
+    samples.placementPolicy_ = placementPolicy_;
+    samples.readBackend_ = readBackend_;
+    samples.resultBatchSize_ = resultBatchSize_;
+    samples.maxBufferedBatches_ = maxBufferedBatches_;
+    samples.sharedPool_ = sharedPool_;
+    samples.cancelToken_ = cancelToken_;
+    samples.deadline_ = deadline_;
+
+    std::vector <ResultEstimator::SampledFile> sampled(fileCount);
+    bool passed = true;
+    for (size_t f = 0; f < fileCount && passed; f++) {
+        MapperFile file = files_[f];
+        const std::string path = (directory / ("sample" + std::to_string(f))).string();
+        passed = ResultEstimator::sample(file, path, settings, settings.seed + f, sampled[f]);
+        if (!passed) {
+            std::cerr << "ERROR: Could not sample " << file.file_path() << " into " << path << ".  \n";
+        }
+        file.set_file_path(path);
+        file.set_shared_index(nullptr);
+        samples.addFile(std::move(file));
+    }
+
+    ResultEstimator estimator(std::move(sampled), settings);
+    std::string line;
+    passed = passed && samples.map([&](const ResultBatch & batch) {
+        for (const MappedResult & result : batch) {
+            line.clear();
+            appendAnnotation(line, result.file_a, *result.annotation_a);
+            line += '\t';
+            appendAnnotation(line, result.file_b, *result.annotation_b);
+            estimator.add(result, line.size() + 1);
+        }
+    });
+    std::filesystem::remove_all(directory, ec);
+    if (!passed) {
+        return false;
+    }
+
+    estimate = estimator.estimate();
+    estimate.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return true;
+}
+
+/*****************************************************************************************
+ * ResultStream
+ *      Pull interface; map() runs on a background thread and hands
+ *      batches over one at a time.
+ ****************************************************************************************/
+
+std::unique_ptr <ResultStream> BioMapper::stream() {
+    return std::make_unique<ResultStream>(*this);
+}
+
+ResultStream::ResultStream(BioMapper & mapper) {
+    worker_ = std::thread([this, &mapper]() {
+        bool passed = mapper.map([this](const ResultBatch & batch) {
+            // Hold the mapper until the caller asks for the batch after
+            // this one, so the annotations stay valid while it is used.
+            std::unique_lock lock(mtx_);
+            if (abandoned_) {
+                return;
+            }
+            batches_.push_back(batch);
+            const uint64_t handed = ++handed_;
+            changed_.notify_all();
+            changed_.wait(lock, [this, handed]() { return requested_ > handed || abandoned_; });
+        });
+        const std::scoped_lock lock(mtx_);
+        passed_ = passed;
+        done_ = true;
+        changed_.notify_all();
+    });
+}
+
+ResultStream::~ResultStream() {
+    {
+        const std::scoped_lock lock(mtx_);
+        abandoned_ = true;
+        batches_.clear();
+        changed_.notify_all();
+    }
+    worker_.join();
+}
+
+bool ResultStream::next(ResultBatch & batch) {
+    std::unique_lock lock(mtx_);
+    requested_++;
+    changed_.notify_all();
+    changed_.wait(lock, [this]() { return !batches_.empty() || done_; });
+    if (batches_.empty()) {
+        return false;
+    }
+    batch = std::move(batches_.front());
+    batches_.pop_front();
+    return true;
+}
+
+bool ResultStream::succeeded() {
+    const std::scoped_lock lock(mtx_);
+    return done_ && passed_;
+}
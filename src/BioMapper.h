@@ -1,20 +1,107 @@
 #ifndef BIOMAPPER2_BIOMAPPER_H
 #define BIOMAPPER2_BIOMAPPER_H
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <string>
 #include <thread>
 #include <map>
+#include <set>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <sys/types.h>
 
 #include "Annotation.h"
+#include "BlockReader.h"
+#include "Checkpoint.h"
+#include "Coroutines.h"
+#include "Coverage.h"
+#include "ExecutionPlanner.h"
 #include "FileList.h"
+#include "JobPool.h"
+#include "JoinKeyFilter.h"
+#include "KeyHashTable.h"
 #include "MapperFile.h"
+#include "MapperProgress.h"
+#include "MapperStats.h"
 #include "MappingStream.h"
+#include "MemoryBudget.h"
+#include "Nearest.h"
+#include "OverlapPredicates.h"
+#include "Placement.h"
+#include "ResultEstimator.h"
+#include "ResultQueue.h"
+#include "TraceRecorder.h"
 #include "thread_pool.hpp"
 
+class BioMapper;
+
+/**
+ * How rows of different files are matched.
+ */
+enum class JoinMode {
+    Range,      ///< Same join value and overlapping ranges
+    Key         ///< Same key, exactly; ranges are not read
+};
+
+/**
+ * What a range join produces.
+ */
+enum class ResultMode {
+    Pairs,      ///< Every overlapping pair of rows
+    Coverage,   ///< Overlap counts per row and coverage per reference, no pairs
+    Nearest     ///< The nearest rows of the later file to each row of the earlier, by NearestOptions
+};
+
+/**
+ * @brief Pull interface over the results of one map() run.
+ *
+ * Created by BioMapper::stream(), which starts map() on a background thread.
+ * next() returns the result batches in reference order.  Delivery waits until
+ * the caller asks for the following batch, so a returned batch stays valid
+ * until the next call to next() and a slow caller throttles the mapping
+ * instead of growing memory.  Destroying the stream before the end discards
+ * the remaining results and waits for the run to finish.  The BioMapper must
+ * outlive the stream.
+ */
+class ResultStream
+{
+public:
+    explicit ResultStream(BioMapper & mapper);
+    ~ResultStream();
+
+    ResultStream(const ResultStream &) = delete;
+    ResultStream & operator=(const ResultStream &) = delete;
+
+    /**
+     * @param[out] batch Receives the next batch of results.
+     * @retval true A batch was returned.
+     * @retval false The run is over; see succeeded().
+     */
+    bool next(ResultBatch & batch);
+
+    /**
+     * @return Whether the run finished successfully; false while it is still running.
+     */
+    bool succeeded();
+
+private:
+    std::mutex                  mtx_;
+    std::condition_variable     changed_;            ///< Signalled on every hand over and at the end of the run
+    std::deque <ResultBatch>    batches_;            ///< Batches waiting for next()
+    bool                        done_ = false;       ///< map() has returned
+    bool                        passed_ = false;     ///< map()'s return value
+    bool                        abandoned_ = false;  ///< The stream is being destroyed
+    uint64_t                    handed_ = 0;         ///< Batches handed over by map()
+    uint64_t                    requested_ = 0;      ///< Calls to next()
+    std::thread                 worker_;             ///< Runs map()
+};
+
 class BioMapper
 {
 public:
@@ -26,16 +113,101 @@ public:
     explicit BioMapper(int threadsToUse=-1, int readingThreads=-1);
 
     /**
-     *
+     * Removes any spill files.
      */
-    ~BioMapper() = default;
+    ~BioMapper();
 
     /**
+     * @brief Map all added files.
      *
-     * @return
+     * Results are written to the output file if one is set.
+     *
+     * The references and annotations of every mapped file are kept, so
+     * after files are added with addFile() the next map() is incremental:
+     * only the new files are read (plus, in the earlier files, the rows of
+     * references that only the new files made shared), and only overlaps
+     * involving a new file are computed and delivered.  The output file is
+     * appended to rather than rewritten.  Files already mapped are assumed
+     * unchanged; call resetIndex() to map everything again.
+     *
+     * @return Whether every stage succeeded.
      */
     bool map();
 
+    /**
+     * @brief Map all added files, streaming the results to a callback.
+     *
+     * The callback runs on the calling thread and receives batches of up to
+     * the configured batch size, in reference order, while mapping is still
+     * in progress.  Mappers block once they are too far ahead of the
+     * callback (see setResultBatching()), so memory stays bounded however
+     * large the output is.  The output file, if set, is written as well.
+     *
+     * A callback that throws stops the run as a cancel would, with
+     * stopReason() Callback; the exception is reported, not rethrown.
+     *
+     * @param callback Receives each batch of results.
+     * @return Whether every stage succeeded.
+     */
+    bool map(const ResultCallback & callback);
+
+    /**
+     * @brief Map all added files on a background thread and pull the results.
+     *
+     * @return A stream handing out the result batches; see ResultStream.
+     */
+    std::unique_ptr <ResultStream> stream();
+
+    /**
+     * @brief Forget the indexes kept from earlier map() calls.
+     *
+     * The next map() reads and maps every file again.  A failed map()
+     * does this itself.
+     */
+    void resetIndex();
+
+    /**
+     * @brief Cap the memory the mapper keeps, spilling to disk beyond it.
+     *
+     * The estimated size of the annotations, their sorted indexes and the
+     * buffered results is tracked against the cap.  When reading pushes it
+     * over, the reader spills its file's largest per-reference partitions
+     * to disk, and waits for room if it has nothing left to spill.  Spilled
+     * references are loaded back and mapped in waves that fit in the cap.
+     * A single reference larger than the cap is still mapped, over it.
+     *
+     * With a budget, the annotations of spilled references are freed
+     * once their wave is delivered, so results must be used or copied in
+     * the callback (or before the next ResultStream::next()).
+     *
+     * @param bytes The cap; 0 (the default) for no cap.
+     * @param spill_directory Where to put the spill files; the system
+     * temporary directory if empty.
+     */
+    void setMemoryBudget(uint64_t bytes, std::string spill_directory = std::string()) {
+        memoryBudget_.setLimit(bytes);
+        requestedBudget_ = bytes;
+        spillDirectory_ = std::move(spill_directory);
+    }
+
+    /**
+     *
+     * @return Most bytes the budget tracked at once since the indexes were last reset.
+     */
+    [[nodiscard]] uint64_t peakTrackedMemory() const { return memoryBudget_.peak(); }
+
+    /**
+     * @brief Set how results are batched for delivery.
+     *
+     * @param batch_size Results per batch.
+     * @param max_buffered_batches Batches each reference may have waiting
+     * for the consumer before its mapper blocks.
+     */
+    void setResultBatching(size_t batch_size, size_t max_buffered_batches) {
+        resultBatchSize_ = batch_size == 0 ? 1 : batch_size;
+        maxBufferedBatches_ = max_buffered_batches == 0 ? 1 : max_buffered_batches;
+    }
+
     /**
      *
      * @param file
@@ -46,14 +218,435 @@ public:
         return true;
     }
 
+    bool addFile(MapperFile && file) {
+        files_.push_back(std::move(file));
+        return true;
+    }
+
     bool addFile(const char * file_path, int join_index, long long int start_range_index, long long int end_range_index = -1,
                  bool zero_based_range = false, bool has_header = false, char delimiter = ',');
 
+    /**
+     * @brief Add a file whose rows are taken from a shared index instead of parsing it.
+     *
+     * The index at index_path is mapped read-only (see SharedIndex), after
+     * building it if it is missing, stale or of other column settings.  Any
+     * number of mappers, in any number of processes, can attach the same
+     * index and share its memory.  Range joins read nothing but the index;
+     * key joins still read the file.
+     *
+     * @param file The file and its column settings.
+     * @param index_path Where the file's index is, or is to be built.
+     * @return false if there is no usable index and it could not be built.
+     */
+    bool addIndexedFile(MapperFile file, const std::string & index_path);
+
+    /**
+     * @brief Add a file joined on its key columns alone, for JoinMode::Key.
+     *
+     * @param file_path
+     * @param key_columns Columns (zero based) whose values together form the key.
+     * @param has_header
+     * @param delimiter
+     * @return
+     */
+    bool addKeyFile(const char * file_path, std::vector <int32_t> key_columns, bool has_header = false, char delimiter = ',');
+
+    /**
+     * @brief Plan each map() from a pre-scan of its files.
+     *
+     * While the files are verified each is measured with stat() and a few
+     * sampled blocks (see ExecutionPlanner) for its rows, row width,
+     * references and sortedness.  The plan made from these sets the
+     * engine (the sweep, or binary searches of the larger file of each
+     * pair when the files are very unequal; hash tables for key joins), the
+     * read lanes, the block size, the rows reserved per stream and, if the
+     * rows would not fit in memory and no budget is set, a memory budget.
+     * The plan is logged to std::clog as a "PLAN:" line and kept for plan().
+     * Planned settings replace those made with the constructor and
+     * setResultBatching() for this and later runs.  Off by default.
+     *
+     * @param enable Whether to plan.
+     */
+    void enablePlanning(bool enable = true) { planning_ = enable; }
+
+    /**
+     * @brief Fix some settings of the plan instead of planning them.
+     *
+     * An engine that does not fit the join mode is ignored.
+     *
+     * @param plan_override The settings to use whatever the pre-scan finds.
+     */
+    void setPlanOverride(PlanOverride plan_override) { planOverride_ = std::move(plan_override); }
+
+    /**
+     *
+     * @return The plan of the last map() made with planning.
+     */
+    [[nodiscard]] const ExecutionPlan & plan() const { return plan_; }
+
+    /**
+     * @brief Estimate the results of a map() of the added files from a sample of them.
+     *
+     * A stratified sample of blocks of each file (see ResultEstimator) is
+     * mapped with this mapper's join and settings, in a mapper of its own,
+     * and the results found are extrapolated to every pair of files, with
+     * confidence intervals from a bootstrap of the blocks.  At the default
+     * one percent a sample maps in a small fraction of the full run's time.
+     * The estimate covers every file, whatever earlier map() calls did, and
+     * leaves this mapper as it was.  For range and key joins of pairs;
+     * nearest rows and coverage are not estimated.
+     *
+     * @param[out] estimate The results and output size, per pair of files and in all.
+     * @param settings The sampled fraction and the intervals.
+     * @return false if a file cannot be sampled or the samples mapped.
+     */
+    bool estimateResults(ResultEstimate & estimate, const ResultEstimator::Settings & settings = ResultEstimator::Settings());
+
+    /**
+     * @brief Choose how files are read.
+     *
+     * Every stage that reads whole files reads them through a BlockReader,
+     * with many large reads in flight across the files; by default through
+     * io_uring where the kernel allows it, pread() threads otherwise.
+     *
+     * @param backend The backend for the next map().
+     */
+    void setReadBackend(ReadBackend backend) { readBackend_ = backend; }
+
+    /**
+     * @brief Choose between range and exact key joins.
+     *
+     * In JoinMode::Key the rows of two files map when their keys (see
+     * MapperFile::key_indexes()) are equal.  For each pair of files a
+     * KeyHashTable is built on the file with fewer rows and probed in
+     * parallel with the rows of the other; results come by file pair, in
+     * the probing file's row order.  The memory budget applies to range
+     * joins only.  Changing the mode resets the index.
+     *
+     * @param mode The mode for the next map().
+     */
+    void setJoinMode(JoinMode mode) {
+        if (mode != joinMode_) {
+            resetIndex();
+            joinMode_ = mode;
+        }
+    }
+
+    /**
+     * @brief Choose between the overlapping pairs and their aggregates.
+     *
+     * In ResultMode::Coverage every reference is kept, even if only one
+     * file has it, and instead of the pairs each reference gets, from
+     * sorted endpoint sweeps run in parallel per reference (see
+     * CoverageSweep), the count of the other files' rows overlapping each
+     * of its rows, the bases covered by each file and by any, and the bases
+     * covered at each depth.  The output file has, per reference, a line
+     * per row, in file order:
+     *
+     *      file, the row's columns, overlapping rows of other files
+     *
+     * then "#coverage", the reference, the bases covered and the bases
+     * covered by each file, and a "#depth" line (reference, depth, bases)
+     * per depth reached; all tab separated.  Its size follows the rows,
+     * not the pairs.  The callback gets no batches.  Each map() in this mode
+     * aggregates all files again and rewrites the output file.  Only range
+     * joins aggregate; changing the mode resets the index.
+     *
+     * @param mode The mode for the next map().
+     */
+    void setResultMode(ResultMode mode) {
+        if (mode != resultMode_) {
+            resetIndex();
+            resultMode_ = mode;
+        }
+    }
+
+    /**
+     * @brief Set how ResultMode::Nearest picks the rows to pair.
+     *
+     * For every pair of files each row of the earlier file (in the order of
+     * addFile()) is paired with the k rows of the later file nearest to it
+     * on its reference, within the window if one is set, and with all of
+     * them inside the window if k is 0 (a window join).  The distance is 0
+     * for overlapping rows and the gap plus one otherwise, signed negative
+     * upstream and positive downstream of the row; with a strand column,
+     * rows whose strand is "-" look the other way.  Ties at the k-th
+     * distance are kept unless disabled.  Each reference is searched on the
+     * pool through sorted start and end arrays (see NearestIndex); results
+     * come per row of the earlier file in start order, nearest first, and
+     * the output file has the distance as a last column.
+     *
+     * @param options The options for the next map().
+     */
+    void setNearestOptions(const NearestOptions & options) { nearestOptions_ = options; }
+
+    /**
+     * @brief The coverage of each reference from the last map() in ResultMode::Coverage.
+     *
+     * Not filled by sharded runs, whose workers only write the output file.
+     *
+     * @return The coverage, by reference.
+     */
+    [[nodiscard]] const std::map <std::string, ReferenceCoverage, std::less <> > & coverage() const { return coverage_; }
+
+    /**
+     * @brief Map range joins in worker processes, each on a shard of the references.
+     *
+     * This process coordinates: it finds the references and their row
+     * counts once, cuts them, in reference order, into up to shards runs of
+     * about equal rows and forks a worker per run before starting any
+     * thread.  Each worker reads the files, keeping its own references
+     * only, and maps them into a file next to the output file; the
+     * coordinator then concatenates those in shard order, which is
+     * reference order, so the output is the same as mapping in one
+     * process.  The memory budget is split evenly between the workers.
+     *
+     * A worker that fails or dies is run once more.  If it fails again,
+     * map() returns false and names the references it had, but the
+     * results of the other shards are still written.
+     *
+     * Shards apply to range joins with an output file and no callback, as
+     * results cannot be handed over from another address space; other runs
+     * map in this process.  So do runs on a shared thread pool, and runs
+     * while the process has any thread besides the one calling map() (a
+     * progress poller, say), since the workers would inherit whatever locks
+     * those threads hold.  Sharded runs keep no index, so every map() maps
+     * all files.
+     *
+     * @param shards Worker processes; 1 (the default) maps in this process.
+     */
+    void setProcessShards(int shards) { processShards_ = std::max(1, shards); }
+
+    /**
+     * @brief Run map() on a pool shared with other mappers instead of one of its own.
+     *
+     * The run then has at most as many tasks in the pool at once as the
+     * threads given to the constructor, and takes turns at the workers
+     * with the other runs on it (see JobPool).  The pool's placement is
+     * kept; setPlacementPolicy() no longer applies.  Worker processes are
+     * not forked from a process with a running pool, so a sharded run
+     * maps in process.  See JobServer, which owns such a pool.
+     *
+     * @param pool The pool, which must outlive every map() on it; null for a pool per map().
+     */
+    void setThreadPool(thread_pool * pool) { sharedPool_ = pool; }
+
+    /**
+     * @brief Progress of the map() under way, or of the last one.
+     *
+     * Safe to call from any thread while map() runs; see MapperProgress.
+     *
+     * @return Rows and bytes done per file in the current stage, the
+     * references mapped and written, and the estimated time remaining.
+     */
+    [[nodiscard]] MapperProgress::Snapshot progress() const { return progress_.snapshot(); }
+
+    /**
+     * @brief Stop map() early once token is cancelled.
+     *
+     * The readers, the mappers and the writer check the token between
+     * batches, so a cancelled run stops within a batch per thread, frees
+     * the annotations (as a failed map() does) and returns false, with
+     * stopReason() telling why.  Set before map(), not during it.
+     *
+     * @param token Copies of it share its flag; cancel one to stop the run.
+     */
+    void setCancelToken(CancelToken token) { cancelToken_ = std::move(token); }
+
+    /**
+     * Cancel the token of this mapper; see setCancelToken().  Safe from any thread.
+     */
+    void cancel() { cancelToken_.cancel(); }
+
+    /**
+     * @brief Stop map() early once deadline has passed, as a cancelled one.
+     *
+     * @param deadline The time, for this and later runs; time_point::max() (the default) for none.
+     */
+    void setDeadline(std::chrono::steady_clock::time_point deadline) { deadline_ = deadline; }
+
+    /**
+     *
+     * @return Why the last map() was stopped early, if it was.
+     */
+    [[nodiscard]] StopReason stopReason() const { return stopReason_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Checkpoint range joins so a killed run can be resumed.
+     *
+     * While mapping, the references written in full, the length of the
+     * output after them and the references found in each file are kept in
+     * <output>.checkpoint (see Checkpoint), at most every interval_ms and at
+     * the end of every wave.  A run that is killed loses only the
+     * references written since.  The output is synced for each checkpoint.
+     *
+     * Checkpoints apply to range joins writing pairs or nearest rows to an
+     * output file in this process, on a map() that maps every file; other
+     * runs map without.  A checkpointed run keeps no index, so every map()
+     * maps all files.
+     *
+     * @param enable Whether to keep checkpoints.
+     * @param interval_ms Least time between checkpoints; 0 for one per reference.
+     */
+    void enableCheckpoints(bool enable = true, uint32_t interval_ms = 1000) {
+        checkpointing_ = enable;
+        checkpointInterval_ = std::chrono::milliseconds(interval_ms);
+    }
+
+    /**
+     * @brief Resume from the checkpoint of an earlier run of the same files and settings.
+     *
+     * map() then takes the references found in each file from the
+     * checkpoint instead of scanning for them, cuts the output back to the
+     * checkpointed length and maps (and hands the callback) only the
+     * references not done; the output ends up as a full run writes it.  A
+     * missing checkpoint, or one of another run, is ignored and the run
+     * starts over.  Turns checkpoints on.
+     *
+     * @param resume Whether to resume.
+     */
+    void setResume(bool resume = true) {
+        resume_ = resume;
+        checkpointing_ = checkpointing_ || resume;
+    }
+
+    /**
+     * @brief Set the file the mapped results are written to.
+     *
+     * If no output file is set the results are computed but not written.
+     *
+     * @param output_file_name Path of the output file.
+     */
+    void setOutputFile(std::string output_file_name) { outputFileName_ = std::move(output_file_name); }
+
+    /**
+     * @brief Set how the pipeline threads are placed on the machine.
+     *
+     * With PlacementPolicy::NumaAware the workers are pinned to cores on each
+     * node, files are read on the node they are assigned to and each reference
+     * is mapped on the node that read most of its annotations.  On a single
+     * node machine this degrades to PlacementPolicy::PinCores.
+     *
+     * @param policy The placement policy to use for the next map().
+     */
+    void setPlacementPolicy(PlacementPolicy policy) { placementPolicy_ = policy; }
+
+    /**
+     * @brief Turn per-stage runtime metrics on or off.
+     *
+     * Metrics are off by default; when off the recording calls in the
+     * pipeline reduce to a flag check.  Counters are reset at the start of
+     * every map().
+     *
+     * @param enable Whether to record metrics.
+     */
+    void enableStats(bool enable = true) { stats_.setEnabled(enable); }
+
+    /**
+     * @brief Write the metrics as JSON at the end of every map().
+     *
+     * Setting a file also enables the metrics.
+     *
+     * @param stats_file_name Path of the JSON file; empty to stop writing it.
+     */
+    void setStatsFile(std::string stats_file_name) {
+        statsFileName_ = std::move(stats_file_name);
+        if (!statsFileName_.empty()) {
+            stats_.setEnabled(true);
+        }
+    }
+
+    /**
+     * @brief Per-stage metrics of the current (or last) map().
+     *
+     * Safe to call from another thread while map() runs.
+     *
+     * @return The metrics summed over all threads.
+     */
+    [[nodiscard]] MapperStats::Snapshot stats() const { return stats_.snapshot(); }
+
+    /**
+     * @brief Record a timeline of the next map() runs as Chrome trace-event JSON.
+     *
+     * Every pool task and pipeline stage (per file reads, per reference
+     * mapping) becomes a slice on the thread that ran it.  Open the file in
+     * Perfetto or chrome://tracing.
+     *
+     * @param trace_file_name Path of the trace file; empty to stop tracing.
+     */
+    void setTraceFile(std::string trace_file_name) { traceFileName_ = std::move(trace_file_name); }
+
 //private:
     /*************************************************************************************
      *  Private Functions to src the Mapper
      *************************************************************************************/
 
+    /**
+     * Run every stage of map(); map() wraps this with the stats handling.
+     */
+    bool    _runPipeline(const ResultCallback & callback);
+
+    /**
+     * Find the references, fork a worker per shard of them and merge the workers' output files.
+     */
+    bool    _runShards();
+
+    /**
+     * Cut the references that can map, in order, into up to count runs of about equal rows.
+     */
+    [[nodiscard]] std::vector <std::vector <std::string> > _planShards(size_t count) const;
+
+    /**
+     * Fork a worker that maps the given references (sorted) into output; -1 if it could not be forked.
+     */
+    pid_t   _forkShard(size_t shard, size_t shard_count, const std::vector <std::string> & references,
+                       const std::string & output);
+
+    /**
+     * Verify, parse headers, find references and read the new files into the streams.
+     * A shard worker starts at the streams, the coordinator having found the references.
+     */
+    bool    _ingest(JobPool & pool);
+
+    /**
+     * Verify the new files and parse their headers.
+     */
+    bool    _prepareFiles();
+
+    /**
+     * @brief Start the checkpoint of this run, loading it when resuming; see enableCheckpoints().
+     *
+     * @return Whether a checkpoint was resumed, and with it the references found.
+     */
+    bool    _openCheckpoint();
+
+    /**
+     * Record the first count streams of a wave as done and, if it is time, commit the checkpoint.
+     */
+    void    _checkpointStreams(const std::vector <AnnotationStream *> & wave, size_t count, std::ofstream & out,
+                               size_t & recorded, std::chrono::steady_clock::time_point & committed);
+
+    /**
+     * Plan the run from the files' estimates and apply the plan; see enablePlanning().
+     */
+    void    _planExecution();
+
+    /**
+     * Run one stage, timing it into the stats and the trace.
+     */
+    template <typename F>
+    bool    _runStage(MapperStats::Stage stage, F && body);
+
+    /**
+     * @brief Whether the run is to stop: its token is cancelled or its deadline passed.
+     *
+     * Cheap enough to call per batch; the first call to see it records the reason.
+     *
+     * @return true once the run is to stop.
+     */
+    bool    _interrupted() const;
+
     /**
      *
      * @return
@@ -89,13 +682,288 @@ public:
      */
     bool    _parseHeaders();
 
+    /**
+     * Build the CPU and node assignment of each pool worker for the placement policy.
+     */
+    void    _planPlacement(const NumaTopology & topology, std::vector <std::vector <int> > & thread_cpus,
+                           std::vector <int> & thread_nodes) const;
+
+    /**
+     * Create an annotation stream for every reference found in more than one file.
+     *
+     * @param[out] newly_shared References whose stream was created for files added since the last map().
+     */
+    void    _createStreams(std::set <std::string, std::less <> > & newly_shared);
+
+    /**
+     *
+     * @param pool
+     * @param newly_shared References to read again from the files of earlier runs.
+     * @return
+     */
+    bool    _readFiles(JobPool & pool, const std::set <std::string, std::less <> > & newly_shared);
+
+    /**
+     * Take the rows of the files with a shared index from it, for the streams not given them yet.
+     */
+    void    _attachSharedIndexes();
+
+    /**
+     * Start reading the given files, in that order, through a BlockReader; null if one cannot be opened.
+     */
+    std::unique_ptr <BlockReader> _openReader(const std::vector <size_t> & file_indexes) const;
+
+    /**
+     * Files of a read stage, handed out to the read lanes.
+     */
+    struct ReadQueue {
+        std::vector <std::vector <size_t> >     nodeFiles;  ///< Files preferably read on each NUMA node, in order
+        std::vector <std::atomic <size_t> >     cursors;    ///< Next position in each node's files
+        std::vector <size_t>                    slots;      ///< Index of each file in the stage's BlockReader
+        std::chrono::steady_clock::time_point   pushed;     ///< When the lanes were queued
+
+        /**
+         * Take the next file, the node's own ones first.
+         */
+        bool take(int node, size_t & file_index);
+
+        /**
+         *
+         * @return Files not taken yet.
+         */
+        [[nodiscard]] size_t remaining() const;
+    };
+
+    /**
+     * Run the read lanes over the queue's files until all are read.  Each
+     * lane is a coroutine reading one file at a time; while it waits for a
+     * block its worker parses the files of other lanes.
+     *
+     * @param newly_shared If given, files of earlier runs are only read for these references.
+     * @return Whether every file was read.
+     */
+    bool    _runReadLanes(JobPool & pool, BlockReader & blocks, ReadQueue & queue,
+                          const std::set <std::string, std::less <> > * newly_shared);
+
+    /**
+     * One read lane: take files from the queue and read them, as a range or key file per joinMode_.
+     */
+    DetachedTask _readLane(JobPool & pool, int node, BlockReader & blocks, ReadQueue & queue,
+                           const std::set <std::string, std::less <> > * newly_shared, std::atomic <bool> & passed);
+
+    /**
+     * Read a single file, slot of blocks, into the annotation streams, only the references in only if given.
+     * Waits for blocks by suspending; resumed through scheduler.
+     */
+    Task <bool> _readFile(size_t file_index, BlockReader & blocks, size_t slot, PoolScheduler scheduler,
+                          const std::set <std::string, std::less <> > * only = nullptr);
+
+    /**
+     * Columns of the row being read; keeps its capacity from row to row.
+     */
+    struct RowColumns {
+        std::vector <std::string_view>  fields;     ///< Views of the columns
+        std::string                     unescaped;  ///< Unquoted columns with escaped quotes
+
+        /**
+         *
+         * @return The column at index, empty if the row has none.
+         */
+        [[nodiscard]] std::string_view column(long long int index) const {
+            return index >= 0 && static_cast<size_t>(index) < fields.size() ? fields[index] : std::string_view();
+        }
+    };
+
+    /**
+     * Read one row, number row_number, of a file into its stream, only the references in only if given.
+     * bytes is set to the memory the row takes, 0 if it was dropped.
+     * @return false if its range cannot be read.
+     */
+    bool    _readRow(size_t file_index, std::string_view row, uint64_t row_number, RowColumns & columns,
+                     const std::set <std::string, std::less <> > * only, size_t & bytes);
+
+    /**
+     * The column at index of a delimited row, without copying.
+     */
+    static std::string_view _column(std::string_view row, int index, char delimiter);
+
+    /**
+     * Split a delimited row into views of its columns, reusing fields' storage.
+     */
+    static void _splitRow(std::string_view row, char delimiter, std::vector <std::string_view> & fields);
+
+    /**
+     * Split a row of file into views of its columns, unquoting them if the file is quoted.
+     * Unquoted columns with escaped quotes are kept in unescaped.
+     */
+    static void _splitFields(std::string_view row, const MapperFile & file, std::vector <std::string_view> & fields,
+                             std::string & unescaped);
+
+    /**
+     * The stream a join value belongs to, or nullptr if the value cannot map.
+     */
+    AnnotationStream * _findStream(std::string_view join_value);
+
+    /**
+     * Spill, or wait for the other readers to spill, until the budget is back under its cap.
+     * Resumed through scheduler when giving way to them.
+     * @return false if spilling failed or nothing is left to spill.
+     */
+    Task <bool> _makeRoom(size_t file_index, PoolScheduler scheduler);
+
+    /**
+     * Spill the largest partitions of one file and of files already read until the budget has room.
+     * others is set if files still being read by other readers hold partitions.
+     * @return false if a spill failed.
+     */
+    bool    _spillForRoom(size_t file_index, bool & others);
+
+    /**
+     * Group the streams to map into waves whose spilled data fits in the memory budget.
+     */
+    std::vector <std::vector <AnnotationStream *> > _planWaves(const std::vector <AnnotationStream *> & streams) const;
+
+    /**
+     * Map and deliver the streams wave by wave.
+     */
+    bool    _mapWaves(JobPool & pool, const std::vector <AnnotationStream *> & streams, const ResultCallback & callback);
+
+    /**
+     * Queue a mapping task for every given stream; streams[i] produces into queue slot i.
+     * The last task ends the map stage if end_stage is set, and failures clear passed.
+     */
+    void    _mapStreams(JobPool & pool, const std::vector <AnnotationStream *> & streams, ResultQueue & queue,
+                        bool end_stage, std::atomic <bool> & passed);
+
+    /**
+     * Map the file pairs of one annotation stream that involve a file added since the last map().
+     */
+    bool    _mapStream(AnnotationStream & stream, size_t stream_index, ResultQueue & queue) const;
+
+    /**
+     * Read the files added since the last map() for an exact key join.
+     */
+    bool    _readKeyFiles(JobPool & pool);
+
+    /**
+     * Read the rows and key hashes of a single file for an exact key join.
+     */
+    Task <bool> _readKeyFile(size_t file_index, BlockReader & blocks, size_t slot, PoolScheduler scheduler);
+
+    /**
+     * Read one row, number row_number, of a file with its key, made of its key_columns.
+     * @return false if a key column is missing.
+     */
+    bool    _readKeyRow(size_t file_index, std::string_view row, uint64_t row_number,
+                        const std::vector <int32_t> & key_columns, RowColumns & columns);
+
+    /**
+     * Build the hash tables, then probe every file pair involving a new file and deliver the results.
+     */
+    bool    _mapKeys(JobPool & pool, const ResultCallback & callback);
+
+    /**
+     * Pair each row of one stream's earlier files with its nearest rows in the later ones, per nearestOptions_,
+     * calling flush whenever the batch is full.
+     */
+    template <typename Flush>
+    void    _nearestStream(AnnotationStream & stream, const std::vector <const SortedRanges *> & sorted,
+                           ResultBatch & batch, Flush & flush) const;
+
+    /**
+     * Aggregate the streams of one wave in parallel and write them, in order, to the output file.
+     * The map stage ends with the wave if end_stage is set.
+     */
+    bool    _aggregateWave(JobPool & pool, const std::vector <AnnotationStream *> & wave, std::ofstream & out,
+                           bool end_stage);
+
+    /**
+     * Count the overlaps of every row of one stream and its coverage, formatting the output lines into text.
+     */
+    bool    _aggregateStream(AnnotationStream & stream, std::string & text, ReferenceCoverage & coverage) const;
+
+    /**
+     * Files a reference must be in to get a stream: every reference counts when aggregating.
+     */
+    [[nodiscard]] int _minFilesPerReference() const {
+        return resultMode_ == ResultMode::Coverage ? 1 : minFilesPerReference_;
+    }
+
+    /**
+     * Hand the queued results to the callback and output file until every stream is done.
+     *
+     * @param queue
+     * @param callback
+     * @param out The output file, not open if there is none.
+     * @param drained If set, called with the count of streams drained so far each time it grows,
+     *                while out holds their results and no others.
+     * @return
+     */
+    bool    _deliverResults(ResultQueue & queue, const ResultCallback & callback, std::ofstream & out,
+                            const std::function<void(size_t)> & drained = {}) const;
+
     /*************************************************************************************
      *  Member variables
      *************************************************************************************/
     FileList<MapperFile>        files_;              /**< The files to be mapped */
-    std::map <std::string, std::map <std::string, bool> > referenceIDs_;       /**< Dictionary of the reference IDs by file */
+    std::map <std::string, std::map <std::string, uint64_t, std::less <> > > referenceIDs_;   /**< Rows of each reference ID, by file */
     std::map <std::string, int> allReferenceIDs_;       /**< The reference IDs across all files, with file count */
     std::string outputFileName_;                     /**< The name for the output file for mapped results. */
+    PlacementPolicy placementPolicy_ = PlacementPolicy::None; /**< How pipeline threads are placed */
+    std::vector <int> fileNodes_;                    /**< The node (index) each file was read on, -1 if unplaced */
+    mutable MapperStats stats_;                      /**< Per-stage runtime metrics */
+    std::string statsFileName_;                      /**< JSON file the metrics are written to after map(), empty for none */
+    std::unique_ptr <TraceRecorder> tracer_;         /**< Timeline of the current map(), null unless tracing */
+    std::string traceFileName_;                      /**< Chrome trace file written after map(), empty for none */
+    size_t resultBatchSize_ = 4096;                  /**< Results per delivered batch */
+    size_t maxBufferedBatches_ = 4;                  /**< Batches a reference may have waiting before its mapper blocks */
+    size_t mappedFileCount_ = 0;                     /**< Files indexed and mapped by earlier map() calls */
+    int minFilesPerReference_ = 2;                   /**< Files a reference must be in to be kept; 1 for a query index */
+    MemoryBudget memoryBudget_;                      /**< Cap on the tracked memory, off by default */
+    std::string spillDirectory_;                     /**< Directory spill files are created in, empty for the temporary directory */
+    std::string spillPath_;                          /**< This mapper's spill directory, empty until created */
+    size_t streamsCreated_ = 0;                      /**< Streams created so far; numbers the spill files */
+    std::mutex spillMtx_;                            /**< Serializes spilling during reading; guards readDone_ */
+    std::vector <bool> readDone_;                    /**< Whether each file is not (or no longer) being read this run */
+    JoinMode joinMode_ = JoinMode::Range;            /**< How rows are matched */
+    ResultMode resultMode_ = ResultMode::Pairs;      /**< What a range join produces */
+    NearestOptions nearestOptions_;                  /**< How ResultMode::Nearest picks its rows */
+    bool planning_ = false;                          /**< Whether map() plans from a pre-scan */
+    PlanOverride planOverride_;                      /**< Settings fixed instead of planned */
+    ExecutionPlan plan_;                             /**< The last plan */
+    std::vector <FileEstimate> estimates_;           /**< Pre-scan of each file, when planning */
+    MapEngine mapEngine_ = MapEngine::Sweep;         /**< How range joins match two files */
+    size_t blockSize_ = 1 << 20;                     /**< Bytes per read */
+    uint32_t streamCapacity_ = 1000;                 /**< Annotations reserved per file of a new stream */
+    uint64_t requestedBudget_ = 0;                   /**< The budget given to setMemoryBudget(); the plan's may differ */
+    std::map <std::string, ReferenceCoverage, std::less <> > coverage_;  /**< Coverage by reference, in ResultMode::Coverage */
+    ReadBackend readBackend_ = ReadBackend::Auto;    /**< How files are read */
+    static constexpr size_t FILES_PER_READER = 4;    /**< Files in flight per reading thread */
+    static constexpr uint64_t CHECK_ROWS = 4096;     /**< Rows scanned between progress counts and stop checks */
+    int processShards_ = 1;                          /**< Worker processes for range joins; 1 maps in process */
+    long shard_ = -1;                                /**< The shard a worker process maps, -1 in the coordinator */
+    thread_pool * sharedPool_ = nullptr;             /**< The pool map() runs on, null to create one per run */
+    mutable MapperProgress progress_;                /**< Progress of the current run */
+    CancelToken cancelToken_;                        /**< Stops the run once cancelled */
+    std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max(); /**< Stops the run once passed */
+    mutable std::atomic <StopReason> stopReason_ = StopReason::None; /**< Why the run stopped, set by the first to notice */
+    bool checkpointing_ = false;                     /**< Whether range joins keep checkpoints */
+    bool resume_ = false;                            /**< Whether map() resumes from the checkpoint */
+    std::chrono::milliseconds checkpointInterval_{1000}; /**< Least time between checkpoints */
+    std::unique_ptr <Checkpoint> checkpoint_;        /**< The checkpoint of the current run, null if none */
+
+    /**
+     * One file's rows for an exact key join.
+     */
+    struct KeyedFile {
+        // First, so it outlives the rows whose elements it holds.
+        std::unique_ptr <std::pmr::monotonic_buffer_resource> arena;  ///< Holds the rows' elements
+        std::vector <Annotation>    rows;       ///< Every row; the join value is the (composite) key
+        std::vector <uint64_t>      hashes;     ///< KeyHashTable::hash() of each row's key
+        KeyHashTable                table;      ///< Rows by key hash, built if the file is ever the smaller of a pair
+        bool                        built = false;
+    };
+    std::vector <KeyedFile> keyedFiles_;             /**< Rows of each file read for JoinMode::Key */
 
 
     // Thread information
@@ -107,7 +975,9 @@ public:
     std::mutex                  mtx;                 /**< Mutex to lock the BioMapper memory structures if needed */
 
     // Multithread streams
-    std::map <std::string, AnnotationStream> annotationStreams_;
+    std::map <std::string, AnnotationStream, std::less <> > annotationStreams_;  /**< Looked up by string_view too */
+    JoinKeyFilter                       joinFilter_;     /**< Which join values can map; built with the streams */
+    std::vector <AnnotationStream *>    streamsById_;    /**< Stream of each interned join value, null if it cannot map */
     std::map <std::string, Annotation *> bufferCurrentLocation_;
 };
 
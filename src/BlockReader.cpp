@@ -0,0 +1,471 @@
+#include "BlockReader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(BIOMAPPER_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define BIOMAPPER_HAVE_IO_URING
+#endif
+
+namespace {
+
+constexpr size_t MIN_BLOCK_SIZE = 1 << 16;
+
+} // namespace
+
+/*****************************************************************************************
+ * BlockReader
+ *      Constructor
+ ****************************************************************************************/
+
+BlockReader::BlockReader(ReadBackend backend /* =Auto */, size_t block_size /* =1MiB */, size_t block_count /* =16 */)
+        : backend_(backend), blockSize_(std::max(block_size, MIN_BLOCK_SIZE)), blockCount_(std::max<size_t>(block_count, 2)) {
+}
+
+BlockReader::~BlockReader() {
+    {
+        const std::scoped_lock lock(mtx_);
+        stop_ = true;
+        changed_.notify_all();
+    }
+    for (std::thread & thread : threads_) {
+        thread.join();
+    }
+#ifdef BIOMAPPER_HAVE_IO_URING
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqesSize_);
+    }
+    if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_ != nullptr) {
+        munmap(sqRing_, sqRingSize_);
+    }
+#endif
+    if (ringFd_ >= 0) {
+        ::close(ringFd_);
+    }
+    for (OpenFile & file : files_) {
+        if (file.fd >= 0) {
+            ::close(file.fd);
+        }
+    }
+    std::free(pool_);
+}
+
+/******************************************************************
+ * Open
+ *      Open every file, size the pool to the largest of them and
+ *      start the I/O: one thread driving the ring, or pread
+ *      threads when io_uring cannot be set up.
+ ******************************************************************/
+bool BlockReader::open(const std::vector <std::string> & paths, std::vector <std::string> & fail_list) {
+    files_.resize(paths.size());
+    uint64_t largest = 0;
+    bool passed = true;
+    for (size_t i = 0; i < paths.size(); i++) {
+        OpenFile & file = files_[i];
+        file.fd = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info{};
+        if (file.fd < 0 || fstat(file.fd, &info) != 0) {
+            fail_list.push_back(paths[i]);
+            passed = false;
+            continue;
+        }
+        file.size = static_cast<uint64_t>(info.st_size);
+        largest = std::max(largest, file.size);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+    if (!passed) {
+        return false;
+    }
+
+    // Small files do not need large buffers (registered ones are pinned).
+    const uint64_t needed = (largest + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE * MIN_BLOCK_SIZE;
+    blockSize_ = static_cast<size_t>(std::clamp<uint64_t>(needed, MIN_BLOCK_SIZE, blockSize_));
+    pool_ = static_cast<char *>(std::aligned_alloc(4096, blockSize_ * blockCount_));
+    if (pool_ == nullptr) {
+        std::cerr << "ERROR: Could not allocate " << blockSize_ * blockCount_ << " bytes of read buffers.  \n";
+        return false;
+    }
+    reads_.resize(blockCount_);
+    for (size_t b = blockCount_; b-- > 0;) {
+        free_.push_back(static_cast<uint32_t>(b));
+    }
+
+    if (backend_ != ReadBackend::Pread && _setupRing()) {
+        backend_ = ReadBackend::IoUring;
+        threads_.emplace_back([this]() { _ringLoop(); });
+        return true;
+    }
+    if (backend_ == ReadBackend::IoUring) {
+        std::cerr << "ERROR: io_uring is not available.  \n";
+        return false;
+    }
+    backend_ = ReadBackend::Pread;
+    // Enough threads to keep a few reads in flight per device.
+    const size_t threads = std::min<size_t>(4, blockCount_);
+    for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back([this]() { _preadLoop(); });
+    }
+    return true;
+}
+
+/******************************************************************
+ * Next
+ *      Blocks of a file are handed out in offset order; a block
+ *      completed early waits in the file's ready map.
+ ******************************************************************/
+bool BlockReader::next(size_t file, FileBlock & block) {
+    std::unique_lock lock(mtx_);
+    OpenFile & f = files_[file];
+    if (f.state == FileState::Queued) {
+        f.state = FileState::Parsing;
+        changed_.notify_all();
+    }
+    changed_.wait(lock, [&f]() { return _available(f); });
+    if (f.failed || f.consumed >= f.size) {
+        return false;
+    }
+    const auto [buffer, size] = f.ready.begin()->second;
+    f.ready.erase(f.ready.begin());
+    f.consumed += size;
+    block = FileBlock{pool_ + static_cast<size_t>(buffer) * blockSize_, size, buffer};
+    return true;
+}
+
+bool BlockReader::whenReady(size_t file, std::function <void()> wake) {
+    const std::scoped_lock lock(mtx_);
+    OpenFile & f = files_[file];
+    if (f.state == FileState::Queued) {
+        f.state = FileState::Parsing;
+        changed_.notify_all();
+    }
+    if (_available(f)) {
+        return true;
+    }
+    f.waiter = std::move(wake);
+    return false;
+}
+
+void BlockReader::release(const FileBlock & block) {
+    const std::scoped_lock lock(mtx_);
+    free_.push_back(block.buffer);
+    changed_.notify_all();
+}
+
+void BlockReader::close(size_t file) {
+    const std::scoped_lock lock(mtx_);
+    OpenFile & f = files_[file];
+    f.state = FileState::Closed;
+    for (const auto & ready : f.ready) {
+        free_.push_back(ready.second.first);
+    }
+    f.ready.clear();
+    changed_.notify_all();
+}
+
+bool BlockReader::failed(size_t file) const {
+    const std::scoped_lock lock(mtx_);
+    return files_[file].failed;
+}
+
+/******************************************************************
+ * Schedule
+ *      Files being parsed share half the pool for read-ahead, the
+ *      emptiest first.  While more than half the pool is free,
+ *      the files queued next get their first two blocks, so a
+ *      file's data is waiting when its parser starts.  Queued
+ *      files never hold more than half the pool, which leaves the
+ *      files being parsed room to make progress.
+ ******************************************************************/
+bool BlockReader::_schedule(uint32_t & buffer) {
+    if (stop_ || free_.empty()) {
+        return false;
+    }
+    const size_t count = files_.size();
+    const size_t parsing = static_cast<size_t>(std::count_if(files_.begin(), files_.end(), [](const OpenFile & f) {
+        return f.state == FileState::Parsing;
+    }));
+    const size_t ahead = std::max<size_t>(2, blockCount_ / (2 * std::max<size_t>(1, parsing)));
+
+    size_t best = count, bestLoad = 0;
+    for (size_t k = 0; k < count; k++) {
+        const size_t i = (cursor_ + k) % count;
+        const OpenFile & f = files_[i];
+        const size_t load = f.inFlight + f.ready.size();
+        if (f.state != FileState::Parsing || f.failed || f.issued >= f.size || load >= ahead) {
+            continue;
+        }
+        if (best == count || load < bestLoad) {
+            best = i;
+            bestLoad = load;
+        }
+    }
+    if (best == count && free_.size() > blockCount_ / 2) {
+        for (size_t i = 0; i < count; i++) {
+            const OpenFile & f = files_[i];
+            if (f.state == FileState::Queued && !f.failed && f.issued < f.size && f.inFlight + f.ready.size() < 2) {
+                best = i;
+                break;
+            }
+        }
+    }
+    if (best == count) {
+        return false;
+    }
+
+    cursor_ = (best + 1) % count;
+    buffer = free_.back();
+    free_.pop_back();
+    OpenFile & f = files_[best];
+    const size_t length = static_cast<size_t>(std::min<uint64_t>(blockSize_, f.size - f.issued));
+    reads_[buffer] = Read{best, f.issued, length, 0};
+    f.issued += length;
+    f.inFlight++;
+    inFlight_++;
+    return true;
+}
+
+void BlockReader::_complete(uint32_t buffer, bool ok) {
+    const Read & read = reads_[buffer];
+    OpenFile & f = files_[read.file];
+    f.inFlight--;
+    inFlight_--;
+    if (!ok) {
+        f.failed = true;
+    }
+    if (!ok || f.state == FileState::Closed) {
+        free_.push_back(buffer);
+    } else {
+        f.ready.emplace(read.offset, std::make_pair(buffer, read.done));
+    }
+    if (f.waiter && _available(f)) {
+        wakes_.push_back(std::move(f.waiter));
+        f.waiter = nullptr;
+    }
+    changed_.notify_all();
+}
+
+void BlockReader::_wake() {
+    std::vector <std::function <void()> > wakes;
+    {
+        const std::scoped_lock lock(mtx_);
+        wakes.swap(wakes_);
+    }
+    for (auto & wake : wakes) {
+        wake();
+    }
+}
+
+/******************************************************************
+ * Pread Loop
+ *      Take one read at a time and do it synchronously.
+ ******************************************************************/
+void BlockReader::_preadLoop() {
+    while (true) {
+        uint32_t buffer = 0;
+        {
+            std::unique_lock lock(mtx_);
+            changed_.wait(lock, [&]() { return stop_ || _schedule(buffer); });
+            if (stop_) {
+                return;
+            }
+        }
+
+        Read & read = reads_[buffer];
+        const int fd = files_[read.file].fd;
+        char * data = pool_ + static_cast<size_t>(buffer) * blockSize_;
+        bool ok = true;
+        while (read.done < read.length) {
+            const ssize_t n = pread(fd, data + read.done, read.length - read.done, static_cast<off_t>(read.offset + read.done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // An error, or the file shrank since it was opened
+                ok = false;
+                break;
+            }
+            read.done += static_cast<size_t>(n);
+        }
+
+        {
+            const std::scoped_lock lock(mtx_);
+            _complete(buffer, ok);
+        }
+        _wake();
+    }
+}
+
+/******************************************************************
+ * Setup Ring
+ *      Raw io_uring setup: map the submission and completion rings
+ *      and register the pool as fixed buffers.  Registration can
+ *      be refused (memlock limit); plain reads are used then.
+ ******************************************************************/
+bool BlockReader::_setupRing() {
+#ifdef BIOMAPPER_HAVE_IO_URING
+    io_uring_params params{};
+    const int fd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(blockCount_), &params));
+    if (fd < 0) {
+        return false;
+    }
+    ringFd_ = fd;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    auto map = [fd](size_t size, off_t offset) -> void * {
+        void * mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return mapped == MAP_FAILED ? nullptr : mapped;
+    };
+    sqRing_ = map(sqRingSize_, IORING_OFF_SQ_RING);
+    cqRing_ = singleMap ? sqRing_ : map(cqRingSize_, IORING_OFF_CQ_RING);
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = map(sqesSize_, IORING_OFF_SQES);
+    if (sqRing_ == nullptr || cqRing_ == nullptr || sqes_ == nullptr) {
+        return false;
+    }
+
+    auto field = [](void * ring, unsigned offset) {
+        return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+    };
+    sqHead_ = field(sqRing_, params.sq_off.head);
+    sqTail_ = field(sqRing_, params.sq_off.tail);
+    sqMask_ = field(sqRing_, params.sq_off.ring_mask);
+    sqArray_ = field(sqRing_, params.sq_off.array);
+    cqHead_ = field(cqRing_, params.cq_off.head);
+    cqTail_ = field(cqRing_, params.cq_off.tail);
+    cqMask_ = field(cqRing_, params.cq_off.ring_mask);
+    cqes_ = static_cast<char *>(cqRing_) + params.cq_off.cqes;
+
+    std::vector <iovec> buffers(blockCount_);
+    for (size_t b = 0; b < blockCount_; b++) {
+        buffers[b].iov_base = pool_ + b * blockSize_;
+        buffers[b].iov_len = blockSize_;
+    }
+    fixedBuffers_ = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(),
+                            static_cast<unsigned>(blockCount_)) == 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/******************************************************************
+ * Ring Loop
+ *      Queue every read the scheduler allows, submit them and wait
+ *      for at least one completion in the same call, then reap.
+ *      Short reads are resubmitted for the rest of their block.
+ *      Exits once stopped with nothing in flight, so no buffer is
+ *      freed under the kernel.
+ ******************************************************************/
+void BlockReader::_ringLoop() {
+#ifdef BIOMAPPER_HAVE_IO_URING
+    auto * sqes = static_cast<io_uring_sqe *>(sqes_);
+    auto * cqes = static_cast<io_uring_cqe *>(cqes_);
+    std::vector <uint32_t> toSubmit;
+
+    while (true) {
+        {
+            std::unique_lock lock(mtx_);
+            changed_.wait(lock, [&]() {
+                uint32_t buffer;
+                while (_schedule(buffer)) {
+                    toSubmit.push_back(buffer);
+                }
+                return stop_ || inFlight_ > 0 || !toSubmit.empty();
+            });
+            if (inFlight_ == 0 && toSubmit.empty()) {
+                return;
+            }
+        }
+
+        // Only this thread writes the submission ring.
+        unsigned tail = *sqTail_;
+        for (uint32_t buffer : toSubmit) {
+            const Read & read = reads_[buffer];
+            const unsigned index = tail & *sqMask_;
+            io_uring_sqe & sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = fixedBuffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe.fd = files_[read.file].fd;
+            sqe.addr = reinterpret_cast<uint64_t>(pool_ + static_cast<size_t>(buffer) * blockSize_ + read.done);
+            sqe.len = static_cast<unsigned>(read.length - read.done);
+            sqe.off = read.offset + read.done;
+            sqe.buf_index = fixedBuffers_ ? static_cast<uint16_t>(buffer) : 0;
+            sqe.user_data = buffer;
+            sqArray_[index] = index;
+            tail++;
+        }
+        std::atomic_ref<unsigned>(*sqTail_).store(tail, std::memory_order_release);
+        toSubmit.clear();
+        while (true) {
+            // Whatever the kernel has not consumed yet, also after an interrupted call.
+            const unsigned pending = tail - std::atomic_ref<unsigned>(*sqHead_).load(std::memory_order_acquire);
+            if (syscall(__NR_io_uring_enter, ringFd_, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0) {
+                break;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // The ring is unusable; fail every file so the parsers stop.
+                std::cerr << "ERROR: io_uring_enter failed (" << std::strerror(errno) << ").  \n";
+                {
+                    const std::scoped_lock lock(mtx_);
+                    for (OpenFile & file : files_) {
+                        file.failed = true;
+                        if (file.waiter) {
+                            wakes_.push_back(std::move(file.waiter));
+                            file.waiter = nullptr;
+                        }
+                    }
+                    stop_ = true;
+                    changed_.notify_all();
+                }
+                _wake();
+                return;
+            }
+        }
+
+        unsigned head = *cqHead_;
+        const unsigned completed = std::atomic_ref<unsigned>(*cqTail_).load(std::memory_order_acquire);
+        std::unique_lock lock(mtx_);
+        for (; head != completed; head++) {
+            const io_uring_cqe & cqe = cqes[head & *cqMask_];
+            const auto buffer = static_cast<uint32_t>(cqe.user_data);
+            Read & read = reads_[buffer];
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                toSubmit.push_back(buffer);
+                continue;
+            }
+            if (cqe.res > 0) {
+                read.done += static_cast<size_t>(cqe.res);
+                if (read.done < read.length) {
+                    toSubmit.push_back(buffer);
+                    continue;
+                }
+            }
+            // Zero bytes before the end means the file shrank since it was opened.
+            _complete(buffer, cqe.res > 0);
+        }
+        std::atomic_ref<unsigned>(*cqHead_).store(head, std::memory_order_release);
+        lock.unlock();
+        _wake();
+    }
+#endif
+}
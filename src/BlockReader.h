@@ -0,0 +1,435 @@
+/*! \file BlockReader.h
+    \author John Torcivia, Ph.D.
+
+    \brief Asynchronous block reads across many files.
+
+    All files of a run are opened up front and read in large blocks into a
+    fixed pool of buffers, with many reads in flight at once: read-ahead for
+    the files being parsed and the first blocks of the files queued after
+    them.  Parsers take the blocks of a file in order straight out of the
+    pool buffers and hand them back when done, so the data is never copied
+    between the device and the parser.
+
+    On Linux the reads go through io_uring, with the pool registered as
+    fixed buffers.  Where io_uring is not available (other systems, older
+    kernels, seccomp filters) a few threads issue pread() instead.
+*/
+
+#ifndef BIOMAPPER_BLOCKREADER_H
+#define BIOMAPPER_BLOCKREADER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "Coroutines.h"
+#include "CsvScanner.h"
+
+/**
+ * How a BlockReader issues its reads.
+ */
+enum class ReadBackend {
+    Auto,       ///< io_uring if the kernel allows it, pread otherwise
+    IoUring,    ///< io_uring only; open() fails without it
+    Pread       ///< pread() from a few I/O threads
+};
+
+/**
+ * One block of a file, valid until it is released.
+ */
+struct FileBlock {
+    const char *    data = nullptr;
+    size_t          size = 0;
+    uint32_t        buffer = 0;     ///< Pool buffer holding the block
+};
+
+/**
+ *
+ */
+class BlockReader {
+public:
+    /**
+     *
+     * @param backend How to issue the reads.
+     * @param block_size Largest read; smaller if every file is smaller.
+     * @param block_count Buffers in the pool, which bounds the reads in flight plus the blocks waiting to be parsed.
+     */
+    explicit BlockReader(ReadBackend backend = ReadBackend::Auto, size_t block_size = 1 << 20, size_t block_count = 16);
+
+    /**
+     * Waits for the reads in flight and closes the files.
+     */
+    ~BlockReader();
+
+    BlockReader(const BlockReader &) = delete;
+    BlockReader & operator=(const BlockReader &) = delete;
+
+    /**
+     * @brief Open the files and start reading them.
+     *
+     * Files are prefetched in the given order, so list them in the order
+     * they will be parsed.  Can only be called once.
+     *
+     * @param paths The files; later calls refer to them by index.
+     * @param[out] fail_list Receives the files that could not be opened.
+     * @return Whether every file was opened.
+     */
+    bool open(const std::vector <std::string> & paths, std::vector <std::string> & fail_list);
+
+    /**
+     * @brief Wait for the next block of a file.
+     *
+     * The first call marks the file as being parsed, which gives it a
+     * deeper read-ahead.
+     *
+     * @param file Index of the file in open()'s paths.
+     * @param[out] block The block; release() it when done.
+     * @retval true A block was returned.
+     * @retval false The file is finished, or a read failed (see failed()).
+     */
+    bool next(size_t file, FileBlock & block);
+
+    /**
+     * @brief Ask to be woken once next() would not wait.
+     *
+     * For parsers that must not hold a thread while a read is in flight.
+     * Marks the file as being parsed, like next().  At most one wait per
+     * file may be pending.
+     *
+     * @param file Index of the file in open()'s paths.
+     * @param wake Called once when the file's next block is there (or the
+     *             file ended or failed), from an I/O thread with no lock
+     *             held; only if false is returned.
+     * @return Whether next() would return without waiting now.
+     */
+    bool whenReady(size_t file, std::function <void()> wake);
+
+    /**
+     * Hand a block's buffer back to the pool.
+     */
+    void release(const FileBlock & block);
+
+    /**
+     * Stop reading a file and drop its queued blocks.
+     */
+    void close(size_t file);
+
+    /**
+     *
+     * @return Whether a read of the file failed.
+     */
+    [[nodiscard]] bool failed(size_t file) const;
+
+    /**
+     *
+     * @return The backend in use once open() has succeeded; never Auto then.
+     */
+    [[nodiscard]] ReadBackend backend() const { return backend_; }
+
+    /**
+     *
+     * @return Size of each pool buffer.
+     */
+    [[nodiscard]] size_t blockSize() const { return blockSize_; }
+
+    /**
+     *
+     * @return Bytes the buffer pool occupies.
+     */
+    [[nodiscard]] size_t memoryUsage() const { return blockSize_ * blockCount_; }
+
+private:
+    enum class FileState { Queued, Parsing, Closed };
+
+    struct OpenFile {
+        int         fd = -1;
+        uint64_t    size = 0;
+        uint64_t    issued = 0;     ///< Offset of the next read to issue
+        uint64_t    consumed = 0;   ///< Offset of the next block to hand out
+        size_t      inFlight = 0;   ///< Reads issued and not completed
+        FileState   state = FileState::Queued;
+        bool        failed = false;
+        std::map <uint64_t, std::pair <uint32_t, size_t> > ready;  ///< Completed blocks by offset: buffer, size
+        std::function <void()> waiter;  ///< Pending whenReady() callback
+    };
+
+    /**
+     * Whether next() on the file would return without waiting.
+     */
+    static bool _available(const OpenFile & f) {
+        return f.failed || f.consumed >= f.size || (!f.ready.empty() && f.ready.begin()->first == f.consumed);
+    }
+
+    /**
+     * A read being served by one buffer.
+     */
+    struct Read {
+        size_t      file = 0;
+        uint64_t    offset = 0;
+        size_t      length = 0;     ///< Bytes requested
+        size_t      done = 0;       ///< Bytes read so far (reads may come back short)
+    };
+
+    /**
+     * Pick the next read to issue, under mtx_.  Files being parsed come
+     * first, fewest buffered blocks first; queued files get their first
+     * blocks only while most of the pool is free.
+     *
+     * @return The buffer assigned, or false if nothing should be read now.
+     */
+    bool _schedule(uint32_t & buffer);
+
+    /**
+     * Record a finished read, under mtx_.
+     */
+    void _complete(uint32_t buffer, bool ok);
+
+    /**
+     * Call the whenReady() callbacks collected in wakes_, without mtx_.
+     */
+    void _wake();
+
+    bool _setupRing();
+    void _ringLoop();
+    void _preadLoop();
+
+    ReadBackend                 backend_;
+    size_t                      blockSize_;
+    size_t                      blockCount_;
+    char *                      pool_ = nullptr;    ///< blockCount_ buffers of blockSize_ bytes
+    std::vector <Read>          reads_;             ///< The read of each buffer
+    std::vector <uint32_t>      free_;              ///< Buffers not in use
+    std::vector <OpenFile>      files_;
+    std::vector <std::function <void()> > wakes_;   ///< Callbacks due, collected under mtx_
+    size_t                      cursor_ = 0;        ///< Rotates the scheduling among equal files
+    size_t                      inFlight_ = 0;      ///< Reads issued and not completed, over all files
+    bool                        stop_ = false;
+
+    mutable std::mutex          mtx_;
+    std::condition_variable     changed_;           ///< Signalled on every completion, release and state change
+    std::vector <std::thread>   threads_;           ///< The ring's thread, or the pread threads
+
+    // io_uring state, mapped in _setupRing()
+    int                         ringFd_ = -1;
+    bool                        fixedBuffers_ = false;  ///< The pool is registered with the ring
+    void *                      sqRing_ = nullptr;
+    void *                      cqRing_ = nullptr;
+    void *                      sqes_ = nullptr;
+    size_t                      sqRingSize_ = 0;
+    size_t                      cqRingSize_ = 0;
+    size_t                      sqesSize_ = 0;
+    unsigned *                  sqHead_ = nullptr;
+    unsigned *                  sqTail_ = nullptr;
+    unsigned *                  sqMask_ = nullptr;
+    unsigned *                  sqArray_ = nullptr;
+    unsigned *                  cqHead_ = nullptr;
+    unsigned *                  cqTail_ = nullptr;
+    unsigned *                  cqMask_ = nullptr;
+    void *                      cqes_ = nullptr;
+};
+
+/**
+ * @brief Lines of one file, read through a BlockReader.
+ *
+ * Splits like std::getline: the newline is dropped and a last line
+ * without one is still returned.  A line is a view into the block that
+ * holds it; only lines straddling two blocks are copied.  With quoted
+ * set, newlines inside quotes (RFC 4180) do not end a line.
+ */
+class BlockLineReader {
+public:
+    BlockLineReader(BlockReader & reader, size_t file, bool quoted = false) : reader_(reader), file_(file), quoted_(quoted) {}
+
+    /**
+     * Releases the current block and closes the file.
+     */
+    ~BlockLineReader() {
+        if (block_.data != nullptr) {
+            reader_.release(block_);
+        }
+        reader_.close(file_);
+    }
+
+    BlockLineReader(const BlockLineReader &) = delete;
+    BlockLineReader & operator=(const BlockLineReader &) = delete;
+
+    /**
+     * @param[out] line The next line, valid until the next call.
+     * @return false at the end of the file or on a read error (see failed()).
+     */
+    bool next(std::string_view & line) {
+        carry_.clear();
+        while (true) {
+            if (position_ < block_.size) {
+                const char * begin = block_.data + position_;
+                const char * newline = _lineEnd(begin, block_.size - position_);
+                if (newline != nullptr) {
+                    position_ = static_cast<size_t>(newline - block_.data) + 1;
+                    if (carry_.empty()) {
+                        line = std::string_view(begin, static_cast<size_t>(newline - begin));
+                    } else {
+                        carry_.append(begin, newline);
+                        line = carry_;
+                    }
+                    return true;
+                }
+                carry_.append(begin, block_.data + block_.size);
+            }
+            if (block_.data != nullptr) {
+                reader_.release(block_);
+                block_ = FileBlock();
+            }
+            position_ = 0;
+            if (!reader_.next(file_, block_)) {
+                block_ = FileBlock();
+                line = carry_;
+                return !carry_.empty();
+            }
+            plain_ = !quoted_ || (!quotes_.inside() && memchr(block_.data, '"', block_.size) == nullptr);
+        }
+    }
+
+    /**
+     *
+     * @return Whether a read of the file failed.
+     */
+    [[nodiscard]] bool failed() const { return reader_.failed(file_); }
+
+private:
+    /**
+     * The end of the line starting at begin, or null if it does not end in the block.
+     */
+    const char * _lineEnd(const char * begin, size_t size) {
+        if (plain_) {
+            return static_cast<const char *>(memchr(begin, '\n', size));
+        }
+        const size_t end = csvRowEnd(std::string_view(begin, size), quotes_);
+        return end == std::string_view::npos ? nullptr : begin + end;
+    }
+
+    BlockReader &   reader_;
+    size_t          file_;
+    bool            quoted_;            ///< Whether fields may be quoted
+    bool            plain_ = true;      ///< Whether block_ can be split without looking at quotes
+    CsvQuotes       quotes_;            ///< Quote state at position_
+    FileBlock       block_;             ///< Block being split, data null before the first
+    size_t          position_ = 0;      ///< Start of the next line in block_
+    std::string     carry_;             ///< A line straddling blocks
+};
+
+/**
+ * @brief Awaitable for the next block of a file.
+ *
+ * Suspends only if the block is not there yet, and is then resumed on the
+ * scheduler's pool when it is.  Call BlockReader::next() after it; that no
+ * longer waits.
+ */
+struct NextBlock {
+    BlockReader &   reader;
+    size_t          file;
+    PoolScheduler   scheduler;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle <> handle) {
+        // Nothing of this awaiter is used once the callback is registered:
+        // the coroutine may already run elsewhere.
+        const PoolScheduler resume = scheduler;
+        return !reader.whenReady(file, [resume, handle]() { resume.resume(handle); });
+    }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * The rows of one block of a file.
+ */
+struct RowBatch {
+    std::vector <std::string_view> rows;  ///< Split like std::getline, views into the block
+};
+
+/**
+ * @brief The rows of a file, a block at a time.
+ *
+ * The asynchronous counterpart of BlockLineReader: waiting for a block
+ * suspends the consumer instead of blocking its thread.  Rows are views
+ * into the block, valid until the next batch is asked for; only a row
+ * straddling two blocks is copied.  The file is closed when the generator
+ * finishes or is destroyed.
+ *
+ * @param reader Reader the file was opened with.
+ * @param file Index of the file in the reader.
+ * @param scheduler Where to resume once a block has arrived.
+ * @param quoted Whether newlines inside quotes (RFC 4180) are part of the row; blocks
+ *               without quotes are still split with memchr().
+ */
+inline AsyncGenerator <RowBatch> rowBatches(BlockReader & reader, size_t file, PoolScheduler scheduler, bool quoted = false) {
+    // Hands the current block back and closes the file, also when the
+    // consumer stops early and destroys the generator.
+    struct Holder {
+        BlockReader &   reader;
+        size_t          file;
+        FileBlock       block;
+
+        ~Holder() {
+            if (block.data != nullptr) {
+                reader.release(block);
+            }
+            reader.close(file);
+        }
+    } holder{reader, file, FileBlock()};
+
+    RowBatch batch;
+    std::string carry, straddling;
+    CsvQuotes quotes;
+    while (true) {
+        co_await NextBlock{reader, file, scheduler};
+        if (!reader.next(file, holder.block)) {
+            holder.block = FileBlock();
+            break;
+        }
+        const char * begin = holder.block.data;
+        const char * const end = begin + holder.block.size;
+        const bool plain = !quoted || (!quotes.inside() && memchr(begin, '"', holder.block.size) == nullptr);
+        batch.rows.clear();
+        while (begin < end) {
+            const char * newline;
+            if (plain) {
+                newline = static_cast<const char *>(memchr(begin, '\n', static_cast<size_t>(end - begin)));
+            } else {
+                const size_t at = csvRowEnd(std::string_view(begin, static_cast<size_t>(end - begin)), quotes);
+                newline = at == std::string_view::npos ? nullptr : begin + at;
+            }
+            if (newline == nullptr) {
+                break;
+            }
+            if (!carry.empty()) {
+                straddling = std::move(carry);
+                carry.clear();
+                straddling.append(begin, newline);
+                batch.rows.emplace_back(straddling);
+            } else {
+                batch.rows.emplace_back(begin, static_cast<size_t>(newline - begin));
+            }
+            begin = newline + 1;
+        }
+        if (!batch.rows.empty()) {
+            co_yield batch;
+        }
+        carry.append(begin, end);
+        reader.release(holder.block);
+        holder.block = FileBlock();
+    }
+    if (!carry.empty()) {
+        // Last row without a newline
+        batch.rows.assign(1, carry);
+        co_yield batch;
+    }
+}
+
+#endif //BIOMAPPER_BLOCKREADER_H
@@ -0,0 +1,195 @@
+#include "Checkpoint.h"
+
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const char MAGIC[] = "biomapper-checkpoint";
+
+/**
+ * Split off the text up to the next tab; the rest is left in line.
+ */
+std::string_view field(std::string_view & line) {
+    const size_t tab = line.find('\t');
+    const std::string_view value = line.substr(0, tab);
+    line = tab == std::string_view::npos ? std::string_view() : line.substr(tab + 1);
+    return value;
+}
+
+/**
+ * A name with its backslashes, tabs and line breaks escaped, so a quoted
+ * join value cannot split its record.
+ */
+std::string escape(std::string_view name) {
+    std::string escaped;
+    escaped.reserve(name.size());
+    for (char c : name) {
+        switch (c) {
+            case '\\': escaped += "\\\\"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/**
+ * Undo escape(); false on an escape it does not write.
+ */
+bool unescape(std::string_view escaped, std::string & name) {
+    name.clear();
+    for (size_t i = 0; i < escaped.size(); i++) {
+        if (escaped[i] != '\\') {
+            name += escaped[i];
+            continue;
+        }
+        if (++i == escaped.size()) {
+            return false;
+        }
+        switch (escaped[i]) {
+            case '\\': name += '\\'; break;
+            case 't': name += '\t'; break;
+            case 'n': name += '\n'; break;
+            case 'r': name += '\r'; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+bool number(std::string_view text, T & value) {
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+} // namespace
+
+/******************************************************************
+ * Load
+ *      Everything is read before any of it is kept, so a file that
+ *      turns out to be of another run (or cut short, with no end
+ *      line) leaves the checkpoint as it was.
+ ******************************************************************/
+bool Checkpoint::load(size_t file_count) {
+    std::ifstream in(path_);
+    std::string line;
+    if (!std::getline(in, line) || line != std::string(MAGIC) + " " + std::to_string(FORMAT_VERSION)) {
+        return false;
+    }
+    if (!std::getline(in, line) || line != "run\t" + run_) {
+        return false;
+    }
+
+    std::vector <References> references(file_count);
+    std::set <std::string, std::less <> > done;
+    uint64_t outputBytes = 0;
+    bool ended = false;
+    std::string name;
+    while (!ended && std::getline(in, line)) {
+        std::string_view rest = line;
+        const std::string_view kind = field(rest);
+        if (kind == "output") {
+            if (!number(rest, outputBytes)) {
+                return false;
+            }
+        } else if (kind == "reference") {
+            size_t file;
+            uint64_t rows;
+            if (!number(field(rest), file) || file >= file_count || !number(field(rest), rows) || !unescape(rest, name)) {
+                return false;
+            }
+            references[file][name] = rows;
+        } else if (kind == "done") {
+            if (!unescape(rest, name)) {
+                return false;
+            }
+            done.insert(name);
+        } else if (kind == "end") {
+            ended = true;
+        } else {
+            return false;
+        }
+    }
+    if (!ended) {
+        return false;
+    }
+
+    references_ = std::move(references);
+    done_ = std::move(done);
+    outputBytes_ = outputBytes;
+    return true;
+}
+
+/******************************************************************
+ * Commit
+ *      Written to a temporary file, synced and renamed over the
+ *      last checkpoint, so a crash leaves one or the other.
+ ******************************************************************/
+bool Checkpoint::commit(uint64_t output_bytes) {
+    const std::string temporary = path_ + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream out(temporary, std::ofstream::out | std::ofstream::trunc);
+        out << MAGIC << " " << FORMAT_VERSION << "\n"
+            << "run\t" << run_ << "\n"
+            << "output\t" << output_bytes << "\n";
+        for (size_t f = 0; f < references_.size(); f++) {
+            for (const auto & [name, rows] : references_[f]) {
+                out << "reference\t" << f << "\t" << rows << "\t" << escape(name) << "\n";
+            }
+        }
+        for (const std::string & name : done_) {
+            out << "done\t" << escape(name) << "\n";
+        }
+        out << "end\n";
+        out.close();
+        if (out.fail()) {
+            std::error_code ec;
+            std::filesystem::remove(temporary, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    if (!syncFile(temporary)) {
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    std::filesystem::rename(temporary, path_, ec);
+    if (ec) {
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    outputBytes_ = output_bytes;
+    return true;
+}
+
+bool Checkpoint::describeFile(const std::string & file_path, std::string & run) {
+    std::error_code ec;
+    const uint64_t size = std::filesystem::file_size(file_path, ec);
+    if (ec) {
+        return false;
+    }
+    const auto written = std::filesystem::last_write_time(file_path, ec);
+    if (ec) {
+        return false;
+    }
+    run += file_path + ":" + std::to_string(size) + ":" + std::to_string(written.time_since_epoch().count());
+    return true;
+}
+
+bool Checkpoint::syncFile(const std::string & path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
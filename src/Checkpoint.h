@@ -0,0 +1,135 @@
+/*! \file Checkpoint.h
+    \author John Torcivia, Ph.D.
+
+    \brief Completion checkpoints of a mapping run, for resuming it.
+
+    A run's output is written reference by reference, so a prefix of the
+    output file is the complete output of the references written so far.
+    The checkpoint records that prefix: the references done and the length
+    of the output after them, together with the references found in each
+    file, so a resumed run skips the reference scan too.  It is tied to
+    its run by a description of the files (path, size, modification time,
+    column settings) and the settings that shape the output; a checkpoint
+    of another run is ignored.
+
+    The checkpoint is a small text file of tab separated records, with the
+    reference names escaped, as a quoted join value may hold a tab or a
+    line break.  It is rewritten whole, under a temporary name synced and
+    renamed into place, after the output it describes has been synced, so
+    it never claims more than the output file holds.  A run killed at any
+    point resumes from its last checkpoint: the output is cut back to the
+    recorded length and only the other references are mapped.
+*/
+
+#ifndef BIOMAPPER_CHECKPOINT_H
+#define BIOMAPPER_CHECKPOINT_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ *
+ */
+class Checkpoint {
+public:
+    static constexpr uint32_t FORMAT_VERSION = 2;   ///< Bumped on every format change
+
+    typedef std::map <std::string, uint64_t, std::less <> > References;    ///< Rows of each reference
+
+    Checkpoint() = default;
+
+    /**
+     *
+     * @param path The checkpoint file.
+     * @param run Describes the run, on one line; see the file comment.
+     */
+    Checkpoint(std::string path, std::string run) : path_(std::move(path)), run_(std::move(run)) {}
+
+    /**
+     * @brief Read the checkpoint file, if it is of this run.
+     *
+     * @param file_count Files of the run; a checkpoint with others is not of it.
+     * @retval true The checkpoint was read.
+     * @retval false There is none, it is of another run or unreadable; nothing is done.
+     */
+    bool load(size_t file_count);
+
+    /**
+     * @brief Write the checkpoint file.
+     *
+     * The output it describes must already be synced; see syncFile().
+     *
+     * @param output_bytes Length of the output once the done references are written.
+     * @return false if the file could not be written or moved into place.
+     */
+    bool commit(uint64_t output_bytes);
+
+    /**
+     * Set the references found in each file, in the order the files were added.
+     */
+    void setReferences(std::vector <References> references) { references_ = std::move(references); }
+
+    /**
+     * Record a reference as written in full; it is in the file from the next commit().
+     */
+    void complete(const std::string & reference) { done_.insert(reference); }
+
+    /**
+     *
+     * @return The references found in each file; empty before load() or setReferences().
+     */
+    [[nodiscard]] const std::vector <References> & references() const { return references_; }
+
+    /**
+     *
+     * @return Whether a reference is done.
+     */
+    [[nodiscard]] bool done(std::string_view reference) const { return done_.find(reference) != done_.end(); }
+
+    /**
+     *
+     * @return References done.
+     */
+    [[nodiscard]] size_t doneCount() const { return done_.size(); }
+
+    /**
+     *
+     * @return Length of the output after the done references.
+     */
+    [[nodiscard]] uint64_t outputBytes() const { return outputBytes_; }
+
+    /**
+     *
+     * @return The checkpoint file.
+     */
+    [[nodiscard]] const std::string & path() const { return path_; }
+
+    /**
+     * @brief Describe one input file for the run line.
+     *
+     * @param file_path The file.
+     * @param[out] run Appended to.
+     * @return false if the file cannot be found.
+     */
+    static bool describeFile(const std::string & file_path, std::string & run);
+
+    /**
+     * @brief Flush a file's written data to the device.
+     *
+     * @return false if the file could not be opened or synced.
+     */
+    static bool syncFile(const std::string & path);
+
+private:
+    std::string                             path_;
+    std::string                             run_;
+    std::vector <References>                references_;        ///< Of each file
+    std::set <std::string, std::less <> >   done_;              ///< References written in full
+    uint64_t                                outputBytes_ = 0;   ///< Length of the output after them
+};
+
+#endif //BIOMAPPER_CHECKPOINT_H
@@ -0,0 +1,244 @@
+/*! \file Coroutines.h
+    \author John Torcivia, Ph.D.
+
+    \brief The coroutine types of the ingest pipeline.
+
+    C++20 has the coroutine machinery but no library types, so these are the
+    three the pipeline needs:
+
+        Task<T>             A lazily started coroutine returning T, run by
+                            co_await-ing it from another coroutine.
+        AsyncGenerator<T>   A coroutine producing a sequence of T, each one
+                            fetched with co_await next().  It can suspend in
+                            between (waiting on I/O) without blocking the
+                            consumer's thread.
+        DetachedTask        The root of a chain, started on a thread_pool
+                            worker; counts a latch down once it has finished.
+
+    Control passes between awaiting and awaited coroutines by symmetric
+    transfer, so a chain of them runs on one thread until something suspends
+    it, and resumes on whichever worker the awaitable that suspended it
+    schedules it on.  Errors are reported through return values as in the
+    rest of the mapper; an exception escaping a coroutine terminates.
+*/
+
+#ifndef BIOMAPPER_COROUTINES_H
+#define BIOMAPPER_COROUTINES_H
+
+#include <coroutine>
+#include <exception>
+#include <latch>
+#include <optional>
+#include <utility>
+
+#include "JobPool.h"
+
+/**
+ * Final awaiter of awaited coroutines: resume whoever awaited them.
+ */
+struct ResumeContinuation {
+    std::coroutine_handle <> continuation;
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle <> await_suspend(std::coroutine_handle <>) const noexcept {
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * @brief A coroutine returning T, started when awaited.
+ */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+    struct promise_type {
+        std::optional <T>           value;
+        std::coroutine_handle <>    continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle <promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        ResumeContinuation final_suspend() noexcept { return {continuation}; }
+        template <typename V>
+        void return_value(V && v) { value.emplace(std::forward<V>(v)); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle <promise_type> handle) : handle_(handle) {}
+    Task(Task && other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task & operator=(const Task &) = delete;
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle <> await_suspend(std::coroutine_handle <> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return std::move(*handle_.promise().value); }
+
+private:
+    std::coroutine_handle <promise_type> handle_;
+};
+
+/**
+ * @brief A sequence of T produced by a coroutine.
+ *
+ * A value is yielded by reference and stays valid until the next call of
+ * next(), so the generator can hand out views of buffers it owns.
+ */
+template <typename T>
+class [[nodiscard]] AsyncGenerator {
+public:
+    struct promise_type {
+        T *                         current = nullptr;
+        std::coroutine_handle <>    consumer;
+
+        AsyncGenerator get_return_object() {
+            return AsyncGenerator(std::coroutine_handle <promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        ResumeContinuation final_suspend() noexcept {
+            current = nullptr;
+            return {consumer};
+        }
+        ResumeContinuation yield_value(T & value) noexcept {
+            current = &value;
+            return {consumer};
+        }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    /**
+     * Awaitable of next(): runs the generator to its next value.
+     */
+    struct NextAwaiter {
+        std::coroutine_handle <promise_type> handle;
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle <> await_suspend(std::coroutine_handle <> consumer) noexcept {
+            handle.promise().consumer = consumer;
+            return handle;
+        }
+        bool await_resume() const noexcept { return !handle.done(); }
+    };
+
+    explicit AsyncGenerator(std::coroutine_handle <promise_type> handle) : handle_(handle) {}
+    AsyncGenerator(AsyncGenerator && other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    AsyncGenerator(const AsyncGenerator &) = delete;
+    AsyncGenerator & operator=(const AsyncGenerator &) = delete;
+
+    /**
+     * Destroying a generator that has not finished destroys its frame
+     * where it is suspended, which runs its locals' destructors.
+     */
+    ~AsyncGenerator() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /**
+     *
+     * @return co_await it for whether there is a next value; false at the end.
+     */
+    NextAwaiter next() { return NextAwaiter{handle_}; }
+
+    /**
+     *
+     * @return The value of the last successful next().
+     */
+    T & value() const { return *handle_.promise().current; }
+
+private:
+    std::coroutine_handle <promise_type> handle_;
+};
+
+/**
+ * @brief A coroutine started on a thread_pool and not awaited by anyone.
+ *
+ * Its frame frees itself at the end, after which the latch is counted down;
+ * waiting on the latch therefore waits for every local to be destroyed.
+ */
+class DetachedTask {
+public:
+    struct promise_type {
+        std::latch * done = nullptr;
+
+        DetachedTask get_return_object() { return DetachedTask(std::coroutine_handle <promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct Finish {
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle <promise_type> handle) const noexcept {
+                    std::latch * done = handle.promise().done;
+                    handle.destroy();
+                    if (done != nullptr) {
+                        done->count_down();
+                    }
+                }
+                void await_resume() const noexcept {}
+            };
+            return Finish();
+        }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit DetachedTask(std::coroutine_handle <promise_type> handle) : handle_(handle) {}
+    DetachedTask(DetachedTask && other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    DetachedTask(const DetachedTask &) = delete;
+    DetachedTask & operator=(const DetachedTask &) = delete;
+    ~DetachedTask() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /**
+     * @brief Run the coroutine on a worker of the pool; it owns itself from then on.
+     *
+     * @param node NUMA node whose workers should run it, -1 for any.
+     * @param done Counted down once the coroutine has finished.
+     */
+    void start(JobPool & pool, int node, std::latch & done) {
+        std::coroutine_handle <promise_type> handle = std::exchange(handle_, nullptr);
+        handle.promise().done = &done;
+        pool.push_task_on_node(node, [handle]() { handle.resume(); });
+    }
+
+private:
+    std::coroutine_handle <promise_type> handle_;
+};
+
+/**
+ * @brief Resumes coroutines on the workers of a pool, preferring a node.
+ */
+struct PoolScheduler {
+    JobPool *       pool = nullptr;
+    int             node = -1;
+
+    void resume(std::coroutine_handle <> handle) const {
+        pool->push_task_on_node(node, [handle]() { handle.resume(); });
+    }
+};
+
+/**
+ * @brief Awaited to let the worker run its other tasks first.
+ *
+ * The coroutine is queued again on the scheduler and resumed in turn.
+ */
+struct Reschedule {
+    PoolScheduler   scheduler;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle <> handle) const { scheduler.resume(handle); }
+    void await_resume() const noexcept {}
+};
+
+#endif //BIOMAPPER_COROUTINES_H
@@ -0,0 +1,143 @@
+/*! \file Coverage.h
+    \author John Torcivia, Ph.D.
+
+    \brief Overlap counts and coverage depth of one reference, without the join.
+
+    Aggregation needs, for every range, how many ranges of the other files
+    overlap it, and for the reference how many bases are covered at each
+    depth.  Both follow from the sorted endpoints.  With the starts and the
+    ends of a file each sorted, the ranges overlapping [s, e) are those
+    starting before e less those ending at or before s: a sweep over s
+    (the ranges come sorted by start) and one binary search on e, whatever
+    the number of overlaps.  Walking the merged starts and ends in order
+    gives the depth between consecutive endpoints.  The work is
+    O(n log n) in the ranges and the result O(n), however many pairs a join
+    of the same ranges would produce.
+*/
+
+#ifndef BIOMAPPER_COVERAGE_H
+#define BIOMAPPER_COVERAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "Annotation.h"
+
+/**
+ * Coverage of one reference over all files.
+ */
+struct ReferenceCoverage {
+    std::vector <uint64_t>  ranges;         ///< Ranges of each file
+    std::vector <uint64_t>  fileCovered;    ///< Bases covered by each file's ranges
+    uint64_t                covered = 0;    ///< Bases covered by any range
+    std::vector <uint64_t>  depth;          ///< Bases covered by exactly d ranges at index d; index 0 is unused
+};
+
+/**
+ *
+ */
+class CoverageSweep {
+public:
+    /**
+     * Sort the ends of every file and merge the endpoints of all of them.
+     *
+     * @param files The sorted ranges of each file; they must outlive the sweep.
+     */
+    explicit CoverageSweep(const std::vector <const SortedRanges *> & files) : files_(files), ends_(files.size()) {
+        for (size_t f = 0; f < files.size(); f++) {
+            ends_[f].assign(files[f]->ends.begin(), files[f]->ends.end());
+            std::sort(ends_[f].begin(), ends_[f].end());
+            allStarts_.insert(allStarts_.end(), files[f]->starts.begin(), files[f]->starts.end());
+            allEnds_.insert(allEnds_.end(), ends_[f].begin(), ends_[f].end());
+        }
+        std::sort(allStarts_.begin(), allStarts_.end());
+        std::sort(allEnds_.begin(), allEnds_.end());
+    }
+
+    /**
+     * @brief Count, for each range of one file, the ranges of the other files overlapping it.
+     *
+     * @param f The file.
+     * @param[out] counts The count of each range, by sorted position.
+     */
+    void overlaps(size_t f, std::vector <uint64_t> & counts) const {
+        const SortedRanges & ranges = *files_[f];
+        const std::vector <long long int> & ends = ends_[f];
+        counts.resize(ranges.starts.size());
+
+        // Ranges are never empty (the reader makes them a position at least),
+        // so those ending at or before start all start before end.  Ends at
+        // or before the (ascending) starts, over all files and this one:
+        size_t allEnded = 0, ended = 0;
+        for (size_t i = 0; i < ranges.starts.size(); i++) {
+            const long long int start = ranges.starts[i], end = ranges.ends[i];
+            while (allEnded < allEnds_.size() && allEnds_[allEnded] <= start) {
+                allEnded++;
+            }
+            while (ended < ends.size() && ends[ended] <= start) {
+                ended++;
+            }
+            const auto allStarted = static_cast<int64_t>(
+                std::lower_bound(allStarts_.begin(), allStarts_.end(), end) - allStarts_.begin());
+            const auto started = static_cast<int64_t>(
+                std::lower_bound(ranges.starts.begin(), ranges.starts.end(), end) - ranges.starts.begin());
+            counts[i] = static_cast<uint64_t>((allStarted - static_cast<int64_t>(allEnded)) - (started - static_cast<int64_t>(ended)));
+        }
+    }
+
+    /**
+     *
+     * @return The ranges, covered bases and depth histogram of the reference.
+     */
+    [[nodiscard]] ReferenceCoverage summary() const {
+        ReferenceCoverage coverage;
+        coverage.depth.assign(1, 0);
+        for (size_t f = 0; f < files_.size(); f++) {
+            coverage.ranges.push_back(files_[f]->starts.size());
+            uint64_t covered = 0;
+            sweepDepth(files_[f]->starts, ends_[f], [&](uint64_t, uint64_t bases) { covered += bases; });
+            coverage.fileCovered.push_back(covered);
+        }
+        sweepDepth(allStarts_, allEnds_, [&](uint64_t depth, uint64_t bases) {
+            if (coverage.depth.size() <= depth) {
+                coverage.depth.resize(depth + 1, 0);
+            }
+            coverage.depth[depth] += bases;
+            coverage.covered += bases;
+        });
+        return coverage;
+    }
+
+private:
+    /**
+     * Call bases(depth, count) for every stretch between endpoints covered by at least one range.
+     */
+    template <typename F>
+    static void sweepDepth(std::span <const long long int> starts, std::span <const long long int> ends, F bases) {
+        size_t i = 0, j = 0;
+        int64_t depth = 0;
+        long long int at = 0;
+        while (i < starts.size() || j < ends.size()) {
+            const long long int next = (j >= ends.size() || (i < starts.size() && starts[i] < ends[j])) ? starts[i] : ends[j];
+            if (depth > 0 && next > at) {
+                bases(static_cast<uint64_t>(depth), static_cast<uint64_t>(next - at));
+            }
+            at = next;
+            for (; i < starts.size() && starts[i] == next; i++) {
+                depth++;
+            }
+            for (; j < ends.size() && ends[j] == next; j++) {
+                depth--;
+            }
+        }
+    }
+
+    std::vector <const SortedRanges *>          files_;     ///< Ranges of each file, sorted by start
+    std::vector <std::vector <long long int> >  ends_;      ///< Ends of each file, ascending
+    std::vector <long long int>                 allStarts_; ///< Starts of all files, ascending
+    std::vector <long long int>                 allEnds_;   ///< Ends of all files, ascending
+};
+
+#endif //BIOMAPPER_COVERAGE_H
@@ -0,0 +1,232 @@
+/*! \file CsvScanner.h
+    \author John Torcivia, Ph.D.
+
+    \brief Quote-aware (RFC 4180) row and column splitting, 64 bytes at a time.
+
+    A field in double quotes may hold the delimiter, line breaks and
+    doubled ("escaped") quotes.  Whether a byte is inside quotes is the
+    parity of the quotes before it, so for a chunk of 64 bytes the mask of
+    quoted bytes is the prefix XOR of the mask of quote characters: one
+    carry-less multiply by all ones (PCLMUL) or, without it, six shifts.
+    The last bit of that mask carries the state into the next chunk.  An
+    escaped quote toggles the parity twice, leaving an empty run between
+    the two, so escapes need no special case to find the delimiters and
+    line breaks outside quotes; only unquote() looks at them.
+
+    The byte masks come from SSE2 (or AVX2 with BIOMAPPER_AVX2) compares,
+    with a scalar loop elsewhere.  Blocks and rows with no quote at all
+    take the same memchr() and find() paths as unquoted files.
+*/
+
+#ifndef BIOMAPPER_CSVSCANNER_H
+#define BIOMAPPER_CSVSCANNER_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__PCLMUL__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static constexpr size_t CSV_CHUNK = 64;     ///< Bytes scanned per step
+
+/**
+ * @brief Bit i set if byte i of the 64 byte chunk equals c.
+ */
+inline uint64_t csvByteMask(const char * chunk, char c) {
+#if defined(__AVX2__)
+    const __m256i match = _mm256_set1_epi8(c);
+    const auto low = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(chunk)), match)));
+    const auto high = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(chunk + 32)), match)));
+    return static_cast<uint64_t>(high) << 32 | low;
+#elif defined(__SSE2__)
+    const __m128i match = _mm_set1_epi8(c);
+    uint64_t mask = 0;
+    for (size_t i = 0; i < CSV_CHUNK; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chunk + i));
+        mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, match)))) << i;
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (size_t i = 0; i < CSV_CHUNK; i++) {
+        mask |= static_cast<uint64_t>(chunk[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * @brief Bit i set if an odd number of bits 0 to i are set.
+ */
+inline uint64_t csvPrefixXor(uint64_t bits) {
+#if defined(__PCLMUL__)
+    const __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<long long>(bits)), _mm_set1_epi8(-1), 0);
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(product));
+#else
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+#endif
+}
+
+/**
+ * @brief Masks of the quoted bytes, chunk after chunk of one text.
+ *
+ * An opening quote counts as quoted, a closing one does not.
+ */
+class CsvQuotes {
+public:
+    /**
+     * @param quotes The quote characters of the next chunk, from csvByteMask().
+     * @return Bit i set if byte i of the chunk is inside quotes.
+     */
+    uint64_t next(uint64_t quotes) {
+        const uint64_t quoted = csvPrefixXor(quotes) ^ inside_;
+        inside_ = static_cast<uint64_t>(static_cast<int64_t>(quoted) >> 63);
+        return quoted;
+    }
+
+    /**
+     *
+     * @return Whether the text so far ends inside quotes.
+     */
+    [[nodiscard]] bool inside() const { return inside_ != 0; }
+
+    void reset() { inside_ = 0; }
+
+private:
+    uint64_t    inside_ = 0;    ///< All ones while inside quotes
+};
+
+/**
+ * @brief Call fn(offset, mask) for each 64 byte chunk of text, mask having bit i for each byte c outside quotes.
+ *
+ * The last chunk is scanned from a zero padded copy; its mask only covers the text.
+ * fn returns false to stop; quotes then holds the state at the end of that chunk.
+ */
+template <typename Fn>
+inline void csvScan(std::string_view text, char c, CsvQuotes & quotes, Fn fn) {
+    size_t offset = 0;
+    for (; offset + CSV_CHUNK <= text.size(); offset += CSV_CHUNK) {
+        const char * chunk = text.data() + offset;
+        if (!fn(offset, csvByteMask(chunk, c) & ~quotes.next(csvByteMask(chunk, '"')))) {
+            return;
+        }
+    }
+    if (offset < text.size()) {
+        char padded[CSV_CHUNK] = {};
+        std::memcpy(padded, text.data() + offset, text.size() - offset);
+        const uint64_t valid = (uint64_t{1} << (text.size() - offset)) - 1;
+        fn(offset, csvByteMask(padded, c) & ~quotes.next(csvByteMask(padded, '"')) & valid);
+    }
+}
+
+/**
+ * @brief Offset of the first line break outside quotes, or npos.
+ *
+ * @param text The text, starting where quotes left off.
+ * @param[in,out] quotes The state at the start of text; on a find, outside quotes
+ *                       (right after the break), otherwise at the end of text.
+ */
+inline size_t csvRowEnd(std::string_view text, CsvQuotes & quotes) {
+    size_t end = std::string_view::npos;
+    csvScan(text, '\n', quotes, [&](size_t offset, uint64_t breaks) {
+        if (breaks == 0) {
+            return true;
+        }
+        end = offset + static_cast<size_t>(std::countr_zero(breaks));
+        return false;
+    });
+    if (end != std::string_view::npos) {
+        quotes.reset();
+    }
+    return end;
+}
+
+/**
+ * @brief A field without its quotes.
+ *
+ * A field that starts and ends with a quote loses them, and its doubled
+ * quotes become single ones; any other field is kept as it is.
+ *
+ * @param field The field as written.
+ * @param[out] unescaped Appended to when a field holds escaped quotes; it must not reallocate.
+ * @return A view of the field's value.
+ */
+inline std::string_view unquote(std::string_view field, std::string & unescaped) {
+    if (field.size() < 2 || field.front() != '"' || field.back() != '"') {
+        return field;
+    }
+    field = field.substr(1, field.size() - 2);
+    if (field.find('"') == std::string_view::npos) {
+        return field;
+    }
+    const size_t begin = unescaped.size();
+    for (size_t i = 0; i < field.size(); i++) {
+        unescaped += field[i];
+        if (field[i] == '"' && i + 1 < field.size() && field[i + 1] == '"') {
+            i++;
+        }
+    }
+    return std::string_view(unescaped).substr(begin);
+}
+
+/**
+ * @brief Views of every column of a row with quoted fields.
+ *
+ * Split like BioMapper::_splitRow (a trailing delimiter does not start an
+ * empty last column), but not at delimiters inside quotes, and unquoted.
+ *
+ * @param row The row, line breaks inside quotes included.
+ * @param delimiter The column delimiter.
+ * @param[out] fields The columns; views into row or unescaped.
+ * @param[out] unescaped Holds the columns that had escaped quotes; valid as long as fields.
+ */
+inline void splitQuotedRow(std::string_view row, char delimiter, std::vector <std::string_view> & fields,
+                           std::string & unescaped) {
+    fields.clear();
+    size_t begin = 0;
+    if (std::memchr(row.data(), '"', row.size()) == nullptr) {
+        while (begin < row.size()) {
+            const size_t next = row.find(delimiter, begin);
+            if (next == std::string_view::npos) {
+                fields.push_back(row.substr(begin));
+                break;
+            }
+            fields.push_back(row.substr(begin, next - begin));
+            begin = next + 1;
+        }
+        return;
+    }
+
+    unescaped.clear();
+    unescaped.reserve(row.size());
+    CsvQuotes quotes;
+    csvScan(row, delimiter, quotes, [&](size_t offset, uint64_t delimiters) {
+        for (; delimiters != 0; delimiters &= delimiters - 1) {
+            const size_t end = offset + static_cast<size_t>(std::countr_zero(delimiters));
+            fields.push_back(unquote(row.substr(begin, end - begin), unescaped));
+            begin = end + 1;
+        }
+        return true;
+    });
+    if (begin < row.size()) {
+        fields.push_back(unquote(row.substr(begin), unescaped));
+    }
+}
+
+#endif //BIOMAPPER_CSVSCANNER_H
@@ -0,0 +1,284 @@
+#include "ExecutionPlanner.h"
+
+#include "Annotation.h"
+#include "BioMapper.h"
+#include "CsvScanner.h"
+#include "SharedIndex.h"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * Rows seen by the sample of one file.
+ */
+struct Sample {
+    uint64_t                                    rows = 0;
+    uint64_t                                    bytes = 0;      ///< Of the rows, line breaks included
+    uint64_t                                    columns = 0;    ///< Over all rows
+    uint64_t                                    pairs = 0;      ///< Neighbouring rows on the same reference
+    uint64_t                                    ordered = 0;    ///< Of those, the ones in start order
+    size_t                                      blocks = 0;     ///< Blocks taken
+    std::unordered_map <std::string, size_t>    references;     ///< Blocks each join value was seen in
+    std::unordered_set <std::string>            seen;           ///< Join values of the current block
+    BioMapper::RowColumns                       quoted;         ///< Columns of a quoted row
+
+    /**
+     * Take the whole rows of one block; a partial first row (unless the
+     * block starts the file) and a partial last one (unless it ends it) are skipped.
+     */
+    void add(const MapperFile & file, std::string_view block, bool file_start, bool file_end) {
+        blocks++;
+        seen.clear();
+        size_t at = 0;
+        if (!file_start || file.has_header()) {
+            at = block.find('\n');
+            if (at == std::string_view::npos) {
+                return;
+            }
+            at++;
+        }
+        std::string previous;
+        long long int previousStart = 0;
+        // A block sampled mid-file is taken to start outside quotes.
+        CsvQuotes quotes;
+        while (at < block.size()) {
+            size_t end = file.quoted() ? csvRowEnd(block.substr(at), quotes) : block.find('\n', at);
+            if (file.quoted() && end != std::string_view::npos) {
+                end += at;
+            }
+            if (end == std::string_view::npos) {
+                if (!file_end) {
+                    return;
+                }
+                end = block.size();
+            }
+            std::string_view row = block.substr(at, end - at);
+            at = end + 1;
+            if (!row.empty() && row.back() == '\r') {
+                row.remove_suffix(1);
+            }
+            if (row.empty()) {
+                continue;
+            }
+
+            rows++;
+            bytes += row.size() + 1;
+            columns += std::count(row.begin(), row.end(), file.delimiter()) + 1;
+            std::string_view reference, startText;
+            if (file.quoted()) {
+                splitQuotedRow(row, file.delimiter(), quoted.fields, quoted.unescaped);
+                reference = quoted.column(file.join_index());
+                startText = quoted.column(file.start_range_index());
+            } else {
+                reference = BioMapper::_column(row, file.join_index(), file.delimiter());
+                startText = BioMapper::_column(row, static_cast<int>(file.start_range_index()), file.delimiter());
+            }
+            long long int start = 0;
+            std::from_chars(startText.data(), startText.data() + startText.size(), start);
+            if (!previous.empty() && reference == previous) {
+                pairs++;
+                ordered += start >= previousStart;
+            }
+            previous = reference;
+            previousStart = start;
+            if (seen.emplace(reference).second) {
+                references[std::string(reference)]++;
+            }
+        }
+    }
+};
+
+} // namespace
+
+/*****************************************************************************************
+ * ExecutionPlanner
+ ****************************************************************************************/
+
+/******************************************************************
+ * Estimate
+ *      A file of up to SAMPLE_BLOCKS blocks is read whole; a
+ *      larger one is sampled at SAMPLE_BLOCKS evenly spread
+ *      offsets, the first at its start.
+ ******************************************************************/
+bool ExecutionPlanner::estimate(const MapperFile & file, FileEstimate & estimate) {
+    estimate = FileEstimate();
+    if (const auto & index = file.shared_index()) {
+        estimate.rows = index->rowCount();
+        estimate.references = index->references().size();
+        estimate.sampledRows = estimate.rows;
+        return true;
+    }
+
+    const int fd = ::open(file.file_path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    estimate.bytes = static_cast<uint64_t>(st.st_size);
+
+    const bool whole = estimate.bytes <= SAMPLE_BLOCKS * SAMPLE_BYTES;
+    std::string block(whole ? estimate.bytes : SAMPLE_BYTES, '\0');
+    Sample sample;
+    bool passed = true;
+    for (size_t b = 0; b < (whole ? 1 : SAMPLE_BLOCKS) && passed; b++) {
+        const uint64_t offset = whole ? 0 : (estimate.bytes - SAMPLE_BYTES) * b / (SAMPLE_BLOCKS - 1);
+        size_t done = 0;
+        while (done < block.size()) {
+            const ssize_t got = pread(fd, block.data() + done, block.size() - done, static_cast<off_t>(offset + done));
+            if (got <= 0) {
+                passed = got == 0;
+                break;
+            }
+            done += static_cast<size_t>(got);
+        }
+        sample.add(file, std::string_view(block.data(), done), offset == 0, offset + done >= estimate.bytes);
+    }
+    ::close(fd);
+    if (!passed) {
+        return false;
+    }
+
+    estimate.sampledRows = sample.rows;
+    if (sample.rows == 0) {
+        return true;
+    }
+    estimate.rowWidth = static_cast<double>(sample.bytes) / static_cast<double>(sample.rows);
+    estimate.columns = static_cast<double>(sample.columns) / static_cast<double>(sample.rows);
+    estimate.rows = whole ? sample.rows : static_cast<uint64_t>(static_cast<double>(estimate.bytes) / estimate.rowWidth);
+    estimate.sortedness = sample.pairs == 0 ? 1.0 : static_cast<double>(sample.ordered) / static_cast<double>(sample.pairs);
+
+    // Chao2: the references seen in one block and in two tell how many
+    // were missed.  Blocks rather than rows are the samples, as a sorted
+    // file has each reference in one run of rows.
+    uint64_t once = 0, twice = 0;
+    for (const auto & reference : sample.references) {
+        once += reference.second == 1;
+        twice += reference.second == 2;
+    }
+    double references = static_cast<double>(sample.references.size());
+    if (!whole) {
+        const double m = static_cast<double>(sample.blocks);
+        references += (m - 1) / m * (twice > 0 ? static_cast<double>(once * once) / (2.0 * static_cast<double>(twice))
+                                               : static_cast<double>(once) * static_cast<double>(once > 0 ? once - 1 : 0) / 2.0);
+    }
+    estimate.references = std::clamp<uint64_t>(static_cast<uint64_t>(references), 1, std::max<uint64_t>(1, estimate.rows));
+    return true;
+}
+
+/******************************************************************
+ * Plan
+ *      Engine: the index when every pair is lopsided enough that
+ *      searching the larger file beats sweeping it.  Read lanes:
+ *      enough threads' worth for every file to be in flight.
+ *      Blocks: about sixteen per average file.  Stream capacity:
+ *      half the rows a file has per reference, as references
+ *      smaller than that would leave the rest unused.  Spilling:
+ *      only if the rows would take most of the machine's memory.
+ ******************************************************************/
+ExecutionPlan ExecutionPlanner::plan(const std::vector <FileEstimate> & files, const Settings & settings) {
+    ExecutionPlan plan;
+    plan.resultBatchSize = settings.resultBatchSize;
+
+    uint64_t bytes = 0, smallest = UINT64_MAX, largest = 0;
+    double sortedRows = 0, rowsPerReference = 0;
+    for (const FileEstimate & file : files) {
+        plan.estimatedRows += file.rows;
+        bytes += file.bytes;
+        plan.estimatedMemory += static_cast<uint64_t>(static_cast<double>(file.rows) *
+            (static_cast<double>(sizeof(Annotation)) + file.columns * sizeof(AnnotationTypes) + file.rowWidth
+             + 2 * sizeof(long long int) + sizeof(uint32_t)));
+        smallest = std::min(smallest, file.rows);
+        if (file.rows >= largest) {
+            largest = file.rows;
+            plan.estimatedReferences = file.references;
+        }
+        sortedRows += file.sortedness * static_cast<double>(file.rows);
+        rowsPerReference += static_cast<double>(file.rows) / static_cast<double>(std::max<uint64_t>(1, file.references));
+    }
+    if (plan.estimatedRows > 0) {
+        plan.sortedness = sortedRows / static_cast<double>(plan.estimatedRows);
+    }
+
+    if (settings.keyJoin) {
+        plan.engine = MapEngine::Hash;
+    } else if (files.size() >= 2 && largest > 0 &&
+               static_cast<double>(std::max<uint64_t>(1, smallest)) * std::log2(static_cast<double>(largest) + 1) * 4 < static_cast<double>(largest)) {
+        plan.engine = MapEngine::Index;
+    }
+
+    const int threads = std::max(1, settings.threads);
+    const size_t perReader = std::max<size_t>(1, settings.filesPerReader);
+    plan.readingThreads = std::clamp(static_cast<int>((files.size() + perReader - 1) / perReader), 1, threads);
+    plan.mappingThreads = threads - plan.readingThreads;
+
+    if (!files.empty()) {
+        const uint64_t perFile = bytes / files.size() / 16;
+        plan.blockSize = static_cast<size_t>(std::clamp<uint64_t>(std::bit_ceil(std::max<uint64_t>(1, perFile)), 1 << 16, 1 << 22));
+        plan.streamCapacity = static_cast<uint32_t>(std::clamp(rowsPerReference / static_cast<double>(files.size()) / 2, 64.0, 65536.0));
+    }
+
+    plan.memoryBudget = settings.memoryBudget;
+    if (plan.memoryBudget == 0 && settings.physicalMemory != 0 && plan.estimatedMemory > settings.physicalMemory / 10 * 6) {
+        plan.memoryBudget = settings.physicalMemory / 2;
+    }
+    return plan;
+}
+
+uint64_t ExecutionPlanner::physicalMemory() {
+    const long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+    return pages > 0 && pageSize > 0 ? static_cast<uint64_t>(pages) * static_cast<uint64_t>(pageSize) : 0;
+}
+
+/*****************************************************************************************
+ * ExecutionPlan
+ ****************************************************************************************/
+
+std::string ExecutionPlan::describe() const {
+    static const char * engines[] = {"sweep", "index", "hash"};
+    std::ostringstream line;
+    line << "engine=" << engines[static_cast<int>(engine)]
+         << " readers=" << readingThreads << " mappers=" << mappingThreads
+         << " block=" << blockSize / 1024 << "KiB batch=" << resultBatchSize
+         << " capacity=" << streamCapacity
+         << " budget=" << (memoryBudget == 0 ? std::string("none") : std::to_string(memoryBudget >> 20) + "MiB")
+         << " rows~" << estimatedRows << " memory~" << (estimatedMemory >> 20) << "MiB"
+         << " references~" << estimatedReferences << " sorted=" << std::round(sortedness * 100) / 100;
+    return line.str();
+}
+
+void PlanOverride::apply(ExecutionPlan & plan) const {
+    if (engine) {
+        plan.engine = *engine;
+    }
+    if (readingThreads) {
+        plan.mappingThreads = std::max(0, plan.mappingThreads + plan.readingThreads - *readingThreads);
+        plan.readingThreads = *readingThreads;
+    }
+    if (blockSize) {
+        plan.blockSize = *blockSize;
+    }
+    if (resultBatchSize) {
+        plan.resultBatchSize = *resultBatchSize;
+    }
+    if (streamCapacity) {
+        plan.streamCapacity = *streamCapacity;
+    }
+    if (memoryBudget) {
+        plan.memoryBudget = *memoryBudget;
+    }
+}
@@ -0,0 +1,136 @@
+/*! \file ExecutionPlanner.h
+    \author John Torcivia, Ph.D.
+
+    \brief A pre-scan of the input files and the execution plan made from it.
+
+    Before anything is read in full, each file is measured with stat() and
+    a few blocks spread over it are sampled: their rows give the average
+    row width (and so the row count), the references seen (extrapolated to
+    the whole file with the Chao2 estimator, the blocks as samples) and how
+    many neighbouring rows of a reference are in start order.  A file with
+    a shared index is measured from the index instead.  The planner turns
+    the estimates into the engine, read lanes, block size, stream capacity
+    and memory budget of the run; each of them can be overridden.  The
+    rules are heuristics tuned on the synthetic benchmarks, not a cost
+    model, and only ever change how fast a run is, never its results.
+*/
+
+#ifndef BIOMAPPER_EXECUTIONPLANNER_H
+#define BIOMAPPER_EXECUTIONPLANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "MapperFile.h"
+
+/**
+ * How the rows of two files are matched.
+ */
+enum class MapEngine {
+    Sweep,      ///< Plane sweep over both files' sorted ranges
+    Index,      ///< Binary searches of the larger file for each range of the smaller
+    Hash        ///< Hash tables on the keys (JoinMode::Key)
+};
+
+/**
+ * What the pre-scan learnt about one file.
+ */
+struct FileEstimate {
+    uint64_t    bytes = 0;          ///< Size of the file
+    uint64_t    rows = 0;           ///< Rows, estimated from the sampled row width
+    double      rowWidth = 0;       ///< Average bytes per row, line break included
+    double      columns = 0;        ///< Average columns per row
+    uint64_t    references = 0;     ///< Distinct join values, estimated
+    double      sortedness = 1;     ///< Share of neighbouring rows of a reference in start order
+    uint64_t    sampledRows = 0;    ///< Rows the estimates are based on
+};
+
+/**
+ * The settings a run is made with.
+ */
+struct ExecutionPlan {
+    MapEngine   engine = MapEngine::Sweep;
+    int         readingThreads = 1;         ///< Threads' worth of read lanes; the other threads map
+    int         mappingThreads = 0;         ///< Threads left to map
+    size_t      blockSize = 1 << 20;        ///< Bytes per read
+    size_t      resultBatchSize = 4096;     ///< Results per delivered batch
+    uint32_t    streamCapacity = 1000;      ///< Annotations reserved per file of a stream
+    uint64_t    memoryBudget = 0;           ///< Spill beyond this many bytes; 0 for never
+    uint64_t    estimatedRows = 0;          ///< Rows over all files
+    uint64_t    estimatedMemory = 0;        ///< Bytes the rows take in memory
+    uint64_t    estimatedReferences = 0;    ///< Distinct references of the largest file
+    double      sortedness = 1;             ///< Row weighted over the files
+
+    /**
+     *
+     * @return The plan on one line, for the log.
+     */
+    [[nodiscard]] std::string describe() const;
+};
+
+/**
+ * Settings that replace the planner's choice; unset ones are planned.
+ */
+struct PlanOverride {
+    std::optional <MapEngine>   engine;
+    std::optional <int>         readingThreads;
+    std::optional <size_t>      blockSize;
+    std::optional <size_t>      resultBatchSize;
+    std::optional <uint32_t>    streamCapacity;
+    std::optional <uint64_t>    memoryBudget;
+
+    /**
+     * Replace the fields of plan that are set here.
+     */
+    void apply(ExecutionPlan & plan) const;
+};
+
+/**
+ *
+ */
+class ExecutionPlanner {
+public:
+    static constexpr size_t SAMPLE_BLOCKS = 32;         ///< Blocks sampled per file
+    static constexpr size_t SAMPLE_BYTES = 1 << 13;     ///< Bytes per sampled block
+
+    /**
+     * What the plan is for, besides the files.
+     */
+    struct Settings {
+        int         threads = 1;                ///< Threads of the pool
+        size_t      filesPerReader = 4;         ///< Files a reading thread interleaves
+        bool        keyJoin = false;            ///< JoinMode::Key
+        uint64_t    memoryBudget = 0;           ///< The budget set by the caller, 0 for none
+        size_t      resultBatchSize = 4096;     ///< The batch size set by the caller
+        uint64_t    physicalMemory = 0;         ///< Memory of the machine, 0 if unknown
+    };
+
+    /**
+     * @brief Measure one file by sampling it.
+     *
+     * @param file The file and its column settings.
+     * @param[out] estimate The estimates.
+     * @return false if the file cannot be read.
+     */
+    static bool estimate(const MapperFile & file, FileEstimate & estimate);
+
+    /**
+     * @brief Plan a run over files with these estimates.
+     *
+     * @param files The estimate of every file.
+     * @param settings The pool and the caller's settings.
+     * @return The plan.
+     */
+    static ExecutionPlan plan(const std::vector <FileEstimate> & files, const Settings & settings);
+
+    /**
+     *
+     * @return Bytes of physical memory, 0 if unknown.
+     */
+    static uint64_t physicalMemory();
+};
+
+#endif //BIOMAPPER_EXECUTIONPLANNER_H
@@ -26,13 +26,26 @@ public:
     ~FileList() = default;
 
     void push_back(T file) {
-        file_list_.push_back(file);
+        file_list_.push_back(std::move(file));
     }
 
-    long int size() {
+    template <typename... Args>
+    T & emplace_back(Args &&... args) {
+        return file_list_.emplace_back(std::forward<Args>(args)...);
+    }
+
+    long int size() const {
         return file_list_.size();
     }
 
+    T & operator[](size_t index) {
+        return file_list_[index];
+    }
+
+    const T & operator[](size_t index) const {
+        return file_list_[index];
+    }
+
     bool is_next() {
         if (current_index >= file_list_.size() - 1) {
             return false;
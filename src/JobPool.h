@@ -0,0 +1,154 @@
+/*! \file JobPool.h
+    \author John Torcivia, Ph.D.
+
+    \brief One job's share of a thread_pool.
+
+    A mapping run pushes its tasks through a JobPool rather than straight
+    into the pool, so any number of runs can share one pool.  The job has
+    at most its quota of tasks in the pool at once; the others wait in the
+    job, in order, and each finishing task pushes the job's next one to the
+    back of the pool's queue.  Jobs with work therefore take turns at the
+    workers instead of the first one filling the queue, and waiting for
+    the tasks of a job ignores those of the others.  With no quota every
+    task goes straight to the pool, as when a run owns its pool.
+*/
+
+#ifndef BIOMAPPER_JOBPOOL_H
+#define BIOMAPPER_JOBPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+#include "TraceRecorder.h"
+#include "thread_pool.hpp"
+
+/**
+ *
+ */
+class JobPool {
+public:
+    /**
+     *
+     * @param pool The pool the tasks run on; it must outlive the job.
+     * @param quota Tasks of the job in the pool at once; 0 for no limit.
+     * @param tracer Records a "task" slice per task, if set; for a pool shared with
+     *               other jobs, whose own tracer would record theirs too.
+     */
+    explicit JobPool(thread_pool & pool, uint32_t quota = 0, TraceRecorder * tracer = nullptr)
+            : pool_(pool), quota_(quota), tracer_(tracer) {}
+
+    /**
+     * Waits for the job's tasks.
+     */
+    ~JobPool() { wait_for_tasks(); }
+
+    JobPool(const JobPool &) = delete;
+    JobPool & operator=(const JobPool &) = delete;
+
+    /**
+     * Same as thread_pool::push_task(), within the quota.
+     */
+    template <typename F>
+    void push_task(const F & task) { _push(-1, std::function<void()>(task)); }
+
+    /**
+     * Same as thread_pool::push_task_on_node(), within the quota.
+     */
+    template <typename F>
+    void push_task_on_node(int node, const F & task) { _push(node, std::function<void()>(task)); }
+
+    /**
+     * Wait until every task of the job has finished, tasks they pushed included.
+     */
+    void wait_for_tasks() {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [this]() { return unfinished_ == 0; });
+    }
+
+    /**
+     *
+     * @return Tasks of the job not started yet.
+     */
+    [[nodiscard]] uint64_t get_tasks_queued() const { return queued_.load(std::memory_order_relaxed); }
+
+    /**
+     *
+     * @return Workers the job can use at once.
+     */
+    [[nodiscard]] uint32_t get_thread_count() const {
+        const auto threads = static_cast<uint32_t>(pool_.get_thread_count());
+        return quota_ == 0 ? threads : std::min(quota_, threads);
+    }
+
+    /**
+     * Same as thread_pool::get_node_count().
+     */
+    [[nodiscard]] uint32_t get_node_count() const { return static_cast<uint32_t>(pool_.get_node_count()); }
+
+private:
+    void _push(int node, std::function<void()> task) {
+        queued_.fetch_add(1, std::memory_order_relaxed);
+        {
+            const std::scoped_lock lock(mutex_);
+            unfinished_++;
+            if (quota_ != 0 && running_ >= quota_) {
+                waiting_.emplace_back(node, std::move(task));
+                return;
+            }
+            running_++;
+        }
+        _submit(node, std::move(task));
+    }
+
+    void _submit(int node, std::function<void()> task) {
+        pool_.push_task_on_node(node, [this, task = std::move(task)]() {
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            if (tracer_ == nullptr) {
+                task();
+            } else {
+                const auto begin = std::chrono::steady_clock::now();
+                task();
+                tracer_->record("task", "pool", begin, std::chrono::steady_clock::now());
+            }
+            _finished();
+        });
+    }
+
+    /**
+     * Hand the finished task's place in the pool to the next waiting one.
+     */
+    void _finished() {
+        std::unique_lock lock(mutex_);
+        if (!waiting_.empty()) {
+            auto [node, task] = std::move(waiting_.front());
+            waiting_.pop_front();
+            unfinished_--;
+            lock.unlock();
+            _submit(node, std::move(task));
+            return;
+        }
+        running_--;
+        if (--unfinished_ == 0) {
+            idle_.notify_all();
+        }
+    }
+
+    thread_pool &                                       pool_;
+    const uint32_t                                      quota_;             ///< 0 for no limit
+    TraceRecorder *                                     tracer_;
+    std::mutex                                          mutex_;
+    std::condition_variable                             idle_;              ///< Notified when unfinished_ reaches 0
+    std::deque <std::pair <int, std::function<void()> > > waiting_;         ///< Tasks beyond the quota, with their node
+    uint32_t                                            running_ = 0;       ///< Tasks in the pool
+    uint64_t                                            unfinished_ = 0;    ///< Tasks waiting, in the pool or running
+    std::atomic <uint64_t>                              queued_ = 0;        ///< Tasks not started
+};
+
+#endif //BIOMAPPER_JOBPOOL_H
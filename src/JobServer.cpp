@@ -0,0 +1,170 @@
+#include "JobServer.h"
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+
+/*****************************************************************************************
+ * JobServer
+ ****************************************************************************************/
+
+JobServer::JobServer(int threads, size_t concurrent_jobs, uint64_t cache_bytes, std::string cache_directory)
+        : pool_(threads > 0 ? static_cast<uint32_t>(threads) : std::thread::hardware_concurrency()),
+          cacheBytes_(cache_bytes), cacheDirectory_(std::move(cache_directory)), ownDirectory_(cacheDirectory_.empty()) {
+    // Jobs are seldom idle for long, but between them the workers poll;
+    // a shorter sleep than the default millisecond picks new ones up sooner.
+    pool_.sleep_duration = 100;
+
+    if (ownDirectory_) {
+        static std::atomic <uint64_t> instances = 0;
+        cacheDirectory_ = (std::filesystem::temp_directory_path() /
+                           ("biomapper-cache-" + std::to_string(getpid()) + "-" + std::to_string(instances++))).string();
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(cacheDirectory_, ec);
+    if (ec) {
+        std::cerr << "WARNING: Could not create the index cache " << cacheDirectory_ << "; files will be parsed per job.  \n";
+    }
+
+    const size_t runners = concurrent_jobs == 0 ? pool_.get_thread_count() : concurrent_jobs;
+    for (size_t r = 0; r < runners; r++) {
+        runners_.emplace_back(&JobServer::_runJobs, this);
+    }
+}
+
+JobServer::~JobServer() {
+    {
+        const std::scoped_lock lock(jobMtx_);
+        stopping_ = true;
+    }
+    jobQueued_.notify_all();
+    for (std::thread & runner : runners_) {
+        runner.join();
+    }
+
+    cache_.clear();
+    if (ownDirectory_) {
+        std::error_code ec;
+        std::filesystem::remove_all(cacheDirectory_, ec);
+    }
+}
+
+std::future <bool> JobServer::submit(BioMapper & mapper, ResultCallback callback) {
+    std::future <bool> done;
+    {
+        const std::scoped_lock lock(jobMtx_);
+        jobs_.push_back(Job{&mapper, std::move(callback), std::promise <bool>()});
+        done = jobs_.back().done.get_future();
+    }
+    jobQueued_.notify_one();
+    return done;
+}
+
+/******************************************************************
+ * Run Jobs
+ *      Each runner is the coordinating thread of its job's map():
+ *      it plans, waits on the job's tasks and delivers the results,
+ *      while the work itself is done by the shared pool.
+ ******************************************************************/
+void JobServer::_runJobs() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(jobMtx_);
+            jobQueued_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job.mapper->setThreadPool(&pool_);
+        const bool passed = job.mapper->map(job.callback);
+        job.mapper->setThreadPool(nullptr);
+        job.done.set_value(passed);
+    }
+}
+
+/******************************************************************
+ * Index
+ *      The key describes the file as Checkpoint does, so a file
+ *      rewritten in place is a new key.  Attaching (and building)
+ *      happens outside the lock; SharedIndex serializes builds of
+ *      the same index, and the first to finish is cached.
+ ******************************************************************/
+std::shared_ptr <const SharedIndex> JobServer::index(const MapperFile & file) {
+    std::string key;
+    if (!Checkpoint::describeFile(file.file_path(), key)) {
+        std::cerr << "ERROR: Could not find " << file.file_path() << ".  \n";
+        return nullptr;
+    }
+    std::ostringstream settings;
+    settings << "\t" << file.join_index() << "\t" << file.start_range_index() << "\t" << file.end_range_index()
+             << "\t" << file.zero_based_range() << file.has_header() << file.quoted() << "\t" << static_cast<int>(file.delimiter());
+    key += settings.str();
+
+    {
+        const std::scoped_lock lock(cacheMtx_);
+        if (auto found = cache_.find(key); found != cache_.end()) {
+            recent_.splice(recent_.begin(), recent_, found->second.use);
+            counters_.hits++;
+            return found->second.index;
+        }
+    }
+
+    std::ostringstream name;
+    name << std::filesystem::path(file.file_path()).filename().string() << "-" << std::hex << std::hash <std::string>{}(key) << ".index";
+    const std::string path = (std::filesystem::path(cacheDirectory_) / name.str()).string();
+    std::shared_ptr <const SharedIndex> index = SharedIndex::attach(file, path, true, &pool_);
+    if (!index) {
+        return nullptr;
+    }
+
+    const std::scoped_lock lock(cacheMtx_);
+    counters_.misses++;
+    if (auto found = cache_.find(key); found != cache_.end()) {
+        recent_.splice(recent_.begin(), recent_, found->second.use);
+        return found->second.index;
+    }
+    recent_.push_front(key);
+    cache_.emplace(key, CacheEntry{index, path, recent_.begin()});
+    counters_.bytes += index->size();
+    _evict();
+    return index;
+}
+
+void JobServer::_evict() {
+    while (counters_.bytes > cacheBytes_ && recent_.size() > 1) {
+        auto entry = cache_.find(recent_.back());
+        counters_.bytes -= entry->second.index->size();
+        // Mappings of the file, here or in a job, stay valid once it is gone.
+        // While it is being built again the new one is left in place.
+        SharedIndex::remove(entry->second.path);
+        cache_.erase(entry);
+        recent_.pop_back();
+        counters_.evictions++;
+    }
+}
+
+bool JobServer::addFile(BioMapper & mapper, MapperFile file) {
+    std::shared_ptr <const SharedIndex> index = this->index(file);
+    if (!index) {
+        return false;
+    }
+    for (const auto & [column, name] : index->header()) {
+        file.add_column_to_header(column, name);
+    }
+    file.set_shared_index(std::move(index));
+    return mapper.addFile(std::move(file));
+}
+
+JobServer::CacheCounters JobServer::cacheCounters() const {
+    const std::scoped_lock lock(cacheMtx_);
+    CacheCounters counters = counters_;
+    counters.entries = cache_.size();
+    return counters;
+}
@@ -0,0 +1,166 @@
+/*! \file JobServer.h
+    \author John Torcivia, Ph.D.
+
+    \brief A resident mapping engine running many jobs on one pool.
+
+    A service that maps on request would otherwise pay, for every request,
+    a thread pool created and joined by map() and a parse of every file.
+    The server owns one thread_pool for its lifetime and runs each
+    submitted job's map() on it (see BioMapper::setThreadPool()), several
+    jobs at once.  A job has at most as many tasks in the pool as the
+    threads its BioMapper was constructed with, and the jobs with work take
+    turns at the workers (see JobPool), so a large job cannot hold up the
+    small ones behind it.
+
+    Files added through the server are attached as shared indexes (see
+    SharedIndex), built once in the cache directory and kept mapped in an
+    LRU cache keyed by the file's path, size, modification time and column
+    settings.  Later jobs on an unchanged file attach the mapped index and
+    read nothing; a changed file gets a new entry, and the least recently
+    used entries are dropped, and their index files deleted, beyond the
+    cache's size.  A job still holding a dropped index keeps its mapping.
+*/
+
+#ifndef BIOMAPPER_JOBSERVER_H
+#define BIOMAPPER_JOBSERVER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BioMapper.h"
+#include "SharedIndex.h"
+#include "thread_pool.hpp"
+
+/**
+ *
+ */
+class JobServer {
+public:
+    /**
+     * What the index cache has done since the server started.
+     */
+    struct CacheCounters {
+        uint64_t    hits = 0;       ///< Files attached from the cache
+        uint64_t    misses = 0;     ///< Files attached (and indexed if needed) from the cache directory
+        uint64_t    evictions = 0;  ///< Entries dropped for room
+        uint64_t    bytes = 0;      ///< Bytes of the indexes cached now
+        size_t      entries = 0;    ///< Indexes cached now
+    };
+
+    /**
+     *
+     * @param threads Workers of the pool; -1 for every hardware thread.
+     * @param concurrent_jobs Jobs mapping at once, the others waiting in order; 0 for one per worker.
+     * @param cache_bytes Size of the mapped indexes kept; the last one used is kept whatever its size.
+     * @param cache_directory Where the indexes are built; a directory of the server's own,
+     *                        removed with it, in the temporary directory if empty.
+     */
+    explicit JobServer(int threads = -1, size_t concurrent_jobs = 0, uint64_t cache_bytes = uint64_t{1} << 30,
+                       std::string cache_directory = std::string());
+
+    /**
+     * Runs the jobs submitted so far, then stops.
+     */
+    ~JobServer();
+
+    JobServer(const JobServer &) = delete;
+    JobServer & operator=(const JobServer &) = delete;
+
+    /**
+     * @brief The index of a file, from the cache or attached (and built if needed) into it.
+     *
+     * @param file The file and its column settings.
+     * @return The index, or null if the file cannot be found or indexed.
+     */
+    std::shared_ptr <const SharedIndex> index(const MapperFile & file);
+
+    /**
+     * @brief Add a file to a job's mapper as its cached index.
+     *
+     * Same as BioMapper::addIndexedFile(), with the index from index().
+     *
+     * @return false if there is no index for the file.
+     */
+    bool addFile(BioMapper & mapper, MapperFile file);
+
+    /**
+     * @brief Queue a job: map() of a mapper on the server's pool.
+     *
+     * The mapper is set up as for a map() of its own, its files added
+     * directly or through addFile(); its threads are the job's quota.  It
+     * must not be used until the job is done, and must outlive it.
+     *
+     * @param mapper The job.
+     * @param callback Handed the job's results, on the job's own thread.
+     * @return What map() returns, once the job is done.
+     */
+    std::future <bool> submit(BioMapper & mapper, ResultCallback callback = ResultCallback());
+
+    /**
+     *
+     * @return The index cache's counters.
+     */
+    [[nodiscard]] CacheCounters cacheCounters() const;
+
+    /**
+     *
+     * @return Workers of the pool.
+     */
+    [[nodiscard]] size_t threadCount() const { return pool_.get_thread_count(); }
+
+private:
+    /**
+     * A queued job.
+     */
+    struct Job {
+        BioMapper *             mapper = nullptr;
+        ResultCallback          callback;
+        std::promise <bool>     done;
+    };
+
+    /**
+     * A cached index.
+     */
+    struct CacheEntry {
+        std::shared_ptr <const SharedIndex>     index;
+        std::string                             path;   ///< Its file in the cache directory
+        std::list <std::string>::iterator       use;    ///< Its key in recent_
+    };
+
+    /**
+     * Run queued jobs until the server stops and none is left.
+     */
+    void _runJobs();
+
+    /**
+     * Drop the least recently used entries beyond the cache's size; cacheMtx_ held.
+     */
+    void _evict();
+
+    thread_pool                             pool_;              ///< Every job's tasks run here
+    std::vector <std::thread>               runners_;           ///< Run one job at a time each
+
+    std::mutex                              jobMtx_;            ///< Guards jobs_ and stopping_
+    std::condition_variable                 jobQueued_;         ///< Notified on a new job and on stopping
+    std::deque <Job>                        jobs_;              ///< Jobs not started, in order
+    bool                                    stopping_ = false;
+
+    mutable std::mutex                      cacheMtx_;          ///< Guards the cache
+    std::map <std::string, CacheEntry>      cache_;             ///< By key: path, size, time and settings
+    std::list <std::string>                 recent_;            ///< Keys, most recently used first
+    CacheCounters                           counters_;
+    const uint64_t                          cacheBytes_;        ///< Size kept
+    std::string                             cacheDirectory_;
+    bool                                    ownDirectory_;      ///< Whether the server made the directory
+};
+
+#endif //BIOMAPPER_JOBSERVER_H
@@ -0,0 +1,148 @@
+/*! \file JoinKeyFilter.h
+    \author John Torcivia, Ph.D.
+
+    \brief Membership filter for join keys that can map.
+
+    Only join keys (references) present in two or more files can produce
+    overlaps.  The filter is built from the per-key file counts and lets the
+    reader drop every other row as soon as its join column is extracted,
+    before the rest of the row is split.
+
+    With few distinct keys every key is interned to a dense ID and the
+    mappable ones are marked in a bitset, so a lookup also yields the ID.
+    With many distinct keys (transcript IDs and the like) a Bloom filter
+    over the mappable keys is used instead; it is much smaller, and its
+    rare false positives are caught by the exact lookup that follows.
+*/
+
+#ifndef BIOMAPPER_JOINKEYFILTER_H
+#define BIOMAPPER_JOINKEYFILTER_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ *
+ */
+class JoinKeyFilter {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;            ///< The key cannot map
+    static constexpr uint32_t UNRESOLVED = UINT32_MAX - 1;  ///< The key may map; look it up exactly
+
+    /**
+     * @brief Build the filter from the number of files containing each key.
+     *
+     * The key strings must stay alive and unmodified while the filter is used.
+     *
+     * @param counts Files containing each join key.
+     * @param min_files Keys in fewer files are filtered out.
+     * @param exact_limit Most distinct keys for the interned bitset; beyond it a Bloom filter is used.
+     */
+    void build(const std::map <std::string, int> & counts, int min_files = 2, size_t exact_limit = 1 << 16) {
+        ids_.clear();
+        shared_.clear();
+        bloom_.clear();
+        keyCount_ = counts.size();
+
+        if (counts.size() <= exact_limit) {
+            ids_.reserve(counts.size());
+            shared_.assign((counts.size() + 63) / 64, 0);
+            uint32_t id = 0;
+            for (const auto & count : counts) {
+                ids_.emplace(count.first, id);
+                if (count.second >= min_files) {
+                    shared_[id / 64] |= uint64_t(1) << (id % 64);
+                }
+                id++;
+            }
+            return;
+        }
+
+        // About 10 bits and 7 probes per key, ~1% false positives.
+        size_t sharedKeys = 0;
+        for (const auto & count : counts) {
+            sharedKeys += count.second >= min_files;
+        }
+        size_t bits = 64;
+        while (bits < sharedKeys * BITS_PER_KEY) {
+            bits <<= 1;
+        }
+        bloom_.assign(bits / 64, 0);
+        for (const auto & count : counts) {
+            if (count.second >= min_files) {
+                _probe(count.first, [this](size_t bit) {
+                    bloom_[bit / 64] |= uint64_t(1) << (bit % 64);
+                    return true;
+                });
+            }
+        }
+    }
+
+    /**
+     * @param key A join value read from a file.
+     * @return NONE if the key cannot map; otherwise its interned ID (the
+     * key's position in the counts) or, with the Bloom filter, UNRESOLVED.
+     */
+    [[nodiscard]] uint32_t lookup(std::string_view key) const {
+        if (!bloom_.empty()) {
+            const bool maybe = _probe(key, [this](size_t bit) {
+                return (bloom_[bit / 64] >> (bit % 64)) & 1;
+            });
+            return maybe ? UNRESOLVED : NONE;
+        }
+        auto it = ids_.find(key);
+        if (it == ids_.end() || !((shared_[it->second / 64] >> (it->second % 64)) & 1)) {
+            return NONE;
+        }
+        return it->second;
+    }
+
+    /**
+     *
+     * @return Whether the Bloom filter is in use (lookups never return IDs).
+     */
+    [[nodiscard]] bool usesBloom() const { return !bloom_.empty(); }
+
+    /**
+     *
+     * @return The number of distinct keys the filter was built from.
+     */
+    [[nodiscard]] size_t keyCount() const { return keyCount_; }
+
+private:
+    static constexpr size_t BITS_PER_KEY = 10;
+    static constexpr size_t PROBES = 7;
+
+    /**
+     * Visit the key's bit positions (double hashing) until test returns false.
+     */
+    template <typename Test>
+    bool _probe(std::string_view key, Test test) const {
+        const uint64_t h1 = std::hash<std::string_view>()(key);
+        // Second hash derived by mixing (splitmix64 finalizer); forced odd
+        // so the probes cycle through the whole power of two table.
+        uint64_t h2 = h1 + 0x9E3779B97F4A7C15ULL;
+        h2 = (h2 ^ (h2 >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h2 = (h2 ^ (h2 >> 27)) * 0x94D049BB133111EBULL;
+        h2 = (h2 ^ (h2 >> 31)) | 1;
+        const size_t mask = bloom_.size() * 64 - 1;
+        for (size_t i = 0; i < PROBES; i++) {
+            if (!test(static_cast<size_t>(h1 + i * h2) & mask)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::unordered_map <std::string_view, uint32_t> ids_;  ///< Interned ID of every key (exact mode)
+    std::vector <uint64_t>  shared_;        ///< Bit per interned ID, set if the key can map (exact mode)
+    std::vector <uint64_t>  bloom_;         ///< Bloom filter of the keys that can map (Bloom mode)
+    size_t                  keyCount_ = 0;  ///< Distinct keys the filter was built from
+};
+
+#endif //BIOMAPPER_JOINKEYFILTER_H
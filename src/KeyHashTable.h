@@ -0,0 +1,171 @@
+/*! \file KeyHashTable.h
+    \author John Torcivia, Ph.D.
+
+    \brief Open addressing hash table for exact key joins.
+
+    Built once over the 64 bit key hashes of one file's rows and then only
+    probed, from any number of threads.  The layout follows SwissTable:
+    slots come in groups of 16 with one control byte each, holding 7 bits
+    of the hash (or EMPTY).  A probe compares the control bytes of a whole
+    group against the hash at once (SSE2 where available) and only visits
+    the slots whose byte matches, so a miss usually costs one cache line.
+
+    Rows sharing a hash are chained in row order behind a single slot;
+    a key whose hash collides with another's is told apart by the caller,
+    which compares the keys of the rows visited.
+*/
+
+#ifndef BIOMAPPER_KEYHASHTABLE_H
+#define BIOMAPPER_KEYHASHTABLE_H
+
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ *
+ */
+class KeyHashTable {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;    ///< End of a row chain
+
+    /**
+     * @brief Hash of a join key.
+     *
+     * Composite keys are packed into the same 64 bits, so tables and probes
+     * never depend on the number or width of the key columns.
+     */
+    static uint64_t hash(std::string_view key) {
+        uint64_t h = std::hash<std::string_view>()(key);
+        // splitmix64 finalizer; the control bytes take the low bits.
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        return h ^ (h >> 31);
+    }
+
+    /**
+     * @brief Build the table over the rows' hashes, replacing any earlier content.
+     *
+     * @param hashes Hash of each row's key; the row numbers are the indexes.
+     */
+    void build(const std::vector <uint64_t> & hashes) {
+        // At most 7/8 of the slots in use, rounded up to a power of two groups.
+        size_t groups = 1;
+        while (groups * GROUP * 7 / 8 < hashes.size()) {
+            groups <<= 1;
+        }
+        control_.assign(groups * GROUP, EMPTY);
+        slotHashes_.assign(groups * GROUP, 0);
+        heads_.assign(groups * GROUP, NONE);
+        next_.assign(hashes.size(), NONE);
+        groupMask_ = groups - 1;
+
+        // Backwards, so every chain ends up in row order.
+        for (size_t row = hashes.size(); row-- > 0;) {
+            const uint64_t h = hashes[row];
+            size_t slot = _find(h);
+            if (slot == NONE) {
+                slot = _freeSlot(h);
+                control_[slot] = static_cast<int8_t>(h & 0x7F);
+                slotHashes_[slot] = h;
+            }
+            next_[row] = heads_[slot];
+            heads_[slot] = static_cast<uint32_t>(row);
+        }
+    }
+
+    /**
+     * @brief Call visit(row) for every row whose key has the given hash, in row order.
+     */
+    template <typename Visit>
+    void find(uint64_t hash, Visit visit) const {
+        if (control_.empty()) {
+            return;
+        }
+        const size_t slot = _find(hash);
+        if (slot == NONE) {
+            return;
+        }
+        for (uint32_t row = heads_[slot]; row != NONE; row = next_[row]) {
+            visit(row);
+        }
+    }
+
+    /**
+     *
+     * @return Estimated bytes the table occupies.
+     */
+    [[nodiscard]] size_t memoryUsage() const {
+        return control_.size() * (sizeof(int8_t) + sizeof(uint64_t) + sizeof(uint32_t)) + next_.size() * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr size_t GROUP = 16;
+    static constexpr int8_t EMPTY = -128;
+
+    /**
+     * Bit i set if control byte i of the group starting at slot equals byte.
+     */
+    [[nodiscard]] uint32_t _match(size_t slot, int8_t byte) const {
+#ifdef __SSE2__
+        const __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(control_.data() + slot));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP; i++) {
+            mask |= static_cast<uint32_t>(control_[slot + i] == byte) << i;
+        }
+        return mask;
+#endif
+    }
+
+    /**
+     * The slot holding hash, or NONE.  Groups are probed quadratically from
+     * the one the high bits select until a group with an empty slot.
+     */
+    [[nodiscard]] size_t _find(uint64_t hash) const {
+        const int8_t tag = static_cast<int8_t>(hash & 0x7F);
+        size_t group = (hash >> 7) & groupMask_;
+        for (size_t step = 1;; step++) {
+            const size_t base = group * GROUP;
+            for (uint32_t mask = _match(base, tag); mask != 0; mask &= mask - 1) {
+                const size_t slot = base + std::countr_zero(mask);
+                if (slotHashes_[slot] == hash) {
+                    return slot;
+                }
+            }
+            if (_match(base, EMPTY) != 0) {
+                return NONE;
+            }
+            group = (group + step) & groupMask_;
+        }
+    }
+
+    /**
+     * The first empty slot along hash's probe sequence.
+     */
+    [[nodiscard]] size_t _freeSlot(uint64_t hash) const {
+        size_t group = (hash >> 7) & groupMask_;
+        for (size_t step = 1;; step++) {
+            const uint32_t empty = _match(group * GROUP, EMPTY);
+            if (empty != 0) {
+                return group * GROUP + std::countr_zero(empty);
+            }
+            group = (group + step) & groupMask_;
+        }
+    }
+
+    std::vector <int8_t>    control_;       ///< Per slot: low 7 bits of its hash, or EMPTY
+    std::vector <uint64_t>  slotHashes_;    ///< Full hash of each used slot
+    std::vector <uint32_t>  heads_;         ///< First row of each used slot
+    std::vector <uint32_t>  next_;          ///< Next row with the same hash, per row
+    size_t                  groupMask_ = 0; ///< Group count minus one
+};
+
+#endif //BIOMAPPER_KEYHASHTABLE_H
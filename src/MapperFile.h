@@ -10,6 +10,14 @@
 #ifndef BIOMAPPER_MAPPERFILE_H
 #define BIOMAPPER_MAPPERFILE_H
 
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class SharedIndex;
+
 /**
  *
  */
@@ -27,23 +35,18 @@ public:
      */
     MapperFile(const char * file_path, int join_index, long long int start_range_index, long long int end_range_index = -1,
                bool zero_based_range = false, bool has_header = true, char delimiter = ',')
-            : file_path_(file_path), join_index_(join_index), start_range_index_(start_range_index), end_range_index_(end_range_index),
-              zero_based_range_(zero_based_range), has_header_(has_header), delimiter_(delimiter) {}
+            : join_index_(join_index), start_range_index_(start_range_index), end_range_index_(end_range_index),
+              zero_based_range_(zero_based_range), has_header_(has_header), delimiter_(delimiter), file_path_(file_path) {}
 
     /**
      *
      */
     ~MapperFile() = default;
 
-    MapperFile(const MapperFile &mf) {
-        file_path_ = mf.file_path();
-        join_index_ = mf.join_index();
-        start_range_index_ = mf.start_range_index();
-        end_range_index_ = mf.end_range_index();
-        zero_based_range_ = mf.zero_based_range();
-        has_header_ = mf.has_header();
-        delimiter_ = mf.delimiter();
-    }
+    MapperFile(const MapperFile &) = default;
+    MapperFile(MapperFile &&) noexcept = default;
+    MapperFile & operator=(const MapperFile &) = default;
+    MapperFile & operator=(MapperFile &&) noexcept = default;
 
     /*****************************************************************************
      *
@@ -74,11 +77,8 @@ public:
     /**
      *
      * @return Returns the full file path with the file name.
-     *
-     * @note A reference cannot be used here for the return value since an std::variant
-     * is being populated with it.
      */
-    [[nodiscard]] std::string file_path() const { return file_path_;}
+    [[nodiscard]] const std::string & file_path() const { return file_path_;}
 
     /**
      *
@@ -92,6 +92,19 @@ public:
      */
     [[nodiscard]] int64_t start_range_index() const { return start_range_index_;}
 
+    /**
+     * @brief Key columns for exact key joins.
+     *
+     * The columns whose values together form the row's key when mapping in
+     * JoinMode::Key.  Without a call to set_key_indexes() this is the join
+     * column alone.
+     *
+     * @return The key column indexes (zero based), in key order.
+     */
+    [[nodiscard]] std::vector <int32_t> key_indexes() const {
+        return key_indexes_.empty() ? std::vector <int32_t>{join_index_} : key_indexes_;
+    }
+
     /**
      * @brief End range index
      *
@@ -135,12 +148,46 @@ public:
      */
     [[nodiscard]] char delimiter() const { return delimiter_;}
 
+    /**
+     * @brief If fields may be quoted.
+     *
+     * Quoted fields (RFC 4180) may hold the delimiter, newlines and doubled
+     * quotes; they are read without their quotes.  Off by default, as the
+     * quote-aware split costs more on the blocks and rows that do hold quotes.
+     *
+     * @retval true Fields in double quotes are read as one value.
+     * @retval false Quotes are ordinary characters.
+     */
+    [[nodiscard]] bool quoted() const { return quoted_;}
+
+    /**
+     *
+     * @return The column names by index (zero based); empty until the header is parsed.
+     */
+    [[nodiscard]] const std::map <uint32_t, std::string> & header() const { return header_;}
+
+    /**
+     * @brief The shared index the file is mapped from, if any.
+     *
+     * A file with a shared index is not parsed for range joins; its
+     * references and rows come from the index.  See SharedIndex.
+     *
+     * @return The index, or null to read the file itself.
+     */
+    [[nodiscard]] const std::shared_ptr <const SharedIndex> & shared_index() const { return shared_index_;}
+
 
     /*****************************************************************************
      *
      * Setters
      *
      *****************************************************************************/
+    /**
+     *
+     * @param[in] file_path Another file of the same layout, e.g. a sample of this one.
+     */
+    void set_file_path(std::string file_path) { file_path_ = std::move(file_path);}
+
     /**
      *
      * @param[in] join_index
@@ -153,6 +200,12 @@ public:
      */
     void set_start_range_index(int64_t start_range_index) {  start_range_index_ = start_range_index;}
 
+    /**
+     *
+     * @param[in] key_indexes Columns forming a composite key, in key order.
+     */
+    void set_key_indexes(std::vector <int32_t> key_indexes) { key_indexes_ = std::move(key_indexes);}
+
     /**
      *
      * @param[in] end_range_index
@@ -171,6 +224,18 @@ public:
      */
     void set_delimiter(char delimiter)  { delimiter_ = delimiter;}
 
+    /**
+     *
+     * @param[in] quoted Whether fields may be quoted; see quoted().
+     */
+    void set_quoted(bool quoted)  { quoted_ = quoted;}
+
+    /**
+     *
+     * @param[in] shared_index An index built from this file with the same settings, or null.
+     */
+    void set_shared_index(std::shared_ptr <const SharedIndex> shared_index) { shared_index_ = std::move(shared_index);}
+
     /**
      *
      * @param[in] column_index The zero (0) based index of the column in the file.
@@ -190,7 +255,7 @@ public:
      * @param[in] column_names Ordered list of column names.
      */
     void replace_header(std::vector<std::string> &column_names) {
-        for (int i = 0; i < column_names.size(); i++) {
+        for (size_t i = 0; i < column_names.size(); i++) {
             header_[i] = std::move(column_names[i]);
         }
     }
@@ -224,7 +289,10 @@ private:
     bool        zero_based_range_;          ///<
     bool        has_header_;          ///<
     char        delimiter_;           ///<
+    bool        quoted_ = false;      ///< Fields may be in double quotes (RFC 4180)
     std::string file_path_{};         ///<
+    std::vector <int32_t> key_indexes_{}; ///< Composite key columns; empty for the join column alone
+    std::shared_ptr <const SharedIndex> shared_index_{}; ///< Index mapped instead of parsing the file, if any
 
     // Extrapolated variables
     std::map <uint32_t, std::string> header_{}; ///<
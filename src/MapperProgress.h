@@ -0,0 +1,244 @@
+/*! \file MapperProgress.h
+    \author John Torcivia, Ph.D.
+
+    \brief Live progress of a map() run, and the means to stop one early.
+
+    The pipeline counts what it has done per batch: rows and bytes of each
+    file as blocks are parsed, and the references (or key join chunks)
+    delivered as their last batch is written.  The counters are relaxed
+    atomics, so progress() can be read from any thread while map() runs.
+
+    A run is stopped cooperatively, by a CancelToken or a deadline, both
+    checked between batches by the readers, the mappers and the thread
+    delivering the results.  A stopped run frees its annotations and
+    returns false; what it wrote to the output file so far stays, and with
+    checkpoints it can be resumed.
+*/
+
+#ifndef BIOMAPPER_MAPPERPROGRESS_H
+#define BIOMAPPER_MAPPERPROGRESS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "MapperStats.h"
+
+/**
+ * @brief Shared flag asking a run to stop.
+ *
+ * Copies share the flag, so a service can keep one copy and hand the
+ * other to the mapper; cancel() is safe from any thread, and stays set.
+ */
+class CancelToken {
+public:
+    CancelToken() : cancelled_(std::make_shared<std::atomic <bool> >(false)) {}
+
+    void cancel() { cancelled_->store(true, std::memory_order_relaxed); }
+
+    [[nodiscard]] bool cancelled() const { return cancelled_->load(std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr <std::atomic <bool> > cancelled_;
+};
+
+/**
+ * Why a run stopped early.
+ */
+enum class StopReason {
+    None,       ///< It was not stopped
+    Cancelled,  ///< Its CancelToken was cancelled
+    Deadline,   ///< Its deadline passed
+    Callback    ///< Its result callback threw
+};
+
+/**
+ *
+ */
+class MapperProgress {
+public:
+    /**
+     * One file in the current stage.
+     */
+    struct FileProgress {
+        uint64_t    bytes = 0;      ///< Bytes done
+        uint64_t    totalBytes = 0; ///< Bytes the stage reads of it; 0 if it reads none
+        uint64_t    rows = 0;       ///< Rows done
+    };
+
+    /**
+     * @brief Progress at one moment.
+     *
+     * The run goes through its stages (the references, reading, then
+     * mapping and writing, which overlap) each for an equal share of
+     * fraction; the remaining time extrapolates the time taken so far.
+     */
+    struct Snapshot {
+        bool                        running = false;    ///< Whether map() is under way
+        MapperStats::Stage          stage = MapperStats::Stage::Verify;
+        std::vector <FileProgress>  files;              ///< By file, in the order added
+        uint64_t                    partsDone = 0;      ///< References (chunks in key joins) mapped and written
+        uint64_t                    partsTotal = 0;     ///< Of the mapping stage; 0 before it
+        uint64_t                    results = 0;        ///< Results delivered
+        double                      fraction = 0;       ///< Of the run, from 0 to 1
+        double                      elapsedSeconds = 0;
+        double                      remainingSeconds = -1;  ///< Estimated; -1 until something is done
+    };
+
+    /**
+     * Begin a run of file_count files through stage_count stages.
+     */
+    void start(size_t file_count, size_t stage_count) {
+        const std::scoped_lock lock(mtx_);
+        files_ = std::make_unique<FileCounters[]>(file_count);
+        fileCount_ = file_count;
+        stageCount_ = stage_count == 0 ? 1 : stage_count;
+        stagesDone_.store(0, std::memory_order_relaxed);
+        partsDone_.store(0, std::memory_order_relaxed);
+        partsTotal_.store(0, std::memory_order_relaxed);
+        results_.store(0, std::memory_order_relaxed);
+        stageEntered_ = false;
+        stage_ = MapperStats::Stage::Verify;
+        started_ = finished_ = std::chrono::steady_clock::now();
+        running_.store(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Enter a stage reading files; the counters of the last stage are cleared.
+     *
+     * @param total_bytes Bytes the stage reads of each file; the files
+     *                    counted, should they be more than start() was given.
+     */
+    void beginFiles(MapperStats::Stage stage, const std::vector <uint64_t> & total_bytes) {
+        const std::scoped_lock lock(mtx_);
+        _advance(stage);
+        if (total_bytes.size() > fileCount_) {
+            files_ = std::make_unique<FileCounters[]>(total_bytes.size());
+            fileCount_ = total_bytes.size();
+        }
+        for (size_t f = 0; f < fileCount_; f++) {
+            files_[f].bytes.store(0, std::memory_order_relaxed);
+            files_[f].rows.store(0, std::memory_order_relaxed);
+            files_[f].totalBytes.store(f < total_bytes.size() ? total_bytes[f] : 0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Enter the mapping stage.
+     *
+     * @param parts References (or chunks) to map and write.
+     */
+    void beginParts(uint64_t parts) {
+        const std::scoped_lock lock(mtx_);
+        _advance(MapperStats::Stage::Map);
+        partsTotal_.store(parts, std::memory_order_relaxed);
+    }
+
+    /**
+     * Count a batch of rows of one file; safe from any thread.
+     */
+    void addRows(size_t file, uint64_t rows, uint64_t bytes) {
+        files_[file].rows.fetch_add(rows, std::memory_order_relaxed);
+        files_[file].bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void addParts(uint64_t parts) { partsDone_.fetch_add(parts, std::memory_order_relaxed); }
+
+    void addResults(uint64_t results) { results_.fetch_add(results, std::memory_order_relaxed); }
+
+    /**
+     * @brief End the run.
+     *
+     * @param completed Whether it ran to the end; a stopped run keeps the fraction it reached.
+     */
+    void finish(bool completed) {
+        const std::scoped_lock lock(mtx_);
+        if (completed) {
+            stagesDone_.store(stageCount_, std::memory_order_relaxed);
+        }
+        finished_ = std::chrono::steady_clock::now();
+        running_.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     *
+     * @return The progress now.
+     */
+    [[nodiscard]] Snapshot snapshot() const {
+        const std::scoped_lock lock(mtx_);
+        Snapshot snapshot;
+        snapshot.running = running_.load(std::memory_order_relaxed);
+        snapshot.stage = stage_;
+        snapshot.partsDone = partsDone_.load(std::memory_order_relaxed);
+        snapshot.partsTotal = partsTotal_.load(std::memory_order_relaxed);
+        snapshot.results = results_.load(std::memory_order_relaxed);
+
+        uint64_t bytes = 0, totalBytes = 0;
+        for (size_t f = 0; f < fileCount_; f++) {
+            FileProgress & file = snapshot.files.emplace_back();
+            file.bytes = files_[f].bytes.load(std::memory_order_relaxed);
+            file.totalBytes = files_[f].totalBytes.load(std::memory_order_relaxed);
+            file.rows = files_[f].rows.load(std::memory_order_relaxed);
+            bytes += std::min(file.bytes, file.totalBytes);
+            totalBytes += file.totalBytes;
+        }
+        double stageFraction = 0;
+        if (snapshot.partsTotal > 0) {
+            stageFraction = static_cast<double>(snapshot.partsDone) / static_cast<double>(snapshot.partsTotal);
+        } else if (totalBytes > 0) {
+            stageFraction = static_cast<double>(bytes) / static_cast<double>(totalBytes);
+        }
+        snapshot.fraction = std::min(1.0, (static_cast<double>(stagesDone_.load(std::memory_order_relaxed)) + stageFraction)
+                                          / static_cast<double>(stageCount_));
+
+        const auto end = snapshot.running ? std::chrono::steady_clock::now() : finished_;
+        snapshot.elapsedSeconds = std::chrono::duration<double>(end - started_).count();
+        if (!snapshot.running) {
+            snapshot.remainingSeconds = 0;
+        } else if (snapshot.fraction > 0) {
+            snapshot.remainingSeconds = snapshot.elapsedSeconds * (1 - snapshot.fraction) / snapshot.fraction;
+        }
+        return snapshot;
+    }
+
+private:
+    /**
+     * One file's counters.
+     */
+    struct FileCounters {
+        std::atomic <uint64_t>  bytes = 0;
+        std::atomic <uint64_t>  totalBytes = 0;
+        std::atomic <uint64_t>  rows = 0;
+    };
+
+    /**
+     * Move to the next stage; mtx_ held.
+     */
+    void _advance(MapperStats::Stage stage) {
+        if (stageEntered_) {
+            stagesDone_.store(std::min(stageCount_, stagesDone_.load(std::memory_order_relaxed) + 1), std::memory_order_relaxed);
+        }
+        stageEntered_ = true;
+        stage_ = stage;
+    }
+
+    mutable std::mutex                      mtx_;               ///< Guards the file table and the stage
+    std::unique_ptr <FileCounters[]>        files_;
+    size_t                                  fileCount_ = 0;
+    size_t                                  stageCount_ = 1;    ///< Stages of the run
+    bool                                    stageEntered_ = false;
+    MapperStats::Stage                      stage_ = MapperStats::Stage::Verify;
+    std::atomic <size_t>                    stagesDone_ = 0;
+    std::atomic <uint64_t>                  partsDone_ = 0;
+    std::atomic <uint64_t>                  partsTotal_ = 0;
+    std::atomic <uint64_t>                  results_ = 0;
+    std::atomic <bool>                      running_ = false;
+    std::chrono::steady_clock::time_point   started_;
+    std::chrono::steady_clock::time_point   finished_;
+};
+
+#endif //BIOMAPPER_MAPPERPROGRESS_H
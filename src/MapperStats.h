@@ -0,0 +1,323 @@
+/*! \file MapperStats.h
+    \author John Torcivia, Ph.D.
+
+    \brief Per-stage runtime metrics for the mapping pipeline.
+
+    Each thread records into its own cache-line aligned block of counters, so
+    recording never contends; the blocks are summed when a snapshot is taken.
+    When disabled every recording call is a single branch on a flag.
+*/
+
+#ifndef BIOMAPPER_MAPPERSTATS_H
+#define BIOMAPPER_MAPPERSTATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ *
+ */
+class MapperStats {
+public:
+    /**
+     * The pipeline stages, in the order map() runs them.
+     */
+    enum class Stage { Verify, Header, References, Read, Map, Write };
+    static constexpr size_t STAGE_COUNT = 6;
+
+    /**
+     * @brief Aggregated metrics of one stage.
+     *
+     * Rows and bytes are what the stage consumed (header, references, read)
+     * or produced (map: result pairs, write: result lines).  Consumer stall
+     * is time spent waiting for input (tasks waiting in the pool queue for a
+     * worker, the writer waiting on mappers); producer stall is time spent
+     * blocked on a full downstream buffer.
+     */
+    struct StageStats {
+        uint64_t    bytes = 0;              ///< Bytes processed
+        uint64_t    rows = 0;               ///< Rows processed
+        uint64_t    wall_ns = 0;            ///< Wall time of the stage
+        uint64_t    producer_stall_ns = 0;  ///< Time producers were blocked, summed over threads
+        uint64_t    consumer_stall_ns = 0;  ///< Time consumers waited for input, summed over threads
+        uint64_t    max_queue_depth = 0;    ///< Largest queue depth observed
+        uint64_t    peak_memory_bytes = 0;  ///< Peak resident memory while the stage ran, see endStage()
+
+        [[nodiscard]] double rows_per_second() const {
+            return wall_ns == 0 ? 0.0 : static_cast<double>(rows) * 1e9 / static_cast<double>(wall_ns);
+        }
+    };
+
+    /**
+     * @brief Aggregated metrics of a run.
+     */
+    struct Snapshot {
+        std::array<StageStats, STAGE_COUNT> stages{};   ///< Indexed by Stage
+        uint64_t                            threads = 0; ///< Threads that recorded metrics
+
+        [[nodiscard]] const StageStats & operator[](Stage stage) const { return stages[static_cast<size_t>(stage)]; }
+
+        /**
+         * @return The snapshot as a JSON document.
+         */
+        [[nodiscard]] std::string toJson() const {
+            std::ostringstream json;
+            json << "{\n  \"threads\": " << threads << ",\n  \"stages\": {";
+            for (size_t i = 0; i < STAGE_COUNT; i++) {
+                const StageStats & s = stages[i];
+                json << (i == 0 ? "\n" : ",\n")
+                     << "    \"" << stageName(static_cast<Stage>(i)) << "\": {"
+                     << "\"wall_seconds\": " << static_cast<double>(s.wall_ns) / 1e9
+                     << ", \"bytes\": " << s.bytes
+                     << ", \"rows\": " << s.rows
+                     << ", \"rows_per_second\": " << s.rows_per_second()
+                     << ", \"max_queue_depth\": " << s.max_queue_depth
+                     << ", \"producer_stall_seconds\": " << static_cast<double>(s.producer_stall_ns) / 1e9
+                     << ", \"consumer_stall_seconds\": " << static_cast<double>(s.consumer_stall_ns) / 1e9
+                     << ", \"peak_memory_bytes\": " << s.peak_memory_bytes << "}";
+            }
+            json << "\n  }\n}\n";
+            return json.str();
+        }
+    };
+
+    MapperStats() : id_(_nextId()) {}
+    ~MapperStats() = default;
+
+    MapperStats(const MapperStats &) = delete;
+    MapperStats & operator=(const MapperStats &) = delete;
+
+    /**
+     *
+     * @param enabled Whether metrics are recorded.
+     */
+    void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+    [[nodiscard]] bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    /**
+     * Zero every counter, e.g. at the start of a run, and drop the blocks of
+     * the threads that recorded before.  Not while any thread records.
+     */
+    void reset() {
+        const std::scoped_lock lock(mtx_);
+        // A new ID misses every thread's cached block before it is freed.
+        id_.store(_nextId(), std::memory_order_relaxed);
+        threads_.clear();
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            wallNs_[i].store(0, std::memory_order_relaxed);
+            peakMemory_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /*****************************************************************************
+     *
+     * Recording - safe to call from any thread
+     *
+     *****************************************************************************/
+
+    void addRows(Stage stage, uint64_t rows, uint64_t bytes) {
+        if (!enabled()) {
+            return;
+        }
+        auto & values = _local().values[static_cast<size_t>(stage)];
+        _add(values[ROWS], rows);
+        _add(values[BYTES], bytes);
+    }
+
+    void addProducerStall(Stage stage, uint64_t ns) {
+        if (enabled()) {
+            _add(_local().values[static_cast<size_t>(stage)][PRODUCER_STALL], ns);
+        }
+    }
+
+    void addConsumerStall(Stage stage, uint64_t ns) {
+        if (enabled()) {
+            _add(_local().values[static_cast<size_t>(stage)][CONSUMER_STALL], ns);
+        }
+    }
+
+    void recordQueueDepth(Stage stage, uint64_t depth) {
+        if (!enabled()) {
+            return;
+        }
+        auto & value = _local().values[static_cast<size_t>(stage)][QUEUE_DEPTH];
+        if (depth > value.load(std::memory_order_relaxed)) {
+            value.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Mark the start of a stage, noting the process' resident and peak resident sizes.
+     */
+    void beginStage(Stage stage) {
+        if (!enabled()) {
+            return;
+        }
+        const size_t i = static_cast<size_t>(stage);
+        stageResident_[i] = _resident();
+        stageStart_[i] = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * @brief Mark the end of a stage, recording its wall time and peak memory.
+     *
+     * The kernel keeps one peak (VmHWM) for the whole process, and it is
+     * not reset here.  If it rose during the stage, that is the stage's
+     * peak; otherwise the stage stayed below it, and the larger of the
+     * resident sizes at its start and end is recorded.
+     */
+    void endStage(Stage stage) {
+        if (!enabled()) {
+            return;
+        }
+        const size_t i = static_cast<size_t>(stage);
+        wallNs_[i].store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - stageStart_[i]).count()), std::memory_order_relaxed);
+        const Resident start = stageResident_[i];
+        const Resident end = _resident();
+        peakMemory_[i].store(end.peak > start.peak ? end.peak : std::max(start.current, end.current),
+                             std::memory_order_relaxed);
+    }
+
+    /**
+     * @return Nanoseconds since the given time point, for stall accounting.
+     */
+    static uint64_t elapsedNs(std::chrono::steady_clock::time_point since) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - since).count());
+    }
+
+    /**
+     * @return The sum of every thread's counters.
+     */
+    [[nodiscard]] Snapshot snapshot() const {
+        Snapshot snapshot;
+        const std::scoped_lock lock(mtx_);
+        snapshot.threads = threads_.size();
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            StageStats & s = snapshot.stages[i];
+            for (const auto & block : threads_) {
+                const auto & values = block->values[i];
+                s.rows += values[ROWS].load(std::memory_order_relaxed);
+                s.bytes += values[BYTES].load(std::memory_order_relaxed);
+                s.producer_stall_ns += values[PRODUCER_STALL].load(std::memory_order_relaxed);
+                s.consumer_stall_ns += values[CONSUMER_STALL].load(std::memory_order_relaxed);
+                s.max_queue_depth = std::max(s.max_queue_depth, values[QUEUE_DEPTH].load(std::memory_order_relaxed));
+            }
+            s.wall_ns = wallNs_[i].load(std::memory_order_relaxed);
+            s.peak_memory_bytes = peakMemory_[i].load(std::memory_order_relaxed);
+        }
+        return snapshot;
+    }
+
+    /**
+     * @param[in] path File to write the JSON snapshot to.
+     * @retval true The file was written.
+     */
+    bool writeJson(const std::string & path) const {
+        std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+        out << snapshot().toJson();
+        return !out.fail();
+    }
+
+    static const char * stageName(Stage stage) {
+        static const char * names[STAGE_COUNT] = {"verify", "header", "references", "read", "map", "write"};
+        return names[static_cast<size_t>(stage)];
+    }
+
+private:
+    enum Field { ROWS, BYTES, PRODUCER_STALL, CONSUMER_STALL, QUEUE_DEPTH, FIELD_COUNT };
+
+    /**
+     * One thread's counters.  Only the owning thread writes, so plain
+     * load/store pairs are enough; atomics keep concurrent snapshots defined.
+     */
+    struct alignas(64) ThreadCounters {
+        std::thread::id owner;
+        std::array<std::array<std::atomic<uint64_t>, FIELD_COUNT>, STAGE_COUNT> values{};
+    };
+
+    static void _add(std::atomic<uint64_t> & value, uint64_t amount) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return The calling thread's counters, registering them on first use.
+     */
+    ThreadCounters & _local() {
+        // One cached entry per thread; instance IDs are never reused, so a
+        // stale entry from a destroyed instance can never match.
+        thread_local uint64_t cachedId = 0;
+        thread_local ThreadCounters * cached = nullptr;
+        if (cachedId == id_.load(std::memory_order_relaxed)) {
+            return *cached;
+        }
+
+        const std::scoped_lock lock(mtx_);
+        const std::thread::id self = std::this_thread::get_id();
+        ThreadCounters * block = nullptr;
+        for (auto & existing : threads_) {
+            if (existing->owner == self) {
+                block = existing.get();
+                break;
+            }
+        }
+        if (block == nullptr) {
+            threads_.push_back(std::make_unique<ThreadCounters>());
+            block = threads_.back().get();
+            block->owner = self;
+        }
+        cachedId = id_.load(std::memory_order_relaxed);
+        cached = block;
+        return *block;
+    }
+
+    static uint64_t _nextId() {
+        static std::atomic<uint64_t> next = 1;
+        return next++;
+    }
+
+    /**
+     * The process' resident set sizes in bytes, 0 where unknown.
+     */
+    struct Resident {
+        uint64_t    current = 0;    ///< VmRSS
+        uint64_t    peak = 0;       ///< VmHWM, the peak of the process so far
+    };
+
+    static Resident _resident() {
+        Resident resident;
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("VmHWM:", 0) == 0) {
+                resident.peak = std::stoull(line.substr(6)) * 1024;
+            } else if (line.rfind("VmRSS:", 0) == 0) {
+                resident.current = std::stoull(line.substr(6)) * 1024;
+            }
+        }
+        return resident;
+    }
+
+    std::atomic<uint64_t>                           id_;                ///< Unique instance ID, new on each reset()
+    std::atomic<bool>                               enabled_ = false;   ///< Whether metrics are recorded
+    mutable std::mutex                              mtx_;               ///< Guards threads_
+    std::vector<std::unique_ptr<ThreadCounters> >   threads_;           ///< Counters of each recording thread
+    std::array<std::chrono::steady_clock::time_point, STAGE_COUNT> stageStart_{}; ///< Stage start times
+    std::array<Resident, STAGE_COUNT>               stageResident_{};   ///< Resident sizes at each stage's start
+    std::array<std::atomic<uint64_t>, STAGE_COUNT>  wallNs_{};          ///< Wall time per stage
+    std::array<std::atomic<uint64_t>, STAGE_COUNT>  peakMemory_{};      ///< Peak RSS per stage
+};
+
+#endif //BIOMAPPER_MAPPERSTATS_H
@@ -0,0 +1,117 @@
+/*! \file MemoryBudget.h
+    \author John Torcivia, Ph.D.
+
+    \brief Accounting for a hard cap on the mapper's memory.
+
+    The pipeline charges the estimated size of what it keeps (annotations,
+    their sorted indexes, buffered results) and releases it when the data is
+    spilled to disk or freed.  Readers that push the total over the limit
+    spill their own partitions and, if that is not enough, wait for room.
+*/
+
+#ifndef BIOMAPPER_MEMORYBUDGET_H
+#define BIOMAPPER_MEMORYBUDGET_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ *
+ */
+class MemoryBudget {
+public:
+    MemoryBudget() = default;
+    ~MemoryBudget() = default;
+
+    MemoryBudget(const MemoryBudget &) = delete;
+    MemoryBudget & operator=(const MemoryBudget &) = delete;
+
+    /**
+     * @param limit Cap in bytes; 0 for no cap.
+     */
+    void setLimit(uint64_t limit) { limit_.store(limit, std::memory_order_relaxed); }
+
+    [[nodiscard]] uint64_t limit() const { return limit_.load(std::memory_order_relaxed); }
+
+    /**
+     * @retval true A cap is set.
+     */
+    [[nodiscard]] bool enabled() const { return limit() != 0; }
+
+    /**
+     * @return Bytes currently charged.
+     */
+    [[nodiscard]] uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    /**
+     * @return The most bytes charged at once since the last reset().
+     */
+    [[nodiscard]] uint64_t peak() const { return peak_.load(std::memory_order_relaxed); }
+
+    /**
+     * @return Bytes left under the cap, 0 if over it or if there is no cap.
+     */
+    [[nodiscard]] uint64_t available() const {
+        const uint64_t cap = limit(), inUse = used();
+        return inUse >= cap ? 0 : cap - inUse;
+    }
+
+    /**
+     * @retval true A cap is set and the charged bytes exceed it.
+     */
+    [[nodiscard]] bool overLimit() const { return enabled() && used() > limit(); }
+
+    /**
+     * Charge bytes against the budget; never blocks.
+     */
+    void charge(uint64_t bytes) {
+        const uint64_t now = used_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        uint64_t seen = peak_.load(std::memory_order_relaxed);
+        while (now > seen && !peak_.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    /**
+     * Return bytes to the budget and wake anyone waiting for room.
+     */
+    void release(uint64_t bytes) {
+        uint64_t seen = used_.load(std::memory_order_relaxed);
+        while (!used_.compare_exchange_weak(seen, seen - std::min(seen, bytes), std::memory_order_relaxed)) {
+        }
+        const std::scoped_lock lock(mtx_);
+        room_.notify_all();
+    }
+
+    /**
+     * @brief Block until the charged bytes are back under the cap.
+     *
+     * @param timeout Longest time to wait.
+     * @retval true There is room.
+     * @retval false Timed out still over the cap.
+     */
+    bool waitForRoom(std::chrono::milliseconds timeout) {
+        std::unique_lock lock(mtx_);
+        return room_.wait_for(lock, timeout, [this]() { return !overLimit(); });
+    }
+
+    /**
+     * Forget all charges, e.g. when everything kept has been dropped.
+     */
+    void reset() {
+        used_.store(0, std::memory_order_relaxed);
+        peak_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t>       limit_ = 0;     ///< Cap in bytes, 0 for none
+    std::atomic<uint64_t>       used_ = 0;      ///< Bytes charged
+    std::atomic<uint64_t>       peak_ = 0;      ///< Most bytes charged at once
+    std::mutex                  mtx_;           ///< Pairs with room_
+    std::condition_variable     room_;          ///< Signalled on every release
+};
+
+#endif //BIOMAPPER_MEMORYBUDGET_H
@@ -0,0 +1,145 @@
+/*! \file Nearest.h
+    \author John Torcivia, Ph.D.
+
+    \brief k nearest and window searches over one file's ranges of a reference.
+
+    The distance between two ranges is 0 if they overlap and otherwise the
+    gap between them plus one, so book-ended ranges are 1 apart and a window
+    of d keeps the ranges OverlapMode::Within d would.  For a query [s, e)
+    the candidates fall in three disjoint runs: those overlapping it, found
+    among the ranges starting before e by the running maximum of the ends;
+    those starting at or after e, nearest first in start order; and those
+    ending at or before s, nearest first in descending end order.  A search
+    walks the two outer runs outwards like a merge, so it touches only the
+    candidates it returns (and their ties) after two binary searches.
+*/
+
+#ifndef BIOMAPPER_NEAREST_H
+#define BIOMAPPER_NEAREST_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "Annotation.h"
+
+/**
+ * Which side of a query candidates may lie on; overlapping ones always count.
+ */
+enum class NearestDirection {
+    Any,            ///< Either side, by distance alone
+    Upstream,       ///< Before the query, on its strand
+    Downstream      ///< After the query, on its strand
+};
+
+/**
+ * How the nearest candidates of each row are chosen.
+ */
+struct NearestOptions {
+    uint32_t            k = 1;              ///< Candidates per row; 0 for every candidate in the window
+    long long int       window = -1;        ///< Largest distance kept; -1 for no limit
+    NearestDirection    direction = NearestDirection::Any;
+    bool                ties = true;        ///< Also keep the candidates tied with the k-th
+    int                 strandColumn = -1;  ///< Column holding the query row's strand, where "-" swaps up and downstream; -1 for none
+};
+
+/**
+ *
+ */
+class NearestIndex {
+public:
+    /**
+     * @param ranges One file's sorted ranges of a reference; they must outlive the index.
+     */
+    explicit NearestIndex(const SortedRanges & ranges) : ranges_(&ranges), prefixMaxEnd_(ranges.starts.size()),
+                                                          byEnd_(ranges.starts.size()) {
+        long long int running = LLONG_MIN;
+        for (size_t i = 0; i < ranges.ends.size(); i++) {
+            running = std::max(running, ranges.ends[i]);
+            prefixMaxEnd_[i] = running;
+        }
+        std::iota(byEnd_.begin(), byEnd_.end(), 0);
+        std::sort(byEnd_.begin(), byEnd_.end(), [&](uint32_t a, uint32_t b) {
+            return ranges.ends[a] != ranges.ends[b] ? ranges.ends[a] < ranges.ends[b] : a < b;
+        });
+        sortedEnds_.reserve(byEnd_.size());
+        for (uint32_t i : byEnd_) {
+            sortedEnds_.push_back(ranges.ends[i]);
+        }
+    }
+
+    /**
+     * @brief Find the nearest ranges to a query, calling emit(position, distance) for each.
+     *
+     * Overlapping ranges come first, in start order, then the others by
+     * distance, the upstream one first on a tie.  The distance is negative
+     * upstream and positive downstream of the query's strand.
+     *
+     * @param start Start of the query.
+     * @param end End of the query, exclusive.
+     * @param reverse Whether the query is on the reverse strand.
+     * @param options Which ranges to keep.
+     * @param emit Called with each range's position in the sorted ranges and its distance.
+     */
+    template <typename Emit>
+    void nearest(long long int start, long long int end, bool reverse, const NearestOptions & options, Emit emit) const {
+        const SortedRanges & ranges = *ranges_;
+        const size_t count = ranges.starts.size();
+        const uint32_t k = options.k;
+        uint32_t taken = 0;
+
+        // Ranges starting before end, less those whose running end is at or before start
+        const size_t after = std::lower_bound(ranges.starts.begin(), ranges.starts.end(), end) - ranges.starts.begin();
+        const size_t first = std::upper_bound(prefixMaxEnd_.begin(), prefixMaxEnd_.begin() + after, start) - prefixMaxEnd_.begin();
+        for (size_t p = first; p < after; p++) {
+            if (ranges.ends[p] > start) {
+                if (k != 0 && taken == k && !options.ties) {
+                    return;
+                }
+                emit(p, 0LL);
+                taken++;
+            }
+        }
+        if (k != 0 && taken >= k) {
+            return;
+        }
+
+        // Lower coordinates are upstream on the forward strand
+        const bool low = options.direction == NearestDirection::Any || ((options.direction == NearestDirection::Upstream) != reverse);
+        const bool high = options.direction == NearestDirection::Any || ((options.direction == NearestDirection::Downstream) != reverse);
+        const long long int lowSign = reverse ? 1 : -1;
+        size_t below = std::upper_bound(sortedEnds_.begin(), sortedEnds_.end(), start) - sortedEnds_.begin();
+        size_t above = after;
+        long long int last = -1;
+        while (true) {
+            const long long int lowDistance = low && below > 0 ? start - sortedEnds_[below - 1] + 1 : LLONG_MAX;
+            const long long int highDistance = high && above < count ? ranges.starts[above] - end + 1 : LLONG_MAX;
+            const long long int distance = std::min(lowDistance, highDistance);
+            if (distance == LLONG_MAX || (options.window >= 0 && distance > options.window)) {
+                return;
+            }
+            if (k != 0 && taken >= k && !(options.ties && distance == last)) {
+                return;
+            }
+            if (lowDistance <= highDistance) {
+                below--;
+                emit(static_cast<size_t>(byEnd_[below]), lowSign * distance);
+            } else {
+                emit(above, -lowSign * distance);
+                above++;
+            }
+            taken++;
+            last = distance;
+        }
+    }
+
+private:
+    const SortedRanges *            ranges_;        ///< Ranges sorted by start
+    std::vector <long long int>     prefixMaxEnd_;  ///< Largest end among ranges [0, i]
+    std::vector <uint32_t>          byEnd_;         ///< Positions of the ranges, by ascending end
+    std::vector <long long int>     sortedEnds_;    ///< Ends in the order of byEnd_
+};
+
+#endif //BIOMAPPER_NEAREST_H
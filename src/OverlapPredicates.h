@@ -0,0 +1,178 @@
+/*! \file OverlapPredicates.h
+    \author John Torcivia, Ph.D.
+
+    \brief Compile time interval predicates and their batch kernels.
+
+    Overlap, containment, within-distance and point-hit tests all reduce to
+    two comparisons against a window derived from the query once:
+
+        candidate start < window.startBelow  and  candidate end > window.endAbove
+
+    Each predicate is a type giving that window for one mapping mode and
+    coordinate convention, so the mode is chosen once per batch and the
+    inner loop is specialized for it.  The same window bounds the binary
+    searches of an index, and the batch kernel tests OVERLAP_BATCH candidates of the
+    columnar start and end arrays at a time.  With AVX2 (BIOMAPPER_AVX2) the
+    kernel compares four 64 bit coordinates per instruction; otherwise it
+    is the scalar loop.
+*/
+
+#ifndef BIOMAPPER_OVERLAPPREDICATES_H
+#define BIOMAPPER_OVERLAPPREDICATES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/**
+ * How the coordinates compared are bounded.  The reader stores every
+ * annotation half open (zero_based_range is applied when the file is read),
+ * so the map engines and QueryEngine always match HalfOpen; Closed is for
+ * callers holding raw closed coordinates.
+ */
+enum class Coordinates {
+    HalfOpen,   ///< [start, end)
+    Closed      ///< [start, end]
+};
+
+/**
+ * Which candidates a query selects.
+ */
+enum class OverlapMode {
+    Overlap,    ///< Candidates sharing a position with the query
+    Contains,   ///< Candidates containing the whole query
+    Within,     ///< Candidates no further than a distance from the query
+    PointHit    ///< Candidates containing the query's start position
+};
+
+/**
+ * The query side of a predicate, in the predicate's coordinates.
+ */
+struct RangeQuery {
+    long long int   start = 0;
+    long long int   end = 0;
+    long long int   distance = 0;   ///< Gap allowed by Within
+};
+
+/**
+ * A candidate (start, end) matches if start < startBelow and end > endAbove.
+ */
+struct RangeWindow {
+    long long int   startBelow;
+    long long int   endAbove;
+};
+
+template <Coordinates C>
+struct OverlapPredicate {
+    static constexpr RangeWindow window(const RangeQuery & q) {
+        if constexpr (C == Coordinates::HalfOpen) {
+            return {q.end, q.start};
+        } else {
+            return {q.end + 1, q.start - 1};
+        }
+    }
+};
+
+template <Coordinates C>
+struct ContainsPredicate {
+    // Same in both conventions: start <= query start and end >= query end.
+    static constexpr RangeWindow window(const RangeQuery & q) {
+        return {q.start + 1, q.end - 1};
+    }
+};
+
+template <Coordinates C>
+struct WithinPredicate {
+    // Overlap with the query widened by the distance on both sides.
+    static constexpr RangeWindow window(const RangeQuery & q) {
+        return OverlapPredicate<C>::window(RangeQuery{q.start - q.distance, q.end + q.distance});
+    }
+};
+
+template <Coordinates C>
+struct PointHitPredicate {
+    static constexpr RangeWindow window(const RangeQuery & q) {
+        if constexpr (C == Coordinates::HalfOpen) {
+            return {q.start + 1, q.start};
+        } else {
+            return {q.start + 1, q.start - 1};
+        }
+    }
+};
+
+/**
+ * Candidates tested per call of matchBatch().
+ */
+constexpr size_t OVERLAP_BATCH = 16;
+
+/**
+ * @return Whether one candidate matches the window.
+ */
+inline bool matchRange(const RangeWindow & window, long long int start, long long int end) {
+    return start < window.startBelow && end > window.endAbove;
+}
+
+/**
+ * @brief Test OVERLAP_BATCH candidates one at a time.
+ *
+ * @return Bit i set if candidate i matches.
+ */
+inline uint32_t matchBatchScalar(const RangeWindow & window, const long long int * starts, const long long int * ends) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < OVERLAP_BATCH; i++) {
+        mask |= static_cast<uint32_t>(matchRange(window, starts[i], ends[i])) << i;
+    }
+    return mask;
+}
+
+/**
+ * @brief Test OVERLAP_BATCH candidates, vectorized when built for AVX2.
+ *
+ * @param starts OVERLAP_BATCH candidate starts; no alignment needed.
+ * @param ends The candidates' ends.
+ * @return Bit i set if candidate i matches.
+ */
+inline uint32_t matchBatch(const RangeWindow & window, const long long int * starts, const long long int * ends) {
+#ifdef __AVX2__
+    const __m256i below = _mm256_set1_epi64x(window.startBelow);
+    const __m256i above = _mm256_set1_epi64x(window.endAbove);
+    uint32_t mask = 0;
+    for (size_t i = 0; i < OVERLAP_BATCH; i += 4) {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(starts + i));
+        const __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ends + i));
+        const __m256i hit = _mm256_and_si256(_mm256_cmpgt_epi64(below, s), _mm256_cmpgt_epi64(e, above));
+        mask |= static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(hit))) << i;
+    }
+    return mask;
+#else
+    return matchBatchScalar(window, starts, ends);
+#endif
+}
+
+/**
+ * @brief Call fn with a value of the predicate type for mode and coordinates.
+ *
+ * Selects the specialization once, outside of the loop fn runs.
+ */
+template <typename Fn>
+decltype(auto) withPredicate(OverlapMode mode, Coordinates coordinates, Fn && fn) {
+    auto select = [&](auto convention) -> decltype(auto) {
+        constexpr Coordinates C = decltype(convention)::value;
+        switch (mode) {
+            case OverlapMode::Contains: return fn(ContainsPredicate<C>());
+            case OverlapMode::Within:   return fn(WithinPredicate<C>());
+            case OverlapMode::PointHit: return fn(PointHitPredicate<C>());
+            default:                    return fn(OverlapPredicate<C>());
+        }
+    };
+    if (coordinates == Coordinates::Closed) {
+        return select(std::integral_constant<Coordinates, Coordinates::Closed>());
+    }
+    return select(std::integral_constant<Coordinates, Coordinates::HalfOpen>());
+}
+
+#endif //BIOMAPPER_OVERLAPPREDICATES_H
@@ -0,0 +1,212 @@
+/*! \file Placement.h
+    \author John Torcivia, Ph.D.
+
+    \brief CPU and NUMA placement helpers for the mapping pipeline.
+
+    Detects the NUMA topology visible to the process and provides the helpers
+    used to pin thread_pool workers to cores.  On machines without NUMA
+    information (or with a single node) everything degrades to one node that
+    owns every CPU the process is allowed to run on.
+*/
+
+#ifndef BIOMAPPER_PLACEMENT_H
+#define BIOMAPPER_PLACEMENT_H
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+/**
+ * How pipeline threads are placed on the machine.
+ */
+enum class PlacementPolicy {
+    None,       ///< Let the OS scheduler place threads (default).
+    PinCores,   ///< Pin each worker to a single core.
+    NumaAware   ///< Pin workers to cores and keep reader/mapper pairs and their streams on one NUMA node.
+};
+
+/**
+ * A single NUMA node and the CPUs the process may use on it.
+ */
+struct NumaNode {
+    int                 id;     ///< The kernel's node ID
+    std::vector<int>    cpus;   ///< CPUs on this node within the process affinity mask
+};
+
+/**
+ *
+ */
+class NumaTopology {
+public:
+    /**
+     * @brief Detect the topology of the current machine.
+     *
+     * Reads /sys/devices/system/node and intersects each node's CPU list with
+     * the process affinity mask.  Nodes without usable CPUs are dropped.  If no
+     * node information can be read, a single node holding all allowed CPUs is
+     * returned.
+     */
+    static NumaTopology detect() {
+        NumaTopology topology;
+        std::vector<int> allowed = _allowedCpus();
+
+#ifdef __linux__
+        DIR * dir = opendir("/sys/devices/system/node");
+        if (dir != nullptr) {
+            struct dirent * entry;
+            while ((entry = readdir(dir)) != nullptr) {
+                std::string name(entry->d_name);
+                if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                    !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+                    continue;
+                }
+                std::ifstream cpulist("/sys/devices/system/node/" + name + "/cpulist");
+                std::string list;
+                if (!std::getline(cpulist, list)) {
+                    continue;
+                }
+
+                NumaNode node{std::stoi(name.substr(4)), {}};
+                for (int cpu : _parseCpuList(list)) {
+                    if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                if (!node.cpus.empty()) {
+                    topology.nodes_.push_back(std::move(node));
+                }
+            }
+            closedir(dir);
+        }
+#endif
+
+        if (topology.nodes_.empty()) {
+            // No NUMA information; treat the machine as one node.
+            topology.nodes_.push_back(NumaNode{0, allowed});
+        }
+        std::sort(topology.nodes_.begin(), topology.nodes_.end(),
+                  [](const NumaNode & a, const NumaNode & b) { return a.id < b.id; });
+        return topology;
+    }
+
+    /**
+     * @return The number of nodes with usable CPUs (always at least one).
+     */
+    [[nodiscard]] size_t node_count() const { return nodes_.size(); }
+
+    /**
+     * @retval true More than one node is usable, so placement matters.
+     * @retval false Single node machine (or no NUMA information).
+     */
+    [[nodiscard]] bool is_numa() const { return nodes_.size() > 1; }
+
+    /**
+     * @return The usable nodes, ordered by node ID.
+     */
+    [[nodiscard]] const std::vector<NumaNode> & nodes() const { return nodes_; }
+
+    /**
+     * @return Every usable CPU, interleaved across nodes so that consecutive
+     * entries fall on different nodes.
+     */
+    [[nodiscard]] std::vector<int> interleaved_cpus() const {
+        std::vector<int> cpus;
+        for (size_t i = 0; ; i++) {
+            bool any = false;
+            for (const NumaNode & node : nodes_) {
+                if (i < node.cpus.size()) {
+                    cpus.push_back(node.cpus[i]);
+                    any = true;
+                }
+            }
+            if (!any) {
+                break;
+            }
+        }
+        return cpus;
+    }
+
+private:
+    /**
+     * @return Sorted list of the CPUs the process is allowed to run on.
+     */
+    static std::vector<int> _allowedCpus() {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &mask)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+#endif
+        if (cpus.empty()) {
+            unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int cpu = 0; cpu < count; cpu++) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+        return cpus;
+    }
+
+    /**
+     * Parse a kernel CPU list such as "0-3,8-11,16".
+     */
+    static std::vector<int> _parseCpuList(const std::string & list) {
+        std::vector<int> cpus;
+        std::stringstream _listElements(list);
+        std::string _element;
+        while (std::getline(_listElements, _element, ',')) {
+            if (_element.empty()) {
+                continue;
+            }
+            size_t dash = _element.find('-');
+            int first = std::stoi(_element.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(_element.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    std::vector<NumaNode> nodes_;   ///< Usable nodes
+};
+
+/**
+ * @brief Pin the calling thread to the given CPUs.
+ *
+ * @param[in] cpus The CPUs to allow; an empty list leaves the thread unpinned.
+ * @retval true The affinity was applied (or nothing was requested).
+ * @retval false The kernel rejected the mask; the thread keeps its old affinity.
+ */
+inline bool pin_current_thread(const std::vector<int> & cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &mask);
+        }
+    }
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else
+    return false;
+#endif
+}
+
+#endif //BIOMAPPER_PLACEMENT_H
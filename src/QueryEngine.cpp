@@ -0,0 +1,220 @@
+#include "QueryEngine.h"
+
+#include <algorithm>
+#include <bit>
+#include <latch>
+#include <numeric>
+#include <string_view>
+
+/*****************************************************************************************
+ * QueryEngine
+ *      Constructor
+ ****************************************************************************************/
+
+QueryEngine::QueryEngine(int threadsToUse /* =-1 */, int readingThreads /* =-1 */) : mapper_(threadsToUse, readingThreads) {
+    // Keep the references of single files too; a query can hit any of them.
+    mapper_.minFilesPerReference_ = 1;
+}
+
+bool QueryEngine::addFile(const char * file_path, int join_index, long long int start_range_index, long long int end_range_index,
+                          bool zero_based_range, bool has_header, char delimiter) {
+    return mapper_.addFile(file_path, join_index, start_range_index, end_range_index, zero_based_range, has_header, delimiter);
+}
+
+/******************************************************************
+ * Load
+ *      Read all files with the mapper's reader, then build the
+ *      overlap index of every reference, one pool task each.
+ ******************************************************************/
+bool QueryEngine::load() {
+    loaded_ = false;
+    references_.clear();
+    if (!pool_) {
+        pool_ = std::make_unique<thread_pool>(mapper_.threadsToUse_);
+        // Idle workers poll for tasks; a shorter sleep than the default
+        // millisecond keeps small batches low latency.
+        pool_->sleep_duration = 100;
+    }
+
+    mapper_.resetIndex();
+    JobPool job(*pool_);
+    if (!mapper_._ingest(job)) {
+        return false;
+    }
+    // Nothing is left to map; the next load() starts over.
+    mapper_.mappedFileCount_ = 0;
+
+    std::vector <std::pair <AnnotationStream *, ReferenceIndex *> > work;
+    for (auto & stream : mapper_.annotationStreams_) {
+        work.emplace_back(&stream.second, &references_[stream.first]);
+    }
+    for (auto & [stream, index] : work) {
+        pool_->push_task([stream = stream, index = index]() {
+            for (size_t f = 0; f < stream->fileCount(); f++) {
+                if (stream->annotations(f).empty()) {
+                    continue;
+                }
+                index->files.emplace_back(static_cast<uint32_t>(f), RangeIndex());
+                index->files.back().second.build(stream->sortedRanges(f), stream->annotations(f));
+            }
+        });
+    }
+    pool_->wait_for_tasks();
+    loaded_ = true;
+    return true;
+}
+
+/******************************************************************
+ * Range Index
+ ******************************************************************/
+void QueryEngine::RangeIndex::build(const SortedRanges & sorted, const std::vector <Annotation> & source) {
+    ranges = &sorted;
+    annotations = &source;
+    const size_t count = sorted.ends.size();
+    prefixMaxEnd.resize(count);
+    blockMaxEnd.assign((count + BLOCK - 1) / BLOCK, 0);
+    long long int running = 0;
+    for (size_t i = 0; i < count; i++) {
+        running = i == 0 ? sorted.ends[i] : std::max(running, sorted.ends[i]);
+        prefixMaxEnd[i] = running;
+        long long int & block = blockMaxEnd[i / BLOCK];
+        block = i % BLOCK == 0 ? sorted.ends[i] : std::max(block, sorted.ends[i]);
+    }
+}
+
+/**
+ * Call emit(annotation) for every range the predicate selects for query, in start order.
+ */
+template <typename Predicate, typename Emit>
+void QueryEngine::RangeIndex::matches(const RangeQuery & query, Emit emit) const {
+    const RangeWindow window = Predicate::window(query);
+    const auto & starts = ranges->starts;
+    const auto & ends = ranges->ends;
+    // Ranges from first on can still end late enough; ranges from last on start too late.
+    const size_t first = std::upper_bound(prefixMaxEnd.begin(), prefixMaxEnd.end(), window.endAbove) - prefixMaxEnd.begin();
+    const size_t last = std::lower_bound(starts.begin(), starts.end(), window.startBelow) - starts.begin();
+    size_t i = first;
+    while (i < last) {
+        if (i % BLOCK == 0 && blockMaxEnd[i / BLOCK] <= window.endAbove) {
+            i += BLOCK;
+            continue;
+        }
+        if (i % OVERLAP_BATCH == 0 && i + OVERLAP_BATCH <= last) {
+            for (uint32_t mask = matchBatch(window, &starts[i], &ends[i]); mask != 0; mask &= mask - 1) {
+                emit(&(*annotations)[ranges->order[i + std::countr_zero(mask)]]);
+            }
+            i += OVERLAP_BATCH;
+            continue;
+        }
+        if (matchRange(window, starts[i], ends[i])) {
+            emit(&(*annotations)[ranges->order[i]]);
+        }
+        i++;
+    }
+}
+
+/******************************************************************
+ * Query
+ *      Sort the batch by (reference, start), answer contiguous
+ *      chunks of it on the pool, then lay the hits out in the
+ *      caller's order: count per query, prefix sum, scatter.
+ ******************************************************************/
+bool QueryEngine::query(const std::vector <IntervalQuery> & queries, QueryResults & results, OverlapMode mode) const {
+    results.offsets.assign(queries.size() + 1, 0);
+    results.hits.clear();
+    if (!loaded_) {
+        return false;
+    }
+    if (queries.empty()) {
+        return true;
+    }
+
+    std::vector <uint32_t> order(queries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        const int reference = queries[a].reference.compare(queries[b].reference);
+        return reference < 0 || (reference == 0 && queries[a].start < queries[b].start);
+    });
+
+    // A few chunks per thread to even out skewed references.
+    const size_t threads = std::max<size_t>(1, pool_->get_thread_count());
+    const size_t chunkSize = std::max<size_t>(256, (queries.size() + threads * 4 - 1) / (threads * 4));
+    const size_t chunkCount = (queries.size() + chunkSize - 1) / chunkSize;
+
+    struct Chunk {
+        std::vector <QueryHit>  hits;       ///< Hits of the chunk's queries, in sorted query order
+        std::vector <uint32_t>  counts;     ///< Hits per query of the chunk
+    };
+    std::vector <Chunk> chunks(chunkCount);
+
+    // The mode is fixed for the batch, so each chunk runs the scan
+    // specialized for its predicate.  Annotations are stored half open.
+    auto runChunk = [&](size_t c) {
+        withPredicate(mode, Coordinates::HalfOpen, [&](auto predicate) {
+            using Predicate = decltype(predicate);
+            Chunk & chunk = chunks[c];
+            const size_t begin = c * chunkSize, end = std::min(queries.size(), begin + chunkSize);
+            chunk.counts.reserve(end - begin);
+            const ReferenceIndex * reference = nullptr;
+            std::string_view current;
+            for (size_t q = begin; q < end; q++) {
+                const IntervalQuery & query = queries[order[q]];
+                // Sorted by reference, so the lookup changes rarely.
+                if (reference == nullptr || current != query.reference) {
+                    auto it = references_.find(std::string_view(query.reference));
+                    reference = it == references_.end() ? nullptr : &it->second;
+                    current = query.reference;
+                }
+                const size_t before = chunk.hits.size();
+                if (reference != nullptr) {
+                    const RangeQuery range{query.start, query.end <= query.start ? query.start + 1 : query.end, query.distance};
+                    for (const auto & [file, index] : reference->files) {
+                        index.template matches<Predicate>(range, [&chunk, file = file](const Annotation * annotation) {
+                            chunk.hits.push_back(QueryHit{file, annotation});
+                        });
+                    }
+                }
+                chunk.counts.push_back(static_cast<uint32_t>(chunk.hits.size() - before));
+            }
+        });
+    };
+
+    auto runAll = [&](auto && body) {
+        if (chunkCount == 1) {
+            // Small batch; a round trip through the pool would cost more.
+            body(0);
+            return;
+        }
+        // Wait on this batch only; other batches may share the pool.
+        // The calling thread takes the first chunk while workers wake up.
+        std::latch done(static_cast<std::ptrdiff_t>(chunkCount - 1));
+        for (size_t c = 1; c < chunkCount; c++) {
+            pool_->push_task([&body, &done, c]() {
+                body(c);
+                done.count_down();
+            });
+        }
+        body(0);
+        done.wait();
+    };
+
+    runAll(runChunk);
+
+    for (size_t c = 0; c < chunkCount; c++) {
+        for (size_t i = 0; i < chunks[c].counts.size(); i++) {
+            results.offsets[order[c * chunkSize + i] + 1] = chunks[c].counts[i];
+        }
+    }
+    std::partial_sum(results.offsets.begin(), results.offsets.end(), results.offsets.begin());
+    results.hits.resize(results.offsets.back());
+
+    runAll([&](size_t c) {
+        const QueryHit * hit = chunks[c].hits.data();
+        for (size_t i = 0; i < chunks[c].counts.size(); i++) {
+            const uint32_t count = chunks[c].counts[i];
+            std::copy(hit, hit + count, results.hits.begin() + static_cast<std::ptrdiff_t>(results.offsets[order[c * chunkSize + i]]));
+            hit += count;
+        }
+    });
+    return true;
+}
@@ -0,0 +1,152 @@
+/*! \file QueryEngine.h
+    \author John Torcivia, Ph.D.
+
+    \brief Batched interval queries over loaded annotation files.
+
+    The files are read once, through the same reader as BioMapper::map(),
+    into per-reference indexes kept in memory.  Batches of (reference, start,
+    end) queries are then answered in parallel: each batch is sorted by
+    reference and start internally so neighbouring queries touch the same
+    part of an index, split into chunks for the thread pool, and returned in
+    the caller's order.
+*/
+
+#ifndef BIOMAPPER_QUERYENGINE_H
+#define BIOMAPPER_QUERYENGINE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Annotation.h"
+#include "BioMapper.h"
+#include "OverlapPredicates.h"
+#include "thread_pool.hpp"
+
+/**
+ * One interval to look up, zero based with an exclusive end.  An end at or
+ * before the start is treated as the single position at start.
+ */
+struct IntervalQuery {
+    std::string     reference;      ///< The join value (reference) to search
+    long long int   start = 0;      ///< Start of the interval
+    long long int   end = 0;        ///< End of the interval (exclusive)
+    long long int   distance = 0;   ///< Largest gap to a hit in OverlapMode::Within
+};
+
+/**
+ * One annotation matching a query.  The pointer stays valid until the
+ * engine is loaded again or destroyed.
+ */
+struct QueryHit {
+    uint32_t            file;       ///< Index of the annotation's file (order of addFile)
+    const Annotation *  annotation; ///< The matching annotation
+};
+
+/**
+ * @brief Results of a batch, in the order the queries were given.
+ *
+ * The hits of query i are hits[offsets[i]] up to hits[offsets[i + 1]],
+ * ordered by file and then by start.
+ */
+struct QueryResults {
+    std::vector <size_t>    offsets;    ///< Start of each query's hits; one more entry than queries
+    std::vector <QueryHit>  hits;       ///< All hits, grouped by query
+
+    [[nodiscard]] size_t count(size_t query) const { return offsets[query + 1] - offsets[query]; }
+    [[nodiscard]] const QueryHit * begin(size_t query) const { return hits.data() + offsets[query]; }
+    [[nodiscard]] const QueryHit * end(size_t query) const { return hits.data() + offsets[query + 1]; }
+};
+
+/**
+ *
+ */
+class QueryEngine {
+public:
+    /**
+     *
+     * @param threadsToUse Threads answering queries (and reading, with readingThreads).
+     * @param readingThreads Threads reading files during load().
+     */
+    explicit QueryEngine(int threadsToUse = -1, int readingThreads = -1);
+
+    ~QueryEngine() = default;
+
+    QueryEngine(const QueryEngine &) = delete;
+    QueryEngine & operator=(const QueryEngine &) = delete;
+
+    /**
+     * Same as BioMapper::addFile(); takes effect at the next load().
+     */
+    bool addFile(const char * file_path, int join_index, long long int start_range_index, long long int end_range_index = -1,
+                 bool zero_based_range = false, bool has_header = false, char delimiter = ',');
+
+    /**
+     * @brief Read every added file and build the per-reference indexes.
+     *
+     * Unlike mapping, references present in a single file are kept.  Calling
+     * it again rebuilds everything, e.g. after adding files.
+     *
+     * @return Whether every file was read.
+     */
+    bool load();
+
+    /**
+     * @brief Find the annotations matching each query.
+     *
+     * Safe to call from several threads at once; the batches share the pool.
+     *
+     * @param queries The batch, in any order.
+     * @param[out] results Receives the hits, in the order of queries.
+     * @param mode Which annotations a query selects; overlapping ones by default.
+     * @return false if load() has not succeeded.
+     */
+    bool query(const std::vector <IntervalQuery> & queries, QueryResults & results,
+               OverlapMode mode = OverlapMode::Overlap) const;
+
+    /**
+     *
+     * @return The number of references indexed.
+     */
+    [[nodiscard]] size_t referenceCount() const { return references_.size(); }
+
+private:
+    /**
+     * @brief Overlap index over one file's annotations of one reference.
+     *
+     * The ranges are sorted by start.  Ends are summarized as a running
+     * maximum, which binary search uses to skip every range that ends
+     * before the query, and as a maximum per block, which lets the scan
+     * jump over blocks with no match.  The rest is tested OVERLAP_BATCH
+     * ranges at a time.
+     */
+    struct RangeIndex {
+        static constexpr size_t BLOCK = 32;
+
+        const SortedRanges *        ranges = nullptr;   ///< The stream's sorted ranges of the file
+        const std::vector <Annotation> * annotations = nullptr; ///< The stream's annotations of the file
+        std::vector <long long int> prefixMaxEnd;       ///< Largest end among ranges [0, i]
+        std::vector <long long int> blockMaxEnd;        ///< Largest end in each block of BLOCK ranges
+
+        void build(const SortedRanges & sorted, const std::vector <Annotation> & source);
+
+        template <typename Predicate, typename Emit>
+        void matches(const RangeQuery & query, Emit emit) const;
+    };
+
+    /**
+     * The indexes of one reference, one per file that has annotations on it.
+     */
+    struct ReferenceIndex {
+        std::vector <std::pair <uint32_t, RangeIndex> > files;
+    };
+
+    BioMapper                                               mapper_;        ///< Reads the files and owns the annotations
+    std::unique_ptr <thread_pool>                           pool_;          ///< Answers queries; kept between batches
+    std::map <std::string, ReferenceIndex, std::less<> >    references_;    ///< Indexes by reference
+    bool                                                    loaded_ = false; ///< Whether load() succeeded
+};
+
+#endif //BIOMAPPER_QUERYENGINE_H
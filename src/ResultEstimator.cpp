@@ -0,0 +1,331 @@
+#include "ResultEstimator.h"
+
+#include "Annotation.h"
+#include "CsvScanner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * Append up to length bytes of fd from offset to buffer; fewer at the end of the file.
+ */
+bool readAt(int fd, uint64_t offset, size_t length, std::string & buffer) {
+    const size_t begin = buffer.size();
+    buffer.resize(begin + length);
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t got = pread(fd, buffer.data() + begin + done, length - done, static_cast<off_t>(offset + done));
+        if (got <= 0) {
+            buffer.resize(begin + done);
+            return got == 0;
+        }
+        done += static_cast<size_t>(got);
+    }
+    return true;
+}
+
+/**
+ * @brief Copy the whole rows of a file starting in [begin, end) to out.
+ *
+ * Rows start at data_start and after each line break; a row running past
+ * end is read to its end.  A block starting mid-file is taken to start
+ * outside quotes.
+ *
+ * @param[out] next Where the row after the last one copied starts.
+ */
+bool copyRows(int fd, const MapperFile & file, uint64_t file_bytes, uint64_t data_start, uint64_t begin, uint64_t end,
+              size_t chunk, std::ofstream & out, uint64_t & rows, uint64_t & next) {
+    // The byte before begin tells whether a row starts at begin.
+    const uint64_t from = begin > data_start ? begin - 1 : begin;
+    std::string buffer;
+    if (!readAt(fd, from, end - from, buffer)) {
+        return false;
+    }
+    size_t at = 0;
+    if (begin > data_start) {
+        at = buffer.find('\n');
+        if (at == std::string::npos) {
+            next = end;
+            return true;
+        }
+        at++;
+    }
+    while (from + at < end) {
+        size_t rowEnd;
+        while (true) {
+            if (file.quoted()) {
+                CsvQuotes quotes;
+                rowEnd = csvRowEnd(std::string_view(buffer).substr(at), quotes);
+                rowEnd = rowEnd == std::string_view::npos ? std::string::npos : rowEnd + at;
+            } else {
+                rowEnd = buffer.find('\n', at);
+            }
+            const size_t had = buffer.size();
+            if (rowEnd != std::string::npos || from + had >= file_bytes) {
+                break;
+            }
+            if (!readAt(fd, from + had, chunk, buffer)) {
+                return false;
+            }
+            if (buffer.size() == had) {
+                break;
+            }
+        }
+        if (rowEnd == std::string::npos) {
+            rowEnd = buffer.size();
+        }
+        std::string_view row(buffer.data() + at, rowEnd - at);
+        at = rowEnd + 1;
+        if (!row.empty() && row.back() == '\r') {
+            row.remove_suffix(1);
+        }
+        if (row.empty()) {
+            continue;
+        }
+        out.write(row.data(), static_cast<std::streamsize>(row.size()));
+        out.put('\n');
+        rows++;
+    }
+    next = from + at;
+    return !out.fail();
+}
+
+/**
+ * The value at quantile q of values, which are sorted in place.
+ */
+double quantile(std::vector <double> & values, double q) {
+    std::sort(values.begin(), values.end());
+    return values[static_cast<size_t>(std::round(q * static_cast<double>(values.size() - 1)))];
+}
+
+} // namespace
+
+/*****************************************************************************************
+ * ResultEstimator
+ ****************************************************************************************/
+
+/******************************************************************
+ * Sample
+ *      Strata of equal bytes over the rows after the header, each
+ *      sampled by one block at a random offset; a block running
+ *      past its stratum's end wraps around to the stratum's start,
+ *      so every row is sampled with the same chance.
+ ******************************************************************/
+bool ResultEstimator::sample(const MapperFile & file, const std::string & sample_path, const Settings & settings, uint64_t seed,
+                             SampledFile & sampled) {
+    sampled = SampledFile();
+    const int fd = ::open(file.file_path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    const auto bytes = static_cast<uint64_t>(st.st_size);
+    size_t blockBytes = std::max<size_t>(1, settings.blockBytes);
+
+    std::ofstream out(sample_path, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+    bool passed = !out.fail();
+    uint64_t rowNumber = 0, dataStart = 0;
+    if (passed && file.has_header()) {
+        passed = copyRows(fd, file, bytes, 0, 0, std::min<uint64_t>(1, bytes), blockBytes, out, rowNumber, dataStart);
+    }
+
+    const uint64_t dataBytes = bytes - std::min(bytes, dataStart);
+    // A few large blocks are a few regions of a sorted file, and the
+    // regions seldom meet those of the other files; smaller ones spread out.
+    const auto spread = static_cast<size_t>(std::max(0.0, settings.fraction) * static_cast<double>(dataBytes) / MIN_STRATA);
+    blockBytes = std::min(blockBytes, std::max(spread, std::min(blockBytes, MIN_BLOCK_BYTES)));
+    const auto strata = static_cast<uint64_t>(std::ceil(std::max(0.0, settings.fraction) * static_cast<double>(dataBytes)
+                                                        / static_cast<double>(blockBytes)));
+    std::mt19937_64 random(seed);
+    if (settings.fraction >= 1 || strata * blockBytes * 2 >= dataBytes) {
+        uint64_t next;
+        passed = passed && copyRows(fd, file, bytes, dataStart, dataStart, bytes, blockBytes, out, rowNumber, next);
+        sampled.blockEnds.push_back(rowNumber);
+    } else {
+        sampled.fraction = static_cast<double>(strata * blockBytes) / static_cast<double>(dataBytes);
+        for (uint64_t s = 0; s < strata && passed; s++) {
+            const uint64_t begin = dataStart + dataBytes * s / strata, end = dataStart + dataBytes * (s + 1) / strata;
+            const uint64_t offset = begin + random() % (end - begin);
+            const uint64_t wrapped = offset + blockBytes > end ? offset + blockBytes - end : 0;
+            uint64_t next;
+            if (wrapped > 0) {
+                passed = copyRows(fd, file, bytes, dataStart, begin, begin + wrapped, blockBytes, out, rowNumber, next);
+            }
+            passed = passed && copyRows(fd, file, bytes, dataStart, offset, std::min(end, offset + blockBytes), blockBytes,
+                                        out, rowNumber, next);
+            sampled.blockEnds.push_back(rowNumber);
+        }
+    }
+    ::close(fd);
+    out.close();
+    sampled.rows = rowNumber - (file.has_header() && rowNumber > 0 ? 1 : 0);
+    return passed && !out.fail();
+}
+
+ResultEstimator::ResultEstimator(std::vector <SampledFile> files, Settings settings)
+        : files_(std::move(files)), settings_(settings), pairs_(files_.size() * (files_.size() - std::min<size_t>(1, files_.size())) / 2) {}
+
+size_t ResultEstimator::_pair(uint32_t first, uint32_t second) const {
+    const size_t n = files_.size();
+    return first * (2 * n - first - 1) / 2 + (second - first - 1);
+}
+
+uint32_t ResultEstimator::_block(uint32_t file, uint64_t row) const {
+    const std::vector <uint64_t> & ends = files_[file].blockEnds;
+    return static_cast<uint32_t>(std::min<size_t>(std::lower_bound(ends.begin(), ends.end(), row) - ends.begin(), ends.size() - 1));
+}
+
+void ResultEstimator::add(const MappedResult & result, uint64_t bytes) {
+    const uint64_t blocks = static_cast<uint64_t>(_block(result.file_a, result.annotation_a->rowNumber())) << 32
+                            | _block(result.file_b, result.annotation_b->rowNumber());
+    Tally & tally = pairs_[_pair(result.file_a, result.file_b)][blocks];
+    tally.results++;
+    tally.bytes += bytes;
+}
+
+/******************************************************************
+ * Estimate
+ *      The point estimate weighs every block once; each replicate
+ *      weighs a block by the times it was drawn.  Files taken
+ *      whole are not resampled.
+ ******************************************************************/
+ResultEstimate ResultEstimator::estimate() const {
+    ResultEstimate estimate;
+    estimate.confidence = settings_.confidence;
+    for (const SampledFile & file : files_) {
+        estimate.sampledFractions.push_back(file.fraction);
+        estimate.sampledRows += file.rows;
+    }
+
+    // Results and bytes of every pair with the blocks weighed so.
+    const size_t n = files_.size();
+    auto extrapolate = [&](const std::vector <std::vector <uint32_t> > & weights, std::vector <double> & results,
+                           std::vector <double> & bytes) {
+        for (uint32_t first = 0; first < n; first++) {
+            for (uint32_t second = first + 1; second < n; second++) {
+                const size_t p = _pair(first, second);
+                double pairResults = 0, pairBytes = 0;
+                for (const auto & [blocks, tally] : pairs_[p]) {
+                    const auto weight = static_cast<double>(weights[first][blocks >> 32]) * weights[second][blocks & UINT32_MAX];
+                    pairResults += weight * static_cast<double>(tally.results);
+                    pairBytes += weight * static_cast<double>(tally.bytes);
+                }
+                const double scale = 1 / (files_[first].fraction * files_[second].fraction);
+                results[p] = pairResults * scale;
+                bytes[p] = pairBytes * scale;
+            }
+        }
+    };
+
+    std::vector <std::vector <uint32_t> > weights(n);
+    for (size_t f = 0; f < n; f++) {
+        weights[f].assign(std::max<size_t>(1, files_[f].blockEnds.size()), 1);
+    }
+    std::vector <double> results(pairs_.size()), bytes(pairs_.size());
+    extrapolate(weights, results, bytes);
+
+    // Blocks are drawn within pairs of neighbouring strata; an odd one
+    // out joins the last pair.
+    const size_t replicates = std::max<uint32_t>(1, settings_.replicates);
+    std::vector <std::vector <double> > replicateResults(pairs_.size() + 1, std::vector <double>(replicates));
+    std::vector <std::vector <double> > replicateBytes(pairs_.size() + 1, std::vector <double>(replicates));
+    std::vector <double> drawnResults(pairs_.size()), drawnBytes(pairs_.size());
+    std::mt19937_64 random(settings_.seed);
+    for (size_t r = 0; r < replicates; r++) {
+        for (size_t f = 0; f < n; f++) {
+            if (files_[f].fraction >= 1) {
+                continue;
+            }
+            std::vector <uint32_t> & drawn = weights[f];
+            std::fill(drawn.begin(), drawn.end(), 0);
+            for (size_t g = 0; g < drawn.size(); ) {
+                const size_t size = drawn.size() - g == 3 ? 3 : std::min<size_t>(2, drawn.size() - g);
+                for (size_t k = 0; k < size; k++) {
+                    drawn[g + random() % size]++;
+                }
+                g += size;
+            }
+        }
+        extrapolate(weights, drawnResults, drawnBytes);
+        for (size_t p = 0; p < pairs_.size(); p++) {
+            replicateResults[p][r] = drawnResults[p];
+            replicateBytes[p][r] = drawnBytes[p];
+            replicateResults[pairs_.size()][r] += drawnResults[p];
+            replicateBytes[pairs_.size()][r] += drawnBytes[p];
+        }
+    }
+
+    // A pair without a sampled result is bounded by the Poisson count of
+    // zero at this confidence, its lines as wide as the sampled ones.
+    uint64_t sampledBytes = 0;
+    for (const auto & pair : pairs_) {
+        for (const auto & block : pair) {
+            estimate.sampledResults += block.second.results;
+            sampledBytes += block.second.bytes;
+        }
+    }
+    const double lineBytes = estimate.sampledResults == 0 ? 0 : static_cast<double>(sampledBytes) / static_cast<double>(estimate.sampledResults);
+    const double alpha = std::clamp(1 - settings_.confidence, 1e-9, 1.0);
+    double unseenResults = 0, unseenBytes = 0;
+
+    for (uint32_t first = 0; first < n; first++) {
+        for (uint32_t second = first + 1; second < n; second++) {
+            const size_t p = _pair(first, second);
+            ResultEstimate::Pair & pair = estimate.pairs.emplace_back();
+            pair.first = first;
+            pair.second = second;
+            pair.results = EstimatedCount{results[p], quantile(replicateResults[p], alpha / 2), quantile(replicateResults[p], 1 - alpha / 2)};
+            pair.bytes = EstimatedCount{bytes[p], quantile(replicateBytes[p], alpha / 2), quantile(replicateBytes[p], 1 - alpha / 2)};
+            const double scale = 1 / (files_[first].fraction * files_[second].fraction);
+            if (pairs_[p].empty() && scale > 1) {
+                pair.results.high = -std::log(alpha / 2) * scale;
+                pair.bytes.high = pair.results.high * lineBytes;
+                unseenResults += pair.results.high;
+                unseenBytes += pair.bytes.high;
+            }
+            estimate.results.value += results[p];
+            estimate.outputBytes.value += bytes[p];
+        }
+    }
+    const size_t total = pairs_.size();
+    estimate.results.low = quantile(replicateResults[total], alpha / 2);
+    estimate.results.high = quantile(replicateResults[total], 1 - alpha / 2) + unseenResults;
+    estimate.outputBytes.low = quantile(replicateBytes[total], alpha / 2);
+    estimate.outputBytes.high = quantile(replicateBytes[total], 1 - alpha / 2) + unseenBytes;
+    return estimate;
+}
+
+/*****************************************************************************************
+ * ResultEstimate
+ ****************************************************************************************/
+
+std::string ResultEstimate::describe() const {
+    double fraction = 0;
+    for (double sampled : sampledFractions) {
+        fraction += sampled;
+    }
+    fraction = sampledFractions.empty() ? 0 : fraction / static_cast<double>(sampledFractions.size());
+    std::ostringstream line;
+    line << std::fixed;
+    line.precision(0);
+    line << "results~" << results.value << " [" << results.low << ", " << results.high << "]"
+         << " output~" << outputBytes.value / (1 << 20) << "MiB [" << outputBytes.low / (1 << 20) << ", " << outputBytes.high / (1 << 20) << "]"
+         << " confidence=" << confidence * 100 << "%";
+    line.precision(2);
+    line << " sampled=" << fraction * 100 << "% (" << sampledRows << " rows, " << sampledResults << " results)"
+         << " in " << seconds << "s";
+    return line.str();
+}
@@ -0,0 +1,166 @@
+/*! \file ResultEstimator.h
+    \author John Torcivia, Ph.D.
+
+    \brief The results of a run, estimated from a sample of its files.
+
+    Each file is cut into strata of equal bytes and one block is sampled
+    per stratum, at a random offset and wrapping around to the stratum's
+    start, so every row is in the sample with the same chance, the sampled
+    fraction of its file.  The rows starting in the blocks are written to a
+    sample file, and the samples are mapped as the files would be (see
+    BioMapper::estimateResults()).  A result of two sampled rows then
+    stands for 1 / (p_a * p_b) results of the files, the Horvitz-Thompson
+    estimate; a file small enough is taken whole, with p = 1.
+
+    The results are tallied by the blocks their rows came from, and the
+    confidence intervals come from a bootstrap of the blocks.  Each
+    replicate draws the blocks of every file with replacement within pairs
+    of neighbouring strata (which, in a file sorted by reference, mostly
+    hold the same references) and recounts the results between the drawn
+    blocks; the percentiles of the replicates bound the estimate.  A pair
+    of files without a sampled result is bounded by a Poisson count of zero.
+*/
+
+#ifndef BIOMAPPER_RESULTESTIMATOR_H
+#define BIOMAPPER_RESULTESTIMATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MapperFile.h"
+#include "ResultQueue.h"
+
+/**
+ * An extrapolated count and its confidence interval.
+ */
+struct EstimatedCount {
+    double      value = 0;      ///< The estimate
+    double      low = 0;        ///< Lower bound of the interval
+    double      high = 0;       ///< Upper bound of the interval
+};
+
+/**
+ * What a run over the files would deliver, from a sample of them.
+ */
+struct ResultEstimate {
+    /**
+     * One pair of files.
+     */
+    struct Pair {
+        uint32_t        first = 0;          ///< Lower file index
+        uint32_t        second = 0;         ///< Higher file index
+        EstimatedCount  results;
+        EstimatedCount  bytes;              ///< Of the output lines
+    };
+
+    EstimatedCount          results;            ///< Over all pairs of files
+    EstimatedCount          outputBytes;        ///< Of the output file
+    std::vector <Pair>      pairs;              ///< By pair of files, in order
+    std::vector <double>    sampledFractions;   ///< By file: each row's chance to be sampled
+    uint64_t                sampledRows = 0;    ///< Over all files
+    uint64_t                sampledResults = 0; ///< Results of the samples
+    double                  confidence = 0;     ///< Of the intervals
+    double                  seconds = 0;        ///< Taken to sample, map and extrapolate
+
+    /**
+     *
+     * @return The estimate on one line, for the log.
+     */
+    [[nodiscard]] std::string describe() const;
+};
+
+/**
+ *
+ */
+class ResultEstimator {
+public:
+    static constexpr size_t MIN_STRATA = 64;            ///< Per file, blocks shrinking to MIN_BLOCK_BYTES to reach it
+    static constexpr size_t MIN_BLOCK_BYTES = 1 << 10;  ///< A few rows
+
+    /**
+     * How the files are sampled and the intervals made.
+     */
+    struct Settings {
+        double      fraction = 0.01;        ///< Share of each file sampled; a file it would take half of is taken whole
+        size_t      blockBytes = 1 << 13;   ///< Bytes per sampled block, one per stratum; smaller blocks spread the sample
+        uint32_t    replicates = 1000;      ///< Bootstrap replicates
+        double      confidence = 0.95;      ///< Of the intervals
+        uint64_t    seed = 1;               ///< Of the offsets and the bootstrap
+    };
+
+    /**
+     * One file's sample.
+     */
+    struct SampledFile {
+        double                  fraction = 1;   ///< Each row's chance to be sampled
+        std::vector <uint64_t>  blockEnds;      ///< Row number (header included) of each block's last row
+        uint64_t                rows = 0;       ///< Rows sampled
+    };
+
+    /**
+     * @brief Write a stratified sample of a file.
+     *
+     * The sample has the file's header, if it has one, then the whole rows
+     * starting in each sampled block, in file order; empty rows are dropped.
+     *
+     * @param file The file and its column settings.
+     * @param sample_path Where the sample is written.
+     * @param settings The fraction and block size.
+     * @param seed Of the block offsets.
+     * @param[out] sampled The fraction sampled and the blocks' rows.
+     * @return false if the file cannot be read or the sample written.
+     */
+    static bool sample(const MapperFile & file, const std::string & sample_path, const Settings & settings, uint64_t seed,
+                       SampledFile & sampled);
+
+    /**
+     *
+     * @param files The sample of each file, in the order the samples are mapped.
+     * @param settings The replicates and confidence.
+     */
+    ResultEstimator(std::vector <SampledFile> files, Settings settings);
+
+    /**
+     * Tally one result of the samples.
+     *
+     * @param result The result.
+     * @param bytes Of its output line, line break included.
+     */
+    void add(const MappedResult & result, uint64_t bytes);
+
+    /**
+     *
+     * @return The estimate, from the results tallied so far.
+     */
+    [[nodiscard]] ResultEstimate estimate() const;
+
+private:
+    /**
+     * Results between one block of each file of a pair.
+     */
+    struct Tally {
+        uint64_t    results = 0;
+        uint64_t    bytes = 0;
+    };
+
+    /**
+     *
+     * @return The block of a file a row number of its sample is in.
+     */
+    [[nodiscard]] uint32_t _block(uint32_t file, uint64_t row) const;
+
+    /**
+     *
+     * @return The index of the pair of files first < second in pairs_.
+     */
+    [[nodiscard]] size_t _pair(uint32_t first, uint32_t second) const;
+
+    std::vector <SampledFile>                                       files_;
+    Settings                                                        settings_;
+    std::vector <std::unordered_map <uint64_t, Tally> >             pairs_;     ///< By pair, then by block of each (first << 32 | second)
+};
+
+#endif //BIOMAPPER_RESULTESTIMATOR_H
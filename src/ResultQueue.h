@@ -0,0 +1,178 @@
+/*! \file ResultQueue.h
+    \author John Torcivia, Ph.D.
+
+    \brief Mapped results and the bounded queue that delivers them.
+
+    Mappers produce results in batches, one producer per annotation stream.
+    The queue hands the batches to a single consumer in stream (reference)
+    order while bounding how many batches each stream may have buffered, so
+    memory stays constant no matter how large the output is.
+*/
+
+#ifndef BIOMAPPER_RESULTQUEUE_H
+#define BIOMAPPER_RESULTQUEUE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Annotation.h"
+
+/**
+ * @brief One pair of overlapping (or, in ResultMode::Nearest, nearby) annotations.
+ *
+ * The pointers refer to annotations owned by the BioMapper and stay valid
+ * until its next map() call or its destruction.
+ */
+struct MappedResult {
+    std::string_view    reference;      ///< The join ID (reference) both annotations are on; valid while they are
+    uint32_t            file_a;         ///< Index of the first annotation's file (order of addFile)
+    const Annotation *  annotation_a;   ///< The first annotation
+    uint32_t            file_b;         ///< Index of the second annotation's file; always > file_a
+    const Annotation *  annotation_b;   ///< The second annotation
+    long long int       distance = 0;   ///< From the first to the second, in ResultMode::Nearest; 0 otherwise
+};
+
+typedef std::vector <MappedResult> ResultBatch;
+
+/**
+ * Receives each batch of results as it is produced, in reference order.
+ */
+typedef std::function<void(const ResultBatch &)> ResultCallback;
+
+/**
+ *
+ */
+class ResultQueue {
+public:
+    /**
+     *
+     * @param stream_count Number of producers (streams); they are consumed in index order.
+     * @param max_buffered Maximum batches one stream may have waiting.
+     */
+    ResultQueue(size_t stream_count, size_t max_buffered)
+            : buffers_(stream_count), finished_(stream_count, false), maxBuffered_(max_buffered == 0 ? 1 : max_buffered) {}
+
+    /**
+     * @brief Hand a batch to the consumer, blocking while the stream's buffer is full.
+     *
+     * Only streams behind the one being consumed can block for long; the
+     * stream being consumed is drained continuously, so producers cannot
+     * deadlock each other.
+     *
+     * @param stream Index of the producing stream.
+     * @param batch The batch; moved from.
+     * @return Number of batches buffered across all streams after the push.
+     */
+    size_t push(size_t stream, ResultBatch && batch) {
+        std::unique_lock lock(mtx_);
+        notFull_.wait(lock, [&]() { return buffers_[stream].size() < maxBuffered_; });
+        buffers_[stream].push_back(std::move(batch));
+        buffered_++;
+        if (stream == current_) {
+            notEmpty_.notify_one();
+        }
+        return buffered_;
+    }
+
+    /**
+     * Mark a stream as complete; no more batches will be pushed for it.
+     */
+    void finish(size_t stream) {
+        const std::scoped_lock lock(mtx_);
+        finished_[stream] = true;
+        if (stream == current_) {
+            notEmpty_.notify_one();
+        }
+    }
+
+    /**
+     * @brief Take the next batch in stream order, waiting for it if needed.
+     *
+     * @param[out] batch Receives the batch.
+     * @retval true A batch was returned.
+     * @retval false Every stream is finished and drained.
+     */
+    bool pop(ResultBatch & batch) {
+        std::unique_lock lock(mtx_);
+        while (current_ < buffers_.size()) {
+            if (!buffers_[current_].empty()) {
+                batch = std::move(buffers_[current_].front());
+                buffers_[current_].pop_front();
+                buffered_--;
+                notFull_.notify_all();
+                return true;
+            }
+            if (finished_[current_]) {
+                current_++;
+                continue;
+            }
+            notEmpty_.wait(lock);
+        }
+        return false;
+    }
+
+    /**
+     *
+     * @return Streams before the one being consumed, which are finished and drained.
+     */
+    size_t drained() {
+        const std::scoped_lock lock(mtx_);
+        return current_;
+    }
+
+    /**
+     *
+     * @return Number of streams.
+     */
+    [[nodiscard]] size_t streamCount() const { return buffers_.size(); }
+
+    /**
+     * @brief An empty batch with room for capacity results.
+     *
+     * Reuses a batch given back with recycle() if there is one, so once
+     * the queue has warmed up, producing results does not allocate.
+     */
+    ResultBatch spare(size_t capacity) {
+        ResultBatch batch;
+        {
+            const std::scoped_lock lock(mtx_);
+            if (!spares_.empty()) {
+                batch = std::move(spares_.back());
+                spares_.pop_back();
+            }
+        }
+        batch.reserve(capacity);
+        return batch;
+    }
+
+    /**
+     * Give a consumed batch back for spare() to reuse.
+     */
+    void recycle(ResultBatch && batch) {
+        batch.clear();
+        const std::scoped_lock lock(mtx_);
+        // Never more spares than batches that can be in flight at once.
+        if (spares_.size() < buffers_.size() * maxBuffered_ + 1) {
+            spares_.push_back(std::move(batch));
+        }
+    }
+
+private:
+    std::mutex                              mtx_;
+    std::condition_variable                 notFull_;       ///< Signalled when a batch is consumed
+    std::condition_variable                 notEmpty_;      ///< Signalled when the current stream gets a batch or finishes
+    std::vector <std::deque <ResultBatch> > buffers_;       ///< Waiting batches per stream
+    std::vector <bool>                      finished_;      ///< Whether each stream is complete
+    size_t                                  current_ = 0;   ///< The stream being consumed
+    size_t                                  buffered_ = 0;  ///< Batches waiting across all streams
+    const size_t                            maxBuffered_;   ///< Per stream limit
+    std::vector <ResultBatch>               spares_;        ///< Consumed batches, kept for their capacity
+};
+
+#endif //BIOMAPPER_RESULTQUEUE_H
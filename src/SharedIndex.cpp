@@ -0,0 +1,511 @@
+#include "SharedIndex.h"
+
+#include "BioMapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/*
+ * On-disk layout.  Every offset is from the start of the file and every
+ * array is aligned to its element size, so the file can be used where it
+ * is mapped.  Integers are in the byte order of the machine that built it;
+ * byteOrder tells another one apart.
+ *
+ *      FileHeader
+ *      ReferenceEntry[referenceCount]          sorted by name
+ *      per reference:  name, starts[count], ends[count], order[count],
+ *                      RowRecord[count], then each row's column lengths
+ *                      (uint32_t[fieldCount]) followed by its text
+ *      header columns: (uint32_t column, uint32_t length, text) each
+ */
+constexpr char MAGIC[8] = {'B', 'M', 'A', 'P', 'I', 'D', 'X', '\n'};
+constexpr uint32_t ORDER_MARK = 0x01020304;
+
+struct FileHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint64_t    size;               // Bytes of the whole file
+    uint64_t    sourceSize;         // Of the source file when it was indexed
+    int64_t     sourceModified;     // Last write time of the source file, in file clock ticks
+    int64_t     startIndex;
+    int64_t     endIndex;
+    int32_t     joinIndex;
+    uint8_t     zeroBased;
+    uint8_t     hasHeader;
+    char        delimiter;
+    uint8_t     quoted;             // Was reserved (0) before quoted fields, so older indexes read as unquoted
+    uint64_t    referenceCount;
+    uint64_t    referencesOffset;
+    uint64_t    headerCount;
+    uint64_t    headerOffset;
+    uint64_t    rowCount;
+};
+
+struct ReferenceEntry {
+    uint64_t    nameOffset;
+    uint64_t    nameLength;
+    uint64_t    count;
+    uint64_t    startsOffset;
+    uint64_t    endsOffset;
+    uint64_t    orderOffset;
+    uint64_t    rowsOffset;
+};
+
+struct RowRecord {
+    int64_t     start;
+    int64_t     end;
+    uint64_t    rowNumber;
+    uint64_t    fieldsOffset;
+    uint32_t    fieldCount;
+    uint32_t    reserved;
+};
+
+/**
+ * Size and last write time of the source file, as recorded in the header.
+ */
+bool sourceIdentity(const std::string & path, uint64_t & size, int64_t & modified) {
+    std::error_code ec;
+    size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    const auto written = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return false;
+    }
+    modified = static_cast<int64_t>(written.time_since_epoch().count());
+    return true;
+}
+
+/**
+ * Sequential writer keeping track of the offset, for aligning the arrays.
+ */
+class IndexWriter {
+public:
+    explicit IndexWriter(const std::string & path) : out_(path, std::ofstream::binary | std::ofstream::trunc) {}
+
+    [[nodiscard]] bool ok() const { return !out_.fail(); }
+    [[nodiscard]] uint64_t offset() const { return offset_; }
+
+    void write(const void * data, size_t bytes) {
+        out_.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+        offset_ += bytes;
+    }
+
+    void align(size_t alignment) {
+        static constexpr char zeros[8] = {};
+        write(zeros, (alignment - offset_ % alignment) % alignment);
+    }
+
+    /**
+     * Overwrite bytes written earlier (the tables at the front).
+     */
+    void patch(uint64_t at, const void * data, size_t bytes) {
+        out_.seekp(static_cast<std::streamoff>(at));
+        out_.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+        out_.seekp(static_cast<std::streamoff>(offset_));
+    }
+
+    void close() { out_.close(); }
+
+private:
+    std::ofstream   out_;
+    uint64_t        offset_ = 0;
+};
+
+/**
+ * Append every column of an annotation as text, as the output file shows it.
+ */
+void appendField(std::string & text, const AnnotationTypes & element) {
+    std::visit([&text](const auto & value) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::pmr::string>) {
+            text += value;
+        } else {
+            text += std::to_string(value);
+        }
+    }, element);
+}
+
+/**
+ * Take the exclusive lock on an index's lock file, waiting for it unless
+ * wait is false; -1 if it could not be taken.  SharedIndex::remove()
+ * unlinks the file while holding the lock, so once locked it must still be
+ * the file at the path; if it is not, the new one is locked instead.
+ */
+int lockIndex(const std::string & lock_path, bool wait) {
+    for (;;) {
+        const int lock = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock < 0) {
+            return -1;
+        }
+        if (flock(lock, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+            close(lock);
+            return -1;
+        }
+        struct stat held {}, named {};
+        if (fstat(lock, &held) == 0 && stat(lock_path.c_str(), &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino) {
+            return lock;
+        }
+        close(lock);
+    }
+}
+
+} // namespace
+
+/*****************************************************************************************
+ * SharedIndex
+ *      Mapping
+ ****************************************************************************************/
+
+SharedIndex::~SharedIndex() {
+    if (base_ != nullptr) {
+        munmap(const_cast<char *>(base_), size_);
+    }
+}
+
+const SharedIndex::Reference * SharedIndex::find(std::string_view name) const {
+    auto it = std::lower_bound(references_.begin(), references_.end(), name,
+                               [](const Reference & reference, std::string_view value) { return reference.name < value; });
+    return it != references_.end() && it->name == name ? &*it : nullptr;
+}
+
+SharedIndex::Row SharedIndex::row(const Reference & reference, uint32_t index) const {
+    const RowRecord & record = static_cast<const RowRecord *>(reference.rows)[index];
+    Row row{record.start, record.end, record.rowNumber, 0, nullptr, nullptr};
+    // The text of a damaged index is dropped rather than read out of bounds.
+    const uint64_t textOffset = record.fieldsOffset + uint64_t(record.fieldCount) * sizeof(uint32_t);
+    if (record.fieldsOffset % alignof(uint32_t) != 0 || textOffset > size_) {
+        return row;
+    }
+    const auto * lengths = reinterpret_cast<const uint32_t *>(base_ + record.fieldsOffset);
+    uint64_t textBytes = 0;
+    for (uint32_t i = 0; i < record.fieldCount; i++) {
+        textBytes += lengths[i];
+    }
+    if (textOffset + textBytes > size_) {
+        return row;
+    }
+    row.fieldCount = record.fieldCount;
+    row.lengths = lengths;
+    row.data = base_ + textOffset;
+    return row;
+}
+
+uint64_t SharedIndex::rowCount() const {
+    return reinterpret_cast<const FileHeader *>(base_)->rowCount;
+}
+
+/******************************************************************
+ * Map
+ *      Map the whole file read-only and check that every table
+ *      lies inside it before handing out pointers into it.
+ ******************************************************************/
+std::shared_ptr <SharedIndex> SharedIndex::_map(const std::string & index_path, bool quiet) {
+    auto fail = [&](const char * why) {
+        if (!quiet) {
+            std::cerr << "WARNING: " << index_path << " is not a usable index (" << why << ").  \n";
+        }
+        return nullptr;
+    };
+
+    const int fd = ::open(index_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return fail("cannot open");
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+        close(fd);
+        return fail("too short");
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void * mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive, even if it is replaced.
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return fail("cannot map");
+    }
+    std::shared_ptr <SharedIndex> index(new SharedIndex());
+    index->base_ = static_cast<const char *>(mapped);
+    index->size_ = size;
+
+    const auto * header = reinterpret_cast<const FileHeader *>(index->base_);
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+        return fail("not an index");
+    }
+    if (header->byteOrder != ORDER_MARK) {
+        return fail("built on a machine of another byte order");
+    }
+    if (header->version != FORMAT_VERSION) {
+        return fail("another format version");
+    }
+    if (header->size != size) {
+        return fail("truncated");
+    }
+
+    auto inside = [size](uint64_t offset, uint64_t count, size_t element, size_t alignment) {
+        return offset % alignment == 0 && offset <= size && count <= (size - offset) / element;
+    };
+    if (!inside(header->referencesOffset, header->referenceCount, sizeof(ReferenceEntry), alignof(ReferenceEntry))) {
+        return fail("damaged reference table");
+    }
+    const auto * entries = reinterpret_cast<const ReferenceEntry *>(index->base_ + header->referencesOffset);
+    index->references_.reserve(header->referenceCount);
+    for (uint64_t r = 0; r < header->referenceCount; r++) {
+        const ReferenceEntry & entry = entries[r];
+        if (!inside(entry.nameOffset, entry.nameLength, 1, 1) ||
+            !inside(entry.startsOffset, entry.count, sizeof(long long int), alignof(long long int)) ||
+            !inside(entry.endsOffset, entry.count, sizeof(long long int), alignof(long long int)) ||
+            !inside(entry.orderOffset, entry.count, sizeof(uint32_t), alignof(uint32_t)) ||
+            !inside(entry.rowsOffset, entry.count, sizeof(RowRecord), alignof(RowRecord))) {
+            return fail("damaged reference");
+        }
+        const auto * order = reinterpret_cast<const uint32_t *>(index->base_ + entry.orderOffset);
+        if (std::any_of(order, order + entry.count, [&](uint32_t row) { return row >= entry.count; })) {
+            return fail("damaged sort order");
+        }
+        index->references_.push_back(Reference{
+                std::string_view(index->base_ + entry.nameOffset, entry.nameLength), entry.count,
+                reinterpret_cast<const long long int *>(index->base_ + entry.startsOffset),
+                reinterpret_cast<const long long int *>(index->base_ + entry.endsOffset),
+                order, index->base_ + entry.rowsOffset});
+    }
+
+    uint64_t offset = header->headerOffset;
+    for (uint64_t c = 0; c < header->headerCount; c++) {
+        if (!inside(offset, 2, sizeof(uint32_t), alignof(uint32_t))) {
+            return fail("damaged header");
+        }
+        const auto * column = reinterpret_cast<const uint32_t *>(index->base_ + offset);
+        offset += 2 * sizeof(uint32_t);
+        if (!inside(offset, column[1], 1, 1)) {
+            return fail("damaged header");
+        }
+        index->header_[column[0]] = std::string(index->base_ + offset, column[1]);
+        offset = (offset + column[1] + 3) / 4 * 4;
+    }
+    return index;
+}
+
+bool SharedIndex::_matches(const MapperFile & file) const {
+    const auto * header = reinterpret_cast<const FileHeader *>(base_);
+    uint64_t sourceSize;
+    int64_t sourceModified;
+    if (!sourceIdentity(file.file_path(), sourceSize, sourceModified)) {
+        return false;
+    }
+    return header->sourceSize == sourceSize && header->sourceModified == sourceModified &&
+           header->joinIndex == file.join_index() && header->startIndex == file.start_range_index() &&
+           header->endIndex == file.end_range_index() && (header->zeroBased != 0) == file.zero_based_range() &&
+           (header->hasHeader != 0) == file.has_header() && header->delimiter == file.delimiter() &&
+           (header->quoted != 0) == file.quoted();
+}
+
+/******************************************************************
+ * Attach
+ *      Map the index if it matches the file.  Otherwise, under an
+ *      exclusive lock on <index>.lock, check again (another
+ *      process may have just built it) and build it.  Readers
+ *      never take the lock; renaming publishes a finished index.
+ ******************************************************************/
+std::shared_ptr <const SharedIndex> SharedIndex::attach(const MapperFile & file, const std::string & index_path,
+                                                        bool build_if_needed, thread_pool * pool) {
+    std::shared_ptr <SharedIndex> index = _map(index_path, true);
+    if (index && index->_matches(file)) {
+        return index;
+    }
+    if (!build_if_needed) {
+        std::cerr << "ERROR: " << index_path << " is missing or does not match " << file.file_path() << ".  \n";
+        return nullptr;
+    }
+
+    const std::string lockPath = index_path + ".lock";
+    const int lock = lockIndex(lockPath, true);
+    if (lock < 0) {
+        std::cerr << "ERROR: Could not lock " << lockPath << ".  \n";
+        return nullptr;
+    }
+    index = _map(index_path, true);
+    if (!index || !index->_matches(file)) {
+        index = build(file, index_path, -1, pool) ? _map(index_path, false) : nullptr;
+        if (index && !index->_matches(file)) {
+            std::cerr << "ERROR: " << file.file_path() << " changed while it was indexed.  \n";
+            index = nullptr;
+        }
+    }
+    flock(lock, LOCK_UN);
+    close(lock);
+    return index;
+}
+
+/******************************************************************
+ * Remove
+ *      Under the index's lock, so neither file is deleted while
+ *      attach() builds and publishes the index.  The lock file
+ *      goes last and before unlocking; attach() notices it is
+ *      gone once it gets the lock.
+ ******************************************************************/
+bool SharedIndex::remove(const std::string & index_path) {
+    const std::string lockPath = index_path + ".lock";
+    const int lock = lockIndex(lockPath, false);
+    if (lock < 0) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::remove(index_path, ec);
+    std::filesystem::remove(lockPath, ec);
+    flock(lock, LOCK_UN);
+    close(lock);
+    return true;
+}
+
+/******************************************************************
+ * Build
+ *      Read the file with a mapper that keeps every reference (as
+ *      the query engine does), then write the streams out one
+ *      reference at a time, to a temporary file renamed into
+ *      place at the end.
+ ******************************************************************/
+bool SharedIndex::build(const MapperFile & file, const std::string & index_path, int threads, thread_pool * pool) {
+    uint64_t sourceSize;
+    int64_t sourceModified;
+    if (!sourceIdentity(file.file_path(), sourceSize, sourceModified)) {
+        std::cerr << "ERROR: Could not open " << file.file_path() << " for indexing.  \n";
+        return false;
+    }
+
+    BioMapper reader(threads);
+    reader.minFilesPerReference_ = 1;
+    MapperFile settings(file.file_path().c_str(), file.join_index(), file.start_range_index(), file.end_range_index(),
+                        file.zero_based_range(), file.has_header(), file.delimiter());
+    settings.set_quoted(file.quoted());
+    reader.addFile(std::move(settings));
+    {
+        std::unique_ptr <thread_pool> ownPool;
+        if (pool == nullptr) {
+            ownPool = std::make_unique<thread_pool>(reader.threadsToUse_);
+        }
+        JobPool job(pool != nullptr ? *pool : *ownPool, pool != nullptr ? static_cast<uint32_t>(reader.threadsToUse_) : 0);
+        if (!reader._ingest(job)) {
+            return false;
+        }
+    }
+    const MapperFile & source = reader.files_[0];
+
+    static std::atomic <uint64_t> builds = 0;
+    const std::string temporary = index_path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(builds++);
+    IndexWriter out(temporary);
+
+    FileHeader header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.byteOrder = ORDER_MARK;
+    header.sourceSize = sourceSize;
+    header.sourceModified = sourceModified;
+    header.startIndex = source.start_range_index();
+    header.endIndex = source.end_range_index();
+    header.joinIndex = source.join_index();
+    header.zeroBased = source.zero_based_range();
+    header.hasHeader = source.has_header();
+    header.delimiter = source.delimiter();
+    header.quoted = source.quoted();
+    header.referenceCount = reader.annotationStreams_.size();
+    header.referencesOffset = sizeof(FileHeader);
+
+    // The tables go in front; they are written again once the offsets are known.
+    std::vector <ReferenceEntry> entries(reader.annotationStreams_.size());
+    out.write(&header, sizeof(header));
+    out.write(entries.data(), entries.size() * sizeof(ReferenceEntry));
+
+    std::vector <RowRecord> records;
+    std::vector <uint32_t> lengths;
+    std::string text;
+    size_t r = 0;
+    for (auto & [name, stream] : reader.annotationStreams_) {
+        const std::vector <Annotation> & annotations = stream.annotations(0);
+        const SortedRanges & sorted = stream.sortedRanges(0);
+        ReferenceEntry & entry = entries[r++];
+        entry.count = annotations.size();
+        header.rowCount += annotations.size();
+
+        entry.nameOffset = out.offset();
+        entry.nameLength = name.size();
+        out.write(name.data(), name.size());
+        out.align(sizeof(long long int));
+        entry.startsOffset = out.offset();
+        out.write(sorted.starts.data(), sorted.starts.size_bytes());
+        entry.endsOffset = out.offset();
+        out.write(sorted.ends.data(), sorted.ends.size_bytes());
+        entry.orderOffset = out.offset();
+        out.write(sorted.order.data(), sorted.order.size_bytes());
+        out.align(sizeof(uint64_t));
+
+        // Each row's columns follow the row table, 4 byte aligned.
+        entry.rowsOffset = out.offset();
+        records.resize(annotations.size());
+        uint64_t fields = entry.rowsOffset + annotations.size() * sizeof(RowRecord);
+        for (size_t i = 0; i < annotations.size(); i++) {
+            const Annotation & annot = annotations[i];
+            text.clear();
+            for (const AnnotationTypes & element : annot.elements()) {
+                appendField(text, element);
+            }
+            records[i] = RowRecord{annot.startRange(), annot.endRange(), annot.rowNumber(), fields,
+                                   static_cast<uint32_t>(annot.elements().size()), 0};
+            fields += (annot.elements().size() * sizeof(uint32_t) + text.size() + 3) / 4 * 4;
+        }
+        out.write(records.data(), records.size() * sizeof(RowRecord));
+        for (const Annotation & annot : annotations) {
+            lengths.clear();
+            text.clear();
+            for (const AnnotationTypes & element : annot.elements()) {
+                const size_t before = text.size();
+                appendField(text, element);
+                lengths.push_back(static_cast<uint32_t>(text.size() - before));
+            }
+            out.write(lengths.data(), lengths.size() * sizeof(uint32_t));
+            out.write(text.data(), text.size());
+            out.align(sizeof(uint32_t));
+        }
+    }
+
+    header.headerOffset = out.offset();
+    for (const auto & [column, columnName] : source.header()) {
+        const uint32_t entryWords[2] = {column, static_cast<uint32_t>(columnName.size())};
+        out.write(entryWords, sizeof(entryWords));
+        out.write(columnName.data(), columnName.size());
+        out.align(sizeof(uint32_t));
+        header.headerCount++;
+    }
+
+    header.size = out.offset();
+    out.patch(0, &header, sizeof(header));
+    out.patch(header.referencesOffset, entries.data(), entries.size() * sizeof(ReferenceEntry));
+    out.close();
+
+    std::error_code ec;
+    if (!out.ok()) {
+        std::cerr << "ERROR: Could not write the index " << temporary << ".  \n";
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    std::filesystem::rename(temporary, index_path, ec);
+    if (ec) {
+        std::cerr << "ERROR: Could not move the index into place at " << index_path << ".  \n";
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,162 @@
+/*! \file SharedIndex.h
+    \author John Torcivia, Ph.D.
+
+    \brief A file's per-reference interval index, shared between processes.
+
+    build() reads an annotation file once and writes its per-reference
+    index to disk: for each reference the ranges sorted by start, their
+    order in the file, and every row's number and columns.  The file only
+    holds offsets from its own start, so any process can map it read-only
+    anywhere in its address space, and every mapper attached to it shares
+    the same pages of the page cache instead of a private copy.
+
+    The index is versioned and tied to its source: attach() refuses (or
+    rebuilds) an index of another format version, of a file that has
+    changed since, or read with other column settings.  An index is
+    written under a temporary name and renamed into place, so attaching
+    never sees a partial file, and a mapping of a replaced index stays
+    valid.  Concurrent attach() calls that find no usable index build it
+    once between them, serialized by a lock file next to the index.
+*/
+
+#ifndef BIOMAPPER_SHAREDINDEX_H
+#define BIOMAPPER_SHAREDINDEX_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "MapperFile.h"
+
+class thread_pool;
+
+/**
+ *
+ */
+class SharedIndex {
+public:
+    static constexpr uint32_t FORMAT_VERSION = 1;   ///< Bumped on every layout change
+
+    /**
+     * One row of the source file, its columns stored back to back.
+     */
+    struct Row {
+        long long int       start;          ///< Zero based start
+        long long int       end;            ///< End, exclusive
+        uint64_t            rowNumber;      ///< The (1 based) line in the source file
+        uint32_t            fieldCount;     ///< Columns of the row
+        const uint32_t *    lengths;        ///< Length of each column
+        const char *        data;           ///< The columns' text, in column order
+    };
+
+    /**
+     * The rows of one reference.  The arrays point into the mapping.
+     */
+    struct Reference {
+        std::string_view        name;       ///< The join value
+        size_t                  count;      ///< Rows on this reference
+        const long long int *   starts;     ///< Start of each range, ascending
+        const long long int *   ends;       ///< End of each range, in the order of starts
+        const uint32_t *        order;      ///< Row (in file order) of each sorted range
+        const void *            rows;       ///< The rows, in file order; see row()
+    };
+
+    ~SharedIndex();
+
+    SharedIndex(const SharedIndex &) = delete;
+    SharedIndex & operator=(const SharedIndex &) = delete;
+
+    /**
+     * @brief Read a file and write its index, replacing any index at that path.
+     *
+     * @param file The file and its column settings.
+     * @param index_path Where to write the index.
+     * @param threads Threads to read the file with; -1 for all.
+     * @param pool A pool to read on, shared with other work; null for one of its own.
+     * @return Whether the index was written.
+     */
+    static bool build(const MapperFile & file, const std::string & index_path, int threads = -1,
+                      thread_pool * pool = nullptr);
+
+    /**
+     * @brief Map the index of a file.
+     *
+     * @param file The file and its column settings, checked against the index.
+     * @param index_path Where the index is.
+     * @param build_if_needed Build the index first if it is missing or does not match.
+     * @param pool The pool to build on; see build().
+     * @return The index, or null if there is no usable one (and building failed).
+     */
+    static std::shared_ptr <const SharedIndex> attach(const MapperFile & file, const std::string & index_path,
+                                                      bool build_if_needed = true, thread_pool * pool = nullptr);
+
+    /**
+     * @brief Delete an index and its lock file, unless it is being built.
+     *
+     * Mappings of the index stay valid once it is gone.
+     *
+     * @param index_path Where the index is.
+     * @return Whether it was deleted; false while attach() holds its lock.
+     */
+    static bool remove(const std::string & index_path);
+
+    /**
+     *
+     * @return Every reference, sorted by name.
+     */
+    [[nodiscard]] const std::vector <Reference> & references() const { return references_; }
+
+    /**
+     *
+     * @return The reference of that name, or null if the file has no rows on it.
+     */
+    [[nodiscard]] const Reference * find(std::string_view name) const;
+
+    /**
+     *
+     * @param reference One of references().
+     * @param index The row, in file order (order[] for the sorted ones).
+     */
+    [[nodiscard]] Row row(const Reference & reference, uint32_t index) const;
+
+    /**
+     *
+     * @return The source file's header, by column; empty if it has none.
+     */
+    [[nodiscard]] const std::map <uint32_t, std::string> & header() const { return header_; }
+
+    /**
+     *
+     * @return Rows over all references.
+     */
+    [[nodiscard]] uint64_t rowCount() const;
+
+    /**
+     *
+     * @return Bytes mapped.
+     */
+    [[nodiscard]] size_t size() const { return size_; }
+
+private:
+    SharedIndex() = default;
+
+    /**
+     * Map an index file and check its layout; null with a message on stderr if it is not one.
+     */
+    static std::shared_ptr <SharedIndex> _map(const std::string & index_path, bool quiet);
+
+    /**
+     * Whether the index was built from file as it is now, with the same column settings.
+     */
+    [[nodiscard]] bool _matches(const MapperFile & file) const;
+
+    const char *                        base_ = nullptr;    ///< Start of the mapping
+    size_t                              size_ = 0;          ///< Bytes mapped
+    std::vector <Reference>             references_;        ///< Resolved reference table
+    std::map <uint32_t, std::string>    header_;            ///< Source header, by column
+};
+
+#endif //BIOMAPPER_SHAREDINDEX_H
@@ -0,0 +1,273 @@
+/*! \file TraceRecorder.h
+    \author John Torcivia, Ph.D.
+
+    \brief Timeline tracing of pool tasks and pipeline stages.
+
+    Records begin/end of thread_pool tasks and labelled pipeline stages into
+    per-thread buffers and writes them as Chrome trace-event JSON, which can be
+    opened in Perfetto (ui.perfetto.dev) or chrome://tracing.  Gaps between a
+    worker's task slices are the time it sat idle.
+*/
+
+#ifndef BIOMAPPER_TRACERECORDER_H
+#define BIOMAPPER_TRACERECORDER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ *
+ */
+class TraceRecorder {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    TraceRecorder() : id_(_nextId()), origin_(std::chrono::steady_clock::now()) {}
+    ~TraceRecorder() = default;
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder & operator=(const TraceRecorder &) = delete;
+
+    /**
+     * @brief Record a completed slice on the calling thread.
+     *
+     * Only the calling thread writes to its buffer, so this never locks
+     * except the first time a thread records.
+     *
+     * @param[in] name Label of the slice.
+     * @param[in] category Category shown in the viewer (e.g. "pool", "read").
+     * @param[in] begin When the slice started.
+     * @param[in] end When the slice finished.
+     */
+    void record(std::string name, const char * category, TimePoint begin, TimePoint end) {
+        ThreadBuffer & buffer = _local();
+        Chunk * chunk = buffer.tail;
+        size_t count = chunk->count.load(std::memory_order_relaxed);
+        if (count == CHUNK_SIZE) {
+            buffer.overflow.push_back(std::make_unique<Chunk>());
+            chunk->next.store(buffer.overflow.back().get(), std::memory_order_release);
+            chunk = buffer.overflow.back().get();
+            buffer.tail = chunk;
+            count = 0;
+        }
+        Event & event = chunk->events[count];
+        event.name = std::move(name);
+        event.category = category;
+        event.begin_ns = _sinceOrigin(begin);
+        event.end_ns = _sinceOrigin(end);
+        // Publish the event to concurrent writers of the JSON.
+        chunk->count.store(count + 1, std::memory_order_release);
+    }
+
+    /**
+     * @param[in] name Name of the calling thread in the viewer.
+     */
+    void setThreadName(std::string name) {
+        ThreadBuffer & buffer = _local();
+        const std::scoped_lock lock(mtx_);
+        buffer.name = std::move(name);
+        buffer.named = true;
+    }
+
+    /**
+     * @brief Name the calling thread "<prefix> <index>" unless it already has a name.
+     *
+     * Cheap enough to call before every task.
+     */
+    void nameThreadOnce(const char * prefix, uint64_t index) {
+        if (!_local().named) {
+            setThreadName(std::string(prefix) + " " + std::to_string(index));
+        }
+    }
+
+    /**
+     * @return The trace as a Chrome trace-event JSON document.
+     */
+    [[nodiscard]] std::string toJson() const {
+        std::ostringstream json;
+        json << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        bool first = true;
+        auto separator = [&]() {
+            json << (first ? "\n" : ",\n");
+            first = false;
+        };
+
+        const std::scoped_lock lock(mtx_);
+        for (size_t tid = 0; tid < threads_.size(); tid++) {
+            const ThreadBuffer & buffer = *threads_[tid];
+            separator();
+            json << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+                 << ", \"args\": {\"name\": \"" << _escape(buffer.name) << "\"}}";
+
+            for (const Chunk * chunk = &buffer.head; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire)) {
+                const size_t count = chunk->count.load(std::memory_order_acquire);
+                for (size_t i = 0; i < count; i++) {
+                    const Event & event = chunk->events[i];
+                    separator();
+                    json << "{\"name\": \"" << _escape(event.name) << "\", \"cat\": \"" << event.category
+                         << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+                         << ", \"ts\": " << _micros(event.begin_ns)
+                         << ", \"dur\": " << _micros(event.end_ns - event.begin_ns) << "}";
+                }
+            }
+        }
+        json << "\n]}\n";
+        return json.str();
+    }
+
+    /**
+     * @param[in] path File to write the trace to.
+     * @retval true The file was written.
+     */
+    bool writeJson(const std::string & path) const {
+        std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+        out << toJson();
+        return !out.fail();
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    struct Event {
+        std::string     name;
+        const char *    category = "";
+        uint64_t        begin_ns = 0;
+        uint64_t        end_ns = 0;
+    };
+
+    /**
+     * Fixed block of events; chunks are never moved, so readers can walk
+     * the list while the owner appends.
+     */
+    struct Chunk {
+        std::array<Event, CHUNK_SIZE>   events;
+        std::atomic<size_t>             count = 0;
+        std::atomic<Chunk *>            next = nullptr;
+    };
+
+    struct ThreadBuffer {
+        std::thread::id                         owner;
+        std::string                             name;
+        bool                                    named = false;
+        Chunk                                   head;
+        Chunk *                                 tail = &head;
+        std::vector<std::unique_ptr<Chunk> >    overflow;   ///< Owns the chunks after head; only the owner touches it
+    };
+
+    /**
+     * @return The calling thread's buffer, registering it on first use.
+     */
+    ThreadBuffer & _local() {
+        thread_local uint64_t cachedId = 0;
+        thread_local ThreadBuffer * cached = nullptr;
+        if (cachedId == id_) {
+            return *cached;
+        }
+
+        const std::scoped_lock lock(mtx_);
+        const std::thread::id self = std::this_thread::get_id();
+        ThreadBuffer * buffer = nullptr;
+        for (auto & existing : threads_) {
+            if (existing->owner == self) {
+                buffer = existing.get();
+                break;
+            }
+        }
+        if (buffer == nullptr) {
+            threads_.push_back(std::make_unique<ThreadBuffer>());
+            buffer = threads_.back().get();
+            buffer->owner = self;
+            buffer->name = "thread " + std::to_string(threads_.size() - 1);
+        }
+        cachedId = id_;
+        cached = buffer;
+        return *buffer;
+    }
+
+    uint64_t _sinceOrigin(TimePoint time) const {
+        return time <= origin_ ? 0 : static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(time - origin_).count());
+    }
+
+    static std::string _micros(uint64_t ns) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.3f", static_cast<double>(ns) / 1000.0);
+        return buffer;
+    }
+
+    static std::string _escape(const std::string & text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                escaped += buffer;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    static uint64_t _nextId() {
+        static std::atomic<uint64_t> next = 1;
+        return next++;
+    }
+
+    const uint64_t                              id_;        ///< Unique instance ID
+    const TimePoint                             origin_;    ///< Time zero of the trace
+    mutable std::mutex                          mtx_;       ///< Guards threads_ and thread names
+    std::vector<std::unique_ptr<ThreadBuffer> > threads_;   ///< One buffer per recording thread
+};
+
+/**
+ * @brief Records a slice from construction to destruction.
+ *
+ * A null recorder makes this a no-op (no clock reads or string building), so
+ * call sites can stay unconditional.  The slice is labelled "<label> <detail>".
+ */
+class TraceScope {
+public:
+    TraceScope(TraceRecorder * recorder, const char * category, const char * label, const std::string & detail = std::string())
+            : recorder_(recorder), category_(category) {
+        if (recorder_ != nullptr) {
+            name_ = label;
+            if (!detail.empty()) {
+                name_ += ' ';
+                name_ += detail;
+            }
+            begin_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (recorder_ != nullptr) {
+            recorder_->record(std::move(name_), category_, begin_, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope & operator=(const TraceScope &) = delete;
+
+private:
+    TraceRecorder *             recorder_;
+    const char *                category_;
+    std::string                 name_;
+    TraceRecorder::TimePoint    begin_;
+};
+
+#endif //BIOMAPPER_TRACERECORDER_H
@@ -14,6 +14,7 @@
 
 #define THREAD_POOL_VERSION "v2.0.0 (2021-08-14)"
 
+#include <algorithm>   // std::max
 #include <atomic>      // std::atomic
 #include <chrono>      // std::chrono
 #include <cstdint>     // std::int_fast64_t, std::uint_fast32_t
@@ -26,6 +27,10 @@
 #include <thread>      // std::this_thread, std::thread
 #include <type_traits> // std::common_type_t, std::decay_t, std::enable_if_t, std::is_void_v, std::invoke_result_t
 #include <utility>     // std::move
+#include <vector>      // std::vector
+
+#include "Placement.h"     // pin_current_thread
+#include "TraceRecorder.h" // TraceRecorder
 
 // ============================================================================================= //
 //                                    Begin class thread_pool                                    //
@@ -54,6 +59,25 @@ public:
         create_threads();
     }
 
+    /**
+     * @brief Construct a new thread pool whose workers are pinned to CPUs and grouped by NUMA node.
+     * @details Worker i is pinned to _thread_cpus[i % _thread_cpus.size()] and serves node _thread_nodes[i % _thread_nodes.size()] first. Tasks pushed with push_task_on_node() are preferentially executed by workers of that node; idle workers still steal from other nodes so no task is left waiting. Empty vectors leave workers unpinned and without a node.
+     *
+     * @param _thread_count The number of threads to use. If the argument is zero, the total number of hardware threads is used.
+     * @param _thread_cpus The CPUs each worker is allowed to run on.
+     * @param _thread_nodes The node index (0 based, not the kernel node ID) each worker belongs to, or -1 for none.
+     */
+    thread_pool(const ui32 &_thread_count, std::vector<std::vector<int>> _thread_cpus, std::vector<int> _thread_nodes)
+            : thread_cpus(std::move(_thread_cpus)), thread_nodes(std::move(_thread_nodes)),
+              thread_count(_thread_count ? _thread_count : std::thread::hardware_concurrency()), threads(new std::thread[_thread_count ? _thread_count : std::thread::hardware_concurrency()])
+    {
+        int node_count = 0;
+        for (const int &node : thread_nodes)
+            node_count = std::max(node_count, node + 1);
+        node_tasks.resize(node_count);
+        create_threads();
+    }
+
     /**
      * @brief Destruct the thread pool. Waits for all tasks to complete, then destroys all threads. Note that if the variable paused is set to true, then any tasks still in the queue will never be executed.
      */
@@ -76,7 +100,10 @@ public:
     ui64 get_tasks_queued() const
     {
         const std::scoped_lock lock(queue_mutex);
-        return tasks.size();
+        ui64 queued = tasks.size();
+        for (const auto &queue : node_tasks)
+            queued += queue.size();
+        return queued;
     }
 
     /**
@@ -178,6 +205,48 @@ public:
         }
     }
 
+    /**
+     * @brief Push a function with no arguments or return value into the task queue of a NUMA node. Workers of that node run it first; if the pool has no workers on that node the task goes to the shared queue.
+     *
+     * @tparam F The type of the function.
+     * @param node The node index (as passed to the constructor) the task should run on.
+     * @param task The function to push.
+     */
+    template <typename F>
+    void push_task_on_node(const int &node, const F &task)
+    {
+        if (node < 0 || node >= (int)node_tasks.size())
+        {
+            push_task(task);
+            return;
+        }
+        tasks_total++;
+        {
+            const std::scoped_lock lock(queue_mutex);
+            node_tasks[node].push(std::function<void()>(task));
+        }
+    }
+
+    /**
+     * @brief Get the number of NUMA nodes the workers are grouped into. Zero if the pool was created without placement.
+     *
+     * @return The number of nodes.
+     */
+    ui32 get_node_count() const
+    {
+        return (ui32)node_tasks.size();
+    }
+
+    /**
+     * @brief Get the node index of the worker executing the calling thread.
+     *
+     * @return The node index, or -1 if the caller is not a pool worker with a node.
+     */
+    static int get_current_node()
+    {
+        return current_node;
+    }
+
     /**
      * @brief Push a function with arguments, but no return value, into the task queue.
      * @details The function is wrapped inside a lambda in order to hide the arguments, as the tasks in the queue must be of type std::function<void()>, so they cannot have any arguments or return value. If no arguments are provided, the other overload will be used, in order to avoid the (slight) overhead of using a lambda.
@@ -318,6 +387,11 @@ public:
      */
     ui32 sleep_duration = 1000;
 
+    /**
+     * @brief An optional recorder for a timeline of task execution. When set, each worker records a "task" slice for every task it runs, named after the worker. Set to nullptr (the default) to disable tracing.
+     */
+    std::atomic<TraceRecorder *> tracer = nullptr;
+
 private:
     // ========================
     // Private member functions
@@ -330,7 +404,7 @@ private:
     {
         for (ui32 i = 0; i < thread_count; i++)
         {
-            threads[i] = std::thread(&thread_pool::worker, this);
+            threads[i] = std::thread(&thread_pool::worker, this, i);
         }
     }
 
@@ -351,17 +425,32 @@ private:
      * @param task A reference to the task. Will be populated with a function if the queue is not empty.
      * @return true if a task was found, false if the queue is empty.
      */
-    bool pop_task(std::function<void()> &task)
+    bool pop_task(std::function<void()> &task, const int &node = -1)
     {
         const std::scoped_lock lock(queue_mutex);
-        if (tasks.empty())
-            return false;
-        else
+        // Own node first, then the shared queue, then steal from the other nodes.
+        if (node >= 0 && node < (int)node_tasks.size() && !node_tasks[node].empty())
+        {
+            task = std::move(node_tasks[node].front());
+            node_tasks[node].pop();
+            return true;
+        }
+        if (!tasks.empty())
         {
             task = std::move(tasks.front());
             tasks.pop();
             return true;
         }
+        for (auto &queue : node_tasks)
+        {
+            if (!queue.empty())
+            {
+                task = std::move(queue.front());
+                queue.pop();
+                return true;
+            }
+        }
+        return false;
     }
 
     /**
@@ -378,15 +467,32 @@ private:
 
     /**
      * @brief A worker function to be assigned to each thread in the pool. Continuously pops tasks out of the queue and executes them, as long as the atomic variable running is set to true.
+     *
+     * @param index The index of the worker, used to look up its CPUs and node.
      */
-    void worker()
+    void worker(const ui32 index)
     {
+        if (!thread_cpus.empty())
+            pin_current_thread(thread_cpus[index % thread_cpus.size()]);
+        const int node = thread_nodes.empty() ? -1 : thread_nodes[index % thread_nodes.size()];
+        current_node = node;
         while (running)
         {
             std::function<void()> task;
-            if (!paused && pop_task(task))
+            if (!paused && pop_task(task, node))
             {
-                task();
+                TraceRecorder *recorder = tracer.load(std::memory_order_relaxed);
+                if (recorder == nullptr)
+                {
+                    task();
+                }
+                else
+                {
+                    recorder->nameThreadOnce("worker", index);
+                    const auto begin = std::chrono::steady_clock::now();
+                    task();
+                    recorder->record("task", "pool", begin, std::chrono::steady_clock::now());
+                }
                 tasks_total--;
             }
             else
@@ -415,6 +521,26 @@ private:
      */
     std::queue<std::function<void()>> tasks = {};
 
+    /**
+     * @brief One queue per NUMA node for tasks pushed with push_task_on_node().
+     */
+    std::vector<std::queue<std::function<void()>>> node_tasks = {};
+
+    /**
+     * @brief The CPUs each worker is pinned to. Empty if workers are not pinned.
+     */
+    std::vector<std::vector<int>> thread_cpus = {};
+
+    /**
+     * @brief The node index each worker serves first. Empty if workers have no node.
+     */
+    std::vector<int> thread_nodes = {};
+
+    /**
+     * @brief The node index of the worker running on the current thread, -1 outside of pool workers.
+     */
+    inline static thread_local int current_node = -1;
+
     /**
      * @brief The number of threads in the pool.
      */